@@ -15,6 +15,7 @@ use crossterm::{
 use anyhow::Result;
 use std::io::stdout;
 use std::time::Instant;
+use std::collections::VecDeque;
 use std::sync::Arc;
 use tokio::sync::Mutex;
 use tokio::time::{interval, Duration};
@@ -23,8 +24,9 @@ use futures::{StreamExt, FutureExt};
 
 mod network;
 use network::udp_client::UdpClient;
+use network::clock::ClockSync;
 use network::tcp_client::TcpClient;
-use network::models::{Position, TcpRequest, RegisterResponseMessage};
+use network::models::{Position, TcpRequest, RegisterResponseMessage, TCP_REGISTER, TCP_SPECTATE, TCP_STATUS_OK, InputCommand, InputMessage, SpectateMessage, SpectateRequest, INPUT_REDUNDANCY, MAX_CLIENTS};
 
 use log::{info};
 
@@ -32,13 +34,17 @@ const TICK_RATE: u64 = 16;  // ~60 fps
 
 const ANTI_ALIASING_TIMEOUT: u64 = 350;
 
-const SERVER_ADDRESS: &str = "127.0.0.1:9034";
+const DEFAULT_SERVER_ADDRESS: &str = "127.0.0.1:9034";
 const SERVER_TIMEOUT: Duration = Duration::from_secs(2);
-const RECONCILE_THRESHOLD: f32 = 5.0;
+// commands kept for reconciliation while waiting on the server, ~1s
+const MAX_PENDING_INPUTS: usize = 64;
 
 #[derive(Debug)]
 pub struct App {
-    player_id: u32,
+    server_address: String,
+    player_id: u32,     // spectator id when spectating
+    player_index: u32,  // 0 when spectating
+    match_id: u32,
     player: Position, 
     opponent: Position,
     player_score: u8,
@@ -61,10 +67,19 @@ pub struct App {
 
     last_udp_send: Instant,
     last_udp_recv: Option<Instant>,
-    ping_ms: f64,
+    last_snapshot_seq: u32,
+    clock: ClockSync,
+
+    // server tick of the newest snapshot, and frames drawn since it arrived
+    server_tick: u32,
+    frames_since_snapshot: u32,
+    // commands sent but not yet reflected in a snapshot
+    pending_inputs: VecDeque<(u32, InputCommand)>,
+    next_input_seq: u32,
 
     game_active: bool,
-    seconds_to_start: i32,
+    // when the countdown ends, on our clock
+    start_at: Option<Instant>,
     status_msg: String
 }
 
@@ -72,7 +87,10 @@ pub struct App {
 impl App {
 
     fn new(
+        server_address: String,
         player_id: u32,
+        player_index: u32,
+        match_id: u32,
         rows: u32,
         cols: u32,
         player_move_speed: f32,
@@ -95,7 +113,7 @@ impl App {
 
         let player_position: Position;
         let opponent_position: Position;
-        if player_id == 1 {
+        if player_index <= 1 {
             player_position = left_position;
             opponent_position = right_position;
         } else {
@@ -104,7 +122,10 @@ impl App {
         }
             
         Self {
+            server_address,
             player_id: player_id,
+            player_index: player_index,
+            match_id: match_id,
             player: player_position,
             opponent: opponent_position,
             player_score: 0,
@@ -132,10 +153,16 @@ impl App {
 
             last_udp_send: now,
             last_udp_recv: None,
-            ping_ms: 0.0,
+            last_snapshot_seq: 0,
+            clock: ClockSync::new(),
+
+            server_tick: 0,
+            frames_since_snapshot: 0,
+            pending_inputs: VecDeque::new(),
+            next_input_seq: 1,
 
             game_active: false,
-            seconds_to_start: 0,
+            start_at: None,
             status_msg: "Waiting on players...".to_string()
         }
     }
@@ -171,27 +198,58 @@ impl App {
         Ok(())
     }
 
+    // watching rather than playing: no input, and the left paddle shown as "player"
+    fn spectating(&self) -> bool {
+        self.player_index == 0
+    }
+
     async fn tick(&mut self, delta_time: f32, udp_client: Arc<Mutex<UdpClient>>) -> Result<()> {
+        let movement = self.update(delta_time);
+        if self.spectating() {
+            return self.send_spectate(udp_client).await;
+        }
+
+        // always send input so the server learns our UDP address
+        self.send_input(movement, Arc::clone(&udp_client)).await?;
         let now = Instant::now();
+        if self.clock.ping_due(now) {
+            let ping = self.clock.ping(self.player_id, now);
+            udp_client.lock().await.send_ping(&ping).await?;
+        }
+        Ok(())
+    }
 
-        // always send position so the server learns our UDP address
-        udp_client.lock().await.send_position(&self.player, self.player_id).await?;
-        self.last_udp_send = Instant::now();
+    // advance the local view by a frame, returning how the player moved the paddle
+    fn update(&mut self, delta_time: f32) -> i8 {
+        let now = Instant::now();
+        self.frames_since_snapshot = self.frames_since_snapshot.wrapping_add(1);
 
         if !self.game_active {
-            if self.seconds_to_start > 0 {
-                self.status_msg = format!("Starting in {}...", self.seconds_to_start);
-                return Ok(())
+            if let Some(start) = self.start_at.filter(|start| *start > now) {
+                self.status_msg = format!("Starting in {:.1}...", start.duration_since(now).as_secs_f32());
+                return 0
             } else if self.last_udp_recv.is_none() {
                 self.status_msg = "Waiting on players...".to_string();
-                return Ok(())
+                return 0
             } else {
-                // seconds_to_start hit 0 or went negative, game has started
+                // the countdown has run out, game has started
                 self.game_active = true;
                 self.status_msg = "".to_string();
             }
         }
 
+        // between snapshots the server leaves the ball's flight to us, so
+        // move it along its last known velocity, bouncing off the walls
+        self.ball.x += self.ball.dx * delta_time;
+        self.ball.y += self.ball.dy * delta_time;
+        if self.ball.y - self.ball_radius <= 0.0 {
+            self.ball.y = self.ball_radius;
+            self.ball.dy = -self.ball.dy;
+        } else if self.ball.y + self.ball_radius > self.rows as f32 {
+            self.ball.y = self.rows as f32 - self.ball_radius;
+            self.ball.dy = -self.ball.dy;
+        }
+
         let timeout = Duration::from_millis(ANTI_ALIASING_TIMEOUT);
         if self.s_pressed && now.duration_since(self.s_last_seen) > timeout {
             self.s_pressed = false;
@@ -200,27 +258,87 @@ impl App {
             self.w_pressed = false;
         }
 
-        if self.s_pressed {
-            self.player.y -= self.player_move_speed * delta_time;
-        }
-        if self.w_pressed {
-            self.player.y += self.player_move_speed * delta_time;
+        if self.spectating() {
+            return 0
         }
 
-        if self.player.y >= self.rows as f32 {
-            self.player.y = self.rows as f32;
-        } else if self.player.y <= 0.0 {
-            self.player.y = 0.0;
+        // predict our own paddle instead of waiting a round trip to see it move
+        let movement = self.w_pressed as i8 - self.s_pressed as i8;
+        self.player.y = self.move_paddle(self.player.y, movement);
+        movement
+    }
+
+    // one frame of paddle movement, exactly as the server applies a command
+    fn move_paddle(&self, y: f32, movement: i8) -> f32 {
+        let y = y + movement as f32 * self.player_move_speed * (TICK_RATE as f32 / 1000.0);
+        y.clamp(0.0, self.rows as f32)
+    }
+
+    async fn send_input(&mut self, movement: i8, udp_client: Arc<Mutex<UdpClient>>) -> Result<()> {
+        // stamp the command with the server tick on screen, so the server
+        // can apply it against the state we were looking at
+        let tick = match self.last_udp_recv {
+            Some(_) => self.server_tick.wrapping_add(self.frames_since_snapshot),
+            None => 0
+        };
+        self.pending_inputs.push_back((self.next_input_seq, InputCommand { tick, movement }));
+        self.next_input_seq = self.next_input_seq.wrapping_add(1);
+        if self.pending_inputs.len() > MAX_PENDING_INPUTS {
+            self.pending_inputs.pop_front();
         }
 
+        // resend the last few unacknowledged commands in case some were lost
+        let count = self.pending_inputs.len().min(INPUT_REDUNDANCY);
+        let recent: Vec<(u32, InputCommand)> = self.pending_inputs.iter().skip(self.pending_inputs.len() - count).cloned().collect();
+        let message = InputMessage {
+            id: self.player_id,
+            ack: self.last_snapshot_seq,
+            first_seq: recent[0].0,
+            commands: recent.iter().map(|(_, command)| command.clone()).collect()
+        };
+        udp_client.lock().await.send_input(&message).await?;
+        self.last_udp_send = Instant::now();
+        Ok(())
+    }
+
+    // tell the server where to send the match until it does, then once a second in case it lost track
+    async fn send_spectate(&mut self, udp_client: Arc<Mutex<UdpClient>>) -> Result<()> {
+        let now = Instant::now();
+        if self.last_udp_recv.is_some() && now.duration_since(self.last_udp_send) < Duration::from_secs(1) {
+            return Ok(());
+        }
+        let message = SpectateMessage { id: self.match_id * MAX_CLIENTS + 1, spectator_id: self.player_id };
+        udp_client.lock().await.send_spectate(&message).await?;
+        self.last_udp_send = now;
         Ok(())
     }
 
+    /// Take the server's position for our paddle, which includes every
+    /// command up to `input_seq`, and replay the ones it hasn't seen yet
+    pub fn reconcile(&mut self, position: &Position, input_seq: u32) {
+        while let Some((seq, _)) = self.pending_inputs.front() {
+            if seq.wrapping_sub(input_seq) as i32 > 0 {
+                break;
+            }
+            self.pending_inputs.pop_front();
+        }
+
+        let mut y = position.y;
+        for (_, command) in self.pending_inputs.iter() {
+            y = self.move_paddle(y, command.movement);
+        }
+        self.player.x = position.x;
+        self.player.y = y;
+    }
+
     fn game_canvas(&self) -> impl Widget + '_ {
 
         let left_score; 
         let right_score;
-        if self.player_id == 1 {
+        if self.spectating() {
+            left_score = format!(" Left: {}    ", self.player_score).bold();
+            right_score = format!("    Right: {} ", self.opponent_score).bold();
+        } else if self.player_index == 1 {
             left_score = format!(" Player: {}    ", self.player_score).green().bold();
             right_score = format!("    Opponent: {} ", self.opponent_score).red().bold();
         } else {
@@ -233,11 +351,14 @@ impl App {
             right_score
         ]);
         let server_status = match self.last_udp_recv {
-            None => format!("{} (registered)", SERVER_ADDRESS).yellow(),
+            None => format!("{} (registered)", self.server_address).yellow(),
             Some(t) if Instant::now().duration_since(t) > SERVER_TIMEOUT => {
-                format!("{} (no response)", SERVER_ADDRESS).red()
+                format!("{} (no response)", self.server_address).red()
             }
-            Some(_) => format!("{} ping {:.1}ms", SERVER_ADDRESS, self.ping_ms).green(),
+            Some(_) => match self.clock.rtt_ms() {
+                Some(rtt) => format!("{} ping {:.1}ms", self.server_address, rtt).green(),
+                None => self.server_address.clone().green()
+            },
         };
 
         let instructions = Line::from(vec![
@@ -355,24 +476,55 @@ async fn main() -> Result<()> {
     let raw_config: log4rs::config::RawConfig = serde_yaml::from_str(log_yaml).expect("failed to parse embedded log4rs config");
     log4rs::init_raw_config(raw_config).expect("failed to initialize logger");
 
-    // networking configuration
-    let udp_client = UdpClient::connect(SERVER_ADDRESS).await?;
-    let mut tcp_client: TcpClient = TcpClient::connect(SERVER_ADDRESS).await?;
+    // --spectate <match_id> watches a match instead of joining one, and
+    // --server <host:port> connects somewhere else, such as through netproxy
+    let usage = "usage: game_client [--server <host:port>] [--spectate <match_id>]";
+    let args: Vec<String> = std::env::args().collect();
+    let spectate: Option<u32> = match args.iter().position(|arg| arg == "--spectate") {
+        Some(i) => Some(args.get(i + 1).and_then(|id| id.parse().ok())
+            .ok_or_else(|| anyhow::anyhow!(usage))?),
+        None => None
+    };
+    let server_address = match args.iter().position(|arg| arg == "--server") {
+        Some(i) => args.get(i + 1).cloned().ok_or_else(|| anyhow::anyhow!(usage))?,
+        None => DEFAULT_SERVER_ADDRESS.to_string()
+    };
 
-    // register with server
-    info!("Registering with server.");
-    let register_request = TcpRequest { opcode: 0, msg: [0; 256]};
+    // networking configuration
+    let udp_client = UdpClient::connect(&server_address).await?;
+    let mut tcp_client: TcpClient = TcpClient::connect(&server_address).await?;
+
+    let register_request = match spectate {
+        Some(match_id) => {
+            info!("Spectating match {}.", match_id);
+            let mut msg = Vec::with_capacity(SpectateRequest::SIZE);
+            SpectateRequest { match_id }.encode(&mut msg);
+            TcpRequest { opcode: TCP_SPECTATE, msg }
+        }
+        None => {
+            // the server answers once it has paired us with an opponent
+            info!("Registering with server.");
+            println!("Waiting for an opponent...");
+            TcpRequest { opcode: TCP_REGISTER, msg: Vec::new() }
+        }
+    };
     let tcp_response = tcp_client.request(&register_request).await?;
     let tcp_response_status = tcp_response.statuscode;
     info!("tcp_response status code: {}", tcp_response_status);
-    let register_response = RegisterResponseMessage::from_tcp_response(tcp_response)?;
+    if tcp_response_status != TCP_STATUS_OK {
+        anyhow::bail!("registration refused by server (status {})", tcp_response_status);
+    }
+    let register_response = RegisterResponseMessage::decode(&tcp_response.msg)?;
 
-    info!("Registered with server, id = {}", register_response.id);
+    info!("Registered with server, id = {}, match = {}, player = {}", register_response.id, register_response.match_id, register_response.player_index);
     info!("Server config: rows = {}, cols = {}, player_move_speed = {}, ball_radius = {}, player_length = {}", register_response.rows, register_response.cols, register_response.player_move_speed, register_response.ball_radius, register_response.player_length);
 
     // init game
     let app = Arc::new(Mutex::new(App::new(
+                server_address,
                 register_response.id,
+                register_response.player_index,
+                register_response.match_id,
                 register_response.rows,
                 register_response.cols,
                 register_response.player_move_speed,
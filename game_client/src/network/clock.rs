@@ -0,0 +1,99 @@
+use std::collections::VecDeque;
+use std::time::{Duration, Instant};
+
+use super::wire::{PingMessage, PongMessage};
+
+// exchanges the offset is chosen from, ~4s of pings
+const CLOCK_SAMPLES: usize = 8;
+pub const PING_INTERVAL: Duration = Duration::from_millis(500);
+
+/// Round trip to the server and the offset from our monotonic clock to
+/// its own, in microseconds, from ping/pong exchanges.  Assuming the path
+/// is symmetric, a pong says what the server's clock read halfway through
+/// its round trip.  Queueing only ever adds delay, so the offset comes
+/// from the fastest recent exchange rather than an average of them.
+#[derive(Debug)]
+pub struct ClockSync {
+    origin: Instant,
+    samples: VecDeque<(u64, i64)>,  // (round trip, offset)
+    rtt_us: Option<f64>,
+    // the server's own estimate of the round trip, 0 until it has one
+    pub server_rtt_us: u32,
+    // until a pong arrives, the offset as if snapshots took no time to arrive
+    snapshot_offset: Option<i64>,
+    last_pong: Option<(u64, Instant)>,
+    last_ping: Option<Instant>
+}
+
+impl ClockSync {
+    pub fn new() -> Self {
+        ClockSync {
+            origin: Instant::now(),
+            samples: VecDeque::with_capacity(CLOCK_SAMPLES),
+            rtt_us: None,
+            server_rtt_us: 0,
+            snapshot_offset: None,
+            last_pong: None,
+            last_ping: None
+        }
+    }
+
+    fn micros(&self, at: Instant) -> u64 {
+        at.duration_since(self.origin).as_micros() as u64
+    }
+
+    pub fn ping_due(&self, now: Instant) -> bool {
+        self.last_ping.map_or(true, |t| now.duration_since(t) >= PING_INTERVAL)
+    }
+
+    /// A ping for player `id`, echoing the newest pong so the server can
+    /// time the round trip as well
+    pub fn ping(&mut self, id: u32, now: Instant) -> PingMessage {
+        self.last_ping = Some(now);
+        let (echo_time, echo_delay) = match self.last_pong {
+            Some((server_time, received)) => (server_time, now.duration_since(received).as_micros() as u32),
+            None => (0, 0)
+        };
+        PingMessage { id, client_time: self.micros(now), echo_time, echo_delay }
+    }
+
+    pub fn on_pong(&mut self, pong: &PongMessage, received: Instant) {
+        let received_us = self.micros(received);
+        if pong.client_time > received_us {
+            return;
+        }
+        let rtt = received_us - pong.client_time;
+        let offset = pong.server_time as i64 - (pong.client_time + rtt / 2) as i64;
+        if self.samples.len() == CLOCK_SAMPLES {
+            self.samples.pop_front();
+        }
+        self.samples.push_back((rtt, offset));
+        self.rtt_us = Some(match self.rtt_us {
+            Some(smoothed) => smoothed + (rtt as f64 - smoothed) / 8.0,
+            None => rtt as f64
+        });
+        self.server_rtt_us = pong.rtt;
+        self.last_pong = Some((pong.server_time, received));
+    }
+
+    pub fn on_snapshot(&mut self, server_time: u64, received: Instant) {
+        if self.snapshot_offset.is_none() {
+            self.snapshot_offset = Some(server_time as i64 - self.micros(received) as i64);
+        }
+    }
+
+    pub fn offset_us(&self) -> Option<i64> {
+        self.samples.iter().min_by_key(|(rtt, _)| *rtt).map(|(_, offset)| *offset).or(self.snapshot_offset)
+    }
+
+    /// Smoothed round trip in milliseconds, once a pong has come back
+    pub fn rtt_ms(&self) -> Option<f64> {
+        self.rtt_us.map(|rtt| rtt / 1000.0)
+    }
+
+    /// When a time on the server's clock comes round on ours
+    pub fn to_local(&self, server_time: u64) -> Option<Instant> {
+        let local = server_time as i64 - self.offset_us()?;
+        Some(self.origin + Duration::from_micros(local.max(0) as u64))
+    }
+}
@@ -1,3 +1,5 @@
 pub mod udp_client;
 pub mod tcp_client;
 pub mod models;
+pub mod clock;
+pub mod wire;
@@ -1,8 +1,15 @@
 use serde::{Serialize, Deserialize};
-use zerocopy::{FromBytes, Immutable, KnownLayout};
-use bincode::{config};
-use bincode::de::{Decoder, Decode};
-use anyhow::Result;
+use anyhow::{anyhow, bail, Result};
+
+use super::wire;
+
+// layouts and constants shared with the server, generated from its schemas
+pub use super::wire::{
+    SpectateMessage, PingMessage, PongMessage, RegisterResponse as RegisterResponseMessage,
+    SpectateRequest, MAX_CLIENTS, INPUT_REDUNDANCY,
+    TCP_MAX_BODY, TCP_MAX_PAYLOAD, TCP_REGISTER, TCP_SPECTATE, TCP_STATUS_OK,
+    SERVER_PONG
+};
 
 #[derive(Serialize, Deserialize, Debug, Clone)]
 #[repr(C)]
@@ -13,76 +20,168 @@ pub struct Position {
     pub dy: f32
 }
 
-#[derive(Serialize, Deserialize, Debug)]
-#[repr(C)]
-pub struct PositionMessage {
-    pub id: u32,
-    pub position: Position
+/// One frame of paddle movement, stamped with the server tick on screen
+#[derive(Debug, Clone, Copy)]
+pub struct InputCommand {
+    pub tick: u32,
+    pub movement: i8
 }
 
+/// The newest few commands, numbered from `first_seq`.  Each datagram
+/// repeats the ones the server hasn't acknowledged so a lost packet doesn't
+/// lose input.
 #[derive(Debug)]
+pub struct InputMessage {
+    pub id: u32,
+    pub ack: u32,
+    pub first_seq: u32,
+    pub commands: Vec<InputCommand>
+}
+
+impl InputMessage {
+    pub fn encode(&self) -> Vec<u8> {
+        let mut buf = Vec::with_capacity(wire::InputMessageHeader::SIZE + wire::InputCommand::SIZE * self.commands.len());
+        let header = wire::InputMessageHeader {
+            id: self.id,
+            ack: self.ack,
+            first_seq: self.first_seq,
+            count: self.commands.len() as u8
+        };
+        header.encode(&mut buf);
+        for command in &self.commands {
+            wire::InputCommand { tick: command.tick, r#move: command.movement }.encode(&mut buf);
+        }
+        buf
+    }
+}
+
+const SNAPSHOT_HISTORY: usize = 64;
+
+#[derive(Debug, Clone)]
 pub struct GameStateMessage {
+    pub sequence: u32,
+    pub tick: u32,
+    pub server_time: u64,   // when the tick was due, server clock microseconds
+    pub input_seq: u32,
     pub game_active: bool,
-    pub seconds_to_start: i32,
+    pub start_tick: u32,    // tick the countdown ends on, 0 if there isn't one
     pub num_positions: u32,
     pub positions: Vec<Position>,
     pub left_score: u8,
     pub right_score: u8
 }
 
-impl<Context> Decode<Context> for GameStateMessage {
-    fn decode<D: Decoder<Context = Context>>(decoder: &mut D) -> Result<Self, bincode::error::DecodeError> {
-        let left_score = u8::decode(decoder)?;
-        let right_score = u8::decode(decoder)?;
-        let game_active = bool::decode(decoder)?;
-
-        let seconds_to_start = i32::decode(decoder)?;
-        let num_positions = u32::decode(decoder)?;
-                let mut positions = Vec::with_capacity(num_positions as usize);
-        for _ in 0..num_positions {
-            let x = f32::decode(decoder)?;
-            let y = f32::decode(decoder)?;
-            let dx = f32::decode(decoder)?;
-            let dy = f32::decode(decoder)?;
-            positions.push(Position { x, y, dx, dy });
+impl GameStateMessage {
+    /// Decode a version 4 snapshot.  Delta snapshots name a base sequence,
+    /// which must still be in `history`; positions missing from the delta
+    /// are copied from that base.
+    pub fn decode(buf: &[u8], history: &SnapshotHistory) -> Result<GameStateMessage> {
+        let header = wire::SnapshotHeader::decode(buf)?;
+        let sequence = header.sequence;
+        let base_sequence = header.base_sequence;
+        let num_positions = header.num_positions as u32;
+
+        let base = if base_sequence == 0 {
+            None
+        } else {
+            Some(history.get(base_sequence).ok_or_else(|| anyhow!("missing base snapshot {}", base_sequence))?)
+        };
+
+        let mut offset = wire::SnapshotHeader::SIZE;
+        let mut positions = Vec::with_capacity(num_positions as usize);
+        for i in 0..num_positions as usize {
+            if header.changed_mask & (1 << i) != 0 {
+                let position = wire::QuantizedPosition::decode(&buf[offset..])?;
+                offset += wire::QuantizedPosition::SIZE;
+                positions.push(Position {
+                    x: position.x as f32 / wire::POSITION_SCALE,
+                    y: position.y as f32 / wire::POSITION_SCALE,
+                    dx: position.dx as f32 / wire::VELOCITY_SCALE,
+                    dy: position.dy as f32 / wire::VELOCITY_SCALE
+                });
+            } else {
+                let position = base.and_then(|b| b.positions.get(i))
+                    .ok_or_else(|| anyhow!("position {} missing from snapshot {}", i, sequence))?;
+                positions.push(position.clone());
+            }
         }
-                Ok(GameStateMessage { game_active, seconds_to_start, num_positions, positions, left_score, right_score})
+
+        Ok(GameStateMessage {
+            sequence,
+            tick: header.tick,
+            server_time: header.server_time,
+            input_seq: header.input_seq,
+            game_active: header.flags & 1 != 0,
+            start_tick: header.start_tick,
+            num_positions,
+            positions,
+            left_score: header.left_score,
+            right_score: header.right_score
+        })
     }
 }
 
-#[derive(FromBytes, Immutable, KnownLayout, Debug)]
-#[repr(C, packed)]
-pub struct TcpRequest {
-    pub opcode: u32,
-    pub msg: [u8; 256]
+/// Recently decoded snapshots, kept so later deltas can be applied to them
+pub struct SnapshotHistory {
+    slots: Vec<Option<GameStateMessage>>
 }
 
-#[derive(Debug, FromBytes, Immutable, KnownLayout)]
-#[repr(C, packed)]
-pub struct TcpResponse {
-    pub statuscode: u32,
-    pub msg: [u8; 256]
+impl SnapshotHistory {
+    pub fn new() -> Self {
+        SnapshotHistory { slots: vec![None; SNAPSHOT_HISTORY] }
+    }
+
+    pub fn get(&self, sequence: u32) -> Option<&GameStateMessage> {
+        self.slots[sequence as usize % SNAPSHOT_HISTORY]
+            .as_ref()
+            .filter(|snapshot| snapshot.sequence == sequence)
+    }
+
+    pub fn insert(&mut self, snapshot: GameStateMessage) {
+        let slot = snapshot.sequence as usize % SNAPSHOT_HISTORY;
+        self.slots[slot] = Some(snapshot);
+    }
 }
 
-#[derive(Serialize, Deserialize, Debug)]
-#[repr(C)]
-pub struct RegisterResponseMessage {
-    pub id: u32,
-    pub rows: u32,
-    pub cols: u32,
-    pub player_move_speed: f32,
-    pub ball_radius: f32,
-    pub player_length: f32
+// TCP frames are a u32 length, then a u32 opcode or status code and the body
+#[derive(Debug)]
+pub struct TcpRequest {
+    pub opcode: u32,
+    pub msg: Vec<u8>
 }
 
-impl RegisterResponseMessage {
-    pub fn from_tcp_response(tcp_response: TcpResponse) -> Result<RegisterResponseMessage> {
-        let config = config::standard()
-            .with_big_endian()
-            .with_fixed_int_encoding();
+impl TcpRequest {
+    /// The request as a complete frame
+    pub fn encode(&self) -> Vec<u8> {
+        let body = &self.msg[..self.msg.len().min(TCP_MAX_BODY)];
+        let mut buf = Vec::with_capacity(wire::TcpFrameHeader::SIZE + body.len());
+        wire::TcpFrameHeader { length: (4 + body.len()) as u32, code: self.opcode }.encode(&mut buf);
+        buf.extend_from_slice(body);
+        buf
+    }
 
-        let (response, _len): (RegisterResponseMessage, usize) = bincode::serde::decode_from_slice(&tcp_response.msg, config).expect("failed to deserialize register response from TcpResponse");
+    /// Parse a frame's payload, i.e. everything after the length
+    pub fn decode(payload: &[u8]) -> Result<TcpRequest> {
+        if payload.len() < 4 {
+            bail!("TCP request too short: {} bytes", payload.len());
+        }
+        let opcode = u32::from_be_bytes(payload[0..4].try_into()?);
+        Ok(TcpRequest { opcode, msg: payload[4..].to_vec() })
+    }
+}
 
-        Ok(response) 
+#[derive(Debug)]
+pub struct TcpResponse {
+    pub statuscode: u32,
+    pub msg: Vec<u8>
+}
+
+impl TcpResponse {
+    pub fn decode(payload: &[u8]) -> Result<TcpResponse> {
+        if payload.len() < 4 {
+            bail!("TCP response too short: {} bytes", payload.len());
+        }
+        let statuscode = u32::from_be_bytes(payload[0..4].try_into()?);
+        Ok(TcpResponse { statuscode, msg: payload[4..].to_vec() })
     }
 }
@@ -1,16 +1,15 @@
-use tokio::sync::Mutex;
-use anyhow::Result;
+use anyhow::{bail, Result};
 use std::sync::Arc;
 use tokio::net::TcpStream;
-use zerocopy::FromBytes;
 
 use log::{info, error};
 
-use crate::App;
-use super::models::{TcpRequest, TcpResponse};
+use super::models::{TcpRequest, TcpResponse, TCP_MAX_PAYLOAD};
 
 pub struct TcpClient {
     pub stream: Arc<TcpStream>,
+    // bytes read past the end of the last frame
+    pending: Vec<u8>,
 }
 
 impl TcpClient {
@@ -18,83 +17,78 @@ impl TcpClient {
 
         let stream = TcpStream::connect(server_address).await?;
 
-        let client = TcpClient { stream: Arc::new(stream) };
+        let client = TcpClient { stream: Arc::new(stream), pending: Vec::new() };
 
         Ok(client)
     }
 
     pub async fn request(&mut self, request: &TcpRequest) -> Result<TcpResponse> {
-        let mut request_buf = [0u8; 260];
-        request_buf[0..4].copy_from_slice(&request.opcode.to_be_bytes());
-        request_buf[4..260].copy_from_slice(&request.msg);
+        let frame = request.encode();
 
         info!("sending request to server.");
-        loop {
+        let mut written = 0;
+        while written < frame.len() {
             self.stream.writable().await?;
-            match self.stream.try_write(&request_buf) {
-                Ok(_) => break,
+            match self.stream.try_write(&frame[written..]) {
+                Ok(n) => written += n,
                 Err(ref e) if e.kind() == std::io::ErrorKind::WouldBlock => continue,
                 Err(e) => return Err(e.into()),
             }
         }
 
-        let mut buf = [0u8; 260];
-        let mut total = 0;
-        while total < buf.len() {
-            self.stream.readable().await?;
-            match self.stream.try_read(&mut buf[total..]) {
+        let payload = Self::read_frame(&self.stream, &mut self.pending).await?;
+        info!("read {} byte response", payload.len());
+
+        TcpResponse::decode(&payload)
+    }
+
+    /// Read one length-prefixed frame, keeping anything after it in pending
+    async fn read_frame(stream: &TcpStream, pending: &mut Vec<u8>) -> Result<Vec<u8>> {
+        let mut buf = [0u8; 4096];
+        loop {
+            if pending.len() >= 4 {
+                let length = u32::from_be_bytes(pending[0..4].try_into()?) as usize;
+                if length < 4 || length > TCP_MAX_PAYLOAD {
+                    bail!("invalid TCP frame length {}", length);
+                }
+                if pending.len() >= 4 + length {
+                    let payload = pending[4..4 + length].to_vec();
+                    pending.drain(..4 + length);
+                    return Ok(payload);
+                }
+            }
+
+            stream.readable().await?;
+            match stream.try_read(&mut buf) {
                 Ok(0) => return Err(std::io::Error::new(std::io::ErrorKind::UnexpectedEof, "connection closed").into()),
-                Ok(n) => total += n,
+                Ok(n) => pending.extend_from_slice(&buf[..n]),
                 Err(ref e) if e.kind() == std::io::ErrorKind::WouldBlock => continue,
                 Err(e) => return Err(e.into()),
             }
         }
-        info!("read {} bytes", total);
-
-        let response = TcpResponse::read_from_bytes(&buf).map_err(|_| std::io::Error::new(std::io::ErrorKind::InvalidData, "Buffer size mismatch"))?;
-        Ok(response)
     }
 
     pub async fn listen(stream: Arc<TcpStream>) {
-        let mut buf = [0u8; 260];
+        let mut pending = Vec::new();
         info!("Starting TCP listener loop.");
         loop {
-            // Wait until the stream is readable
-            if let Err(e) = stream.readable().await {
-                error!("TCP stream not readable: {}", e);
-                break;
-            }
-
-            match stream.try_read(&mut buf) {
-                Ok(0) => {
-                    info!("TCP connection closed by server.");
-                    break;
-                }
-                Ok(_n) => {
-                    let request = match TcpRequest::read_from_bytes(&buf) {
-                        Ok(req) => req,
-                        Err(_) => {
-                            error!("Failed to deserialize TcpResponse");
-                            continue;
-                        }
-                    };
-                    
-                    Self::handle_tcp_event(request);
-                }
-                Err(ref e) if e.kind() == std::io::ErrorKind::WouldBlock => {
-                    // No data ready yet, loop back to readable()
-                    continue;
-                }
+            let payload = match Self::read_frame(&stream, &mut pending).await {
+                Ok(payload) => payload,
                 Err(e) => {
-                    error!("TCP Receiver error: {}", e);
+                    error!("TCP receiver stopped: {}", e);
                     break;
                 }
+            };
+
+            match TcpRequest::decode(&payload) {
+                Ok(request) => Self::handle_tcp_event(request).await,
+                Err(e) => error!("Failed to deserialize TcpRequest: {}", e),
             }
         }
     }
 
     async fn handle_tcp_event(request: TcpRequest) {
-        match u32::from_be(request.opcode) {
+        match request.opcode {
             _ => {
                 info!("Unknown opcode!")
             }
@@ -3,13 +3,12 @@ use tokio::sync::Mutex;
 use anyhow::Result;
 use std::sync::Arc;
 use std::net::SocketAddr;
-use bincode::config;
 
 use std::time::Instant;
 use log::{info, error};
 
-use super::models::{Position, GameStateMessage, PositionMessage};
-use super::super::App;
+use super::models::{GameStateMessage, InputMessage, SpectateMessage, PingMessage, PongMessage, SnapshotHistory, SERVER_PONG};
+use super::super::{App, TICK_RATE};
 
 pub struct UdpClient {
     pub socket: Arc<UdpSocket>,
@@ -33,42 +32,70 @@ impl UdpClient {
 
     }
 
-    pub async fn send_position(&self, position: &Position, player_id: u32) -> Result<()> {
-        let connection_message = PositionMessage {
-            id: player_id,
-            position: position.clone()
-        };
-        let config = config::standard()
-            .with_big_endian()
-            .with_fixed_int_encoding();
+    pub async fn send_input(&self, message: &InputMessage) -> Result<()> {
+        info!("Sending input to socket.");
+        self.socket.send_to(&message.encode(), self.server_address).await?;
+        Ok(())
+    }
 
-        let encoded_message = bincode::serde::encode_to_vec(&connection_message, config)?;
-        info!("Sending position to socket.");
-        self.socket.send_to(&encoded_message, self.server_address).await?;
+    pub async fn send_spectate(&self, message: &SpectateMessage) -> Result<()> {
+        let mut buf = Vec::with_capacity(SpectateMessage::SIZE);
+        message.encode(&mut buf);
+        self.socket.send_to(&buf, self.server_address).await?;
         Ok(())
     }
 
+    pub async fn send_ping(&self, message: &PingMessage) -> Result<()> {
+        let mut buf = Vec::with_capacity(PingMessage::SIZE);
+        message.encode(&mut buf);
+        self.socket.send_to(&buf, self.server_address).await?;
+        Ok(())
+    }
 
     pub async fn listen(socket: Arc<UdpSocket>, app: Arc<Mutex<App>>) {
         let mut buf = [0u8; 1024];
+        let mut history = SnapshotHistory::new();
         info!("Starting UDP listener loop.");
         loop {
             match socket.recv_from(&mut buf).await {
-                Ok((len, addr)) => {
-                    let config = config::standard()
-                        .with_big_endian()
-                        .with_fixed_int_encoding();
+                Ok((len, _addr)) => {
+                    let now = Instant::now();
+                    if len > 0 && buf[0] == SERVER_PONG {
+                        match PongMessage::decode(&buf[..len]) {
+                            Ok(pong) => app.lock().await.clock.on_pong(&pong, now),
+                            Err(e) => error!("Dropping pong: {}", e)
+                        }
+                        continue;
+                    }
 
-                    let (game_state_message, _len): (GameStateMessage, usize) = bincode::decode_from_slice(&buf[..len], config).expect("failed to deserialize packet");
+                    let game_state_message = match GameStateMessage::decode(&buf[..len], &history) {
+                        Ok(message) => message,
+                        Err(e) => {
+                            error!("Dropping snapshot: {}", e);
+                            continue;
+                        }
+                    };
 
                     let mut app = app.lock().await;
-                    let now = Instant::now();
-                    app.ping_ms = now.duration_since(app.last_udp_send).as_secs_f64() * 1000.0;
+                    // snapshots can arrive out of order, never step backwards
+                    if app.last_snapshot_seq != 0 && (game_state_message.sequence.wrapping_sub(app.last_snapshot_seq) as i32) <= 0 {
+                        continue;
+                    }
+                    app.last_snapshot_seq = game_state_message.sequence;
+                    app.server_tick = game_state_message.tick;
+                    app.frames_since_snapshot = 0;
                     app.last_udp_recv = Some(now);
+                    app.clock.on_snapshot(game_state_message.server_time, now);
 
                     app.game_active = game_state_message.game_active;
-                    app.seconds_to_start = game_state_message.seconds_to_start;
-                    if app.player_id == 1 {
+                    // count down to the start on our own clock rather than
+                    // waiting to be told each second
+                    app.start_at = None;
+                    if game_state_message.start_tick != 0 {
+                        let ticks = game_state_message.start_tick.wrapping_sub(game_state_message.tick) as u64;
+                        app.start_at = app.clock.to_local(game_state_message.server_time + ticks * TICK_RATE * 1000);
+                    }
+                    if app.player_index <= 1 {
                         app.player_score = game_state_message.left_score;
                         app.opponent_score = game_state_message.right_score;
                     } else {
@@ -81,19 +108,18 @@ impl UdpClient {
                             app.ball.y = position.y;
                             app.ball.dx = position.dx;
                             app.ball.dy = position.dy;
-                        } else if i as u32 == app.player_id {
-                            let dx = (app.player.x - position.x).abs();
-                            let dy = (app.player.y - position.y).abs();
-                            if dx > crate::RECONCILE_THRESHOLD || dy > crate::RECONCILE_THRESHOLD {
-                                info!("Reconciling player position (drift: dx={}, dy={})", dx, dy);
-                                app.player.x = position.x;
-                                app.player.y = position.y;
-                            }
+                        } else if app.spectating() && i == 1 {
+                            // spectators see the left paddle as "player", nothing to reconcile
+                            app.player.x = position.x;
+                            app.player.y = position.y;
+                        } else if i as u32 == app.player_index {
+                            app.reconcile(position, game_state_message.input_seq);
                         } else {
                             app.opponent.x = position.x;
                             app.opponent.y = position.y;
                         }
                     }
+                    history.insert(game_state_message);
                 }
                 Err(e) => error!("Receiver error: {}", e)
             }
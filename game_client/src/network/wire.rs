@@ -0,0 +1,359 @@
+// Generated by server/tools/schemagen from the schemas in server/src/protocol.h.
+// Don't edit; change the schema and run `make schema` in server/ instead.
+
+#![allow(dead_code)]
+
+use anyhow::{bail, Result};
+
+pub const CLIENT_INPUT: u8 = 1;
+pub const CLIENT_SPECTATE: u8 = 2;
+pub const CLIENT_PING: u8 = 3;
+pub const SERVER_PONG: u8 = 128;
+pub const SNAPSHOT_VERSION: u8 = 4;
+pub const MAX_CLIENTS: u32 = 2;
+pub const INPUT_REDUNDANCY: usize = 4;
+pub const POSITION_SCALE: f32 = 256.0;
+pub const VELOCITY_SCALE: f32 = 256.0;
+pub const TCP_MAX_BODY: usize = 256;
+pub const TCP_MAX_PAYLOAD: usize = 260;
+pub const TCP_REGISTER: u32 = 0;
+pub const TCP_SPECTATE: u32 = 1;
+pub const TCP_STATUS_OK: u32 = 0;
+pub const TCP_STATUS_QUEUE_FULL: u32 = 1;
+pub const TCP_STATUS_ALREADY_WAITING: u32 = 2;
+pub const TCP_STATUS_NO_SUCH_MATCH: u32 = 3;
+pub const TCP_STATUS_ALREADY_PLAYING: u32 = 4;
+pub const TCP_STATUS_UNAVAILABLE: u32 = 5;
+
+#[derive(Debug, Clone, Copy, Default, PartialEq)]
+pub struct InputCommand {
+    pub tick: u32,
+    pub r#move: i8,
+}
+
+impl InputCommand {
+    pub const SIZE: usize = 5;
+
+    pub fn encode(&self, buf: &mut Vec<u8>) {
+        buf.extend_from_slice(&self.tick.to_be_bytes());
+        buf.extend_from_slice(&self.r#move.to_be_bytes());
+    }
+
+    pub fn decode(buf: &[u8]) -> Result<InputCommand> {
+        if buf.len() < Self::SIZE {
+            bail!("InputCommand truncated: {} of {} bytes", buf.len(), Self::SIZE);
+        }
+        Ok(InputCommand {
+            tick: u32::from_be_bytes(buf[0..4].try_into().unwrap()),
+            r#move: i8::from_be_bytes(buf[4..5].try_into().unwrap()),
+        })
+    }
+}
+
+#[derive(Debug, Clone, Copy, Default, PartialEq)]
+pub struct InputMessageHeader {
+    pub id: u32,
+    pub ack: u32,
+    pub first_seq: u32,
+    pub count: u8,
+}
+
+impl InputMessageHeader {
+    pub const SIZE: usize = 14;
+
+    pub fn encode(&self, buf: &mut Vec<u8>) {
+        buf.extend_from_slice(&self.id.to_be_bytes());
+        buf.push(CLIENT_INPUT);
+        buf.extend_from_slice(&self.ack.to_be_bytes());
+        buf.extend_from_slice(&self.first_seq.to_be_bytes());
+        buf.extend_from_slice(&self.count.to_be_bytes());
+    }
+
+    pub fn decode(buf: &[u8]) -> Result<InputMessageHeader> {
+        if buf.len() < Self::SIZE {
+            bail!("InputMessageHeader truncated: {} of {} bytes", buf.len(), Self::SIZE);
+        }
+        if buf[4] != CLIENT_INPUT {
+            bail!("expected CLIENT_INPUT at byte 4, got {}", buf[4]);
+        }
+        Ok(InputMessageHeader {
+            id: u32::from_be_bytes(buf[0..4].try_into().unwrap()),
+            ack: u32::from_be_bytes(buf[5..9].try_into().unwrap()),
+            first_seq: u32::from_be_bytes(buf[9..13].try_into().unwrap()),
+            count: u8::from_be_bytes(buf[13..14].try_into().unwrap()),
+        })
+    }
+}
+
+#[derive(Debug, Clone, Copy, Default, PartialEq)]
+pub struct SpectateMessage {
+    pub id: u32,
+    pub spectator_id: u32,
+}
+
+impl SpectateMessage {
+    pub const SIZE: usize = 9;
+
+    pub fn encode(&self, buf: &mut Vec<u8>) {
+        buf.extend_from_slice(&self.id.to_be_bytes());
+        buf.push(CLIENT_SPECTATE);
+        buf.extend_from_slice(&self.spectator_id.to_be_bytes());
+    }
+
+    pub fn decode(buf: &[u8]) -> Result<SpectateMessage> {
+        if buf.len() < Self::SIZE {
+            bail!("SpectateMessage truncated: {} of {} bytes", buf.len(), Self::SIZE);
+        }
+        if buf[4] != CLIENT_SPECTATE {
+            bail!("expected CLIENT_SPECTATE at byte 4, got {}", buf[4]);
+        }
+        Ok(SpectateMessage {
+            id: u32::from_be_bytes(buf[0..4].try_into().unwrap()),
+            spectator_id: u32::from_be_bytes(buf[5..9].try_into().unwrap()),
+        })
+    }
+}
+
+#[derive(Debug, Clone, Copy, Default, PartialEq)]
+pub struct PingMessage {
+    pub id: u32,
+    pub client_time: u64,
+    pub echo_time: u64,
+    pub echo_delay: u32,
+}
+
+impl PingMessage {
+    pub const SIZE: usize = 25;
+
+    pub fn encode(&self, buf: &mut Vec<u8>) {
+        buf.extend_from_slice(&self.id.to_be_bytes());
+        buf.push(CLIENT_PING);
+        buf.extend_from_slice(&self.client_time.to_be_bytes());
+        buf.extend_from_slice(&self.echo_time.to_be_bytes());
+        buf.extend_from_slice(&self.echo_delay.to_be_bytes());
+    }
+
+    pub fn decode(buf: &[u8]) -> Result<PingMessage> {
+        if buf.len() < Self::SIZE {
+            bail!("PingMessage truncated: {} of {} bytes", buf.len(), Self::SIZE);
+        }
+        if buf[4] != CLIENT_PING {
+            bail!("expected CLIENT_PING at byte 4, got {}", buf[4]);
+        }
+        Ok(PingMessage {
+            id: u32::from_be_bytes(buf[0..4].try_into().unwrap()),
+            client_time: u64::from_be_bytes(buf[5..13].try_into().unwrap()),
+            echo_time: u64::from_be_bytes(buf[13..21].try_into().unwrap()),
+            echo_delay: u32::from_be_bytes(buf[21..25].try_into().unwrap()),
+        })
+    }
+}
+
+#[derive(Debug, Clone, Copy, Default, PartialEq)]
+pub struct PongMessage {
+    pub client_time: u64,
+    pub server_time: u64,
+    pub rtt: u32,
+}
+
+impl PongMessage {
+    pub const SIZE: usize = 21;
+
+    pub fn encode(&self, buf: &mut Vec<u8>) {
+        buf.push(SERVER_PONG);
+        buf.extend_from_slice(&self.client_time.to_be_bytes());
+        buf.extend_from_slice(&self.server_time.to_be_bytes());
+        buf.extend_from_slice(&self.rtt.to_be_bytes());
+    }
+
+    pub fn decode(buf: &[u8]) -> Result<PongMessage> {
+        if buf.len() < Self::SIZE {
+            bail!("PongMessage truncated: {} of {} bytes", buf.len(), Self::SIZE);
+        }
+        if buf[0] != SERVER_PONG {
+            bail!("expected SERVER_PONG at byte 0, got {}", buf[0]);
+        }
+        Ok(PongMessage {
+            client_time: u64::from_be_bytes(buf[1..9].try_into().unwrap()),
+            server_time: u64::from_be_bytes(buf[9..17].try_into().unwrap()),
+            rtt: u32::from_be_bytes(buf[17..21].try_into().unwrap()),
+        })
+    }
+}
+
+#[derive(Debug, Clone, Copy, Default, PartialEq)]
+pub struct QuantizedPosition {
+    pub x: u16,
+    pub y: u16,
+    pub dx: i16,
+    pub dy: i16,
+}
+
+impl QuantizedPosition {
+    pub const SIZE: usize = 8;
+
+    pub fn encode(&self, buf: &mut Vec<u8>) {
+        buf.extend_from_slice(&self.x.to_be_bytes());
+        buf.extend_from_slice(&self.y.to_be_bytes());
+        buf.extend_from_slice(&self.dx.to_be_bytes());
+        buf.extend_from_slice(&self.dy.to_be_bytes());
+    }
+
+    pub fn decode(buf: &[u8]) -> Result<QuantizedPosition> {
+        if buf.len() < Self::SIZE {
+            bail!("QuantizedPosition truncated: {} of {} bytes", buf.len(), Self::SIZE);
+        }
+        Ok(QuantizedPosition {
+            x: u16::from_be_bytes(buf[0..2].try_into().unwrap()),
+            y: u16::from_be_bytes(buf[2..4].try_into().unwrap()),
+            dx: i16::from_be_bytes(buf[4..6].try_into().unwrap()),
+            dy: i16::from_be_bytes(buf[6..8].try_into().unwrap()),
+        })
+    }
+}
+
+#[derive(Debug, Clone, Copy, Default, PartialEq)]
+pub struct SnapshotHeader {
+    pub sequence: u32,
+    pub base_sequence: u32,
+    pub tick: u32,
+    pub server_time: u64,
+    pub input_seq: u32,
+    pub left_score: u8,
+    pub right_score: u8,
+    pub flags: u8,
+    pub start_tick: u32,
+    pub num_positions: u8,
+    pub changed_mask: u8,
+}
+
+impl SnapshotHeader {
+    pub const SIZE: usize = 34;
+
+    pub fn encode(&self, buf: &mut Vec<u8>) {
+        buf.push(SNAPSHOT_VERSION);
+        buf.extend_from_slice(&self.sequence.to_be_bytes());
+        buf.extend_from_slice(&self.base_sequence.to_be_bytes());
+        buf.extend_from_slice(&self.tick.to_be_bytes());
+        buf.extend_from_slice(&self.server_time.to_be_bytes());
+        buf.extend_from_slice(&self.input_seq.to_be_bytes());
+        buf.extend_from_slice(&self.left_score.to_be_bytes());
+        buf.extend_from_slice(&self.right_score.to_be_bytes());
+        buf.extend_from_slice(&self.flags.to_be_bytes());
+        buf.extend_from_slice(&self.start_tick.to_be_bytes());
+        buf.extend_from_slice(&self.num_positions.to_be_bytes());
+        buf.extend_from_slice(&self.changed_mask.to_be_bytes());
+    }
+
+    pub fn decode(buf: &[u8]) -> Result<SnapshotHeader> {
+        if buf.len() < Self::SIZE {
+            bail!("SnapshotHeader truncated: {} of {} bytes", buf.len(), Self::SIZE);
+        }
+        if buf[0] != SNAPSHOT_VERSION {
+            bail!("expected SNAPSHOT_VERSION at byte 0, got {}", buf[0]);
+        }
+        Ok(SnapshotHeader {
+            sequence: u32::from_be_bytes(buf[1..5].try_into().unwrap()),
+            base_sequence: u32::from_be_bytes(buf[5..9].try_into().unwrap()),
+            tick: u32::from_be_bytes(buf[9..13].try_into().unwrap()),
+            server_time: u64::from_be_bytes(buf[13..21].try_into().unwrap()),
+            input_seq: u32::from_be_bytes(buf[21..25].try_into().unwrap()),
+            left_score: u8::from_be_bytes(buf[25..26].try_into().unwrap()),
+            right_score: u8::from_be_bytes(buf[26..27].try_into().unwrap()),
+            flags: u8::from_be_bytes(buf[27..28].try_into().unwrap()),
+            start_tick: u32::from_be_bytes(buf[28..32].try_into().unwrap()),
+            num_positions: u8::from_be_bytes(buf[32..33].try_into().unwrap()),
+            changed_mask: u8::from_be_bytes(buf[33..34].try_into().unwrap()),
+        })
+    }
+}
+
+#[derive(Debug, Clone, Copy, Default, PartialEq)]
+pub struct TcpFrameHeader {
+    pub length: u32,
+    pub code: u32,
+}
+
+impl TcpFrameHeader {
+    pub const SIZE: usize = 8;
+
+    pub fn encode(&self, buf: &mut Vec<u8>) {
+        buf.extend_from_slice(&self.length.to_be_bytes());
+        buf.extend_from_slice(&self.code.to_be_bytes());
+    }
+
+    pub fn decode(buf: &[u8]) -> Result<TcpFrameHeader> {
+        if buf.len() < Self::SIZE {
+            bail!("TcpFrameHeader truncated: {} of {} bytes", buf.len(), Self::SIZE);
+        }
+        Ok(TcpFrameHeader {
+            length: u32::from_be_bytes(buf[0..4].try_into().unwrap()),
+            code: u32::from_be_bytes(buf[4..8].try_into().unwrap()),
+        })
+    }
+}
+
+#[derive(Debug, Clone, Copy, Default, PartialEq)]
+pub struct SpectateRequest {
+    pub match_id: u32,
+}
+
+impl SpectateRequest {
+    pub const SIZE: usize = 4;
+
+    pub fn encode(&self, buf: &mut Vec<u8>) {
+        buf.extend_from_slice(&self.match_id.to_be_bytes());
+    }
+
+    pub fn decode(buf: &[u8]) -> Result<SpectateRequest> {
+        if buf.len() < Self::SIZE {
+            bail!("SpectateRequest truncated: {} of {} bytes", buf.len(), Self::SIZE);
+        }
+        Ok(SpectateRequest {
+            match_id: u32::from_be_bytes(buf[0..4].try_into().unwrap()),
+        })
+    }
+}
+
+#[derive(Debug, Clone, Copy, Default, PartialEq)]
+pub struct RegisterResponse {
+    pub id: u32,
+    pub rows: u32,
+    pub cols: u32,
+    pub player_move_speed: f32,
+    pub ball_radius: f32,
+    pub player_length: f32,
+    pub match_id: u32,
+    pub player_index: u32,
+}
+
+impl RegisterResponse {
+    pub const SIZE: usize = 32;
+
+    pub fn encode(&self, buf: &mut Vec<u8>) {
+        buf.extend_from_slice(&self.id.to_be_bytes());
+        buf.extend_from_slice(&self.rows.to_be_bytes());
+        buf.extend_from_slice(&self.cols.to_be_bytes());
+        buf.extend_from_slice(&self.player_move_speed.to_be_bytes());
+        buf.extend_from_slice(&self.ball_radius.to_be_bytes());
+        buf.extend_from_slice(&self.player_length.to_be_bytes());
+        buf.extend_from_slice(&self.match_id.to_be_bytes());
+        buf.extend_from_slice(&self.player_index.to_be_bytes());
+    }
+
+    pub fn decode(buf: &[u8]) -> Result<RegisterResponse> {
+        if buf.len() < Self::SIZE {
+            bail!("RegisterResponse truncated: {} of {} bytes", buf.len(), Self::SIZE);
+        }
+        Ok(RegisterResponse {
+            id: u32::from_be_bytes(buf[0..4].try_into().unwrap()),
+            rows: u32::from_be_bytes(buf[4..8].try_into().unwrap()),
+            cols: u32::from_be_bytes(buf[8..12].try_into().unwrap()),
+            player_move_speed: f32::from_be_bytes(buf[12..16].try_into().unwrap()),
+            ball_radius: f32::from_be_bytes(buf[16..20].try_into().unwrap()),
+            player_length: f32::from_be_bytes(buf[20..24].try_into().unwrap()),
+            match_id: u32::from_be_bytes(buf[24..28].try_into().unwrap()),
+            player_index: u32::from_be_bytes(buf[28..32].try_into().unwrap()),
+        })
+    }
+}
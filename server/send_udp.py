@@ -9,15 +9,16 @@ parser = argparse.ArgumentParser(
 parser.add_argument('-i', '--id', type=int, required=True)
 parser.add_argument('-x', '--x-position', type=int, required=True)
 parser.add_argument('-y', '--y-position', type=int, required=True)
+parser.add_argument('-a', '--ack', type=int, default=0)
 
 args = parser.parse_args()
 
-# The format '<Ic' means:
-# '<' : Little-endian
-# 'I' : Unsigned 4-byte integer (uint32_t)
-# 'c' : 1-byte character
-# Note: Python's struct.pack will handle the 8-byte alignment automatically.
-data = struct.pack('<III', int(args.id), int(args.x_position), int(args.y_position))
+# The format '!IffffI' matches struct PositionMessage:
+# '!' : Network byte order (big-endian), as the server decodes with ntohl
+# 'I' : player id (uint32_t)
+# 'f' : x, y, dx, dy (float)
+# 'I' : ack, newest snapshot sequence received (uint32_t)
+data = struct.pack('!IffffI', args.id, args.x_position, args.y_position, 0.0, 0.0, args.ack)
 print(f"sending data: {data}")
 sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
 sock.sendto(data, ("localhost", 9034)) # Replace with your server's port
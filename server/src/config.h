@@ -5,10 +5,47 @@
 #define COLS 200
 #define ROWS 50
 #define TICK_RATE 16
+#define TICK_SECONDS (TICK_RATE / 1000.0)
+#define MAX_CATCHUP_STEPS 5
+#define MAX_STEP_TICKS 4	// slowest a match can be simulated at, in ticks per step
+#define START_DELAY_TICKS (5000 / TICK_RATE)
 #define PLAYER_MOVE_SPEED 7.5f
 #define BALL_RADIUS 1.0f
 #define PLAYER_LENGTH 2.5f
+#define PADDLE_INSET 10.0f	// distance of each paddle from its wall
 #define MAX_CLIENTS 2
+#define MAX_MATCHES 10000
+#define MATCHMAKING_QUEUE_SIZE 65536	// players that can wait for an opponent at once
+#define SESSION_AWAY_MS 2000	// a player this long without a datagram pauses their match
+#define SESSION_TIMEOUT_MS 15000	// and this long ends it
+#define SESSION_AWAY_TICKS (SESSION_AWAY_MS / TICK_RATE)
+#define SESSION_TIMEOUT_TICKS (SESSION_TIMEOUT_MS / TICK_RATE)
+#define TCP_KEEPALIVE_IDLE_S 10	// probe a silent control connection after this long
+#define TCP_KEEPALIVE_INTERVAL_S 5
+#define TCP_KEEPALIVE_PROBES 3	// unanswered probes before the kernel reports it dead
+#define MAX_EPOLL_EVENTS 256
+#define NUM_WORKERS 0	// 0 = one worker per online core
+#define UDP_BATCH_SIZE 64
+#define TCP_READ_BUFFER_SIZE 4096	// per connection, room for several pipelined requests
+#define TCP_MAX_PENDING_OUTPUT (64 * 1024)	// unsent response bytes before a connection is dropped as a slow reader
+#define UDP_MAX_DATAGRAM 1024
+#define URING_RECV_BUFFERS 1024	// datagrams each worker's ring can hold before they're handled, a power of two
+#define SNAPSHOT_HISTORY 32
+#define INPUT_QUEUE_SIZE 16
+#define INPUT_REDUNDANCY 4	// commands repeated in each client datagram
+#define INPUT_REWIND_TICKS 16	// how far back late input can change the simulation
+#define SNAPSHOT_IDLE_TICKS 4	// most ticks between snapshots in play when only the ball's flight changes
+#define SNAPSHOT_KEEPALIVE_TICKS (1000 / TICK_RATE)	// most ticks between unchanged countdown snapshots
+#define SPECTATOR_INTERVAL_TICKS 2	// default ticks between spectator snapshots
+#define LOG_RING_SIZE 1024	// records buffered per logging thread
+#define LOG_MAX_THREADS 64
+#define LOG_FLUSH_INTERVAL_MS 10
+#define METRICS_SOCKET_PATH "/tmp/pong_server_metrics.sock"
+#define METRICS_MAX_SCRAPES 16	// scrapes answered at once, more are turned away
+#define HANDOFF_SOCKET_PATH "/tmp/pong_server_handoff.sock"
+#define HANDOFF_TIMEOUT_MS 5000	// longest a hot restart can take before the old server resumes
+#define REPLAY_CHUNK_SIZE (1 << 20)	// replay files grow this much at a time
+#define REPLAY_KEYFRAME_INTERVAL 256	// steps between full state snapshots
 
 #define BALL_MAX_VELO 10.0
 #define BALL_MIN_STARTING_VELO 10.0
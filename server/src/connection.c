@@ -0,0 +1,121 @@
+/*
+ * connection.c -- non-blocking buffered I/O for TCP control connections
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "connection.h"
+
+/**
+ * Start tracking a newly accepted fd.  Returns NULL if out of memory.
+ */
+Connection* connection_open(ConnectionTable* table, int fd) {
+	if ((size_t)fd >= table->capacity) {
+		size_t capacity = table->capacity ? table->capacity : 64;
+		while (capacity <= (size_t)fd)
+			capacity *= 2;
+		Connection** by_fd = realloc(table->by_fd, capacity * sizeof(Connection*));
+		if (by_fd == NULL)
+			return NULL;
+		memset(by_fd + table->capacity, 0, (capacity - table->capacity) * sizeof(Connection*));
+		table->by_fd = by_fd;
+		table->capacity = capacity;
+	}
+
+	Connection* connection = calloc(1, sizeof(Connection));
+	if (connection == NULL)
+		return NULL;
+	connection->fd = fd;
+	table->by_fd[fd] = connection;
+	table->count++;
+	return connection;
+}
+
+Connection* connection_get(const ConnectionTable* table, int fd) {
+	return (size_t)fd < table->capacity ? table->by_fd[fd] : NULL;
+}
+
+/**
+ * Close the socket, which also removes it from any epoll set, and free
+ * whatever was still buffered
+ */
+void connection_close(ConnectionTable* table, Connection* connection) {
+	table->by_fd[connection->fd] = NULL;
+	table->count--;
+	close(connection->fd);
+	free(connection->out);
+	free(connection);
+}
+
+/**
+ * Make room for length bytes at the end of the output buffer, to be
+ * written in place and then queued with connection_commit().  Returns NULL
+ * if that would leave more than TCP_MAX_PENDING_OUTPUT unsent, i.e. the
+ * peer isn't reading.
+ */
+uint8_t* connection_reserve(Connection* connection, size_t length) {
+	size_t pending = connection->out_end - connection->out_start;
+	if (pending + length > TCP_MAX_PENDING_OUTPUT)
+		return NULL;
+
+	if (connection->out_end + length > connection->out_capacity) {
+		// slide what's left to the front before growing
+		memmove(connection->out, connection->out + connection->out_start, pending);
+		connection->out_start = 0;
+		connection->out_end = pending;
+		if (pending + length > connection->out_capacity) {
+			size_t capacity = connection->out_capacity ? connection->out_capacity : 1024;
+			while (capacity < pending + length)
+				capacity *= 2;
+			uint8_t* out = realloc(connection->out, capacity);
+			if (out == NULL)
+				return NULL;
+			connection->out = out;
+			connection->out_capacity = capacity;
+		}
+	}
+	return connection->out + connection->out_end;
+}
+
+/**
+ * Append bytes to the output buffer.  Returns -1 if there's no room for
+ * them, as connection_reserve().
+ */
+int connection_queue(Connection* connection, const uint8_t* data, size_t length) {
+	uint8_t* out = connection_reserve(connection, length);
+	if (out == NULL)
+		return -1;
+	memcpy(out, data, length);
+	connection_commit(connection, length);
+	return 0;
+}
+
+/**
+ * Write buffered output until it's gone or the socket would block.
+ * Returns the number of bytes sent, or -1 if the connection failed.
+ */
+ssize_t connection_flush(Connection* connection) {
+	size_t sent = 0;
+	while (connection_pending(connection)) {
+		ssize_t n = send(connection->fd, connection->out + connection->out_start,
+				connection->out_end - connection->out_start, MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		connection->out_start += n;
+		sent += n;
+	}
+	if (!connection_pending(connection))
+		connection->out_start = connection->out_end = 0;
+	return sent;
+}
@@ -0,0 +1,64 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "config.h"
+
+/**
+ * buffered state for one TCP control connection.  Bytes are read into in
+ * until they make whole frames; responses are appended to out and written
+ * as far as the socket takes them, the rest when it's writable again.
+ */
+typedef struct {
+	int fd;
+	uint8_t in[TCP_READ_BUFFER_SIZE];
+	size_t in_length;
+
+	uint8_t* out;
+	size_t out_start;	// first unsent byte
+	size_t out_end;
+	size_t out_capacity;
+
+	// registration waiting for an opponent, answered once one is found
+	bool waiting;
+	uint64_t ticket;
+
+	// seat in a match, 0 if not playing
+	uint32_t player_id;
+
+	// the match being watched, if spectator_id isn't 0
+	uint32_t spectator_id;
+	uint32_t spectated_match;
+} Connection;
+
+/**
+ * connections of the control thread, indexed by fd
+ */
+typedef struct {
+	Connection** by_fd;
+	size_t capacity;
+	size_t count;
+} ConnectionTable;
+
+Connection* connection_open(ConnectionTable* table, int fd);
+Connection* connection_get(const ConnectionTable* table, int fd);
+void connection_close(ConnectionTable* table, Connection* connection);
+
+uint8_t* connection_reserve(Connection* connection, size_t length);
+int connection_queue(Connection* connection, const uint8_t* data, size_t length);
+ssize_t connection_flush(Connection* connection);
+
+// queue length bytes written at the pointer connection_reserve() returned
+static inline void connection_commit(Connection* connection, size_t length) {
+	connection->out_end += length;
+}
+
+static inline bool connection_pending(const Connection* connection) {
+	return connection->out_end > connection->out_start;
+}
+
+#endif
@@ -1,145 +1,623 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <sys/socket.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <math.h>
 
 #include "config.h"
 #include "protocol.h"
 #include "game.h"
+#include "log.h"
+
+/**
+ * Called when the tick timerfd fires.  Elapsed monotonic time is banked in an
+ * accumulator and consumed in fixed TICK_RATE steps, so physics is identical
+ * no matter how late the event loop services the timer.  If the loop falls
+ * more than MAX_CATCHUP_STEPS behind, the excess is dropped and counted as an
+ * overrun instead of spiralling.
+ */
+void tick(TickState *tick_state) {
+	MatchTable *table = tick_state->match_table;
+	WorkerMetrics *metrics = tick_state->metrics;
 
-void tick(union sigval sv) {
-	
-	TickState *tick_state = (TickState *)sv.sival_ptr;
 	struct timespec now;
-	time_t wall_now = time(NULL);
 	clock_gettime(CLOCK_MONOTONIC, &now);
-	
+	uint64_t now_ns = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+
+	// acknowledge the timer; more than one expiration means we woke up late
+	uint64_t expirations;
+	if (read(tick_state->timer_fd, &expirations, sizeof(expirations)) == (ssize_t)sizeof(expirations) && expirations > 0) {
+		if (expirations > 1)
+			metrics_add(&metrics->timer_overruns, expirations - 1);
+
+		// lateness against the timer's own schedule, not the previous wakeup
+		uint64_t deadline = tick_state->next_deadline_ns + (expirations - 1) * TICK_RATE * 1000000ull;
+		histogram_record(&metrics->tick_jitter, now_ns > deadline ? now_ns - deadline : 0);
+		tick_state->next_deadline_ns = deadline + TICK_RATE * 1000000ull;
+	}
+
+	tick_state->accumulator += (now.tv_sec - tick_state->latest_tick.tv_sec) +
+		(now.tv_nsec - tick_state->latest_tick.tv_nsec) / 1e9;
+	tick_state->latest_tick = now;
+
+	int steps = 0;
+	while (tick_state->accumulator >= TICK_SECONDS && steps < MAX_CATCHUP_STEPS) {
+		tick_state->tick_count++;
+		metrics_add(&metrics->ticks, 1);
+		step_matches(table, tick_state->tick_count, TICK_SECONDS);
+		tick_state->accumulator -= TICK_SECONDS;
+		steps++;
+	}
+
+	if (tick_state->accumulator >= TICK_SECONDS) {
+		uint64_t dropped = (uint64_t)(tick_state->accumulator / TICK_SECONDS);
+		metrics_add(&metrics->tick_overrun_steps, dropped);
+		tick_state->accumulator -= dropped * TICK_SECONDS;
+		tick_state->epoch_ns += dropped * TICK_RATE * 1000000ull;
+		LOG_WARN("tick overrun: dropped %lu steps (%lu total)", dropped, metrics_get(&metrics->tick_overrun_steps));
+	}
+
+	if (steps == 0)
+		return;
+
+	// one snapshot per wakeup, however many steps it took to catch up
+	for (uint32_t i = 0; i < table->high_water; i++) {
+		Match *match = &table->matches[i];
+		if (match->num_clients == 0)
+			continue;
+		broadcast_match(tick_state, match);
+		if (match->num_spectators > 0)
+			broadcast_spectators(tick_state, match);
+	}
+	udp_batch_flush(tick_state->udp_batch);
+	metrics_set(&metrics->udp_send_dropped, tick_state->udp_batch->send_dropped);
+	metrics_set(&metrics->inputs_late, table->inputs_late);
+	metrics_set(&metrics->rewinds, table->rewinds);
+
+	struct timespec done;
+	clock_gettime(CLOCK_MONOTONIC, &done);
+	histogram_record(&metrics->tick_duration, (uint64_t)done.tv_sec * 1000000000ull + done.tv_nsec - now_ns);
+}
+
+/**
+ * Move a paddle by one input command, keeping it on the board
+ */
+static void move_paddle(Position *paddle, int8_t move) {
+	paddle->y += move * PLAYER_MOVE_SPEED * (float)TICK_SECONDS;
+	if (paddle->y >= ROWS)
+		paddle->y = ROWS;
+	else if (paddle->y <= 0.0f)
+		paddle->y = 0.0f;
+}
+
+/**
+ * Award the point a physics step reported and serve the next ball into ball
+ */
+static void score_point(Match *match, int32_t result, Position *ball, uint64_t tick_count) {
+	if (result == PHYSICS_RIGHT_SCORED)
+		match->right_score += 1;
+	else
+		match->left_score += 1;
+	reset_game(match, ball, tick_count);
+}
+
+/**
+ * Run the per-match game logic for one fixed timestep: move through the
+ * waiting and countdown states.  Returns the time the ball should be
+ * advanced by, 0 if the game isn't in play.
+ */
+static float begin_step(Match *match, uint64_t tick_count, double time_delta) {
+	match->last_tick = tick_count;
+	uint8_t present = match_players_present(match);
+
+	// a player gone quiet sends the match back to waiting, with the ball
+	// held where it is, and it counts down again once they're back
+	if (present < MAX_CLIENTS && match->start_tick != 0) {
+		match->game_active = false;
+		match->start_tick = 0;
+	}
+
 	// don't start the game until all clients are connected
-	if (!tick_state->game_active && tick_state->scheduled_start == 0) {
-		for (int i = 0; i < MAX_CLIENTS; i++) {
-			Client* c = &tick_state->clients[i];
-			if (!c->active) {
-				printf("Waiting on all clients.  Only %d clients connected.\n", i);
-				tick_state->latest_tick = now;
-				return;
-			}
+	if (!match->game_active && match->start_tick == 0) {
+		if (present < MAX_CLIENTS) {
+			LOG_DEBUG("Match %u waiting on all clients.  Only %d clients present.", match->match_id, present);
+			return 0.0f;
 		}
 		// all clients connected, schedule game start!
-		time_t start_time = time(NULL) + 5;
-		tick_state->scheduled_start = start_time; 
-
-	} else if (!tick_state->game_active && tick_state->scheduled_start != 0) {
-		// start the game if the scheduled start has elapsed
-		if (wall_now >= tick_state->scheduled_start)
-			tick_state->game_active = true;
-	} else {
-		// game is running, move the ball!
-		double time_delta = (now.tv_sec - tick_state->latest_tick.tv_sec) +
-			(now.tv_nsec - tick_state->latest_tick.tv_nsec) / 1e9;
-
-		tick_state->ball_position->x += tick_state->ball_position->dx * time_delta;
-		tick_state->ball_position->y += tick_state->ball_position->dy * time_delta;
-
-		// left and right wall collisions - change score and reset
-		if (tick_state->ball_position->x - BALL_RADIUS <= 0.0) {
-			tick_state->right_score += 1;
-			reset_game(tick_state);
-		} else if (tick_state->ball_position->x + BALL_RADIUS > COLS) {
-			tick_state->left_score += 1;
-			reset_game(tick_state);
+		match->start_tick = tick_count + START_DELAY_TICKS;
+		return 0.0f;
+	}
+
+	// start the game if the scheduled start has elapsed
+	if (!match->game_active) {
+		if (tick_count >= match->start_tick)
+			match->game_active = true;
+		return 0.0f;
+	}
+
+	// game is running, move the ball!
+	return time_delta;
+}
+
+/**
+ * Whether a match is simulated on this tick: someone has to be there, and
+ * a match on a slower tick rate only steps on every step_ticks'th tick,
+ * offset by its phase so that the table's slow matches take turns
+ */
+static bool steps_on(const Match *match, uint64_t tick_count) {
+	return match_players_present(match) > 0 && (tick_count + match->step_phase) % match->step_ticks == 0;
+}
+
+static MatchState *saved_state(MatchTable *table, uint32_t index, uint64_t tick_count) {
+	return &table->rewind[(size_t)index * INPUT_REWIND_TICKS + tick_count % INPUT_REWIND_TICKS];
+}
+
+/**
+ * Whether the ball could touch a paddle within the rewind window.  Only
+ * then can late input change anything, so only then is the state saved.
+ */
+static bool near_paddle(const MatchTable *table, uint32_t index, const Match *match) {
+	const PhysicsBatch *physics = &table->physics;
+	float x = physics->ball_x[index];
+	float reach = fabsf(physics->ball_dx[index]) * (INPUT_REWIND_TICKS + match->step_ticks) * (float)TICK_SECONDS + BALL_RADIUS;
+	for (int p = 0; p < MAX_CLIENTS; p++) {
+		float px = match->player_positions[p].x;
+		if (x + reach >= px && x - reach <= px + PLAYER_LENGTH)
+			return true;
+	}
+	return false;
+}
+
+static void save_state(MatchTable *table, uint32_t index, const Match *match, uint64_t tick_count) {
+	MatchState *state = saved_state(table, index, tick_count);
+	state->tick = tick_count;
+	state->start_tick = match->start_tick;
+	state->rng_state = match->rng_state;
+	state->game_active = match->game_active;
+	state->left_score = match->left_score;
+	state->right_score = match->right_score;
+	physics_get_ball(&table->physics, index, &state->ball);
+	memcpy(state->players, match->player_positions, sizeof(state->players));
+}
+
+/**
+ * input made on an earlier tick than the one it arrived on
+ */
+typedef struct {
+	uint64_t tick;
+	int8_t move;
+	uint8_t slot;
+} LateInput;
+
+/**
+ * Re-simulate a match from the start of tick from up to tick_count, with
+ * each late input also moving its paddle from the first step on or after
+ * the tick it was made on.
+ * The match steps through the same game logic as step_matches, with its
+ * ball in the table's one-lane rewind batch, and the corrected states
+ * replace the saved ones.
+ */
+static void rewind_match(MatchTable *table, uint32_t index, Match *match, uint64_t from, uint64_t tick_count,
+		const LateInput *late, int num_late) {
+	PhysicsBatch *physics = &table->rewind_physics;
+	const MatchState *start = saved_state(table, index, from);
+	match->start_tick = start->start_tick;
+	match->rng_state = start->rng_state;
+	match->game_active = start->game_active;
+	match->left_score = start->left_score;
+	match->right_score = start->right_score;
+	physics_set_ball(physics, 0, &start->ball);
+
+	for (uint64_t t = from; t < tick_count; t += match->step_ticks) {
+		MatchState *state = saved_state(table, index, t);
+		Position players[MAX_CLIENTS];
+		memcpy(players, state->players, sizeof(players));
+		for (int l = 0; l < num_late; l++) {
+			if (late[l].tick <= t)
+				move_paddle(&players[late[l].slot], late[l].move);
 		}
 
-		// top and bottom wall collisions
-		if (tick_state->ball_position->y - BALL_RADIUS <= 0.0) {
-			tick_state->ball_position->y = BALL_RADIUS;
-			tick_state->ball_position->dy *= -1;
-		} else if (tick_state->ball_position->y + BALL_RADIUS > ROWS) {
-			tick_state->ball_position->y = ROWS - BALL_RADIUS;
-			tick_state->ball_position->dy *= -1;
+		state->start_tick = match->start_tick;
+		state->rng_state = match->rng_state;
+		state->game_active = match->game_active;
+		state->left_score = match->left_score;
+		state->right_score = match->right_score;
+		physics_get_ball(physics, 0, &state->ball);
+		memcpy(state->players, players, sizeof(players));
+
+		physics->step_dt[0] = begin_step(match, t, TICK_SECONDS * match->step_ticks);
+		for (int p = 0; p < MAX_CLIENTS; p++) {
+			physics->paddle_x[p][0] = players[p].x;
+			physics->paddle_y[p][0] = players[p].y;
+		}
+		physics_step(physics, 1);
+		if (physics->result[0] != PHYSICS_NONE) {
+			Position ball;
+			score_point(match, physics->result[0], &ball, t);
+			physics_set_ball(physics, 0, &ball);
 		}
+	}
+
+	Position ball;
+	physics_get_ball(physics, 0, &ball);
+	physics_set_ball(&table->physics, index, &ball);
+}
+
+/**
+ * Apply every input the network side has queued since the last step.  A
+ * command moves its paddle now; one made on a tick still inside the
+ * rewind window is also played back from that tick, re-simulating the
+ * match, so a player on a slow link returns the ball they saw.  Returns
+ * true if the match was rewound.
+ */
+bool apply_inputs(MatchTable *table, uint32_t index, Match *match, uint64_t tick_count) {
+	LateInput late[INPUT_QUEUE_SIZE * INPUT_REDUNDANCY];
+	int num_late = 0;
+	uint64_t from = tick_count;
+
+	InputEvent event;
+	while (input_queue_pop(&match->inputs, &event)) {
+		Client *client = &match->clients[event.slot];
+		if (!client->active)
+			continue;
+
+		// learn/refresh the client's real UDP address
+		client->addr = event.addr;
+		// only move the ack forward, datagrams can arrive out of order
+		if ((int32_t)(event.ack - client->acked_seq) > 0)
+			client->acked_seq = event.ack;
+
+		for (int c = 0; c < event.count; c++) {
+			// skip the redundant copies of commands already applied
+			uint32_t seq = event.first_seq + c;
+			if (client->input_seq != 0 && (int32_t)(seq - client->input_seq) <= 0)
+				continue;
+			client->input_seq = seq;
 
-		// player collisions
-		for (int i = 0; i < MAX_CLIENTS; i++) {
-			float px = tick_state->player_positions[i].x;
-			float py = tick_state->player_positions[i].y;
-			float bx = tick_state->ball_position->x;
-			float by = tick_state->ball_position->y;
-
-			// check if ball overlaps the paddle rectangle
-			bool overlap_x = (bx + BALL_RADIUS >= px) && (bx - BALL_RADIUS <= px + PLAYER_LENGTH);
-			bool overlap_y = (by + BALL_RADIUS >= py) && (by - BALL_RADIUS <= py + PLAYER_LENGTH);
-
-			if (overlap_x && overlap_y) {
-				// determine which side of the paddle the ball is closer to
-				float paddle_center_x = px + PLAYER_LENGTH / 2.0f;
-				if (bx < paddle_center_x) {
-					// ball hit left side, push it left and ensure dx goes left
-					tick_state->ball_position->x = px - BALL_RADIUS;
-					if (tick_state->ball_position->dx > 0)
-						tick_state->ball_position->dx *= -1;
-				} else {
-					// ball hit right side, push it right and ensure dx goes right
-					tick_state->ball_position->x = px + PLAYER_LENGTH + BALL_RADIUS;
-					if (tick_state->ball_position->dx < 0)
-						tick_state->ball_position->dx *= -1;
-				}
+			const InputCommand *command = &event.commands[c];
+			move_paddle(&match->player_positions[event.slot], command->move);
+
+			// commands made before the client saw a snapshot (tick 0) or
+			// stamped with a future tick are simply applied now
+			int32_t age = (int32_t)((uint32_t)tick_count - command->tick);
+			if (command->tick == 0 || age <= 0 || command->move == 0)
+				continue;
+			if (age >= INPUT_REWIND_TICKS) {
+				table->inputs_late++;
+				continue;
 			}
+			late[num_late++] = (LateInput){ .tick = tick_count - age, .move = command->move, .slot = event.slot };
+			if (tick_count - age < from)
+				from = tick_count - age;
 		}
 	}
 
+	if (num_late == 0)
+		return false;
+
+	// states are only saved while the ball is near a paddle, so if there
+	// isn't an unbroken run of them, a step apart, up to now it never came close
+	uint64_t first = tick_count;
+	uint64_t step = match->step_ticks;
+	while (first > from && first >= step && saved_state(table, index, first - step)->tick == first - step)
+		first -= step;
+	if (first == tick_count)
+		return false;
+
+	rewind_match(table, index, match, first, tick_count, late, num_late);
+	table->rewinds++;
+	return true;
+}
+
+/**
+ * Snapshot everything a recorded match's simulation depends on, so
+ * playback can start from here
+ */
+static void record_state(MatchTable *table, uint32_t index, Match *match, uint64_t tick_count, bool resync) {
+	ReplayKeyframe keyframe = {
+		.tick = tick_count,
+		.start_tick = match->start_tick,
+		.rng_state = match->rng_state,
+		.num_clients = match_players_present(match),
+		.game_active = match->game_active,
+		.left_score = match->left_score,
+		.right_score = match->right_score,
+	};
+	physics_get_ball(&table->physics, index, &keyframe.ball);
+	memcpy(keyframe.players, match->player_positions, sizeof(keyframe.players));
+	if (resync)
+		replay_resync(match->replay, &keyframe);
+	else
+		replay_keyframe(match->replay, &keyframe);
+}
+
+/**
+ * Start a recorded match's step record.  Paddles are recorded where the
+ * inputs left them, and a rewind, which changes the past, is recorded as
+ * a fresh state for playback to pick up from.
+ */
+static void record_step(MatchTable *table, uint32_t index, Match *match, uint64_t tick_count,
+		const Position *before, bool rewound) {
+	if (replay_keyframe_due(match->replay))
+		record_state(table, index, match, tick_count, false);
+	if (rewound)
+		record_state(table, index, match, tick_count, true);
+
+	// players who are away are recorded as gone, which is all playback needs to hold the match
+	replay_begin_step(match->replay, tick_count, match_players_present(match));
+	for (int p = 0; p < MAX_CLIENTS; p++) {
+		if (memcmp(&before[p], &match->player_positions[p], sizeof(Position)) != 0)
+			replay_add_input(match->replay, p, &match->player_positions[p]);
+	}
+}
+
+/**
+ * Advance every populated match of a table by a single fixed timestep.  Game
+ * logic runs per match, but the ball physics for the whole table is stepped
+ * in one pass over the structure-of-arrays batch so it vectorizes.  A
+ * match on a slower tick rate is stepped on every step_ticks'th tick by
+ * that many timesteps at once, and stands still in between.
+ */
+void step_matches(MatchTable *table, uint64_t tick_count, double time_delta) {
+	PhysicsBatch *physics = &table->physics;
+
+	for (uint32_t i = 0; i < table->high_water; i++) {
+		Match *match = &table->matches[i];
+		// as does one everyone has left or gone quiet in
+		if (!steps_on(match, tick_count)) {
+			physics->step_dt[i] = 0.0f;
+			continue;
+		}
+		Position before[MAX_CLIENTS];
+		memcpy(before, match->player_positions, sizeof(before));
+		bool rewound = apply_inputs(table, i, match, tick_count);
+		if (match->replay != NULL)
+			record_step(table, i, match, tick_count, before, rewound);
+		if (near_paddle(table, i, match))
+			save_state(table, i, match, tick_count);
 
-	GameStateMessage message;
-	message.left_score = tick_state->left_score;
-	message.right_score = tick_state->right_score;
-	message.game_active = tick_state->game_active;
-	message.seconds_to_start = (int32_t)tick_state->scheduled_start - wall_now;
-	message.num_positions = MAX_CLIENTS + 1;
-	Position ballPosition = *tick_state->ball_position;
-	message.positions[0] = ballPosition;
+		physics->step_dt[i] = begin_step(match, tick_count, time_delta * match->step_ticks);
+		for (int p = 0; p < MAX_CLIENTS; p++) {
+			physics->paddle_x[p][i] = match->player_positions[p].x;
+			physics->paddle_y[p][i] = match->player_positions[p].y;
+		}
+	}
+
+	physics_step(physics, table->high_water);
+
+	// left and right wall collisions - change score and reset
+	for (uint32_t i = 0; i < table->high_water; i++) {
+		if (physics->result[i] == PHYSICS_NONE)
+			continue;
+
+		Position ball;
+		score_point(&table->matches[i], physics->result[i], &ball, tick_count);
+		physics_set_ball(physics, i, &ball);
+	}
+
+	if (table->replay_dir == NULL)
+		return;
+	for (uint32_t i = 0; i < table->high_water; i++) {
+		Match *match = &table->matches[i];
+		if (match->replay == NULL || !steps_on(match, tick_count))
+			continue;
+		GameStateMessage state = { .sequence = 0 };
+		fill_game_state(table, i, match, &state);
+		replay_end_step(match->replay, &state);
+	}
+}
+
+/**
+ * Build the snapshot of a match's current state, everything but the
+ * sequence number and server time
+ */
+void fill_game_state(const MatchTable *table, uint32_t index, const Match *match, GameStateMessage *message) {
+	message->tick = (uint32_t)match->last_tick;
+	message->server_time = 0;
+	message->input_seq = 0;
+	message->left_score = match->left_score;
+	message->right_score = match->right_score;
+	message->game_active = match->game_active;
+	message->start_tick = 0;
+	if (!match->game_active && match->start_tick > match->last_tick)
+		message->start_tick = (uint32_t)match->start_tick;
+	message->num_positions = MAX_CLIENTS + 1;
+	Position ball;
+	physics_get_ball(&table->physics, index, &ball);
+	quantize_position(&ball, &message->positions[0]);
 	for (int i = 0; i < MAX_CLIENTS; i++) {
-		message.positions[i + 1] = tick_state->player_positions[i];
+		quantize_position(&match->player_positions[i], &message->positions[i + 1]);
+	}
+}
+
+/**
+ * Whether clients need a new snapshot of a match this tick.  They move the
+ * ball along its velocity between snapshots, so while it flies straight
+ * and the paddles are still there is nothing they can't work out for
+ * themselves until the idle interval is up.  A countdown needs sending
+ * when it starts or is called off, not each tick of it.
+ */
+static bool snapshot_due(const TickState *tick_state, const Match *match, const GameStateMessage *message) {
+	if (match->snapshot_seq == 0)
+		return true;
+
+	// at full rate, a match on a slower tick rate has nothing new until its next step
+	uint64_t since = tick_state->tick_count - match->snapshot_tick;
+	bool stepped = match->last_tick > match->snapshot_tick;
+	if (message->game_active && ((tick_state->full_rate_snapshots && stepped) || since >= SNAPSHOT_IDLE_TICKS))
+		return true;
+	if (!message->game_active && since >= SNAPSHOT_KEEPALIVE_TICKS)
+		return true;
+
+	const GameStateMessage *last = &match->history[match->snapshot_seq % SNAPSHOT_HISTORY];
+	if (message->left_score != last->left_score || message->right_score != last->right_score ||
+			message->game_active != last->game_active || message->start_tick != last->start_tick)
+		return true;
+	if (memcmp(&message->positions[1], &last->positions[1], MAX_CLIENTS * sizeof(QuantizedPosition)) != 0)
+		return true;
+	// a bounce changes the ball's velocity, which clients can't predict
+	return message->positions[0].dx != last->positions[0].dx || message->positions[0].dy != last->positions[0].dy;
+}
+
+/**
+ * When a tick was due on the server's clock, in the microseconds snapshots
+ * and pongs carry
+ */
+static uint64_t tick_server_time(const TickState *tick_state, uint64_t tick) {
+	return (tick_state->epoch_ns + tick * TICK_RATE * 1000000ull) / 1000;
+}
+
+/**
+ * Send the current state of a match to each of its connected clients, if
+ * it has changed in a way they need to hear about
+ */
+void broadcast_match(TickState *tick_state, Match *match) {
+	// nothing to show until every player has joined
+	if (!match->game_active && match->start_tick == 0)
+		return;
+
+	MatchTable *table = tick_state->match_table;
+	GameStateMessage state;
+	fill_game_state(table, match->match_id / table->num_workers, match, &state);
+	state.server_time = tick_server_time(tick_state, match->last_tick);
+	if (!snapshot_due(tick_state, match, &state)) {
+		metrics_add(&tick_state->metrics->snapshots_skipped, 1);
+		return;
 	}
 
-	uint8_t buffer[256];
-	serialize_game_state_message(buffer, &message);
+	// sequence 0 is reserved for "nothing acked"
+	if (++match->snapshot_seq == 0)
+		match->snapshot_seq = 1;
+	match->snapshot_tick = tick_state->tick_count;
 
-	// broadcast game state to clients
+	GameStateMessage* message = &match->history[match->snapshot_seq % SNAPSHOT_HISTORY];
+	*message = state;
+	message->sequence = match->snapshot_seq;
+
+	// queue game state for each client; tick() sends the whole batch at once
 	for (int i = 0; i < MAX_CLIENTS; i++) {
-		Client* client = &tick_state->clients[i];
+		Client* client = &match->clients[i];
 
-		if (!client->active)
+		// skip clients whose UDP address we haven't learned yet
+		if (!client->active || client->addr.sin_family == 0)
 			continue;
 
-		ssize_t sent = sendto(
-			tick_state->udp_sock_fd,
-			buffer,
-			sizeof(buffer),
-			0,
-			(struct sockaddr*)&client->addr,
-			sizeof(client->addr)
-		);
+		// delta encode against the client's last ack if it's still in history
+		const GameStateMessage* base = NULL;
+		uint32_t acked = client->acked_seq;
+		if (acked != 0 && match->snapshot_seq - acked < SNAPSHOT_HISTORY) {
+			const GameStateMessage* candidate = &match->history[acked % SNAPSHOT_HISTORY];
+			if (candidate->sequence == acked)
+				base = candidate;
+		}
+
+		// the only per-recipient field, so the shared copy is just overwritten
+		message->input_seq = client->input_seq;
+		uint8_t* buffer = udp_batch_reserve(tick_state->udp_batch);
+		size_t length = serialize_game_state_message(buffer, message, base);
+		udp_batch_commit(tick_state->udp_batch, &client->addr, length);
 
-		if (sent < 0)
-			perror("sendto");
-		printf("sent %lu bytes to client %d for game state \n", sent, i);
+		metrics_add(&match->metrics.udp_sent_packets, 1);
+		metrics_add(&match->metrics.udp_sent_bytes, length);
+		metrics_add(&tick_state->metrics->udp_sent_packets, 1);
+		metrics_add(&tick_state->metrics->udp_sent_bytes, length);
 	}
+}
 
-	tick_state->latest_tick = now;
+/**
+ * Send spectators the match every spectator_interval ticks.  The snapshot
+ * is serialized once, without a delta since spectators don't ack, into a
+ * payload every spectator's datagram points at, so each extra viewer only
+ * costs its send.  With a delay the payloads wait in a ring and go out
+ * spectator_delay snapshots later.
+ */
+void broadcast_spectators(TickState *tick_state, Match *match) {
+	if (!match->game_active && match->start_tick == 0)
+		return;
+	if (match->spectator_seq != 0 && tick_state->tick_count - match->spectator_tick < tick_state->spectator_interval)
+		return;
+	match->spectator_tick = tick_state->tick_count;
+
+	MatchTable *table = tick_state->match_table;
+	GameStateMessage state;
+	fill_game_state(table, match->match_id / table->num_workers, match, &state);
+	state.server_time = tick_server_time(tick_state, match->last_tick);
+	if (++match->spectator_seq == 0)
+		match->spectator_seq = 1;
+	state.sequence = match->spectator_seq;
 
+	SharedPayload *payload = shared_payload_new(MAX_SNAPSHOT_SIZE);
+	if (payload == NULL)
+		return;
+	payload->length = serialize_game_state_message(payload->data, &state, NULL);
+	metrics_add(&tick_state->metrics->spectator_snapshots, 1);
+
+	if (tick_state->spectator_delay > 0) {
+		if (match->spectator_delay == NULL) {
+			match->spectator_delay = calloc(tick_state->spectator_delay, sizeof(SharedPayload *));
+			if (match->spectator_delay == NULL) {
+				shared_payload_release(payload);
+				return;
+			}
+			match->spectator_delay_slots = tick_state->spectator_delay;
+		}
+		// the new snapshot takes the place of the one that's now due
+		SharedPayload **slot = &match->spectator_delay[match->spectator_seq % match->spectator_delay_slots];
+		SharedPayload *due = *slot;
+		*slot = payload;
+		payload = due;
+		if (payload == NULL)
+			return;
+	}
+
+	for (uint32_t i = 0; i < match->num_spectators; i++) {
+		Spectator *spectator = &match->spectators[i];
+		if (spectator->addr.sin_family == 0)
+			continue;
+		udp_batch_commit_shared(tick_state->udp_batch, &spectator->addr, payload);
+
+		metrics_add(&match->metrics.udp_sent_packets, 1);
+		metrics_add(&match->metrics.udp_sent_bytes, payload->length);
+		metrics_add(&tick_state->metrics->udp_sent_packets, 1);
+		metrics_add(&tick_state->metrics->udp_sent_bytes, payload->length);
+	}
+	shared_payload_release(payload);
 }
 
-void reset_game(TickState *tick_state) {
-	tick_state->game_active = false;
-	time_t start_time = time(NULL) + 5;
-	tick_state->scheduled_start = start_time; 
+/**
+ * Go back to the countdown after a point, serving a new ball into ball
+ */
+void reset_game(Match *match, Position *ball, uint64_t tick_count) {
+	match->game_active = false;
+	match->start_tick = tick_count + START_DELAY_TICKS;
 
-	tick_state->ball_position->x = COLS / 2.0;
-	tick_state->ball_position->y = ROWS / 2.0;
+	serve_ball(ball, &match->rng_state);
+}
 
-	double speed = BALL_MIN_STARTING_VELO + ((double)rand() / RAND_MAX) * (BALL_MAX_STARTING_VELO - BALL_MIN_STARTING_VELO);
-	tick_state->ball_position->dx = (rand() % 2 == 0) ? speed : -speed;
-	speed = BALL_MIN_STARTING_VELO + ((double)rand() / RAND_MAX) * (BALL_MAX_STARTING_VELO - BALL_MIN_STARTING_VELO);
-	tick_state->ball_position->dy = (rand() % 2 == 0) ? speed : -speed;
+/**
+ * xorshift32: cheap, and private to each match so workers never contend on
+ * the C library's global rand() state
+ */
+static uint32_t next_random(uint32_t *state) {
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
 
+/**
+ * Place the ball at the center of the board with a random starting velocity
+ */
+void serve_ball(Position *ball, uint32_t *rng_state) {
+	ball->x = COLS / 2.0;
+	ball->y = ROWS / 2.0;
 
+	double speed = BALL_MIN_STARTING_VELO + ((double)next_random(rng_state) / UINT32_MAX) * (BALL_MAX_STARTING_VELO - BALL_MIN_STARTING_VELO);
+	ball->dx = (next_random(rng_state) % 2 == 0) ? speed : -speed;
+	speed = BALL_MIN_STARTING_VELO + ((double)next_random(rng_state) / UINT32_MAX) * (BALL_MAX_STARTING_VELO - BALL_MIN_STARTING_VELO);
+	ball->dy = (next_random(rng_state) % 2 == 0) ? speed : -speed;
 }
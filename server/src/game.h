@@ -2,28 +2,37 @@
 #define GAME_H
 
 #include <time.h>
-#include <signal.h>
+#include <stdint.h>
+#include <stdbool.h>
 
 #include "protocol.h"
+#include "match.h"
+#include "udp_batch.h"
 
 typedef struct {
-	Position* ball_position;
-	Position* player_positions;
+	MatchTable* match_table;
+	UdpBatch* udp_batch;
+	WorkerMetrics* metrics;
 	int udp_sock_fd;
-	int tcp_sock_fd;
+	int timer_fd;
 	struct timespec latest_tick;
-	Client* clients;
-
-	bool game_active;
-	time_t scheduled_start;
-
-	uint8_t left_score;
-	uint8_t right_score;
-
-
+	uint64_t next_deadline_ns;	// when the timer should next fire, CLOCK_MONOTONIC
+	uint64_t epoch_ns;		// when tick 0 was due, so tick n is due n steps later
+
+	double accumulator;		// elapsed time not yet simulated, in seconds
+	uint64_t tick_count;		// fixed steps simulated since startup
+	bool full_rate_snapshots;	// send every tick during play, not just on change
+	unsigned int spectator_interval;	// ticks between spectator snapshots
+	unsigned int spectator_delay;	// spectator snapshots held back before sending
 } TickState;
 
-void tick(union sigval sv);
-void reset_game(TickState *tick_state);
+void tick(TickState *tick_state);
+bool apply_inputs(MatchTable *table, uint32_t index, Match *match, uint64_t tick_count);
+void step_matches(MatchTable *table, uint64_t tick_count, double time_delta);
+void fill_game_state(const MatchTable *table, uint32_t index, const Match *match, GameStateMessage *message);
+void broadcast_match(TickState *tick_state, Match *match);
+void broadcast_spectators(TickState *tick_state, Match *match);
+void reset_game(Match *match, Position *ball, uint64_t tick_count);
+void serve_ball(Position *ball, uint32_t *rng_state);
 
 #endif
@@ -0,0 +1,238 @@
+/*
+ * handoff.c -- passing sockets and serialized state to a new server process
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "handoff.h"
+
+/**
+ * Grow the buffer by length bytes, returning where they start, or NULL if
+ * out of memory
+ */
+uint8_t* handoff_append(HandoffBuffer* buffer, size_t length) {
+	if (buffer->length + length > buffer->capacity) {
+		size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+		while (capacity < buffer->length + length)
+			capacity *= 2;
+		uint8_t* data = realloc(buffer->data, capacity);
+		if (data == NULL)
+			return NULL;
+		buffer->data = data;
+		buffer->capacity = capacity;
+	}
+	uint8_t* start = buffer->data + buffer->length;
+	buffer->length += length;
+	return start;
+}
+
+/**
+ * Consume the next length bytes, or return NULL if fewer are left
+ */
+const uint8_t* handoff_take(HandoffBuffer* buffer, size_t length) {
+	if (buffer->length - buffer->offset < length)
+		return NULL;
+	const uint8_t* start = buffer->data + buffer->offset;
+	buffer->offset += length;
+	return start;
+}
+
+void handoff_buffer_free(HandoffBuffer* buffer) {
+	free(buffer->data);
+	memset(buffer, 0, sizeof(*buffer));
+}
+
+size_t handoff_num_listeners(const HandoffListeners* listeners) {
+	return 1 + (listeners->has_metrics_listener ? 1 : 0) + listeners->num_workers;
+}
+
+static int write_full(int sock, const void* data, size_t length) {
+	const uint8_t* p = data;
+	while (length > 0) {
+		ssize_t n = send(sock, p, length, MSG_NOSIGNAL);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		length -= n;
+	}
+	return 0;
+}
+
+static int read_full(int sock, void* data, size_t length) {
+	uint8_t* p = data;
+	while (length > 0) {
+		ssize_t n = recv(sock, p, length, 0);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		length -= n;
+	}
+	return 0;
+}
+
+/**
+ * Send sockets HANDOFF_FDS_PER_MESSAGE at a time, each batch attached to
+ * one byte of data so the receiver can pick them up one recvmsg at a time
+ */
+static int send_fds(int sock, const int* fds, size_t num_fds) {
+	for (size_t sent = 0; sent < num_fds; ) {
+		size_t count = num_fds - sent;
+		if (count > HANDOFF_FDS_PER_MESSAGE)
+			count = HANDOFF_FDS_PER_MESSAGE;
+
+		union {
+			char buf[CMSG_SPACE(HANDOFF_FDS_PER_MESSAGE * sizeof(int))];
+			struct cmsghdr align;
+		} control;
+		memset(&control, 0, sizeof(control));
+		uint8_t byte = 0;
+		struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+		struct msghdr msg = {
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+			.msg_control = control.buf,
+			.msg_controllen = CMSG_SPACE(count * sizeof(int)),
+		};
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds + sent, count * sizeof(int));
+
+		ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n != 1) {
+			perror("sendmsg");
+			return -1;
+		}
+		sent += count;
+	}
+	return 0;
+}
+
+// receive num_fds sockets sent by send_fds() into a newly allocated array
+static int receive_fds(int sock, int** fds, size_t num_fds) {
+	*fds = malloc((num_fds + 1) * sizeof(int));
+	if (*fds == NULL)
+		return -1;
+
+	for (size_t received = 0; received < num_fds; ) {
+		union {
+			char buf[CMSG_SPACE(HANDOFF_FDS_PER_MESSAGE * sizeof(int))];
+			struct cmsghdr align;
+		} control;
+		uint8_t byte;
+		struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+		struct msghdr msg = {
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+			.msg_control = control.buf,
+			.msg_controllen = sizeof(control.buf),
+		};
+		ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+		if (n == -1 && errno == EINTR)
+			continue;
+		struct cmsghdr* cmsg = n == 1 ? CMSG_FIRSTHDR(&msg) : NULL;
+		if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || (msg.msg_flags & MSG_CTRUNC)) {
+			fprintf(stderr, "handoff: expected %zu sockets, got %zu\n", num_fds, received);
+			return -1;
+		}
+		size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if (received + count > num_fds)
+			return -1;
+		memcpy(*fds + received, CMSG_DATA(cmsg), count * sizeof(int));
+		received += count;
+	}
+	return 0;
+}
+
+/**
+ * First half of a handoff: the listeners and the layout of the workers,
+ * which the new process can set up around while this one still serves
+ */
+int handoff_send_listeners(int sock, const HandoffListeners* listeners, const int* fds) {
+	uint8_t encoded[WIRE_SIZE(HANDOFF_LISTENERS_SCHEMA)];
+	encode_handoff_listeners(encoded, listeners);
+	if (write_full(sock, encoded, sizeof(encoded)) == -1)
+		return -1;
+	return send_fds(sock, fds, handoff_num_listeners(listeners));
+}
+
+/**
+ * Receive what handoff_send_listeners() sent.  Returns -1 if the stream is
+ * cut short or from an incompatible version.
+ */
+int handoff_receive_listeners(int sock, HandoffListeners* listeners, int** fds) {
+	uint8_t encoded[WIRE_SIZE(HANDOFF_LISTENERS_SCHEMA)];
+	if (read_full(sock, encoded, sizeof(encoded)) == -1)
+		return -1;
+	if (decode_handoff_listeners(encoded, sizeof(encoded), listeners) == -1) {
+		fprintf(stderr, "handoff: unsupported handoff version %u\n", encoded[0]);
+		return -1;
+	}
+	return receive_fds(sock, fds, handoff_num_listeners(listeners));
+}
+
+/**
+ * Second half, once the workers have stopped: the connections and the
+ * serialized state
+ */
+int handoff_send_state(int sock, const HandoffHeader* header, const int* fds, const HandoffBuffer* state) {
+	uint8_t encoded[WIRE_SIZE(HANDOFF_HEADER_SCHEMA)];
+	encode_handoff_header(encoded, header);
+	if (write_full(sock, encoded, sizeof(encoded)) == -1 || send_fds(sock, fds, header->num_connections) == -1)
+		return -1;
+	return write_full(sock, state->data, state->length);
+}
+
+int handoff_receive_state(int sock, HandoffHeader* header, int** fds, HandoffBuffer* state) {
+	uint8_t encoded[WIRE_SIZE(HANDOFF_HEADER_SCHEMA)];
+	if (read_full(sock, encoded, sizeof(encoded)) == -1
+			|| decode_handoff_header(encoded, sizeof(encoded), header) == -1
+			|| receive_fds(sock, fds, header->num_connections) == -1)
+		return -1;
+
+	memset(state, 0, sizeof(*state));
+	if (header->state_length > 0 && handoff_append(state, header->state_length) == NULL)
+		return -1;
+	return read_full(sock, state->data, state->length);
+}
+
+/**
+ * Grow the fd table to fit count more sockets.  Growing it in a threaded
+ * process waits out an RCU grace period, several milliseconds, each time
+ * it doubles, which is better spent before play is paused than while
+ * receiving the connections.
+ */
+void handoff_reserve_fds(int sock, size_t count) {
+	int highest = dup(sock);
+	if (highest == -1)
+		return;
+	close(highest);
+	int reserved = dup2(sock, highest + (int)count + 16);
+	if (reserved != -1)
+		close(reserved);
+}
+
+// tell the other process a step is done, or wait for it to say so
+int handoff_signal(int sock, char signal) {
+	return write_full(sock, &signal, 1);
+}
+
+int handoff_wait(int sock, char signal) {
+	char received;
+	if (read_full(sock, &received, 1) == -1 || received != signal)
+		return -1;
+	return 0;
+}
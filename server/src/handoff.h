@@ -0,0 +1,177 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "config.h"
+#include "wire.h"
+
+/*
+ * Hot restart: a new server process connects to the running one's handoff
+ * socket and is sent
+ *
+ *   HandoffListeners, with the TCP listener, the metrics listener if there
+ *   is one and each worker's UDP socket in worker order attached
+ *
+ * while the old process keeps serving.  Once the new one has its workers
+ * set up it answers HANDOFF_READY, and the old one stops its workers and
+ * sends
+ *
+ *   HandoffHeader, with each connection attached in the order of its record
+ *   the state: a ConnectionRecord per connection, each followed by its
+ *              unread input and unsent output, then per worker a
+ *              WorkerRecord and its matches, each a MatchRecord, a
+ *              ClientRecord per slot and a SpectatorRecord per viewer
+ *
+ * The new process answers HANDOFF_ACK once its workers are ticking, after
+ * which the old process exits.  Records use the wire codecs so the two
+ * binaries only need to agree on HANDOFF_VERSION, not on struct layouts.
+ */
+
+#define HANDOFF_VERSION 3
+#define HANDOFF_READY 'r'
+#define HANDOFF_ACK 'k'
+#define HANDOFF_FDS_PER_MESSAGE 250	// under the kernel's SCM_MAX_FD of 253
+
+#define HANDOFF_LISTENERS_SCHEMA(FIELD, TAG) \
+	TAG(HANDOFF_VERSION) \
+	FIELD(u32, num_workers) \
+	FIELD(u32, matches_per_worker) \
+	FIELD(u8, has_metrics_listener) \
+	FIELD(u32, num_connections)	/* so far, for the new process to make room for */
+
+typedef struct {
+	WIRE_FIELDS(HANDOFF_LISTENERS_SCHEMA)
+} HandoffListeners;
+
+#define HANDOFF_HEADER_SCHEMA(FIELD, TAG) \
+	FIELD(u32, num_connections) \
+	FIELD(u32, next_spectator_id) \
+	FIELD(u64, stopped_ns) \
+	FIELD(u64, state_length)
+
+typedef struct {
+	WIRE_FIELDS(HANDOFF_HEADER_SCHEMA)
+} HandoffHeader;
+
+// fd is the connection's number in the old process, which clients refer to it by
+#define CONNECTION_RECORD_SCHEMA(FIELD, TAG) \
+	FIELD(u32, fd) \
+	FIELD(u8, waiting) \
+	FIELD(u64, ticket) \
+	FIELD(u32, player_id) \
+	FIELD(u32, spectator_id) \
+	FIELD(u32, spectated_match) \
+	FIELD(u32, in_length) \
+	FIELD(u32, out_length)
+
+typedef struct {
+	WIRE_FIELDS(CONNECTION_RECORD_SCHEMA)
+} ConnectionRecord;
+
+#define WORKER_RECORD_SCHEMA(FIELD, TAG) \
+	FIELD(u64, tick_count) \
+	FIELD(u32, num_matches)
+
+typedef struct {
+	WIRE_FIELDS(WORKER_RECORD_SCHEMA)
+} WorkerRecord;
+
+#define MATCH_RECORD_SCHEMA(FIELD, TAG) \
+	FIELD(u32, match_id) \
+	FIELD(u8, num_clients) \
+	FIELD(u32, rng_state) \
+	FIELD(u8, game_active) \
+	FIELD(u64, start_tick) \
+	FIELD(u64, last_tick) \
+	FIELD(u8, step_ticks) \
+	FIELD(u8, left_score) \
+	FIELD(u8, right_score) \
+	FIELD(u32, snapshot_seq) \
+	FIELD(u64, snapshot_tick) \
+	FIELD(u32, spectator_seq) \
+	FIELD(u64, spectator_tick) \
+	FIELD(u32, num_spectators) \
+	FIELD(f32, ball_x) \
+	FIELD(f32, ball_y) \
+	FIELD(f32, ball_dx) \
+	FIELD(f32, ball_dy)
+
+typedef struct {
+	WIRE_FIELDS(MATCH_RECORD_SCHEMA)
+} MatchRecord;
+
+// addresses are in host byte order
+#define CLIENT_RECORD_SCHEMA(FIELD, TAG) \
+	FIELD(u8, active) \
+	FIELD(u32, tcp_fd) \
+	FIELD(u32, player_id) \
+	FIELD(u32, acked_seq) \
+	FIELD(u32, input_seq) \
+	FIELD(u32, addr) \
+	FIELD(u16, port) \
+	FIELD(f32, x) \
+	FIELD(f32, y) \
+	FIELD(f32, dx) \
+	FIELD(f32, dy)
+
+typedef struct {
+	WIRE_FIELDS(CLIENT_RECORD_SCHEMA)
+} ClientRecord;
+
+#define SPECTATOR_RECORD_SCHEMA(FIELD, TAG) \
+	FIELD(u32, spectator_id) \
+	FIELD(u32, addr) \
+	FIELD(u16, port)
+
+typedef struct {
+	WIRE_FIELDS(SPECTATOR_RECORD_SCHEMA)
+} SpectatorRecord;
+
+WIRE_CODEC(handoff_listeners, HandoffListeners, HANDOFF_LISTENERS_SCHEMA)
+WIRE_CODEC(handoff_header, HandoffHeader, HANDOFF_HEADER_SCHEMA)
+WIRE_CODEC(connection_record, ConnectionRecord, CONNECTION_RECORD_SCHEMA)
+WIRE_CODEC(worker_record, WorkerRecord, WORKER_RECORD_SCHEMA)
+WIRE_CODEC(match_record, MatchRecord, MATCH_RECORD_SCHEMA)
+WIRE_CODEC(client_record, ClientRecord, CLIENT_RECORD_SCHEMA)
+WIRE_CODEC(spectator_record, SpectatorRecord, SPECTATOR_RECORD_SCHEMA)
+
+/**
+ * serialized state, appended to by the old process and read back in the
+ * same order by the new one
+ */
+typedef struct HandoffBuffer {
+	uint8_t* data;
+	size_t length;
+	size_t capacity;
+	size_t offset;	// next byte to read
+} HandoffBuffer;
+
+uint8_t* handoff_append(HandoffBuffer* buffer, size_t length);
+const uint8_t* handoff_take(HandoffBuffer* buffer, size_t length);
+void handoff_buffer_free(HandoffBuffer* buffer);
+
+// append a record, or take one and decode it, returning -1 on failure
+#define HANDOFF_PUT(buffer, name, schema, record) ({ \
+	uint8_t* out_ = handoff_append(buffer, WIRE_SIZE(schema)); \
+	if (out_ != NULL) \
+		encode_##name(out_, record); \
+	out_ == NULL ? -1 : 0; \
+})
+#define HANDOFF_GET(buffer, name, schema, record) ({ \
+	const uint8_t* in_ = handoff_take(buffer, WIRE_SIZE(schema)); \
+	in_ == NULL ? -1 : decode_##name(in_, WIRE_SIZE(schema), record); \
+})
+
+size_t handoff_num_listeners(const HandoffListeners* listeners);
+int handoff_send_listeners(int sock, const HandoffListeners* listeners, const int* fds);
+int handoff_receive_listeners(int sock, HandoffListeners* listeners, int** fds);
+int handoff_send_state(int sock, const HandoffHeader* header, const int* fds, const HandoffBuffer* state);
+int handoff_receive_state(int sock, HandoffHeader* header, int** fds, HandoffBuffer* state);
+void handoff_reserve_fds(int sock, size_t count);
+int handoff_signal(int sock, char signal);
+int handoff_wait(int sock, char signal);
+
+#endif
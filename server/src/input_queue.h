@@ -0,0 +1,67 @@
+#ifndef INPUT_QUEUE_H
+#define INPUT_QUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+
+#include "config.h"
+#include "protocol.h"
+
+_Static_assert((INPUT_QUEUE_SIZE & (INPUT_QUEUE_SIZE - 1)) == 0, "INPUT_QUEUE_SIZE must be a power of two");
+
+/**
+ * a player's input datagram received from the network, waiting for the
+ * next tick
+ */
+typedef struct {
+	struct sockaddr_in addr;
+	uint64_t received_ns;	// CLOCK_MONOTONIC receive time
+	uint32_t ack;
+	uint32_t first_seq;
+	InputCommand commands[INPUT_REDUNDANCY];
+	uint8_t count;
+	uint8_t slot;
+} InputEvent;
+
+/**
+ * bounded single-producer/single-consumer ring of inputs for one match.
+ * The network side pushes, the tick pops; neither takes a lock, and an
+ * event is only visible to the consumer once it has been fully written.
+ * For now both sides run on the match's worker thread, so the ordering
+ * is only there for when receiving and simulating are split between
+ * threads; on x86 the acquire loads and release stores are plain moves.
+ */
+typedef struct {
+	_Alignas(64) _Atomic uint32_t head;	// next slot to write, owned by the producer
+	_Alignas(64) _Atomic uint32_t tail;	// next slot to read, owned by the consumer
+	InputEvent events[INPUT_QUEUE_SIZE];
+} InputQueue;
+
+static inline bool input_queue_push(InputQueue* queue, const InputEvent* event) {
+	uint32_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+	// a full ring is counted by the caller, in the worker's inputs_dropped
+	if (head - tail == INPUT_QUEUE_SIZE)
+		return false;
+
+	queue->events[head & (INPUT_QUEUE_SIZE - 1)] = *event;
+	// publish the event only after its contents are written
+	atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+	return true;
+}
+
+static inline bool input_queue_pop(InputQueue* queue, InputEvent* event) {
+	uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	uint32_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+	if (head == tail)
+		return false;
+
+	*event = queue->events[tail & (INPUT_QUEUE_SIZE - 1)];
+	// hand the slot back to the producer only after it has been copied out
+	atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+	return true;
+}
+
+#endif
@@ -0,0 +1,267 @@
+/*
+ * log.c -- asynchronous logging through per-thread rings
+ *
+ * Logging threads only copy the format pointer and tagged arguments into
+ * their own ring; a background thread formats and writes the records, so a
+ * slow stdout never stalls a worker's tick.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "log.h"
+
+_Atomic int log_level = LOG_LEVEL_INFO;
+
+static _Thread_local LogRing* thread_ring;
+
+// rings are registered once per thread and never freed
+static _Atomic(LogRing*) rings[LOG_MAX_THREADS];
+static _Atomic int num_rings;
+static _Atomic uint64_t unregistered_dropped;	// records from threads past LOG_MAX_THREADS
+
+static pthread_t flusher;
+static _Atomic bool flusher_running;
+
+static const char* level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+static LogRing* register_thread(void) {
+	int index = atomic_fetch_add(&num_rings, 1);
+	if (index >= LOG_MAX_THREADS)
+		return NULL;
+
+	LogRing* ring = calloc(1, sizeof(LogRing));
+	if (ring == NULL)
+		return NULL;
+	ring->thread_index = index;
+	atomic_store_explicit(&rings[index], ring, memory_order_release);
+	return ring;
+}
+
+/**
+ * Capture a record into the calling thread's ring.  Never blocks: if the
+ * flusher has fallen behind the record is dropped and counted.
+ */
+void log_write(int level, const char* format, int num_args, const LogArg* args) {
+	LogRing* ring = thread_ring;
+	if (ring == NULL) {
+		ring = thread_ring = register_thread();
+		if (ring == NULL) {
+			atomic_fetch_add_explicit(&unregistered_dropped, 1, memory_order_relaxed);
+			return;
+		}
+	}
+
+	uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if (head - tail == LOG_RING_SIZE) {
+		atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+		return;
+	}
+
+	LogRecord* record = &ring->records[head & (LOG_RING_SIZE - 1)];
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME_COARSE, &now);
+	record->timestamp_ns = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+	record->format = format;
+	record->level = level;
+	record->num_args = num_args < LOG_MAX_ARGS ? num_args : LOG_MAX_ARGS;
+
+	// strings may not outlive the call, so copy them in
+	size_t text_used = 0;
+	for (int i = 0; i < record->num_args; i++) {
+		record->types[i] = args[i].type;
+		if (args[i].type != LOG_ARG_STRING) {
+			record->args[i].u = args[i].u;
+			continue;
+		}
+		const char* s = args[i].s != NULL ? args[i].s : "(null)";
+		size_t length = strnlen(s, LOG_TEXT_SIZE - 1 - text_used);
+		memcpy(record->text + text_used, s, length);
+		record->text[text_used + length] = '\0';
+		record->args[i].u = text_used;
+		// once the text is full, later strings all point at its final, empty byte
+		text_used += length;
+		if (text_used < LOG_TEXT_SIZE - 1)
+			text_used++;
+	}
+
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/**
+ * Render a record's format string with its captured arguments.  Each
+ * conversion is handed to snprintf on its own, with the length modifier
+ * rewritten to match the 64-bit value that was stored.
+ */
+size_t log_format_record(const LogRecord* record, char* out, size_t size) {
+	size_t used = 0;
+	int arg = 0;
+
+#define APPEND(...) do { \
+	int n_ = snprintf(out + used, size - used, __VA_ARGS__); \
+	if (n_ > 0) used += ((size_t)n_ < size - used) ? (size_t)n_ : size - used - 1; \
+} while (0)
+
+	for (const char* p = record->format; *p != '\0' && used + 1 < size; p++) {
+		if (*p != '%') {
+			out[used++] = *p;
+			continue;
+		}
+		if (p[1] == '%') {
+			out[used++] = '%';
+			p++;
+			continue;
+		}
+
+		// copy flags, width and precision, skip length modifiers
+		char spec[32] = "%";
+		size_t spec_length = 1;
+		const char* q = p + 1;
+		while (*q != '\0' && strchr("-+ #0123456789.", *q) != NULL && spec_length < sizeof(spec) - 4)
+			spec[spec_length++] = *q++;
+		while (*q != '\0' && strchr("hlLqjzt", *q) != NULL)
+			q++;
+		char conversion = *q;
+		if (conversion == '\0')
+			break;
+		p = q;
+
+		if (arg >= record->num_args) {
+			APPEND("<?>");
+			continue;
+		}
+
+		int type = record->types[arg];
+		uint64_t value = record->args[arg].u;
+		arg++;
+
+		if (conversion == 'c') {
+			spec[spec_length++] = 'c';
+			spec[spec_length] = '\0';
+			APPEND(spec, (int)value);
+		} else if (strchr("di", conversion) != NULL || (strchr("uxXo", conversion) != NULL && type == LOG_ARG_INT)) {
+			spec[spec_length++] = 'l';
+			spec[spec_length++] = 'l';
+			spec[spec_length++] = conversion;
+			spec[spec_length] = '\0';
+			APPEND(spec, (long long)value);
+		} else if (strchr("uxXo", conversion) != NULL) {
+			spec[spec_length++] = 'l';
+			spec[spec_length++] = 'l';
+			spec[spec_length++] = conversion;
+			spec[spec_length] = '\0';
+			APPEND(spec, (unsigned long long)value);
+		} else if (strchr("fFeEgGaA", conversion) != NULL) {
+			spec[spec_length++] = conversion;
+			spec[spec_length] = '\0';
+			APPEND(spec, type == LOG_ARG_DOUBLE ? record->args[arg - 1].d : (double)value);
+		} else if (conversion == 's') {
+			spec[spec_length++] = 's';
+			spec[spec_length] = '\0';
+			APPEND(spec, type == LOG_ARG_STRING ? record->text + value : "<?>");
+		} else {
+			APPEND("%p", record->args[arg - 1].p);
+		}
+	}
+#undef APPEND
+
+	out[used] = '\0';
+	return used;
+}
+
+// write everything queued in one ring, returns the number of records
+static int drain_ring(LogRing* ring, FILE* stream) {
+	int count = 0;
+	uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	for (; tail != head; tail++, count++) {
+		const LogRecord* record = &ring->records[tail & (LOG_RING_SIZE - 1)];
+		char message[512];
+		log_format_record(record, message, sizeof(message));
+
+		time_t seconds = record->timestamp_ns / 1000000000ull;
+		struct tm tm;
+		localtime_r(&seconds, &tm);
+		fprintf(stream, "%02d:%02d:%02d.%03u %-5s [%d] %s\n",
+			tm.tm_hour, tm.tm_min, tm.tm_sec, (unsigned)(record->timestamp_ns % 1000000000ull / 1000000),
+			level_names[record->level], ring->thread_index, message);
+		// hand the slot back only once the record has been formatted
+		atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	}
+
+	uint32_t dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+	if (dropped > 0)
+		fprintf(stream, "log: thread %d dropped %u records, ring full\n", ring->thread_index, dropped);
+	return count;
+}
+
+static int drain_all(FILE* stream) {
+	int count = 0;
+	int registered = atomic_load(&num_rings);
+	if (registered > LOG_MAX_THREADS)
+		registered = LOG_MAX_THREADS;
+	for (int i = 0; i < registered; i++) {
+		LogRing* ring = atomic_load_explicit(&rings[i], memory_order_acquire);
+		if (ring != NULL)
+			count += drain_ring(ring, stream);
+	}
+
+	uint64_t dropped = atomic_exchange(&unregistered_dropped, 0);
+	if (dropped > 0)
+		fprintf(stream, "log: dropped %lu records from threads past the limit of %d\n", dropped, LOG_MAX_THREADS);
+	if (count > 0 || dropped > 0)
+		fflush(stream);
+	return count;
+}
+
+static void* flusher_main(void* arg) {
+	struct timespec interval = { .tv_sec = 0, .tv_nsec = LOG_FLUSH_INTERVAL_MS * 1000000L };
+	while (atomic_load(&flusher_running)) {
+		// keep going without sleeping while there's a backlog
+		if (drain_all(stdout) == 0)
+			nanosleep(&interval, NULL);
+	}
+	drain_all(stdout);
+	return NULL;
+}
+
+/**
+ * Set the runtime level and start the flusher thread
+ */
+int log_init(int level) {
+	atomic_store(&log_level, level);
+	atomic_store(&flusher_running, true);
+	int rv = pthread_create(&flusher, NULL, flusher_main, NULL);
+	if (rv != 0) {
+		fprintf(stderr, "log: pthread_create: %s\n", strerror(rv));
+		atomic_store(&flusher_running, false);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Stop the flusher after it has written everything already queued
+ */
+void log_shutdown(void) {
+	if (!atomic_exchange(&flusher_running, false))
+		return;
+	pthread_join(flusher, NULL);
+}
+
+int log_parse_level(const char* name) {
+	for (int level = LOG_LEVEL_DEBUG; level <= LOG_LEVEL_ERROR; level++) {
+		if (strcasecmp(name, level_names[level]) == 0)
+			return level;
+	}
+	if (strcasecmp(name, "off") == 0)
+		return LOG_LEVEL_OFF;
+	return -1;
+}
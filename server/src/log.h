@@ -0,0 +1,144 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "config.h"
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_OFF 4
+
+// statements below this level are compiled out entirely, e.g. -DLOG_COMPILE_LEVEL=1
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#define LOG_MAX_ARGS 8
+#define LOG_TEXT_SIZE 64	// bytes of string arguments copied into a record
+
+_Static_assert((LOG_RING_SIZE & (LOG_RING_SIZE - 1)) == 0, "LOG_RING_SIZE must be a power of two");
+
+typedef enum {
+	LOG_ARG_INT,
+	LOG_ARG_UINT,
+	LOG_ARG_DOUBLE,
+	LOG_ARG_STRING,	// copied into the record's text, value is the offset
+	LOG_ARG_POINTER,
+} LogArgType;
+
+typedef struct {
+	LogArgType type;
+	union {
+		int64_t i;
+		uint64_t u;
+		double d;
+		const void* p;
+		const char* s;
+	};
+} LogArg;
+
+/**
+ * one log statement, captured without formatting.  The format string must
+ * be a literal, only its address is stored; the flusher thread renders the
+ * text later.
+ */
+typedef struct {
+	const char* format;
+	uint64_t timestamp_ns;	// CLOCK_REALTIME
+	uint8_t level;
+	uint8_t num_args;
+	uint8_t types[LOG_MAX_ARGS];
+	union {
+		int64_t i;
+		uint64_t u;
+		double d;
+		const void* p;
+	} args[LOG_MAX_ARGS];
+	char text[LOG_TEXT_SIZE];
+} LogRecord;
+
+/**
+ * single-producer/single-consumer ring of records for one thread.  The
+ * owning thread pushes, the flusher pops; records that don't fit are
+ * dropped and counted rather than blocking the caller.
+ */
+typedef struct {
+	_Alignas(64) _Atomic uint32_t head;	// next slot to write, owned by the logging thread
+	_Atomic uint32_t dropped;
+	_Alignas(64) _Atomic uint32_t tail;	// next slot to read, owned by the flusher
+	int thread_index;
+	LogRecord records[LOG_RING_SIZE];
+} LogRing;
+
+extern _Atomic int log_level;
+
+int log_init(int level);
+void log_shutdown(void);
+int log_parse_level(const char* name);
+void log_write(int level, const char* format, int num_args, const LogArg* args);
+size_t log_format_record(const LogRecord* record, char* out, size_t size);
+
+static inline bool log_enabled(int level) {
+	return level >= atomic_load_explicit(&log_level, memory_order_relaxed);
+}
+
+static inline LogArg log_arg_int(long long value) { return (LogArg){ .type = LOG_ARG_INT, .i = value }; }
+static inline LogArg log_arg_uint(unsigned long long value) { return (LogArg){ .type = LOG_ARG_UINT, .u = value }; }
+static inline LogArg log_arg_double(double value) { return (LogArg){ .type = LOG_ARG_DOUBLE, .d = value }; }
+static inline LogArg log_arg_string(const char* value) { return (LogArg){ .type = LOG_ARG_STRING, .s = value }; }
+static inline LogArg log_arg_pointer(const void* value) { return (LogArg){ .type = LOG_ARG_POINTER, .p = value }; }
+
+// tag each argument with its type at compile time
+#define LOG_ARG(x) _Generic((x), \
+	_Bool: log_arg_uint, \
+	char: log_arg_int, \
+	signed char: log_arg_int, \
+	short: log_arg_int, \
+	int: log_arg_int, \
+	long: log_arg_int, \
+	long long: log_arg_int, \
+	unsigned char: log_arg_uint, \
+	unsigned short: log_arg_uint, \
+	unsigned int: log_arg_uint, \
+	unsigned long: log_arg_uint, \
+	unsigned long long: log_arg_uint, \
+	float: log_arg_double, \
+	double: log_arg_double, \
+	char*: log_arg_string, \
+	const char*: log_arg_string, \
+	default: log_arg_pointer)(x)
+
+#define LOG_NARGS(...) LOG_NARGS_(_, ##__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define LOG_NARGS_(_, a1, a2, a3, a4, a5, a6, a7, a8, n, ...) n
+
+#define LOG_ARGS_0()
+#define LOG_ARGS_1(a) LOG_ARG(a),
+#define LOG_ARGS_2(a, ...) LOG_ARG(a), LOG_ARGS_1(__VA_ARGS__)
+#define LOG_ARGS_3(a, ...) LOG_ARG(a), LOG_ARGS_2(__VA_ARGS__)
+#define LOG_ARGS_4(a, ...) LOG_ARG(a), LOG_ARGS_3(__VA_ARGS__)
+#define LOG_ARGS_5(a, ...) LOG_ARG(a), LOG_ARGS_4(__VA_ARGS__)
+#define LOG_ARGS_6(a, ...) LOG_ARG(a), LOG_ARGS_5(__VA_ARGS__)
+#define LOG_ARGS_7(a, ...) LOG_ARG(a), LOG_ARGS_6(__VA_ARGS__)
+#define LOG_ARGS_8(a, ...) LOG_ARG(a), LOG_ARGS_7(__VA_ARGS__)
+#define LOG_ARGS_N(n) LOG_ARGS_##n
+#define LOG_ARGS(n, ...) LOG_ARGS_N(n)(__VA_ARGS__)
+
+// arguments are only evaluated when the level is enabled
+#define LOG_AT(level, format, ...) do { \
+	if ((level) >= LOG_COMPILE_LEVEL && log_enabled(level)) { \
+		const LogArg log_args_[] = { LOG_ARGS(LOG_NARGS(__VA_ARGS__), ##__VA_ARGS__) log_arg_int(0) }; \
+		log_write((level), (format), LOG_NARGS(__VA_ARGS__), log_args_); \
+	} \
+} while (0)
+
+#define LOG_DEBUG(format, ...) LOG_AT(LOG_LEVEL_DEBUG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) LOG_AT(LOG_LEVEL_INFO, format, ##__VA_ARGS__)
+#define LOG_WARN(format, ...) LOG_AT(LOG_LEVEL_WARN, format, ##__VA_ARGS__)
+#define LOG_ERROR(format, ...) LOG_AT(LOG_LEVEL_ERROR, format, ##__VA_ARGS__)
+
+#endif
@@ -0,0 +1,476 @@
+/*
+ * match.c -- pool of concurrent matches and match id allocation
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "match.h"
+#include "game.h"
+#include "handoff.h"
+
+int match_table_init(MatchTable* table, uint32_t capacity, int worker_index, int num_workers) {
+	table->matches = calloc(capacity, sizeof(Match));
+	table->rewind = calloc((size_t)capacity * INPUT_REWIND_TICKS, sizeof(MatchState));
+	if (table->matches == NULL || table->rewind == NULL
+			|| physics_batch_init(&table->physics, capacity) == -1 || physics_batch_init(&table->rewind_physics, 1) == -1) {
+		physics_batch_free(&table->physics);
+		free(table->matches);
+		free(table->rewind);
+		table->matches = NULL;
+		return -1;
+	}
+
+	table->capacity = capacity;
+	table->high_water = 0;
+	table->worker_index = worker_index;
+	table->num_workers = num_workers;
+	table->replay_dir = NULL;
+	table->step_ticks = 1;
+	timer_wheel_init(&table->sessions, 0);
+
+	uint32_t seed = (uint32_t)time(NULL);
+	for (uint32_t i = 0; i < capacity; i++) {
+		Match* match = &table->matches[i];
+		match->match_id = i * num_workers + worker_index;
+		match->step_ticks = 1;
+		// xorshift state must never be zero
+		match->rng_state = (seed ^ (match->match_id * 2654435761u)) | 1;
+
+		Position ball;
+		serve_ball(&ball, &match->rng_state);
+		physics_set_ball(&table->physics, i, &ball);
+	}
+	return 0;
+}
+
+void match_table_free(MatchTable* table) {
+	for (uint32_t i = 0; i < table->capacity; i++) {
+		Match* match = &table->matches[i];
+		replay_close(match->replay);
+		free(match->spectators);
+		for (uint32_t s = 0; s < match->spectator_delay_slots; s++)
+			shared_payload_release(match->spectator_delay[s]);
+		free(match->spectator_delay);
+	}
+	free(table->matches);
+	free(table->rewind);
+	physics_batch_free(&table->physics);
+	physics_batch_free(&table->rewind_physics);
+	table->matches = NULL;
+	table->capacity = 0;
+}
+
+// give a newly seated player until SESSION_AWAY_TICKS from now to be heard from
+static void watch_session(MatchTable* table, Match* match, int slot) {
+	match->last_seen[slot] = table->sessions.now;
+	match->away[slot] = false;
+	match->sessions[slot].id = match->clients[slot].player_id;
+	timer_wheel_schedule(&table->sessions, &match->sessions[slot], table->sessions.now + SESSION_AWAY_TICKS);
+}
+
+/**
+ * Seat a client in the slot the control plane assigned it.  Player ids are
+ * global: match_id * MAX_CLIENTS + slot + 1, so UDP traffic can be routed
+ * back to its worker and match without a search.  The match takes replay,
+ * if any, as its recording; it's closed if the client can't be seated or
+ * the match is already being recorded.
+ */
+Match* match_table_add_client(MatchTable* table, uint32_t match_id, int slot, int tcp_fd, ReplayWriter* replay) {
+	uint32_t index = match_id / table->num_workers;
+	Match* match = index < table->capacity ? &table->matches[index] : NULL;
+	if ((int)(match_id % table->num_workers) != table->worker_index || match == NULL || match->clients[slot].active) {
+		replay_close(replay);
+		return NULL;
+	}
+
+	Client* client = &match->clients[slot];
+
+	client->active = true;
+	client->player_id = player_id_for(match_id, slot);
+	client->tcp_fd = tcp_fd;
+	client->acked_seq = 0;
+	client->input_seq = 0;
+	client->rtt_us = 0;
+	// paddles start mid-court in front of their own wall
+	match->player_positions[slot] = (Position){ .x = slot == 0 ? PADDLE_INSET : COLS - PADDLE_INSET, .y = ROWS / 2.0f };
+	memset(&client->addr, 0, sizeof(client->addr));
+	// slow matches step on staggered ticks rather than all on the same one
+	if (match->num_clients == 0) {
+		match->step_ticks = table->step_ticks;
+		match->step_phase = index % match->step_ticks;
+	}
+	match->num_clients++;
+	watch_session(table, match, slot);
+
+	if (match->replay == NULL)
+		match->replay = replay;
+	else
+		replay_close(replay);
+
+	if (index >= table->high_water)
+		table->high_water = index + 1;
+	return match;
+}
+
+/**
+ * Find the match and slot owning a player id, or NULL if the id does not
+ * belong to an active client of this worker.
+ */
+Match* match_table_lookup(MatchTable* table, uint32_t player_id, int* slot) {
+	if (player_id == 0)
+		return NULL;
+
+	uint32_t match_id = match_id_for(player_id);
+	if ((int)(match_id % table->num_workers) != table->worker_index)
+		return NULL;
+
+	uint32_t index = match_id / table->num_workers;
+	if (index >= table->high_water)
+		return NULL;
+
+	Match* match = &table->matches[index];
+	int s = (player_id - 1) % MAX_CLIENTS;
+	if (!match->clients[s].active)
+		return NULL;
+
+	*slot = s;
+	return match;
+}
+
+/**
+ * Find the match with an id, if this worker hosts it
+ */
+Match* match_table_find(MatchTable* table, uint32_t match_id) {
+	uint32_t index = match_id / table->num_workers;
+	if ((int)(match_id % table->num_workers) != table->worker_index || index >= table->high_water)
+		return NULL;
+	return &table->matches[index];
+}
+
+/**
+ * Note that a player was heard from, bringing them back if they were away.
+ * Their timer is left as it is and finds out when it fires, so this costs
+ * a store per datagram.
+ */
+void match_table_touch(MatchTable* table, Match* match, int slot) {
+	match->last_seen[slot] = table->sessions.now;
+	if (match->away[slot]) {
+		match->away[slot] = false;
+		match->num_away--;
+	}
+}
+
+/**
+ * Finish a match: unseat its players and spectators, stop its recording
+ * and reset it to be started again under the same id.  Scores, the serve
+ * and the spectator delay start over; snapshot sequence numbers carry on,
+ * so stale acks never match the new match's history.
+ */
+void match_table_end(MatchTable* table, Match* match) {
+	uint32_t index = match->match_id / table->num_workers;
+	for (int slot = 0; slot < MAX_CLIENTS; slot++) {
+		timer_wheel_cancel(&match->sessions[slot]);
+		memset(&match->clients[slot], 0, sizeof(Client));
+		match->clients[slot].tcp_fd = -1;
+		match->away[slot] = false;
+	}
+	match->num_clients = 0;
+	match->num_away = 0;
+	match->num_spectators = 0;
+	// delayed snapshots of this match mustn't reach the next one's audience
+	for (uint32_t s = 0; s < match->spectator_delay_slots; s++) {
+		shared_payload_release(match->spectator_delay[s]);
+		match->spectator_delay[s] = NULL;
+	}
+	match->spectator_tick = 0;
+	match->game_active = false;
+	match->start_tick = 0;
+	match->left_score = 0;
+	match->right_score = 0;
+	metrics_set(&match->metrics.udp_received_packets, 0);
+	metrics_set(&match->metrics.udp_received_bytes, 0);
+	metrics_set(&match->metrics.udp_sent_packets, 0);
+	metrics_set(&match->metrics.udp_sent_bytes, 0);
+
+	InputEvent event;
+	while (input_queue_pop(&match->inputs, &event))
+		;
+
+	replay_close(match->replay);
+	match->replay = NULL;
+
+	Position ball;
+	serve_ball(&ball, &match->rng_state);
+	physics_set_ball(&table->physics, index, &ball);
+}
+
+/**
+ * Add a viewer, whose address is filled in by their first datagram.
+ * Returns -1 if out of memory.
+ */
+int match_add_spectator(Match* match, uint32_t spectator_id) {
+	if (match->num_spectators == match->spectators_capacity) {
+		uint32_t capacity = match->spectators_capacity ? match->spectators_capacity * 2 : 16;
+		Spectator* spectators = realloc(match->spectators, capacity * sizeof(Spectator));
+		if (spectators == NULL)
+			return -1;
+		match->spectators = spectators;
+		match->spectators_capacity = capacity;
+	}
+	Spectator* spectator = &match->spectators[match->num_spectators++];
+	memset(spectator, 0, sizeof(*spectator));
+	spectator->spectator_id = spectator_id;
+	return 0;
+}
+
+Spectator* match_find_spectator(Match* match, uint32_t spectator_id) {
+	for (uint32_t i = 0; i < match->num_spectators; i++) {
+		if (match->spectators[i].spectator_id == spectator_id)
+			return &match->spectators[i];
+	}
+	return NULL;
+}
+
+void match_remove_spectator(Match* match, uint32_t spectator_id) {
+	Spectator* spectator = match_find_spectator(match, spectator_id);
+	if (spectator != NULL)
+		*spectator = match->spectators[--match->num_spectators];
+}
+
+// matches with anyone in them, the ones a handoff carries over
+static bool match_in_play(const Match* match) {
+	return match->num_clients > 0 || match->num_spectators > 0;
+}
+
+uint32_t match_table_count(const MatchTable* table) {
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < table->high_water; i++)
+		count += match_in_play(&table->matches[i]);
+	return count;
+}
+
+static void export_address(const struct sockaddr_in* addr, uint32_t* host, uint16_t* port) {
+	*host = addr->sin_family == AF_INET ? ntohl(addr->sin_addr.s_addr) : 0;
+	*port = addr->sin_family == AF_INET ? ntohs(addr->sin_port) : 0;
+}
+
+static void import_address(struct sockaddr_in* addr, uint32_t host, uint16_t port) {
+	memset(addr, 0, sizeof(*addr));
+	if (port == 0)
+		return;
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = htonl(host);
+	addr->sin_port = htons(port);
+}
+
+/**
+ * Append the state of every match in play for a handoff.  Snapshot
+ * history, rewind states, queued input and delayed spectator snapshots
+ * are left behind: clients get a full snapshot next and resend input.
+ * Returns -1 if out of memory.
+ */
+int match_table_export(const MatchTable* table, HandoffBuffer* buffer) {
+	for (uint32_t i = 0; i < table->high_water; i++) {
+		const Match* match = &table->matches[i];
+		if (!match_in_play(match))
+			continue;
+
+		Position ball;
+		physics_get_ball(&table->physics, i, &ball);
+		MatchRecord record = {
+			.match_id = match->match_id,
+			.num_clients = match->num_clients,
+			.rng_state = match->rng_state,
+			.game_active = match->game_active,
+			.start_tick = match->start_tick,
+			.last_tick = match->last_tick,
+			.step_ticks = match->step_ticks,
+			.left_score = match->left_score,
+			.right_score = match->right_score,
+			.snapshot_seq = match->snapshot_seq,
+			.snapshot_tick = match->snapshot_tick,
+			.spectator_seq = match->spectator_seq,
+			.spectator_tick = match->spectator_tick,
+			.num_spectators = match->num_spectators,
+			.ball_x = ball.x,
+			.ball_y = ball.y,
+			.ball_dx = ball.dx,
+			.ball_dy = ball.dy,
+		};
+		if (HANDOFF_PUT(buffer, match_record, MATCH_RECORD_SCHEMA, &record) == -1)
+			return -1;
+
+		for (int slot = 0; slot < MAX_CLIENTS; slot++) {
+			const Client* client = &match->clients[slot];
+			const Position* paddle = &match->player_positions[slot];
+			ClientRecord client_record = {
+				.active = client->active,
+				.tcp_fd = client->tcp_fd,
+				.player_id = client->player_id,
+				.acked_seq = client->acked_seq,
+				.input_seq = client->input_seq,
+				.x = paddle->x,
+				.y = paddle->y,
+				.dx = paddle->dx,
+				.dy = paddle->dy,
+			};
+			export_address(&client->addr, &client_record.addr, &client_record.port);
+			if (HANDOFF_PUT(buffer, client_record, CLIENT_RECORD_SCHEMA, &client_record) == -1)
+				return -1;
+		}
+
+		for (uint32_t s = 0; s < match->num_spectators; s++) {
+			SpectatorRecord spectator = { .spectator_id = match->spectators[s].spectator_id };
+			export_address(&match->spectators[s].addr, &spectator.addr, &spectator.port);
+			if (HANDOFF_PUT(buffer, spectator_record, SPECTATOR_RECORD_SCHEMA, &spectator) == -1)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Restore num_matches matches exported by match_table_export() in another
+ * process.  Clients' TCP fds are translated through fd_map, indexed by
+ * their number in the old process.  Returns -1 if the state is malformed
+ * or names a match this table can't host.
+ */
+int match_table_import(MatchTable* table, HandoffBuffer* buffer, uint32_t num_matches, const int* fd_map, size_t fd_map_size) {
+	for (uint32_t m = 0; m < num_matches; m++) {
+		MatchRecord record;
+		if (HANDOFF_GET(buffer, match_record, MATCH_RECORD_SCHEMA, &record) == -1)
+			return -1;
+		uint32_t index = record.match_id / table->num_workers;
+		if ((int)(record.match_id % table->num_workers) != table->worker_index || index >= table->capacity) {
+			fprintf(stderr, "handoff: match %u doesn't belong to worker %d\n", record.match_id, table->worker_index);
+			return -1;
+		}
+		if (record.step_ticks == 0 || record.step_ticks > MAX_STEP_TICKS) {
+			fprintf(stderr, "handoff: match %u steps every %u ticks\n", record.match_id, record.step_ticks);
+			return -1;
+		}
+
+		Match* match = &table->matches[index];
+		match->match_id = record.match_id;
+		match->num_clients = record.num_clients;
+		match->rng_state = record.rng_state;
+		match->game_active = record.game_active;
+		match->start_tick = record.start_tick;
+		match->last_tick = record.last_tick;
+		match->step_ticks = record.step_ticks;
+		match->step_phase = index % match->step_ticks;
+		match->left_score = record.left_score;
+		match->right_score = record.right_score;
+		match->snapshot_seq = record.snapshot_seq;
+		match->snapshot_tick = record.snapshot_tick;
+		match->spectator_seq = record.spectator_seq;
+		match->spectator_tick = record.spectator_tick;
+		Position ball = { .x = record.ball_x, .y = record.ball_y, .dx = record.ball_dx, .dy = record.ball_dy };
+		physics_set_ball(&table->physics, index, &ball);
+
+		for (int slot = 0; slot < MAX_CLIENTS; slot++) {
+			ClientRecord client_record;
+			if (HANDOFF_GET(buffer, client_record, CLIENT_RECORD_SCHEMA, &client_record) == -1)
+				return -1;
+			Client* client = &match->clients[slot];
+			client->active = client_record.active;
+			client->tcp_fd = client_record.tcp_fd < fd_map_size ? fd_map[client_record.tcp_fd] : -1;
+			client->player_id = client_record.player_id;
+			client->acked_seq = client_record.acked_seq;
+			client->input_seq = client_record.input_seq;
+			client->rtt_us = 0;
+			import_address(&client->addr, client_record.addr, client_record.port);
+			match->player_positions[slot] = (Position){ .x = client_record.x, .y = client_record.y, .dx = client_record.dx, .dy = client_record.dy };
+			// everyone gets a fresh grace period after the pause
+			if (client->active)
+				watch_session(table, match, slot);
+		}
+
+		for (uint32_t s = 0; s < record.num_spectators; s++) {
+			SpectatorRecord spectator;
+			if (HANDOFF_GET(buffer, spectator_record, SPECTATOR_RECORD_SCHEMA, &spectator) == -1
+					|| match_add_spectator(match, spectator.spectator_id) == -1)
+				return -1;
+			import_address(&match->spectators[match->num_spectators - 1].addr, spectator.addr, spectator.port);
+		}
+
+		// recording carries on in a new file, starting with a keyframe
+		if (table->replay_dir != NULL && match->replay == NULL && match->num_clients > 0)
+			match->replay = replay_open(table->replay_dir, match->match_id, match->step_ticks * TICK_RATE);
+
+		if (index >= table->high_water)
+			table->high_water = index + 1;
+	}
+	return 0;
+}
+
+int match_registry_init(MatchRegistry* registry, uint32_t capacity) {
+	registry->free_ids = malloc(capacity * sizeof(uint32_t));
+	registry->in_use = calloc(capacity, sizeof(bool));
+	if (registry->free_ids == NULL || registry->in_use == NULL) {
+		free(registry->free_ids);
+		free(registry->in_use);
+		return -1;
+	}
+	// stacked so ids come out in ascending order, and consecutive matches
+	// land on different workers, spreading load across cores
+	for (uint32_t i = 0; i < capacity; i++)
+		registry->free_ids[i] = capacity - 1 - i;
+	registry->num_free = capacity;
+	registry->capacity = capacity;
+	return 0;
+}
+
+void match_registry_free(MatchRegistry* registry) {
+	free(registry->free_ids);
+	free(registry->in_use);
+	registry->free_ids = NULL;
+	registry->in_use = NULL;
+	registry->num_free = 0;
+	registry->capacity = 0;
+}
+
+/**
+ * Take a free match id.  Returns -1 if every match is in use.
+ */
+int match_registry_allocate(MatchRegistry* registry, uint32_t* match_id) {
+	if (registry->num_free == 0)
+		return -1;
+	*match_id = registry->free_ids[--registry->num_free];
+	registry->in_use[*match_id] = true;
+	return 0;
+}
+
+/**
+ * Return the id of a match that has ended, to be handed out again
+ */
+void match_registry_release(MatchRegistry* registry, uint32_t match_id) {
+	if (match_id >= registry->capacity || !registry->in_use[match_id])
+		return;
+	registry->in_use[match_id] = false;
+	registry->free_ids[registry->num_free++] = match_id;
+}
+
+/**
+ * Mark the ids of matches taken over from another process as in use,
+ * leaving the rest free in the usual order
+ */
+void match_registry_claim(MatchRegistry* registry, const uint32_t* match_ids, uint32_t count) {
+	for (uint32_t i = 0; i < count; i++) {
+		if (match_ids[i] < registry->capacity)
+			registry->in_use[match_ids[i]] = true;
+	}
+	registry->num_free = 0;
+	for (uint32_t i = registry->capacity; i-- > 0; ) {
+		if (!registry->in_use[i])
+			registry->free_ids[registry->num_free++] = i;
+	}
+}
+
+bool match_registry_in_use(const MatchRegistry* registry, uint32_t match_id) {
+	return match_id < registry->capacity && registry->in_use[match_id];
+}
@@ -0,0 +1,166 @@
+#ifndef MATCH_H
+#define MATCH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "config.h"
+#include "protocol.h"
+#include "input_queue.h"
+#include "physics.h"
+#include "metrics.h"
+#include "replay.h"
+#include "udp_batch.h"
+#include "timer_wheel.h"
+
+/**
+ * what one step of a match starts from, kept for the last few ticks while
+ * the ball is near a paddle so late input can be applied where the player
+ * made it
+ */
+typedef struct {
+	uint64_t tick;
+	uint64_t start_tick;
+	uint32_t rng_state;
+	bool game_active;
+	uint8_t left_score;
+	uint8_t right_score;
+	Position ball;
+	Position players[MAX_CLIENTS];
+} MatchState;
+
+/**
+ * a viewer of a match, sent the spectator snapshot but never read from
+ */
+typedef struct {
+	uint32_t spectator_id;
+	struct sockaddr_in addr;	// sin_family is 0 until their first datagram
+} Spectator;
+
+/**
+ * state for a single game of pong between MAX_CLIENTS players.  The ball
+ * lives in the owning table's PhysicsBatch, at the same index as the match.
+ */
+typedef struct {
+	Position player_positions[MAX_CLIENTS];
+	Client clients[MAX_CLIENTS];
+
+	uint32_t match_id;
+	uint8_t num_clients;
+	uint32_t rng_state;	// per-match random stream for serves
+
+	bool game_active;
+	uint64_t start_tick;	// tick the countdown ends on, 0 until all players join
+	uint64_t last_tick;	// last tick this match was stepped
+	uint8_t step_ticks;	// ticks per simulation step, fixed when the match starts
+	uint8_t step_phase;	// steps when tick + step_phase is a multiple of step_ticks
+
+	uint8_t left_score;
+	uint8_t right_score;
+
+	// inputs published by the network side, applied at the start of each step
+	InputQueue inputs;
+
+	// recent snapshots, indexed by sequence % SNAPSHOT_HISTORY, that client
+	// acks can be delta encoded against
+	uint32_t snapshot_seq;
+	uint64_t snapshot_tick;	// tick the latest snapshot was sent on
+	GameStateMessage history[SNAPSHOT_HISTORY];
+
+	// viewers, all sent the same snapshot, serialized once per interval
+	Spectator* spectators;
+	uint32_t num_spectators;
+	uint32_t spectators_capacity;
+	uint32_t spectator_seq;
+	uint64_t spectator_tick;	// tick the latest spectator snapshot was taken on
+	// snapshots held back to delay what spectators see, oldest first at
+	// spectator_seq % spectator_delay_slots
+	SharedPayload** spectator_delay;
+	uint32_t spectator_delay_slots;
+
+	// liveness of each seat: the tick its player was last heard from over
+	// UDP, and when the table's timer wheel next checks on them
+	uint64_t last_seen[MAX_CLIENTS];
+	TimerEntry sessions[MAX_CLIENTS];
+	bool away[MAX_CLIENTS];
+	uint8_t num_away;	// players quiet for SESSION_AWAY_TICKS, who hold the match until they're back
+
+	MatchMetrics metrics;
+	ReplayWriter* replay;	// NULL unless the match is being recorded
+} Match;
+
+/**
+ * fixed pool of matches owned by one worker.  Match ids are global and
+ * striped across workers: worker w hosts match ids w, w + N, w + 2N, ...
+ */
+typedef struct {
+	Match* matches;
+	uint32_t capacity;
+	uint32_t high_water;	// one past the highest match index ever used
+	int worker_index;
+	int num_workers;
+
+	PhysicsBatch physics;	// ball and paddle state, indexed like matches
+	// INPUT_REWIND_TICKS saved states per match, indexed by
+	// index * INPUT_REWIND_TICKS + tick % INPUT_REWIND_TICKS
+	MatchState* rewind;
+	PhysicsBatch rewind_physics;	// a single lane for re-simulating one match
+	const char* replay_dir;	// record matches here, NULL to not record
+	uint8_t step_ticks;	// simulation step of matches started from now on
+	TimerWheel sessions;	// every seated player's next liveness check, by player id
+
+	// counters for the worker's metrics, which tick() publishes
+	uint64_t inputs_late;
+	uint64_t rewinds;
+} MatchTable;
+
+/**
+ * control-plane view of which match ids are free, used to start matches
+ * for paired players.  Covers the match ids of every worker.
+ */
+typedef struct {
+	uint32_t* free_ids;	// stack of unused match ids, the next to hand out on top
+	uint32_t num_free;
+	bool* in_use;
+	uint32_t capacity;
+} MatchRegistry;
+
+int match_table_init(MatchTable* table, uint32_t capacity, int worker_index, int num_workers);
+void match_table_free(MatchTable* table);
+
+Match* match_table_add_client(MatchTable* table, uint32_t match_id, int slot, int tcp_fd, ReplayWriter* replay);
+Match* match_table_lookup(MatchTable* table, uint32_t player_id, int* slot);
+Match* match_table_find(MatchTable* table, uint32_t match_id);
+void match_table_touch(MatchTable* table, Match* match, int slot);
+void match_table_end(MatchTable* table, Match* match);
+
+typedef struct HandoffBuffer HandoffBuffer;
+uint32_t match_table_count(const MatchTable* table);
+int match_table_export(const MatchTable* table, HandoffBuffer* buffer);
+int match_table_import(MatchTable* table, HandoffBuffer* buffer, uint32_t num_matches, const int* fd_map, size_t fd_map_size);
+
+int match_add_spectator(Match* match, uint32_t spectator_id);
+void match_remove_spectator(Match* match, uint32_t spectator_id);
+Spectator* match_find_spectator(Match* match, uint32_t spectator_id);
+
+int match_registry_init(MatchRegistry* registry, uint32_t capacity);
+void match_registry_free(MatchRegistry* registry);
+int match_registry_allocate(MatchRegistry* registry, uint32_t* match_id);
+void match_registry_release(MatchRegistry* registry, uint32_t match_id);
+void match_registry_claim(MatchRegistry* registry, const uint32_t* match_ids, uint32_t count);
+bool match_registry_in_use(const MatchRegistry* registry, uint32_t match_id);
+
+// players seated and not away, the ones a match needs all of to be played
+static inline uint8_t match_players_present(const Match* match) {
+	return match->num_clients - match->num_away;
+}
+
+static inline uint32_t player_id_for(uint32_t match_id, int slot) {
+	return match_id * MAX_CLIENTS + slot + 1;
+}
+
+static inline uint32_t match_id_for(uint32_t player_id) {
+	return (player_id - 1) / MAX_CLIENTS;
+}
+
+#endif
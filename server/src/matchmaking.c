@@ -0,0 +1,76 @@
+/*
+ * matchmaking.c -- queue of registered players waiting to be paired
+ */
+
+#include <stdlib.h>
+
+#include "matchmaking.h"
+
+int matchmaker_init(Matchmaker* matchmaker, MatchRegistry* registry, uint32_t capacity) {
+	matchmaker->queue = malloc(capacity * sizeof(int));
+	if (matchmaker->queue == NULL)
+		return -1;
+	matchmaker->registry = registry;
+	matchmaker->capacity = capacity;
+	matchmaker->head = 0;
+	matchmaker->tail = 0;
+	matchmaker->waiting = 0;
+	return 0;
+}
+
+void matchmaker_free(Matchmaker* matchmaker) {
+	free(matchmaker->queue);
+	matchmaker->queue = NULL;
+	matchmaker->capacity = 0;
+}
+
+/**
+ * Put a player at the back of the queue.  Returns -1 if the queue is full.
+ */
+int matchmaker_enqueue(Matchmaker* matchmaker, int fd, uint64_t* ticket) {
+	if (matchmaker->tail - matchmaker->head == matchmaker->capacity)
+		return -1;
+	*ticket = matchmaker->tail++;
+	matchmaker->queue[*ticket % matchmaker->capacity] = fd;
+	matchmaker->waiting++;
+	return 0;
+}
+
+/**
+ * Take a player out of the queue, e.g. because they disconnected while
+ * waiting.  The entry is skipped when the queue reaches it.
+ */
+void matchmaker_cancel(Matchmaker* matchmaker, uint64_t ticket) {
+	if (ticket < matchmaker->head || ticket >= matchmaker->tail)
+		return;
+	int* fd = &matchmaker->queue[ticket % matchmaker->capacity];
+	if (*fd == -1)
+		return;
+	*fd = -1;
+	matchmaker->waiting--;
+}
+
+// drop cancelled entries from the front of the queue
+static void skip_cancelled(Matchmaker* matchmaker) {
+	while (matchmaker->head < matchmaker->tail && matchmaker->queue[matchmaker->head % matchmaker->capacity] == -1)
+		matchmaker->head++;
+}
+
+/**
+ * Seat the MAX_CLIENTS longest waiting players in a new match, in the
+ * order they registered.  Returns false if there aren't enough players
+ * waiting or every match is taken; they stay queued until there are.
+ */
+bool matchmaker_pair(Matchmaker* matchmaker, MatchPairing* pairing) {
+	if (matchmaker->waiting < MAX_CLIENTS || match_registry_allocate(matchmaker->registry, &pairing->match_id) == -1)
+		return false;
+
+	for (int slot = 0; slot < MAX_CLIENTS; slot++) {
+		skip_cancelled(matchmaker);
+		pairing->fds[slot] = matchmaker->queue[matchmaker->head % matchmaker->capacity];
+		matchmaker->head++;
+	}
+	matchmaker->waiting -= MAX_CLIENTS;
+	skip_cancelled(matchmaker);
+	return true;
+}
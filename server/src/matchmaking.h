@@ -0,0 +1,39 @@
+#ifndef MATCHMAKING_H
+#define MATCHMAKING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "config.h"
+#include "match.h"
+
+/**
+ * players waiting for a match, paired first come first served.  Entries
+ * are identified by a ticket, their position in the queue since startup,
+ * so a player who leaves can be cancelled in place.
+ */
+typedef struct {
+	MatchRegistry* registry;
+	int* queue;		// connection fd per ticket, -1 once cancelled
+	uint32_t capacity;
+	uint64_t head;		// oldest ticket still in the queue
+	uint64_t tail;		// next ticket to hand out
+	uint32_t waiting;	// tickets that haven't been cancelled
+} Matchmaker;
+
+/**
+ * players seated together in a newly allocated match, fds[slot] for each slot
+ */
+typedef struct {
+	uint32_t match_id;
+	int fds[MAX_CLIENTS];
+} MatchPairing;
+
+int matchmaker_init(Matchmaker* matchmaker, MatchRegistry* registry, uint32_t capacity);
+void matchmaker_free(Matchmaker* matchmaker);
+
+int matchmaker_enqueue(Matchmaker* matchmaker, int fd, uint64_t* ticket);
+void matchmaker_cancel(Matchmaker* matchmaker, uint64_t ticket);
+bool matchmaker_pair(Matchmaker* matchmaker, MatchPairing* pairing);
+
+#endif
@@ -0,0 +1,208 @@
+/*
+ * metrics.c -- latency histograms and the Prometheus text exposition
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "metrics.h"
+#include "worker.h"
+
+static int bucket_for(uint64_t value) {
+	if (value < HISTOGRAM_SUB_BUCKETS)
+		return (int)value;
+	int exponent = 63 - __builtin_clzll(value);
+	int mantissa = (int)(value >> (exponent - HISTOGRAM_SUB_BITS));	// in [SUB_BUCKETS, 2 * SUB_BUCKETS)
+	return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + mantissa - HISTOGRAM_SUB_BUCKETS;
+}
+
+// largest value that lands in a bucket
+static uint64_t bucket_upper_bound(int bucket) {
+	if (bucket < HISTOGRAM_SUB_BUCKETS)
+		return bucket;
+	int exponent = bucket / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+	uint64_t mantissa = bucket % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+	int shift = exponent - HISTOGRAM_SUB_BITS;
+	return (mantissa << shift) + ((1ull << shift) - 1);
+}
+
+void histogram_record(Histogram* histogram, uint64_t value) {
+	metrics_add(&histogram->counts[bucket_for(value)], 1);
+	metrics_add(&histogram->count, 1);
+	metrics_add(&histogram->sum, value);
+	if (value > metrics_get(&histogram->max))
+		metrics_set(&histogram->max, value);
+}
+
+/**
+ * Value at the given quantile across several histograms, e.g. one per
+ * worker, to within the bucket precision
+ */
+uint64_t histogram_quantile(const Histogram* const* histograms, int count, double quantile) {
+	uint64_t total = 0;
+	for (int h = 0; h < count; h++)
+		total += metrics_get(&histograms[h]->count);
+	if (total == 0)
+		return 0;
+
+	uint64_t rank = (uint64_t)(quantile * total);
+	if (rank >= total)
+		rank = total - 1;
+
+	uint64_t seen = 0;
+	for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+		for (int h = 0; h < count; h++)
+			seen += metrics_get(&histograms[h]->counts[bucket]);
+		if (seen > rank)
+			return bucket_upper_bound(bucket);
+	}
+	return bucket_upper_bound(HISTOGRAM_BUCKETS - 1);
+}
+
+void metrics_buffer_free(MetricsBuffer* buffer) {
+	free(buffer->data);
+	memset(buffer, 0, sizeof(*buffer));
+}
+
+void metrics_printf(MetricsBuffer* buffer, const char* format, ...) {
+	for (;;) {
+		size_t room = buffer->capacity - buffer->length;
+		va_list args;
+		va_start(args, format);
+		int n = vsnprintf(buffer->data ? buffer->data + buffer->length : NULL, room, format, args);
+		va_end(args);
+		if (n < 0)
+			return;
+		if ((size_t)n < room) {
+			buffer->length += n;
+			return;
+		}
+
+		size_t capacity = buffer->capacity ? buffer->capacity * 2 : 16384;
+		while (capacity - buffer->length <= (size_t)n)
+			capacity *= 2;
+		char* data = realloc(buffer->data, capacity);
+		if (data == NULL)
+			return;
+		buffer->data = data;
+		buffer->capacity = capacity;
+	}
+}
+
+static void header(MetricsBuffer* out, const char* name, const char* type, const char* help) {
+	metrics_printf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void server_counter(MetricsBuffer* out, const char* name, const char* help, const _Atomic uint64_t* value) {
+	header(out, name, "counter", help);
+	metrics_printf(out, "%s %lu\n", name, metrics_get(value));
+}
+
+static void server_gauge(MetricsBuffer* out, const char* name, const char* help, const _Atomic uint64_t* value) {
+	header(out, name, "gauge", help);
+	metrics_printf(out, "%s %lu\n", name, metrics_get(value));
+}
+
+// one series per worker, the field found at the same offset in each WorkerMetrics
+static void worker_series(MetricsBuffer* out, const Worker* workers, int num_workers,
+		const char* name, const char* type, const char* help, size_t offset) {
+	header(out, name, type, help);
+	for (int w = 0; w < num_workers; w++) {
+		const _Atomic uint64_t* value = (const _Atomic uint64_t*)((const char*)&workers[w].metrics + offset);
+		metrics_printf(out, "%s{worker=\"%d\"} %lu\n", name, w, metrics_get(value));
+	}
+}
+
+static void match_counter(MetricsBuffer* out, const Worker* workers, int num_workers,
+		const char* name, const char* help, size_t offset) {
+	header(out, name, "counter", help);
+	for (int w = 0; w < num_workers; w++) {
+		const MatchTable* table = &workers[w].match_table;
+		for (uint32_t i = 0; i < table->capacity; i++) {
+			const Match* match = &table->matches[i];
+			// matches that have never seen traffic are left out
+			if (metrics_get(&match->metrics.udp_received_packets) == 0 && metrics_get(&match->metrics.udp_sent_packets) == 0)
+				continue;
+			const _Atomic uint64_t* value = (const _Atomic uint64_t*)((const char*)&match->metrics + offset);
+			metrics_printf(out, "%s{match=\"%u\"} %lu\n", name, match->match_id, metrics_get(value));
+		}
+	}
+}
+
+static void summary(MetricsBuffer* out, const Worker* workers, int num_workers,
+		const char* name, const char* help, size_t offset) {
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	const Histogram* histograms[num_workers];
+	uint64_t count = 0, sum = 0, max = 0;
+	for (int w = 0; w < num_workers; w++) {
+		histograms[w] = (const Histogram*)((const char*)&workers[w].metrics + offset);
+		count += metrics_get(&histograms[w]->count);
+		sum += metrics_get(&histograms[w]->sum);
+		if (metrics_get(&histograms[w]->max) > max)
+			max = metrics_get(&histograms[w]->max);
+	}
+
+	header(out, name, "summary", help);
+	for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+		// a bucket's upper bound can overshoot the largest value actually seen
+		uint64_t value = histogram_quantile(histograms, num_workers, quantiles[q]);
+		metrics_printf(out, "%s{quantile=\"%g\"} %.9f\n", name, quantiles[q], (value < max ? value : max) / 1e9);
+	}
+	metrics_printf(out, "%s_sum %.9f\n%s_count %lu\n", name, sum / 1e9, name, count);
+	metrics_printf(out, "# HELP %s_max Largest observed value.\n# TYPE %s_max gauge\n%s_max %.9f\n", name, name, name, max / 1e9);
+}
+
+/**
+ * Render every metric in the Prometheus text exposition format
+ */
+void metrics_render(MetricsBuffer* out, const ServerMetrics* server, const Worker* workers, int num_workers) {
+#define WORKER_COUNTER(name, help, field) worker_series(out, workers, num_workers, name, "counter", help, offsetof(WorkerMetrics, field))
+#define MATCH_COUNTER(name, help, field) match_counter(out, workers, num_workers, name, help, offsetof(MatchMetrics, field))
+
+	server_counter(out, "pong_tcp_connections_total", "TCP connections accepted.", &server->tcp_connections);
+	server_counter(out, "pong_tcp_requests_total", "TCP requests received.", &server->tcp_requests);
+	server_counter(out, "pong_tcp_received_bytes_total", "Bytes received over TCP.", &server->tcp_received_bytes);
+	server_counter(out, "pong_tcp_sent_bytes_total", "Bytes sent over TCP.", &server->tcp_sent_bytes);
+	server_counter(out, "pong_tcp_dropped_connections_total", "TCP connections closed for sending a malformed frame or not reading responses.", &server->tcp_dropped_connections);
+	server_counter(out, "pong_registrations_total", "Players placed in a match.", &server->registrations);
+	server_counter(out, "pong_registrations_rejected_total", "Registrations refused because the matchmaking queue was full.", &server->registrations_rejected);
+	server_counter(out, "pong_matches_started_total", "Matches started for a pair of waiting players.", &server->matches_started);
+	server_counter(out, "pong_matches_ended_total", "Matches ended by a player hanging up or timing out.", &server->matches_ended);
+	server_gauge(out, "pong_matchmaking_waiting", "Players waiting for an opponent.", &server->matchmaking_waiting);
+	server_counter(out, "pong_spectates_total", "Spectate requests accepted.", &server->spectates);
+	server_counter(out, "pong_metrics_scrapes_total", "Requests served by this endpoint.", &server->metrics_scrapes);
+
+	WORKER_COUNTER("pong_udp_received_packets_total", "Datagrams received.", udp_received_packets);
+	WORKER_COUNTER("pong_udp_received_bytes_total", "Bytes received over UDP.", udp_received_bytes);
+	WORKER_COUNTER("pong_udp_sent_packets_total", "Datagrams queued for sending.", udp_sent_packets);
+	WORKER_COUNTER("pong_udp_sent_bytes_total", "Bytes queued for sending over UDP.", udp_sent_bytes);
+	WORKER_COUNTER("pong_udp_send_dropped_total", "Datagrams the socket refused.", udp_send_dropped);
+	WORKER_COUNTER("pong_udp_malformed_packets_total", "Datagrams ignored for not being a valid input, spectate or ping message.", udp_malformed_packets);
+	WORKER_COUNTER("pong_udp_unknown_player_total", "Datagrams ignored for carrying an unknown player or spectator id.", udp_unknown_player);
+	WORKER_COUNTER("pong_inputs_dropped_total", "Inputs dropped because the match's input queue was full.", inputs_dropped);
+	WORKER_COUNTER("pong_inputs_late_total", "Input commands too old to rewind for, applied on the current tick instead.", inputs_late);
+	WORKER_COUNTER("pong_rewinds_total", "Times a match was re-simulated to apply input where the player made it.", rewinds);
+	WORKER_COUNTER("pong_snapshots_skipped_total", "Match snapshots not sent because clients could already predict them.", snapshots_skipped);
+	WORKER_COUNTER("pong_spectator_snapshots_total", "Snapshots serialized for the spectators of a match.", spectator_snapshots);
+	WORKER_COUNTER("pong_sessions_expired_total", "Matches ended by a player going quiet for too long.", sessions_expired);
+	WORKER_COUNTER("pong_ticks_total", "Fixed timesteps simulated.", ticks);
+	WORKER_COUNTER("pong_tick_overrun_steps_total", "Timesteps dropped because the worker fell too far behind.", tick_overrun_steps);
+	WORKER_COUNTER("pong_timer_overruns_total", "Tick timer expirations coalesced into one wakeup.", timer_overruns);
+	worker_series(out, workers, num_workers, "pong_active_matches", "gauge", "Matches with at least one player.", offsetof(WorkerMetrics, active_matches));
+	worker_series(out, workers, num_workers, "pong_spectators", "gauge", "Spectators watching matches.", offsetof(WorkerMetrics, spectators));
+	worker_series(out, workers, num_workers, "pong_players_away", "gauge", "Players gone quiet, holding their matches.", offsetof(WorkerMetrics, players_away));
+
+	summary(out, workers, num_workers, "pong_tick_duration_seconds", "Time spent handling each tick.", offsetof(WorkerMetrics, tick_duration));
+	summary(out, workers, num_workers, "pong_tick_jitter_seconds", "How late the tick timer fired.", offsetof(WorkerMetrics, tick_jitter));
+	summary(out, workers, num_workers, "pong_player_rtt_seconds", "Round trips measured by player pings.", offsetof(WorkerMetrics, player_rtt));
+
+	MATCH_COUNTER("pong_match_udp_received_packets_total", "Datagrams received for a match.", udp_received_packets);
+	MATCH_COUNTER("pong_match_udp_received_bytes_total", "Bytes received over UDP for a match.", udp_received_bytes);
+	MATCH_COUNTER("pong_match_udp_sent_packets_total", "Datagrams queued for a match's clients.", udp_sent_packets);
+	MATCH_COUNTER("pong_match_udp_sent_bytes_total", "Bytes queued for a match's clients.", udp_sent_bytes);
+
+#undef WORKER_COUNTER
+#undef MATCH_COUNTER
+}
@@ -0,0 +1,121 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "config.h"
+
+typedef struct Worker Worker;
+
+/*
+ * Every counter and histogram has exactly one writer thread, which updates
+ * it with relaxed loads and stores; the control thread reads them when the
+ * stats endpoint is scraped.
+ */
+
+// log-linear buckets: exact below 2^HISTOGRAM_SUB_BITS, then that many bits of
+// precision per power of two (about 6% error), up to the full uint64_t range
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+/**
+ * HDR-style histogram of nanosecond durations
+ */
+typedef struct {
+	_Atomic uint64_t counts[HISTOGRAM_BUCKETS];
+	_Atomic uint64_t count;
+	_Atomic uint64_t sum;
+	_Atomic uint64_t max;
+} Histogram;
+
+/**
+ * packet counters for one match, written by the owning worker
+ */
+typedef struct {
+	_Atomic uint64_t udp_received_packets;
+	_Atomic uint64_t udp_received_bytes;
+	_Atomic uint64_t udp_sent_packets;
+	_Atomic uint64_t udp_sent_bytes;
+} MatchMetrics;
+
+/**
+ * totals for one worker thread
+ */
+typedef struct {
+	_Atomic uint64_t udp_received_packets;
+	_Atomic uint64_t udp_received_bytes;
+	_Atomic uint64_t udp_sent_packets;	// handed to the socket, including any dropped below
+	_Atomic uint64_t udp_sent_bytes;
+	_Atomic uint64_t udp_send_dropped;
+	_Atomic uint64_t udp_malformed_packets;	// not a well-formed client datagram
+	_Atomic uint64_t udp_unknown_player;	// player or spectator not known to this worker
+	_Atomic uint64_t inputs_dropped;	// input queue of the match was full
+	_Atomic uint64_t inputs_late;		// commands stamped further back than the rewind window
+	_Atomic uint64_t rewinds;		// matches re-simulated to apply late input
+	_Atomic uint64_t snapshots_skipped;	// match snapshots not sent because nothing had changed
+	_Atomic uint64_t spectator_snapshots;	// serialized once each, however many watch
+	_Atomic uint64_t sessions_expired;	// matches ended by a player going quiet
+	_Atomic uint64_t players_away;	// gauge
+
+	_Atomic uint64_t ticks;
+	_Atomic uint64_t tick_overrun_steps;
+	_Atomic uint64_t timer_overruns;
+	_Atomic uint64_t active_matches;
+	_Atomic uint64_t spectators;
+
+	Histogram tick_duration;	// time spent in tick()
+	Histogram tick_jitter;		// how late the tick timer fired
+	Histogram player_rtt;		// round trips measured by player pings
+} WorkerMetrics;
+
+/**
+ * control thread totals
+ */
+typedef struct {
+	_Atomic uint64_t tcp_connections;
+	_Atomic uint64_t tcp_requests;
+	_Atomic uint64_t tcp_received_bytes;
+	_Atomic uint64_t tcp_sent_bytes;
+	_Atomic uint64_t tcp_dropped_connections;	// malformed frames or unread responses
+	_Atomic uint64_t registrations;
+	_Atomic uint64_t registrations_rejected;	// the matchmaking queue was full
+	_Atomic uint64_t matches_started;
+	_Atomic uint64_t matches_ended;
+	_Atomic uint64_t matchmaking_waiting;	// gauge
+	_Atomic uint64_t spectates;
+	_Atomic uint64_t metrics_scrapes;
+} ServerMetrics;
+
+/**
+ * growable text buffer the exposition is rendered into
+ */
+typedef struct {
+	char* data;
+	size_t length;
+	size_t capacity;
+} MetricsBuffer;
+
+// only the owning thread calls this, so there's no need for a locked add
+static inline void metrics_add(_Atomic uint64_t* counter, uint64_t value) {
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+static inline void metrics_set(_Atomic uint64_t* gauge, uint64_t value) {
+	atomic_store_explicit(gauge, value, memory_order_relaxed);
+}
+
+static inline uint64_t metrics_get(const _Atomic uint64_t* counter) {
+	return atomic_load_explicit((_Atomic uint64_t*)counter, memory_order_relaxed);
+}
+
+void histogram_record(Histogram* histogram, uint64_t value);
+uint64_t histogram_quantile(const Histogram* const* histograms, int count, double quantile);
+
+void metrics_buffer_free(MetricsBuffer* buffer);
+void metrics_printf(MetricsBuffer* buffer, const char* format, ...) __attribute__((format(printf, 2, 3)));
+void metrics_render(MetricsBuffer* out, const ServerMetrics* server, const Worker* workers, int num_workers);
+
+#endif
@@ -0,0 +1,492 @@
+/*
+ * physics.c -- batched ball physics over structure-of-arrays match state
+ *
+ * Every kernel implements the same step.  The ball is swept along its path:
+ * the time it would reach each wall, goal line and paddle face is worked
+ * out, it moves to the first of them, bounces, and goes on for the rest of
+ * the step, up to PHYSICS_MAX_BOUNCES times.  However far it moves in a
+ * step it can't pass through a paddle.  Scoring is then detected, and
+ * anything left overlapping, such as a paddle moved onto the ball, is
+ * pushed out.  The vector kernels do it without branches, using compare
+ * masks to select between the old and new values in each lane.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#include "physics.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+static float* alloc_lanes(uint32_t capacity) {
+	float* lanes = aligned_alloc(32, capacity * sizeof(float));
+	if (lanes != NULL)
+		memset(lanes, 0, capacity * sizeof(float));
+	return lanes;
+}
+
+int physics_batch_init(PhysicsBatch* batch, uint32_t capacity) {
+	memset(batch, 0, sizeof(*batch));
+	batch->capacity = (capacity + PHYSICS_LANES - 1) / PHYSICS_LANES * PHYSICS_LANES;
+	batch->kernel = physics_select_kernel(&batch->kernel_name);
+
+	batch->ball_x = alloc_lanes(batch->capacity);
+	batch->ball_y = alloc_lanes(batch->capacity);
+	batch->ball_dx = alloc_lanes(batch->capacity);
+	batch->ball_dy = alloc_lanes(batch->capacity);
+	batch->step_dt = alloc_lanes(batch->capacity);
+	batch->result = (int32_t*)alloc_lanes(batch->capacity);
+	bool ok = batch->ball_x && batch->ball_y && batch->ball_dx && batch->ball_dy && batch->step_dt && batch->result;
+	for (int p = 0; p < MAX_CLIENTS; p++) {
+		batch->paddle_x[p] = alloc_lanes(batch->capacity);
+		batch->paddle_y[p] = alloc_lanes(batch->capacity);
+		ok = ok && batch->paddle_x[p] && batch->paddle_y[p];
+	}
+
+	if (!ok) {
+		physics_batch_free(batch);
+		return -1;
+	}
+	return 0;
+}
+
+void physics_batch_free(PhysicsBatch* batch) {
+	free(batch->ball_x);
+	free(batch->ball_y);
+	free(batch->ball_dx);
+	free(batch->ball_dy);
+	free(batch->step_dt);
+	free(batch->result);
+	for (int p = 0; p < MAX_CLIENTS; p++) {
+		free(batch->paddle_x[p]);
+		free(batch->paddle_y[p]);
+	}
+	memset(batch, 0, sizeof(*batch));
+}
+
+void physics_get_ball(const PhysicsBatch* batch, uint32_t index, Position* ball) {
+	ball->x = batch->ball_x[index];
+	ball->y = batch->ball_y[index];
+	ball->dx = batch->ball_dx[index];
+	ball->dy = batch->ball_dy[index];
+}
+
+void physics_set_ball(PhysicsBatch* batch, uint32_t index, const Position* ball) {
+	batch->ball_x[index] = ball->x;
+	batch->ball_y[index] = ball->y;
+	batch->ball_dx[index] = ball->dx;
+	batch->ball_dy[index] = ball->dy;
+}
+
+/**
+ * Reference kernel, and the one used on CPUs without a vector kernel
+ */
+void physics_step_scalar(PhysicsBatch* batch, uint32_t count) {
+	for (uint32_t i = 0; i < count; i++) {
+		float left = batch->step_dt[i];	// time the ball still has to move this step
+		bool active = left > 0.0f;
+		float x = batch->ball_x[i];
+		float y = batch->ball_y[i];
+		float dx = batch->ball_dx[i];
+		float dy = batch->ball_dy[i];
+		bool right_scored = false;
+		bool left_scored = false;
+
+		// move the ball to the first surface in its path, bounce, and carry
+		// on with the rest of the step.  Times are infinite or NaN for
+		// surfaces it isn't heading for, which every comparison rejects.
+		for (int b = 0; b < PHYSICS_MAX_BOUNCES && left > 0.0f; b++) {
+			float wall_y = dy < 0.0f ? BALL_RADIUS : ROWS - BALL_RADIUS;
+			float goal_x = dx < 0.0f ? BALL_RADIUS : COLS - BALL_RADIUS;
+			float t_wall = (wall_y - y) / dy;
+			float t_goal = (goal_x - x) / dx;
+			float t = left;
+			t = (t_wall >= 0.0f && t_wall < t) ? t_wall : t;
+			t = (t_goal >= 0.0f && t_goal < t) ? t_goal : t;
+
+			// a paddle is hit on the face towards the ball, if the ball is
+			// level with it when it gets there
+			float face_x[MAX_CLIENTS];
+			float t_paddle[MAX_CLIENTS];
+			for (int p = 0; p < MAX_CLIENTS; p++) {
+				float px = batch->paddle_x[p][i];
+				float py = batch->paddle_y[p][i];
+				face_x[p] = dx < 0.0f ? px + PLAYER_LENGTH + BALL_RADIUS : px - BALL_RADIUS;
+				t_paddle[p] = (face_x[p] - x) / dx;
+				float y_at = y + dy * t_paddle[p];
+				bool level = (y_at >= py - BALL_RADIUS) && (y_at <= py + PLAYER_LENGTH + BALL_RADIUS);
+				t_paddle[p] = level ? t_paddle[p] : -1.0f;
+				t = (t_paddle[p] >= 0.0f && t_paddle[p] < t) ? t_paddle[p] : t;
+			}
+
+			x += dx * t;
+			y += dy * t;
+			left -= t;
+
+			bool hit_paddle = false;
+			for (int p = 0; p < MAX_CLIENTS; p++) {
+				bool hit = t_paddle[p] >= 0.0f && t_paddle[p] <= t;
+				x = hit ? face_x[p] : x;
+				hit_paddle = hit_paddle || hit;
+			}
+			bool hit_goal = !hit_paddle && t_goal >= 0.0f && t_goal <= t;
+			right_scored = right_scored || (hit_goal && dx < 0.0f);
+			left_scored = left_scored || (hit_goal && dx >= 0.0f);
+			x = hit_goal ? goal_x : x;
+			left = hit_goal ? 0.0f : left;
+			dx = hit_paddle ? -dx : dx;
+
+			bool hit_wall = t_wall >= 0.0f && t_wall <= t;
+			y = hit_wall ? wall_y : y;
+			dy = hit_wall ? -dy : dy;
+		}
+		x += dx * left;
+		y += dy * left;
+
+		// anything still overlapping after that is pushed back out: a ball
+		// that ran out of bounces, or a paddle that moved onto it
+
+		// left and right walls score
+		right_scored = right_scored || (active && (x - BALL_RADIUS <= 0.0f));
+		left_scored = !right_scored && (left_scored || (active && (x + BALL_RADIUS > COLS)));
+		batch->result[i] = right_scored ? PHYSICS_RIGHT_SCORED : (left_scored ? PHYSICS_LEFT_SCORED : PHYSICS_NONE);
+
+		// top and bottom walls turn the ball back onto the board
+		bool bottom = active && (y - BALL_RADIUS <= 0.0f);
+		bool top = active && !bottom && (y + BALL_RADIUS > ROWS);
+		y = bottom ? BALL_RADIUS : (top ? ROWS - BALL_RADIUS : y);
+		dy = bottom ? fabsf(dy) : (top ? -fabsf(dy) : dy);
+
+		// paddles push the ball out of whichever side it is closer to
+		for (int p = 0; p < MAX_CLIENTS; p++) {
+			float px = batch->paddle_x[p][i];
+			float py = batch->paddle_y[p][i];
+			bool overlap_x = (x + BALL_RADIUS >= px) && (x - BALL_RADIUS <= px + PLAYER_LENGTH);
+			bool overlap_y = (y + BALL_RADIUS >= py) && (y - BALL_RADIUS <= py + PLAYER_LENGTH);
+			bool hit = active && overlap_x && overlap_y;
+			bool left_side = x < px + PLAYER_LENGTH / 2.0f;
+
+			float new_x = left_side ? px - BALL_RADIUS : px + PLAYER_LENGTH + BALL_RADIUS;
+			float new_dx = left_side ? -fabsf(dx) : fabsf(dx);
+			x = hit ? new_x : x;
+			dx = hit ? new_dx : dx;
+		}
+
+		batch->ball_x[i] = x;
+		batch->ball_y[i] = y;
+		batch->ball_dx[i] = dx;
+		batch->ball_dy[i] = dy;
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+static inline __m128 select_ps(__m128 mask, __m128 a, __m128 b) {
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+// t is in [0, limit]: NaN fails both ordered compares
+static inline __m128 within_ps(__m128 t, __m128 limit) {
+	return _mm_and_ps(_mm_cmpge_ps(t, _mm_setzero_ps()), _mm_cmple_ps(t, limit));
+}
+
+/**
+ * Four matches per iteration.  SSE2 is part of the x86-64 baseline, so this
+ * is always available there.
+ */
+void physics_step_sse2(PhysicsBatch* batch, uint32_t count) {
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 radius = _mm_set1_ps(BALL_RADIUS);
+	const __m128 cols = _mm_set1_ps(COLS);
+	const __m128 rows = _mm_set1_ps(ROWS);
+	const __m128 far_x = _mm_set1_ps(COLS - BALL_RADIUS);
+	const __m128 far_y = _mm_set1_ps(ROWS - BALL_RADIUS);
+	const __m128 length = _mm_set1_ps(PLAYER_LENGTH);
+	const __m128 half_length = _mm_set1_ps(PLAYER_LENGTH / 2.0f);
+	const __m128 reach = _mm_set1_ps(PLAYER_LENGTH + BALL_RADIUS);
+	const __m128 sign = _mm_set1_ps(-0.0f);
+	const __m128i right_code = _mm_set1_epi32(PHYSICS_RIGHT_SCORED);
+	const __m128i left_code = _mm_set1_epi32(PHYSICS_LEFT_SCORED);
+
+	for (uint32_t i = 0; i < count; i += 4) {
+		__m128 left = _mm_load_ps(batch->step_dt + i);
+		__m128 active = _mm_cmpgt_ps(left, zero);
+		// groups with nothing in play, like every match between the steps
+		// of a slower tick rate, stay as they are
+		if (_mm_movemask_ps(active) == 0) {
+			_mm_store_si128((__m128i*)(batch->result + i), _mm_setzero_si128());
+			continue;
+		}
+		__m128 x = _mm_load_ps(batch->ball_x + i);
+		__m128 y = _mm_load_ps(batch->ball_y + i);
+		__m128 dx = _mm_load_ps(batch->ball_dx + i);
+		__m128 dy = _mm_load_ps(batch->ball_dy + i);
+		__m128 right_scored = zero;
+		__m128 left_scored = zero;
+
+		// sweep each lane to its first surface, bounce, and go again with
+		// the rest of its step until every lane has used up its time
+		for (int b = 0; b < PHYSICS_MAX_BOUNCES; b++) {
+			__m128 moving = _mm_cmpgt_ps(left, zero);
+			if (_mm_movemask_ps(moving) == 0)
+				break;
+			__m128 backwards = _mm_cmplt_ps(dx, zero);
+			__m128 wall_y = select_ps(_mm_cmplt_ps(dy, zero), radius, far_y);
+			__m128 goal_x = select_ps(backwards, radius, far_x);
+			__m128 t_wall = _mm_div_ps(_mm_sub_ps(wall_y, y), dy);
+			__m128 t_goal = _mm_div_ps(_mm_sub_ps(goal_x, x), dx);
+			__m128 t = _mm_min_ps(left, select_ps(_mm_cmpge_ps(t_wall, zero), t_wall, left));
+			t = _mm_min_ps(t, select_ps(_mm_cmpge_ps(t_goal, zero), t_goal, t));
+
+			__m128 face_x[MAX_CLIENTS];
+			__m128 t_paddle[MAX_CLIENTS];
+			__m128 valid[MAX_CLIENTS];
+			for (int p = 0; p < MAX_CLIENTS; p++) {
+				__m128 px = _mm_load_ps(batch->paddle_x[p] + i);
+				__m128 py = _mm_load_ps(batch->paddle_y[p] + i);
+				face_x[p] = select_ps(backwards, _mm_add_ps(px, reach), _mm_sub_ps(px, radius));
+				t_paddle[p] = _mm_div_ps(_mm_sub_ps(face_x[p], x), dx);
+				__m128 y_at = _mm_add_ps(y, _mm_mul_ps(dy, t_paddle[p]));
+				__m128 level = _mm_and_ps(
+					_mm_cmpge_ps(y_at, _mm_sub_ps(py, radius)),
+					_mm_cmple_ps(y_at, _mm_add_ps(py, reach)));
+				valid[p] = _mm_and_ps(level, _mm_cmpge_ps(t_paddle[p], zero));
+				t = _mm_min_ps(t, select_ps(valid[p], t_paddle[p], t));
+			}
+
+			x = _mm_add_ps(x, _mm_mul_ps(dx, t));
+			y = _mm_add_ps(y, _mm_mul_ps(dy, t));
+			left = _mm_sub_ps(left, t);
+
+			__m128 hit_paddle = zero;
+			for (int p = 0; p < MAX_CLIENTS; p++) {
+				__m128 hit = _mm_and_ps(_mm_and_ps(moving, valid[p]), _mm_cmple_ps(t_paddle[p], t));
+				x = select_ps(hit, face_x[p], x);
+				hit_paddle = _mm_or_ps(hit_paddle, hit);
+			}
+			__m128 hit_goal = _mm_andnot_ps(hit_paddle, _mm_and_ps(moving, within_ps(t_goal, t)));
+			right_scored = _mm_or_ps(right_scored, _mm_and_ps(hit_goal, backwards));
+			left_scored = _mm_or_ps(left_scored, _mm_andnot_ps(backwards, hit_goal));
+			x = select_ps(hit_goal, goal_x, x);
+			left = _mm_andnot_ps(hit_goal, left);
+			dx = _mm_xor_ps(dx, _mm_and_ps(hit_paddle, sign));
+
+			__m128 hit_wall = _mm_and_ps(moving, within_ps(t_wall, t));
+			y = select_ps(hit_wall, wall_y, y);
+			dy = _mm_xor_ps(dy, _mm_and_ps(hit_wall, sign));
+		}
+		x = _mm_add_ps(x, _mm_mul_ps(dx, left));
+		y = _mm_add_ps(y, _mm_mul_ps(dy, left));
+
+		// left and right walls score
+		right_scored = _mm_or_ps(right_scored, _mm_and_ps(active, _mm_cmple_ps(_mm_sub_ps(x, radius), zero)));
+		left_scored = _mm_andnot_ps(right_scored,
+			_mm_or_ps(left_scored, _mm_and_ps(active, _mm_cmpgt_ps(_mm_add_ps(x, radius), cols))));
+		__m128i result = _mm_or_si128(
+			_mm_and_si128(_mm_castps_si128(right_scored), right_code),
+			_mm_and_si128(_mm_castps_si128(left_scored), left_code));
+		_mm_store_si128((__m128i*)(batch->result + i), result);
+
+		// top and bottom walls turn the ball back onto the board
+		__m128 bottom = _mm_and_ps(active, _mm_cmple_ps(_mm_sub_ps(y, radius), zero));
+		__m128 top = _mm_andnot_ps(bottom, _mm_and_ps(active, _mm_cmpgt_ps(_mm_add_ps(y, radius), rows)));
+		y = select_ps(bottom, radius, select_ps(top, _mm_sub_ps(rows, radius), y));
+		__m128 abs_dy = _mm_andnot_ps(sign, dy);
+		dy = select_ps(bottom, abs_dy, select_ps(top, _mm_or_ps(abs_dy, sign), dy));
+
+		// paddles push the ball out of whichever side it is closer to
+		for (int p = 0; p < MAX_CLIENTS; p++) {
+			__m128 px = _mm_load_ps(batch->paddle_x[p] + i);
+			__m128 py = _mm_load_ps(batch->paddle_y[p] + i);
+			__m128 overlap_x = _mm_and_ps(
+				_mm_cmpge_ps(_mm_add_ps(x, radius), px),
+				_mm_cmple_ps(_mm_sub_ps(x, radius), _mm_add_ps(px, length)));
+			__m128 overlap_y = _mm_and_ps(
+				_mm_cmpge_ps(_mm_add_ps(y, radius), py),
+				_mm_cmple_ps(_mm_sub_ps(y, radius), _mm_add_ps(py, length)));
+			__m128 hit = _mm_and_ps(active, _mm_and_ps(overlap_x, overlap_y));
+			__m128 left_side = _mm_cmplt_ps(x, _mm_add_ps(px, half_length));
+
+			__m128 new_x = select_ps(left_side, _mm_sub_ps(px, radius), _mm_add_ps(_mm_add_ps(px, length), radius));
+			__m128 abs_dx = _mm_andnot_ps(sign, dx);
+			__m128 new_dx = select_ps(left_side, _mm_or_ps(abs_dx, sign), abs_dx);
+			x = select_ps(hit, new_x, x);
+			dx = select_ps(hit, new_dx, dx);
+		}
+
+		_mm_store_ps(batch->ball_x + i, x);
+		_mm_store_ps(batch->ball_y + i, y);
+		_mm_store_ps(batch->ball_dx + i, dx);
+		_mm_store_ps(batch->ball_dy + i, dy);
+	}
+}
+
+__attribute__((target("avx2")))
+static inline __m256 within256_ps(__m256 t, __m256 limit) {
+	return _mm256_and_ps(_mm256_cmp_ps(t, _mm256_setzero_ps(), _CMP_GE_OQ), _mm256_cmp_ps(t, limit, _CMP_LE_OQ));
+}
+
+/**
+ * Eight matches per iteration.  Compiled for AVX2 regardless of the build
+ * flags, and only called after the CPU has been checked for it.
+ */
+__attribute__((target("avx2")))
+void physics_step_avx2(PhysicsBatch* batch, uint32_t count) {
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 radius = _mm256_set1_ps(BALL_RADIUS);
+	const __m256 cols = _mm256_set1_ps(COLS);
+	const __m256 rows = _mm256_set1_ps(ROWS);
+	const __m256 far_x = _mm256_set1_ps(COLS - BALL_RADIUS);
+	const __m256 far_y = _mm256_set1_ps(ROWS - BALL_RADIUS);
+	const __m256 length = _mm256_set1_ps(PLAYER_LENGTH);
+	const __m256 half_length = _mm256_set1_ps(PLAYER_LENGTH / 2.0f);
+	const __m256 reach = _mm256_set1_ps(PLAYER_LENGTH + BALL_RADIUS);
+	const __m256 sign = _mm256_set1_ps(-0.0f);
+	const __m256i right_code = _mm256_set1_epi32(PHYSICS_RIGHT_SCORED);
+	const __m256i left_code = _mm256_set1_epi32(PHYSICS_LEFT_SCORED);
+
+	for (uint32_t i = 0; i < count; i += 8) {
+		__m256 left = _mm256_load_ps(batch->step_dt + i);
+		__m256 active = _mm256_cmp_ps(left, zero, _CMP_GT_OQ);
+		if (_mm256_movemask_ps(active) == 0) {
+			_mm256_store_si256((__m256i*)(batch->result + i), _mm256_setzero_si256());
+			continue;
+		}
+		__m256 x = _mm256_load_ps(batch->ball_x + i);
+		__m256 y = _mm256_load_ps(batch->ball_y + i);
+		__m256 dx = _mm256_load_ps(batch->ball_dx + i);
+		__m256 dy = _mm256_load_ps(batch->ball_dy + i);
+		__m256 right_scored = zero;
+		__m256 left_scored = zero;
+
+		for (int b = 0; b < PHYSICS_MAX_BOUNCES; b++) {
+			__m256 moving = _mm256_cmp_ps(left, zero, _CMP_GT_OQ);
+			if (_mm256_movemask_ps(moving) == 0)
+				break;
+			__m256 backwards = _mm256_cmp_ps(dx, zero, _CMP_LT_OQ);
+			__m256 wall_y = _mm256_blendv_ps(far_y, radius, _mm256_cmp_ps(dy, zero, _CMP_LT_OQ));
+			__m256 goal_x = _mm256_blendv_ps(far_x, radius, backwards);
+			__m256 t_wall = _mm256_div_ps(_mm256_sub_ps(wall_y, y), dy);
+			__m256 t_goal = _mm256_div_ps(_mm256_sub_ps(goal_x, x), dx);
+			__m256 t = _mm256_min_ps(left, _mm256_blendv_ps(left, t_wall, _mm256_cmp_ps(t_wall, zero, _CMP_GE_OQ)));
+			t = _mm256_min_ps(t, _mm256_blendv_ps(t, t_goal, _mm256_cmp_ps(t_goal, zero, _CMP_GE_OQ)));
+
+			__m256 face_x[MAX_CLIENTS];
+			__m256 t_paddle[MAX_CLIENTS];
+			__m256 valid[MAX_CLIENTS];
+			for (int p = 0; p < MAX_CLIENTS; p++) {
+				__m256 px = _mm256_load_ps(batch->paddle_x[p] + i);
+				__m256 py = _mm256_load_ps(batch->paddle_y[p] + i);
+				face_x[p] = _mm256_blendv_ps(_mm256_sub_ps(px, radius), _mm256_add_ps(px, reach), backwards);
+				t_paddle[p] = _mm256_div_ps(_mm256_sub_ps(face_x[p], x), dx);
+				__m256 y_at = _mm256_add_ps(y, _mm256_mul_ps(dy, t_paddle[p]));
+				__m256 level = _mm256_and_ps(
+					_mm256_cmp_ps(y_at, _mm256_sub_ps(py, radius), _CMP_GE_OQ),
+					_mm256_cmp_ps(y_at, _mm256_add_ps(py, reach), _CMP_LE_OQ));
+				valid[p] = _mm256_and_ps(level, _mm256_cmp_ps(t_paddle[p], zero, _CMP_GE_OQ));
+				t = _mm256_min_ps(t, _mm256_blendv_ps(t, t_paddle[p], valid[p]));
+			}
+
+			x = _mm256_add_ps(x, _mm256_mul_ps(dx, t));
+			y = _mm256_add_ps(y, _mm256_mul_ps(dy, t));
+			left = _mm256_sub_ps(left, t);
+
+			__m256 hit_paddle = zero;
+			for (int p = 0; p < MAX_CLIENTS; p++) {
+				__m256 hit = _mm256_and_ps(_mm256_and_ps(moving, valid[p]), _mm256_cmp_ps(t_paddle[p], t, _CMP_LE_OQ));
+				x = _mm256_blendv_ps(x, face_x[p], hit);
+				hit_paddle = _mm256_or_ps(hit_paddle, hit);
+			}
+			__m256 hit_goal = _mm256_andnot_ps(hit_paddle, _mm256_and_ps(moving, within256_ps(t_goal, t)));
+			right_scored = _mm256_or_ps(right_scored, _mm256_and_ps(hit_goal, backwards));
+			left_scored = _mm256_or_ps(left_scored, _mm256_andnot_ps(backwards, hit_goal));
+			x = _mm256_blendv_ps(x, goal_x, hit_goal);
+			left = _mm256_andnot_ps(hit_goal, left);
+			dx = _mm256_xor_ps(dx, _mm256_and_ps(hit_paddle, sign));
+
+			__m256 hit_wall = _mm256_and_ps(moving, within256_ps(t_wall, t));
+			y = _mm256_blendv_ps(y, wall_y, hit_wall);
+			dy = _mm256_xor_ps(dy, _mm256_and_ps(hit_wall, sign));
+		}
+		x = _mm256_add_ps(x, _mm256_mul_ps(dx, left));
+		y = _mm256_add_ps(y, _mm256_mul_ps(dy, left));
+
+		// left and right walls score
+		right_scored = _mm256_or_ps(right_scored,
+			_mm256_and_ps(active, _mm256_cmp_ps(_mm256_sub_ps(x, radius), zero, _CMP_LE_OQ)));
+		left_scored = _mm256_andnot_ps(right_scored,
+			_mm256_or_ps(left_scored, _mm256_and_ps(active, _mm256_cmp_ps(_mm256_add_ps(x, radius), cols, _CMP_GT_OQ))));
+		__m256i result = _mm256_or_si256(
+			_mm256_and_si256(_mm256_castps_si256(right_scored), right_code),
+			_mm256_and_si256(_mm256_castps_si256(left_scored), left_code));
+		_mm256_store_si256((__m256i*)(batch->result + i), result);
+
+		// top and bottom walls turn the ball back onto the board
+		__m256 bottom = _mm256_and_ps(active, _mm256_cmp_ps(_mm256_sub_ps(y, radius), zero, _CMP_LE_OQ));
+		__m256 top = _mm256_andnot_ps(bottom,
+			_mm256_and_ps(active, _mm256_cmp_ps(_mm256_add_ps(y, radius), rows, _CMP_GT_OQ)));
+		y = _mm256_blendv_ps(_mm256_blendv_ps(y, _mm256_sub_ps(rows, radius), top), radius, bottom);
+		__m256 abs_dy = _mm256_andnot_ps(sign, dy);
+		dy = _mm256_blendv_ps(_mm256_blendv_ps(dy, _mm256_or_ps(abs_dy, sign), top), abs_dy, bottom);
+
+		// paddles push the ball out of whichever side it is closer to
+		for (int p = 0; p < MAX_CLIENTS; p++) {
+			__m256 px = _mm256_load_ps(batch->paddle_x[p] + i);
+			__m256 py = _mm256_load_ps(batch->paddle_y[p] + i);
+			__m256 overlap_x = _mm256_and_ps(
+				_mm256_cmp_ps(_mm256_add_ps(x, radius), px, _CMP_GE_OQ),
+				_mm256_cmp_ps(_mm256_sub_ps(x, radius), _mm256_add_ps(px, length), _CMP_LE_OQ));
+			__m256 overlap_y = _mm256_and_ps(
+				_mm256_cmp_ps(_mm256_add_ps(y, radius), py, _CMP_GE_OQ),
+				_mm256_cmp_ps(_mm256_sub_ps(y, radius), _mm256_add_ps(py, length), _CMP_LE_OQ));
+			__m256 hit = _mm256_and_ps(active, _mm256_and_ps(overlap_x, overlap_y));
+			__m256 left_side = _mm256_cmp_ps(x, _mm256_add_ps(px, half_length), _CMP_LT_OQ);
+
+			__m256 new_x = _mm256_blendv_ps(_mm256_add_ps(_mm256_add_ps(px, length), radius), _mm256_sub_ps(px, radius), left_side);
+			__m256 abs_dx = _mm256_andnot_ps(sign, dx);
+			__m256 new_dx = _mm256_blendv_ps(abs_dx, _mm256_or_ps(abs_dx, sign), left_side);
+			x = _mm256_blendv_ps(x, new_x, hit);
+			dx = _mm256_blendv_ps(dx, new_dx, hit);
+		}
+
+		_mm256_store_ps(batch->ball_x + i, x);
+		_mm256_store_ps(batch->ball_y + i, y);
+		_mm256_store_ps(batch->ball_dx + i, dx);
+		_mm256_store_ps(batch->ball_dy + i, dy);
+	}
+}
+
+#endif
+
+/**
+ * Pick the widest kernel this CPU supports
+ */
+PhysicsKernel physics_select_kernel(const char** name) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		*name = "avx2";
+		return physics_step_avx2;
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		*name = "sse2";
+		return physics_step_sse2;
+	}
+#endif
+	*name = "scalar";
+	return physics_step_scalar;
+}
+
+/**
+ * Step the first count matches of the batch with the kernel chosen at init.
+ * Vector kernels run whole groups of lanes, which is safe because capacity
+ * is padded and unused lanes have a step_dt of 0.
+ */
+void physics_step(PhysicsBatch* batch, uint32_t count) {
+	uint32_t lanes = (count + PHYSICS_LANES - 1) / PHYSICS_LANES * PHYSICS_LANES;
+	batch->kernel(batch, lanes);
+}
@@ -0,0 +1,59 @@
+#ifndef PHYSICS_H
+#define PHYSICS_H
+
+#include <stdint.h>
+
+#include "config.h"
+#include "protocol.h"
+
+#define PHYSICS_LANES 8	// widest kernel (AVX2) processes this many matches at once
+#define PHYSICS_MAX_BOUNCES 4	// surfaces the ball can be swept into in one step
+
+// what happened to a match's ball during a step
+#define PHYSICS_NONE 0
+#define PHYSICS_RIGHT_SCORED 1	// ball went out through the left wall
+#define PHYSICS_LEFT_SCORED 2	// ball went out through the right wall
+
+typedef struct PhysicsBatch PhysicsBatch;
+typedef void (*PhysicsKernel)(PhysicsBatch* batch, uint32_t count);
+
+/**
+ * ball and paddle state for every match of a worker, stored as one array
+ * per field so a kernel can step PHYSICS_LANES matches per instruction.
+ * Index i is the match at index i of the owning MatchTable.
+ */
+struct PhysicsBatch {
+	float* ball_x;
+	float* ball_y;
+	float* ball_dx;
+	float* ball_dy;
+	float* paddle_x[MAX_CLIENTS];
+	float* paddle_y[MAX_CLIENTS];
+
+	// seconds to advance each match this step, 0 for matches not in play
+	float* step_dt;
+	int32_t* result;
+
+	uint32_t capacity;	// rounded up to a multiple of PHYSICS_LANES
+
+	// widest kernel the CPU supports, picked once at init
+	PhysicsKernel kernel;
+	const char* kernel_name;
+};
+
+int physics_batch_init(PhysicsBatch* batch, uint32_t capacity);
+void physics_batch_free(PhysicsBatch* batch);
+
+void physics_get_ball(const PhysicsBatch* batch, uint32_t index, Position* ball);
+void physics_set_ball(PhysicsBatch* batch, uint32_t index, const Position* ball);
+
+PhysicsKernel physics_select_kernel(const char** name);
+void physics_step(PhysicsBatch* batch, uint32_t count);
+
+void physics_step_scalar(PhysicsBatch* batch, uint32_t count);
+#if defined(__x86_64__) || defined(__i386__)
+void physics_step_sse2(PhysicsBatch* batch, uint32_t count);
+void physics_step_avx2(PhysicsBatch* batch, uint32_t count);
+#endif
+
+#endif
@@ -3,116 +3,219 @@
  */
 
 #include <string.h>
-#include <arpa/inet.h>
 
 #include "protocol.h"
 
-void serialize_position_message(const struct PositionMessage* msg, uint8_t* buffer) {
-	uint32_t id = htonl(msg->id);
-	memcpy(buffer, &id, 4);
-
-	// serialize floats by bit-casting to uint32_t first
-	float fields[4] = {msg->position.x, msg->position.y, msg->position.dx, msg->position.dy};
-	for (int i = 0; i < 4; i++) {
-		uint32_t temp;
-		memcpy(&temp, &fields[i], 4);
-		uint32_t net_val = htonl(temp);
-		memcpy(buffer + 4 + (i * 4), &net_val, 4);
+/**
+ * Serialize an InputMessage, returning the number of bytes written, at
+ * most MAX_INPUT_MESSAGE_SIZE
+ */
+size_t serialize_input_message(uint8_t* buffer, const InputMessage* msg) {
+	size_t offset = encode_input_message_header(buffer, msg);
+	for (int i = 0; i < msg->count; i++)
+		offset += encode_input_command(buffer + offset, &msg->commands[i]);
+	return offset;
+}
+
+/**
+ * Decode an InputMessage.  Returns -1 if the buffer is the wrong type,
+ * truncated or carries more commands than INPUT_REDUNDANCY.
+ */
+int deserialize_input_message(const uint8_t* buffer, size_t length, InputMessage* msg) {
+	if (decode_input_message_header(buffer, length, msg) == -1)
+		return -1;
+	if (msg->count > INPUT_REDUNDANCY || length != INPUT_MESSAGE_HEADER_SIZE + msg->count * INPUT_COMMAND_SIZE)
+		return -1;
+
+	const uint8_t* commands = buffer + INPUT_MESSAGE_HEADER_SIZE;
+	for (int i = 0; i < msg->count; i++) {
+		InputCommand* command = &msg->commands[i];
+		decode_input_command(commands + i * INPUT_COMMAND_SIZE, INPUT_COMMAND_SIZE, command);
+		// a command is one frame of movement at most
+		command->move = command->move > 0 ? 1 : (command->move < 0 ? -1 : 0);
 	}
+	return 0;
+}
+
+/**
+ * The type byte of a client datagram, or -1 if it's too short to have one
+ */
+int client_datagram_type(const uint8_t* buffer, size_t length) {
+	return length < 5 ? -1 : buffer[4];
+}
+
+/**
+ * Look for a complete frame at the start of buffer.  Returns its total
+ * length, 0 if more bytes are needed, or -1 if the length prefix is out of
+ * range and the stream can't be parsed any further.
+ */
+int tcp_frame_length(const uint8_t* buffer, size_t available) {
+	if (available < TCP_LENGTH_SIZE)
+		return 0;
+	uint32_t payload = wire_get_u32(buffer);
+	if (payload < 4 || payload > TCP_MAX_PAYLOAD)
+		return -1;
+	if (available < TCP_LENGTH_SIZE + payload)
+		return 0;
+	return TCP_LENGTH_SIZE + payload;
+}
+
+// write a frame of a u32 code and body, returning its length
+static size_t serialize_frame(uint8_t* buffer, uint32_t code, const char* body, uint16_t length) {
+	if (length > TCP_MAX_BODY)
+		length = TCP_MAX_BODY;
+	TcpFrameHeader header = { .length = 4 + length, .code = code };
+	size_t offset = encode_tcp_frame_header(buffer, &header);
+	memcpy(buffer + offset, body, length);
+	return offset + length;
+}
+
+// split a complete frame into its code and body
+static int deserialize_frame(const uint8_t* frame, size_t length, uint32_t* code, char* body, uint16_t* body_length) {
+	TcpFrameHeader header;
+	if (tcp_frame_length(frame, length) != (int)length || decode_tcp_frame_header(frame, length, &header) == -1)
+		return -1;
+	size_t offset = WIRE_SIZE(TCP_FRAME_HEADER_SCHEMA);
+	*code = header.code;
+	*body_length = length - offset;
+	memcpy(body, frame + offset, *body_length);
+	return 0;
+}
+
+/**
+ * Serialize a TcpMessage as a frame, returning its length, at most
+ * TCP_MAX_FRAME
+ */
+size_t serialize_tcp_message(const struct TcpMessage* tcpMessage, uint8_t* buffer) {
+	return serialize_frame(buffer, tcpMessage->opcode, tcpMessage->msg, tcpMessage->length);
 }
 
-void deserialize_position_message(const uint8_t* buffer, struct PositionMessage* msg) {
-	uint32_t temp_val;
-	memcpy(&temp_val, buffer, 4);
-	msg->id = ntohl(temp_val);
+/**
+ * Read a request from one complete frame.  Returns -1 if frame isn't one.
+ */
+int deserialize_tcp_message(const uint8_t* frame, size_t length, struct TcpMessage* msg) {
+	return deserialize_frame(frame, length, &msg->opcode, msg->msg, &msg->length);
+}
 
-	uint32_t host_bits;
-	int offset = 4;
+static uint16_t quantize_unsigned(float value, float scale) {
+	float q = value * scale + 0.5f;
+	if (q <= 0.0f)
+		return 0;
+	if (q >= UINT16_MAX)
+		return UINT16_MAX;
+	return (uint16_t)q;
+}
 
-	memcpy(&temp_val, buffer + offset, 4);
-	host_bits = ntohl(temp_val);
-	memcpy(&msg->position.x, &host_bits, 4);
-	offset += 4;
+static int16_t quantize_signed(float value, float scale) {
+	float q = value * scale;
+	q += (q < 0.0f) ? -0.5f : 0.5f;
+	if (q <= INT16_MIN)
+		return INT16_MIN;
+	if (q >= INT16_MAX)
+		return INT16_MAX;
+	return (int16_t)q;
+}
 
-	// y
-	memcpy(&temp_val, buffer + offset, 4);
-	host_bits = ntohl(temp_val);
-	memcpy(&msg->position.y, &host_bits, 4);
-	offset += 4;
+void quantize_position(const Position* position, QuantizedPosition* quantized) {
+	quantized->x = quantize_unsigned(position->x, POSITION_SCALE);
+	quantized->y = quantize_unsigned(position->y, POSITION_SCALE);
+	quantized->dx = quantize_signed(position->dx, VELOCITY_SCALE);
+	quantized->dy = quantize_signed(position->dy, VELOCITY_SCALE);
+}
 
-	// dx
-	memcpy(&temp_val, buffer + offset, 4);
-	host_bits = ntohl(temp_val);
-	memcpy(&msg->position.dx, &host_bits, 4);
-	offset += 4;
+/**
+ * Serialize a snapshot, delta encoded against base if it is not NULL.
+ * Returns the exact number of bytes written, at most MAX_SNAPSHOT_SIZE.
+ */
+size_t serialize_game_state_message(uint8_t* buffer, const GameStateMessage* gameStateMessage, const GameStateMessage* base) {
+	SnapshotHeader header = {
+		.sequence = gameStateMessage->sequence,
+		.base_sequence = base != NULL ? base->sequence : 0,
+		.tick = gameStateMessage->tick,
+		.server_time = gameStateMessage->server_time,
+		.input_seq = gameStateMessage->input_seq,
+		.left_score = gameStateMessage->left_score,
+		.right_score = gameStateMessage->right_score,
+		.flags = gameStateMessage->game_active ? 1 : 0,
+		.start_tick = gameStateMessage->start_tick,
+		.num_positions = gameStateMessage->num_positions,
+	};
+
+	// only positions that differ from the base are sent
+	for (int i = 0; i < gameStateMessage->num_positions; i++) {
+		if (base == NULL || memcmp(&gameStateMessage->positions[i], &base->positions[i], sizeof(QuantizedPosition)) != 0)
+			header.changed_mask |= 1 << i;
+	}
+	size_t offset = encode_snapshot_header(buffer, &header);
 
-	// dy
-	memcpy(&temp_val, buffer + offset, 4);
-	host_bits = ntohl(temp_val);
-	memcpy(&msg->position.dy, &host_bits, 4);
+	if (base == NULL)
+		return offset + encode_quantized_position_array(buffer + offset, gameStateMessage->positions, gameStateMessage->num_positions);
 
+	for (int i = 0; i < gameStateMessage->num_positions; i++) {
+		if (header.changed_mask & (1 << i))
+			offset += encode_quantized_position_array(buffer + offset, &gameStateMessage->positions[i], 1);
+	}
+	return offset;
 }
 
 /**
- * Serialize TcpMessage into a buffer, to be sent over the wire
+ * Read the base sequence a snapshot was delta encoded against, so the
+ * caller can find it before decoding.  Returns 0 for full snapshots or
+ * buffers too short to be a snapshot.
  */
-void serialize_tcp_message(const struct TcpMessage* tcpMessage, char* buffer) {
-	memset(buffer, 0, sizeof(*buffer));
-	uint32_t opcode = htonl(tcpMessage->opcode);
-	memcpy(buffer, &opcode, sizeof(uint32_t));
-
-	int offset = sizeof(uint32_t);
-	memcpy(buffer + offset, tcpMessage->msg, sizeof(tcpMessage->msg));
-}
-
-
-void deserialize_tcp_message(char buffer[256], struct TcpMessage* msg) {
-	uint32_t temp_val;
-	memcpy(&temp_val, buffer, 4);
-	msg->opcode = ntohl(temp_val);
-}
-
-void serialize_game_state_message(uint8_t* buffer, const GameStateMessage* gameStateMessage) {
-	int offset = 0;
-
-	buffer[offset] = gameStateMessage->left_score;
-	offset += 1;
-	buffer[offset] = gameStateMessage->right_score;
-	offset += 1;
-
-	uint8_t active = gameStateMessage->game_active ? 1 : 0;
-	buffer[offset] = active;
-	offset += 1;
-
-	uint32_t seconds_to_start = htonl((uint32_t)gameStateMessage->seconds_to_start);
-	memcpy(buffer + offset, &seconds_to_start, 4);
-	offset += 4;
-
-	uint32_t num_positions = htonl(gameStateMessage->num_positions);
-	memcpy(buffer + offset, &num_positions, 4);
-	offset += 4;
-
-	for (int i = 0; i < (int)gameStateMessage->num_positions; i++) {
-		float fields[4] = {
-			gameStateMessage->positions[i].x,
-			gameStateMessage->positions[i].y,
-			gameStateMessage->positions[i].dx,
-			gameStateMessage->positions[i].dy
-		};
-		for (int j = 0; j < 4; j++) {
-			uint32_t temp;
-			memcpy(&temp, &fields[j], 4);
-			uint32_t net_val = htonl(temp);
-			memcpy(buffer + offset, &net_val, 4);
-			offset += 4;
+uint32_t game_state_base_sequence(const uint8_t* buffer, size_t length) {
+	if (length < SNAPSHOT_HEADER_SIZE)
+		return 0;
+	return wire_get_u32(buffer + 5);
+}
+
+/**
+ * Decode a snapshot produced by serialize_game_state_message.  Delta
+ * snapshots need the base they were encoded against; positions absent from
+ * the delta are copied from it.  Returns -1 if the buffer is malformed, the
+ * wrong version, or names a base that wasn't supplied.
+ */
+int deserialize_game_state_message(const uint8_t* buffer, size_t length, const GameStateMessage* base, GameStateMessage* gameStateMessage) {
+	SnapshotHeader header;
+	if (decode_snapshot_header(buffer, length, &header) == -1)
+		return -1;
+	if (header.base_sequence != 0 && (base == NULL || base->sequence != header.base_sequence))
+		return -1;
+	if (header.num_positions > MAX_CLIENTS + 1)
+		return -1;
+
+	gameStateMessage->sequence = header.sequence;
+	gameStateMessage->tick = header.tick;
+	gameStateMessage->server_time = header.server_time;
+	gameStateMessage->input_seq = header.input_seq;
+	gameStateMessage->left_score = header.left_score;
+	gameStateMessage->right_score = header.right_score;
+	gameStateMessage->game_active = header.flags & 1;
+	gameStateMessage->start_tick = header.start_tick;
+	gameStateMessage->num_positions = header.num_positions;
+
+	size_t offset = SNAPSHOT_HEADER_SIZE;
+	for (int i = 0; i < header.num_positions; i++) {
+		QuantizedPosition* position = &gameStateMessage->positions[i];
+		if (!(header.changed_mask & (1 << i))) {
+			if (header.base_sequence == 0)
+				return -1;
+			*position = base->positions[i];
+			continue;
 		}
+
+		if (offset + QUANTIZED_POSITION_SIZE > length)
+			return -1;
+		decode_quantized_position_array(buffer + offset, position, 1);
+		offset += QUANTIZED_POSITION_SIZE;
 	}
+	return offset == length ? 0 : -1;
 }
 
-void serialize_tcp_response(const struct TcpResponse* tcpResponse, uint8_t* buffer) {
-	uint32_t response_code = htonl(tcpResponse->statuscode);
-	memcpy(buffer, &response_code, 4);
-	size_t offset = 4;
+size_t serialize_tcp_response(const struct TcpResponse* tcpResponse, uint8_t* buffer) {
+	return serialize_frame(buffer, tcpResponse->statuscode, tcpResponse->msg, tcpResponse->length);
+}
 
-	memcpy(buffer + offset, tcpResponse->msg, sizeof(tcpResponse->msg));
+int deserialize_tcp_response(const uint8_t* frame, size_t length, struct TcpResponse* response) {
+	return deserialize_frame(frame, length, &response->statuscode, response->msg, &response->length);
 }
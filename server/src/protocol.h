@@ -4,8 +4,10 @@
 #include <stdint.h>
 #include <netinet/in.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #include "config.h"
+#include "wire.h"
 
 typedef struct {
 	struct sockaddr_in addr;
@@ -13,6 +15,9 @@ typedef struct {
 	int tcp_fd;
 	uint32_t udp_port;
 	uint32_t player_id;
+	uint32_t acked_seq;	// newest snapshot the client has confirmed, 0 if none
+	uint32_t input_seq;	// newest input command applied, 0 if none
+	uint32_t rtt_us;	// smoothed round trip measured by pings, 0 until one is
 	bool active;
 } Client;
 
@@ -24,23 +29,180 @@ typedef struct __attribute((packed)) {
 } Position;
 
 /**
- * structure broadcasted from clients to server containing position info
+ * datagram types sent by clients, the byte after the player id
  */
-struct __attribute((packed)) PositionMessage {
-	uint32_t id;
-	Position position;
-};
+#define CLIENT_INPUT 1
+#define CLIENT_SPECTATE 2
+#define CLIENT_PING 3
 
 /**
- * Structrue broadcasted from server to clients containing game state info
+ * first byte of a pong, where a snapshot has its version
  */
-typedef struct __attribute((packed)) {
+#define SERVER_PONG 0x80
+
+/*
+ * Wire layouts, network byte order.  Each is declared once as a schema
+ * (see wire.h) that generates its struct and codec here and its Rust
+ * counterpart in the client; run `make schema` after changing one.
+ */
+
+/**
+ * one client frame of paddle movement, stamped with the server tick the
+ * client was showing when the player made it.  move is 1 up, -1 down, 0
+ * still.
+ */
+#define INPUT_COMMAND_SCHEMA(FIELD, TAG) \
+	FIELD(u32, tick) \
+	FIELD(i8, move)
+
+typedef struct {
+	WIRE_FIELDS(INPUT_COMMAND_SCHEMA)
+} InputCommand;
+
+/**
+ * structure sent from clients to server carrying their latest input: this
+ * header, then count InputCommands numbered from first_seq.  ack is the
+ * sequence of the newest snapshot received.
+ * Clients repeat their last INPUT_REDUNDANCY commands in every datagram so
+ * a lost packet doesn't lose input; the server skips the ones it has seen.
+ */
+#define INPUT_MESSAGE_SCHEMA(FIELD, TAG) \
+	FIELD(u32, id) \
+	TAG(CLIENT_INPUT) \
+	FIELD(u32, ack) \
+	FIELD(u32, first_seq) \
+	FIELD(u8, count)
+
+typedef struct {
+	WIRE_FIELDS(INPUT_MESSAGE_SCHEMA)
+	InputCommand commands[INPUT_REDUNDANCY];
+} InputMessage;
+
+/**
+ * sent by spectators so the server learns where to send the match.  The
+ * id is the first player id of the match being watched, which routes the
+ * datagram to the worker hosting it.
+ */
+#define SPECTATE_MESSAGE_SCHEMA(FIELD, TAG) \
+	FIELD(u32, id) \
+	TAG(CLIENT_SPECTATE) \
+	FIELD(u32, spectator_id)
+
+typedef struct {
+	WIRE_FIELDS(SPECTATE_MESSAGE_SCHEMA)
+} SpectateMessage;
+
+#define SPECTATE_MESSAGE_SIZE WIRE_SIZE(SPECTATE_MESSAGE_SCHEMA)
+
+/**
+ * a player's clock probe, answered straight away with a pong.  Times are
+ * monotonic microseconds on the sender's own clock.  echo_time is the
+ * server_time of the newest pong the client has had, 0 if none, and
+ * echo_delay how long it held that pong before this ping, so the server
+ * can measure the round trip too.
+ */
+#define PING_MESSAGE_SCHEMA(FIELD, TAG) \
+	FIELD(u32, id) \
+	TAG(CLIENT_PING) \
+	FIELD(u64, client_time) \
+	FIELD(u64, echo_time) \
+	FIELD(u32, echo_delay)
+
+typedef struct {
+	WIRE_FIELDS(PING_MESSAGE_SCHEMA)
+} PingMessage;
+
+/**
+ * answer to a ping: its client_time, the server's clock when it arrived,
+ * and the server's smoothed measure of the player's round trip, 0 until
+ * it has one.  The client takes its own round trip and the offset between
+ * the clocks from the pong.
+ */
+#define PONG_MESSAGE_SCHEMA(FIELD, TAG) \
+	TAG(SERVER_PONG) \
+	FIELD(u64, client_time) \
+	FIELD(u64, server_time) \
+	FIELD(u32, rtt)
+
+typedef struct {
+	WIRE_FIELDS(PONG_MESSAGE_SCHEMA)
+} PongMessage;
+
+#define PING_MESSAGE_SIZE WIRE_SIZE(PING_MESSAGE_SCHEMA)
+#define PONG_MESSAGE_SIZE WIRE_SIZE(PONG_MESSAGE_SCHEMA)
+
+#define INPUT_MESSAGE_HEADER_SIZE WIRE_SIZE(INPUT_MESSAGE_SCHEMA)
+#define INPUT_COMMAND_SIZE WIRE_SIZE(INPUT_COMMAND_SCHEMA)
+#define MAX_INPUT_MESSAGE_SIZE (INPUT_MESSAGE_HEADER_SIZE + INPUT_REDUNDANCY * INPUT_COMMAND_SIZE)
+
+/**
+ * Position quantized for the wire: coordinates in 1/POSITION_SCALE units,
+ * velocities in 1/VELOCITY_SCALE units per second
+ */
+#define QUANTIZED_POSITION_SCHEMA(FIELD, TAG) \
+	FIELD(u16, x) \
+	FIELD(u16, y) \
+	FIELD(i16, dx) \
+	FIELD(i16, dy)
+
+typedef struct {
+	WIRE_FIELDS(QUANTIZED_POSITION_SCHEMA)
+} QuantizedPosition;
+
+#define SNAPSHOT_VERSION 4
+
+/**
+ * the fixed part of a snapshot, followed by a QuantizedPosition for each
+ * bit set in changed_mask.  base_sequence 0 means a full snapshot;
+ * otherwise positions absent from the mask are unchanged from that earlier
+ * snapshot.  Bit 0 of flags is set while the game is active.  server_time
+ * is when the tick was due, in the server's monotonic microseconds, and
+ * start_tick the tick a countdown ends on, 0 if there isn't one, so a
+ * client that knows the offset to the server's clock starts on time.
+ */
+#define SNAPSHOT_HEADER_SCHEMA(FIELD, TAG) \
+	TAG(SNAPSHOT_VERSION) \
+	FIELD(u32, sequence) \
+	FIELD(u32, base_sequence) \
+	FIELD(u32, tick) \
+	FIELD(u64, server_time) \
+	FIELD(u32, input_seq) \
+	FIELD(u8, left_score) \
+	FIELD(u8, right_score) \
+	FIELD(u8, flags) \
+	FIELD(u32, start_tick) \
+	FIELD(u8, num_positions) \
+	FIELD(u8, changed_mask)
+
+typedef struct {
+	WIRE_FIELDS(SNAPSHOT_HEADER_SCHEMA)
+} SnapshotHeader;
+
+#define POSITION_SCALE 256.0f
+#define VELOCITY_SCALE 256.0f
+#define SNAPSHOT_HEADER_SIZE WIRE_SIZE(SNAPSHOT_HEADER_SCHEMA)
+#define QUANTIZED_POSITION_SIZE WIRE_SIZE(QUANTIZED_POSITION_SCHEMA)
+#define MAX_SNAPSHOT_SIZE (SNAPSHOT_HEADER_SIZE + (MAX_CLIENTS + 1) * QUANTIZED_POSITION_SIZE)
+
+_Static_assert(COLS * POSITION_SCALE <= UINT16_MAX && ROWS * POSITION_SCALE <= UINT16_MAX,
+	"board does not fit in a quantized position");
+_Static_assert(MAX_CLIENTS + 1 <= 8, "changed-position mask is a single byte");
+
+/**
+ * Structrue broadcasted from server to clients containing game state info,
+ * sent as a SnapshotHeader and the positions
+ */
+typedef struct {
+	uint32_t sequence;
+	uint32_t tick;		// server tick the state is from
+	uint64_t server_time;	// when that tick was due, in monotonic microseconds
+	uint32_t input_seq;	// newest input command of the recipient that the state includes
 	uint8_t left_score;
 	uint8_t right_score;
 	bool game_active;
-	int32_t seconds_to_start;
-	uint32_t num_positions;
-	Position positions[MAX_CLIENTS + 1];  //position for each player, plus the ball
+	uint32_t start_tick;	// tick the countdown ends on, 0 if not counting down
+	uint8_t num_positions;
+	QuantizedPosition positions[MAX_CLIENTS + 1];  //position for each player, plus the ball
 } GameStateMessage;
 
 typedef struct __attribute((packed)) {
@@ -48,26 +210,104 @@ typedef struct __attribute((packed)) {
 	uint16_t tcp_port;
 } ClientNetworkingData;
 
-typedef struct __attribute((packed)) {
-	time_t scheduled_start;
-} StartGameMessage;
+/*
+ * TCP messages are framed as a u32 length followed by that many bytes of
+ * payload: a u32 opcode (requests) or status code (responses) and up to
+ * TCP_MAX_BODY bytes of body.  Integers are big-endian.  Requests can be
+ * pipelined; responses come back in the order the requests were sent.
+ */
+#define TCP_LENGTH_SIZE 4
+#define TCP_MAX_BODY 256
+#define TCP_MAX_PAYLOAD (4 + TCP_MAX_BODY)
+#define TCP_MAX_FRAME (TCP_LENGTH_SIZE + TCP_MAX_PAYLOAD)
+
+/**
+ * the start of every frame: the payload length, then the opcode or status
+ */
+#define TCP_FRAME_HEADER_SCHEMA(FIELD, TAG) \
+	FIELD(u32, length) \
+	FIELD(u32, code)
+
+typedef struct {
+	WIRE_FIELDS(TCP_FRAME_HEADER_SCHEMA)
+} TcpFrameHeader;
+
+#define TCP_REGISTER 0	// opcode: join the matchmaking queue
+#define TCP_SPECTATE 1	// opcode: watch the match whose u32 id is the body
+
+#define TCP_STATUS_OK 0
+#define TCP_STATUS_QUEUE_FULL 1	// too many players waiting, try again later
+#define TCP_STATUS_ALREADY_WAITING 2	// the connection's earlier registration is still queued
+#define TCP_STATUS_NO_SUCH_MATCH 3	// nothing is being played under the requested match id
+#define TCP_STATUS_ALREADY_PLAYING 4	// the connection already has a seat in a match
+#define TCP_STATUS_UNAVAILABLE 5	// the server couldn't set up the seat or audience, try again
+
+/**
+ * body of a TCP_SPECTATE request
+ */
+#define SPECTATE_REQUEST_SCHEMA(FIELD, TAG) \
+	FIELD(u32, match_id)
+
+typedef struct {
+	WIRE_FIELDS(SPECTATE_REQUEST_SCHEMA)
+} SpectateRequest;
+
+/**
+ * body of the response to a register or spectate request: the player (or
+ * spectator) and match ids, and the server config the client simulates
+ * with
+ */
+#define REGISTER_RESPONSE_SCHEMA(FIELD, TAG) \
+	FIELD(u32, id) \
+	FIELD(u32, rows) \
+	FIELD(u32, cols) \
+	FIELD(f32, player_move_speed) \
+	FIELD(f32, ball_radius) \
+	FIELD(f32, player_length) \
+	FIELD(u32, match_id) \
+	FIELD(u32, player_index)
+
+typedef struct {
+	WIRE_FIELDS(REGISTER_RESPONSE_SCHEMA)
+} RegisterResponse;
+
+#define REGISTER_RESPONSE_SIZE WIRE_SIZE(REGISTER_RESPONSE_SCHEMA)
+
+WIRE_CODEC(input_command, InputCommand, INPUT_COMMAND_SCHEMA)
+WIRE_CODEC(input_message_header, InputMessage, INPUT_MESSAGE_SCHEMA)
+WIRE_CODEC(spectate_message, SpectateMessage, SPECTATE_MESSAGE_SCHEMA)
+WIRE_CODEC(ping_message, PingMessage, PING_MESSAGE_SCHEMA)
+WIRE_CODEC(pong_message, PongMessage, PONG_MESSAGE_SCHEMA)
+WIRE_BLOCK_CODEC(quantized_position, QuantizedPosition, QUANTIZED_POSITION_SCHEMA, 16)
+WIRE_CODEC(snapshot_header, SnapshotHeader, SNAPSHOT_HEADER_SCHEMA)
+WIRE_CODEC(tcp_frame_header, TcpFrameHeader, TCP_FRAME_HEADER_SCHEMA)
+WIRE_CODEC(spectate_request, SpectateRequest, SPECTATE_REQUEST_SCHEMA)
+WIRE_BLOCK_CODEC(register_response, RegisterResponse, REGISTER_RESPONSE_SCHEMA, 32)
 
-struct __attribute((packed)) TcpMessage {
+struct TcpMessage {
 	uint32_t opcode;
-	char msg[256];
+	uint16_t length;	// bytes of msg in use
+	char msg[TCP_MAX_BODY];
 };
 
-struct __attribute((packed)) TcpResponse {
+struct TcpResponse {
 	uint32_t statuscode;
-	char msg[256];
+	uint16_t length;
+	char msg[TCP_MAX_BODY];
 };
 
-void serialize_position_message(const struct PositionMessage* msg, uint8_t* buffer);
-void serialize_tcp_message(const struct TcpMessage* tcpMessage, char* buffer);
-void deserialize_position_message(const uint8_t* buffer, struct PositionMessage* msg);
-void deserialize_tcp_message(char buffer[256], struct TcpMessage* msg);
-void serialize_tcp_response(const struct TcpResponse* tcpResponse, uint8_t* buffer);
+size_t serialize_input_message(uint8_t* buffer, const InputMessage* msg);
+int deserialize_input_message(const uint8_t* buffer, size_t length, InputMessage* msg);
+int client_datagram_type(const uint8_t* buffer, size_t length);
+int tcp_frame_length(const uint8_t* buffer, size_t available);
+size_t serialize_tcp_message(const struct TcpMessage* tcpMessage, uint8_t* buffer);
+int deserialize_tcp_message(const uint8_t* frame, size_t length, struct TcpMessage* msg);
+size_t serialize_tcp_response(const struct TcpResponse* tcpResponse, uint8_t* buffer);
+int deserialize_tcp_response(const uint8_t* frame, size_t length, struct TcpResponse* response);
 
-void serialize_game_state_message(uint8_t* buffer, const GameStateMessage* gameStateMessage);
+void quantize_position(const Position* position, QuantizedPosition* quantized);
+size_t serialize_game_state_message(uint8_t* buffer, const GameStateMessage* gameStateMessage, const GameStateMessage* base);
+uint32_t game_state_base_sequence(const uint8_t* buffer, size_t length);
+int deserialize_game_state_message(const uint8_t* buffer, size_t length, const GameStateMessage* base, GameStateMessage* gameStateMessage);
 
 #endif
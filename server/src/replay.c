@@ -0,0 +1,233 @@
+/*
+ * replay.c -- append-only, memory-mapped match recordings
+ *
+ * Records are copied straight into a shared mapping, so recording a tick
+ * costs a few small memcpys; the kernel writes the pages back in the
+ * background.  Files grow a chunk at a time.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "replay.h"
+
+static ReplayFileHeader* header_of(const ReplayWriter* writer) {
+	return (ReplayFileHeader*)writer->data;
+}
+
+// make room for length more bytes at the end of a mapped file
+static int grow(int fd, uint8_t** data, size_t* mapped, size_t used, size_t length) {
+	if (used + length <= *mapped)
+		return 0;
+
+	size_t size = *mapped;
+	while (size < used + length)
+		size += REPLAY_CHUNK_SIZE;
+	if (ftruncate(fd, size) == -1) {
+		perror("ftruncate");
+		return -1;
+	}
+	void* remapped = *data == NULL
+		? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+		: mremap(*data, *mapped, size, MREMAP_MAYMOVE);
+	if (remapped == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	*data = remapped;
+	*mapped = size;
+	return 0;
+}
+
+static int open_file(const char* dir, uint32_t match_id, time_t created, const char* extension) {
+	char path[512];
+	snprintf(path, sizeof(path), "%s/match_%u_%ld.%s", dir, match_id, (long)created, extension);
+	int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd == -1 && errno != EEXIST)
+		perror(path);
+	return fd;
+}
+
+/**
+ * Start a recording in dir of a match stepped every tick_rate ms.  Returns
+ * NULL if the files can't be created, in which case the match just isn't
+ * recorded.
+ */
+ReplayWriter* replay_open(const char* dir, uint32_t match_id, uint32_t tick_rate) {
+	ReplayWriter* writer = calloc(1, sizeof(ReplayWriter));
+	if (writer == NULL)
+		return NULL;
+
+	// a match carried over by a hot restart is recorded again from there,
+	// and mustn't clobber the first recording if that began the same second
+	time_t created = time(NULL);
+	while ((writer->fd = open_file(dir, match_id, created, "replay")) == -1 && errno == EEXIST)
+		created++;
+	writer->index_fd = open_file(dir, match_id, created, "index");
+	if (writer->fd == -1 || writer->index_fd == -1
+			|| grow(writer->fd, &writer->data, &writer->mapped, 0, sizeof(ReplayFileHeader)) == -1) {
+		replay_close(writer);
+		return NULL;
+	}
+
+	ReplayFileHeader* header = header_of(writer);
+	memcpy(header->magic, REPLAY_MAGIC, sizeof(REPLAY_MAGIC));
+	header->version = REPLAY_VERSION;
+	header->match_id = match_id;
+	header->tick_rate = tick_rate;
+	header->max_clients = MAX_CLIENTS;
+	header->created = created;
+	writer->used = sizeof(ReplayFileHeader);
+	// the first step recorded starts with a keyframe
+	writer->steps_since_keyframe = REPLAY_KEYFRAME_INTERVAL;
+	atomic_store_explicit(&header->data_end, writer->used, memory_order_release);
+	return writer;
+}
+
+/**
+ * Trim both files to what was written and release them
+ */
+void replay_close(ReplayWriter* writer) {
+	if (writer == NULL)
+		return;
+
+	size_t index_used = 0;
+	if (writer->data != NULL) {
+		ReplayFileHeader* header = header_of(writer);
+		index_used = atomic_load(&header->num_keyframes) * sizeof(ReplayIndexEntry);
+		size_t data_end = atomic_load(&header->data_end);
+		munmap(writer->data, writer->mapped);
+		if (ftruncate(writer->fd, data_end) == -1)
+			perror("ftruncate");
+	}
+	if (writer->index != NULL) {
+		munmap(writer->index, writer->index_mapped);
+		if (ftruncate(writer->index_fd, index_used) == -1)
+			perror("ftruncate");
+	}
+	free(writer->step);
+	if (writer->fd != -1)
+		close(writer->fd);
+	if (writer->index_fd != -1)
+		close(writer->index_fd);
+	free(writer);
+}
+
+// reserve a record at the end of the file, returning its offset or 0 on failure
+static size_t append_record(ReplayWriter* writer, uint32_t type, size_t length) {
+	length = (sizeof(ReplayRecordHeader) + length + 7) & ~(size_t)7;
+	if (grow(writer->fd, &writer->data, &writer->mapped, writer->used, length) == -1)
+		return 0;
+
+	size_t offset = writer->used;
+	ReplayRecordHeader record = { .type = type, .length = length };
+	memcpy(writer->data + offset, &record, sizeof(record));
+	writer->used += length;
+	return offset;
+}
+
+// append length bytes to the step being recorded
+static void stage(ReplayWriter* writer, const void* data, size_t length) {
+	if (writer->step_length + length > writer->step_capacity) {
+		size_t capacity = writer->step_capacity ? writer->step_capacity * 2 : 256;
+		while (capacity < writer->step_length + length)
+			capacity *= 2;
+		uint8_t* step = realloc(writer->step, capacity);
+		if (step == NULL)
+			return;
+		writer->step = step;
+		writer->step_capacity = capacity;
+	}
+	memcpy(writer->step + writer->step_length, data, length);
+	writer->step_length += length;
+}
+
+static void publish(ReplayWriter* writer) {
+	atomic_store_explicit(&header_of(writer)->data_end, writer->used, memory_order_release);
+}
+
+static size_t write_state(ReplayWriter* writer, uint32_t type, const ReplayKeyframe* keyframe) {
+	size_t offset = append_record(writer, type, sizeof(*keyframe));
+	if (offset == 0)
+		return 0;
+	memcpy(writer->data + offset + sizeof(ReplayRecordHeader), keyframe, sizeof(*keyframe));
+	publish(writer);
+	return offset;
+}
+
+/**
+ * Write a full state snapshot and index it
+ */
+void replay_keyframe(ReplayWriter* writer, const ReplayKeyframe* keyframe) {
+	size_t offset = write_state(writer, REPLAY_KEYFRAME, keyframe);
+	if (offset == 0)
+		return;
+
+	ReplayFileHeader* header = header_of(writer);
+	uint64_t count = atomic_load_explicit(&header->num_keyframes, memory_order_relaxed);
+	size_t index_used = count * sizeof(ReplayIndexEntry);
+	if (grow(writer->index_fd, &writer->index, &writer->index_mapped, index_used, sizeof(ReplayIndexEntry)) == -1)
+		return;
+	ReplayIndexEntry entry = { .tick = keyframe->tick, .offset = offset };
+	memcpy(writer->index + index_used, &entry, sizeof(entry));
+	atomic_store_explicit(&header->num_keyframes, count + 1, memory_order_release);
+	writer->steps_since_keyframe = 0;
+}
+
+/**
+ * Write the state a rewind left the match in, which playback can't
+ * arrive at by simulating the recorded steps
+ */
+void replay_resync(ReplayWriter* writer, const ReplayKeyframe* keyframe) {
+	write_state(writer, REPLAY_RESYNC, keyframe);
+}
+
+int replay_keyframe_due(const ReplayWriter* writer) {
+	return writer->steps_since_keyframe >= REPLAY_KEYFRAME_INTERVAL;
+}
+
+/**
+ * Start the record for one tick; inputs are added as they're applied
+ */
+void replay_begin_step(ReplayWriter* writer, uint64_t tick, uint8_t num_clients) {
+	ReplayStep step = { .tick = tick, .num_clients = num_clients };
+	writer->step_length = 0;
+	stage(writer, &step, sizeof(step));
+}
+
+void replay_add_input(ReplayWriter* writer, uint8_t slot, const Position* position) {
+	if (writer->step_length < sizeof(ReplayStep))
+		return;
+	ReplayInput input = { .slot = slot, .position = *position };
+	stage(writer, &input, sizeof(input));
+	((ReplayStep*)writer->step)->num_inputs++;
+}
+
+/**
+ * Finish the step with the state it produced, write it out and make it
+ * visible to readers
+ */
+void replay_end_step(ReplayWriter* writer, const GameStateMessage* state) {
+	if (writer->step_length < sizeof(ReplayStep))
+		return;
+	uint8_t buffer[MAX_SNAPSHOT_SIZE];
+	size_t length = serialize_game_state_message(buffer, state, NULL);
+	((ReplayStep*)writer->step)->state_length = length;
+	stage(writer, buffer, length);
+
+	size_t step_length = writer->step_length;
+	writer->step_length = 0;
+	size_t offset = append_record(writer, REPLAY_STEP, step_length);
+	if (offset == 0)
+		return;
+	memcpy(writer->data + offset + sizeof(ReplayRecordHeader), writer->step, step_length);
+	writer->steps_since_keyframe++;
+	publish(writer);
+}
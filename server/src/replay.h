@@ -0,0 +1,120 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "config.h"
+#include "protocol.h"
+
+/*
+ * A replay is two append-only files per match, written through mmap:
+ *
+ *   <name>.replay  ReplayFileHeader, then records.  A keyframe holds the
+ *                  full simulation state and is written when recording
+ *                  starts and every REPLAY_KEYFRAME_INTERVAL steps after.
+ *                  A step holds the inputs applied on one tick and the
+ *                  GameStateMessage it produced.  A resync has the same
+ *                  contents as a keyframe and is written when the server
+ *                  re-simulated the match for late input; readers restore
+ *                  it instead of simulating through it.
+ *   <name>.index   ReplayIndexEntry for every keyframe, so a reader can
+ *                  seek to any tick and re-simulate from the keyframe
+ *                  before it.
+ *
+ * Files use host byte order; they are for debugging on the machine, or at
+ * least the architecture, that recorded them.
+ */
+
+#define REPLAY_MAGIC "PONGRPL"
+#define REPLAY_VERSION 3
+
+#define REPLAY_KEYFRAME 1
+#define REPLAY_STEP 2
+#define REPLAY_RESYNC 3	// a keyframe that isn't indexed, written when late input rewrote the past
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t match_id;
+	uint32_t tick_rate;	// milliseconds per step
+	uint32_t max_clients;
+	uint64_t created;	// unix time
+	// bytes of complete records, published after each record so a live
+	// file can be read while it's being written
+	_Atomic uint64_t data_end;
+	_Atomic uint64_t num_keyframes;
+	uint8_t reserved[16];
+} ReplayFileHeader;
+
+typedef struct {
+	uint32_t type;
+	uint32_t length;	// including this header and padding to 8 bytes
+} ReplayRecordHeader;
+
+/**
+ * everything the simulation of one match depends on, as of the start of a tick
+ */
+typedef struct {
+	uint64_t tick;
+	uint64_t start_tick;
+	uint32_t rng_state;
+	uint8_t num_clients;
+	uint8_t game_active;
+	uint8_t left_score;
+	uint8_t right_score;
+	Position ball;
+	Position players[MAX_CLIENTS];
+} ReplayKeyframe;
+
+typedef struct {
+	uint64_t tick;
+	uint32_t num_inputs;
+	uint8_t num_clients;
+	uint8_t state_length;	// serialized GameStateMessage following the inputs
+	uint16_t reserved;
+	// followed by num_inputs ReplayInput, then the state
+} ReplayStep;
+
+typedef struct __attribute__((packed)) {
+	uint8_t slot;
+	Position position;
+} ReplayInput;
+
+typedef struct {
+	uint64_t tick;
+	uint64_t offset;	// of the keyframe record in the .replay file
+} ReplayIndexEntry;
+
+/**
+ * recorder for one match, owned by the worker hosting it
+ */
+typedef struct {
+	int fd;
+	int index_fd;
+	uint8_t* data;
+	size_t mapped;
+	uint8_t* index;
+	size_t index_mapped;
+
+	size_t used;		// bytes of complete records
+
+	// the step being recorded, copied into the file once it's complete
+	uint8_t* step;
+	size_t step_length;
+	size_t step_capacity;
+	uint32_t steps_since_keyframe;
+} ReplayWriter;
+
+ReplayWriter* replay_open(const char* dir, uint32_t match_id, uint32_t tick_rate);
+void replay_close(ReplayWriter* writer);
+
+void replay_keyframe(ReplayWriter* writer, const ReplayKeyframe* keyframe);
+void replay_resync(ReplayWriter* writer, const ReplayKeyframe* keyframe);
+int replay_keyframe_due(const ReplayWriter* writer);
+void replay_begin_step(ReplayWriter* writer, uint64_t tick, uint8_t num_clients);
+void replay_add_input(ReplayWriter* writer, uint8_t slot, const Position* position);
+void replay_end_step(ReplayWriter* writer, const GameStateMessage* state);
+
+#endif
@@ -2,6 +2,7 @@
  * server.c -- game server for terminal-based game
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,11 +15,31 @@
 #include <time.h>
 #include <unistd.h>
 #include <stdbool.h>
-#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <netinet/tcp.h>
+#include <linux/filter.h>
 
 #include "config.h"
 #include "protocol.h"
-#include "game.h"
+#include "match.h"
+#include "worker.h"
+#include "log.h"
+#include "metrics.h"
+#include "connection.h"
+#include "matchmaking.h"
+#include "handoff.h"
+#include "uring.h"
+
+// what each completion on the control thread's ring is for
+enum {
+	CONTROL_ACCEPT = 1,
+	CONTROL_EPOLL,
+};
 
 // get sockaddr in IPv4 or IPv6
 void *get_in_addr(struct sockaddr *sa)
@@ -29,57 +50,528 @@ void *get_in_addr(struct sockaddr *sa)
 	return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
-int main(void)
+/**
+ * control plane state: TCP connections and match placement.  The matches
+ * themselves live on the workers.
+ */
+typedef struct {
+	Matchmaker matchmaker;
+	Worker* workers;
+	int num_workers;
+	int epoll_fd;
+	int tcp_listener;
+	int metrics_listener;	// -1 when the stats endpoint is disabled
+	int handoff_listener;	// -1 when hot restarts are disabled
+	int handoff_fd;		// successor getting ready to take over, -1 if none
+	int handoff_timer_fd;	// fires if it isn't ready in time
+	int events_fd;	// signalled when a worker has events for us
+	ConnectionTable connections;
+	ConnectionTable scrapes;	// metrics requests being answered
+
+	// with io_uring, connections are accepted on the ring, and the ring
+	// watches the epoll instance for everything else
+	bool use_uring;
+	Uring uring;
+	bool accepting;	// multishot accept is armed
+	bool polling_epoll;	// multishot poll on epoll_fd is armed
+	bool epoll_pending;	// epoll has events to collect
+	uint32_t next_spectator_id;
+	ServerMetrics metrics;
+} Server;
+
+int set_nonblocking(int fd)
 {
-	printf("Starting the game server.\n");
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags == -1)
+		return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
 
-	// Seed the random number generator once
-	srand(time(NULL));
+// start serving a newly accepted TCP client
+void add_connection(Server* server, int newfd, const struct sockaddr_storage* remoteaddr)
+{
+	char remoteIP[INET6_ADDRSTRLEN];
 
-	// INIT PHYSICS ================================
-	Position ballPosition;
-	ballPosition.x = COLS / 2.0;
-	ballPosition.y = ROWS / 2.0;
+	// players say nothing over TCP once they're in a match, so have the
+	// kernel probe for peers that vanished without closing
+	int yes = 1, idle = TCP_KEEPALIVE_IDLE_S, interval = TCP_KEEPALIVE_INTERVAL_S, probes = TCP_KEEPALIVE_PROBES;
+	if (setsockopt(newfd, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes)) == -1
+			|| setsockopt(newfd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) == -1
+			|| setsockopt(newfd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval)) == -1
+			|| setsockopt(newfd, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes)) == -1)
+		perror("setsockopt");
+
+	// edge triggered, so EPOLLOUT only fires when a full send buffer
+	// drains and can stay registered for the life of the connection
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.fd = newfd };
+	if (set_nonblocking(newfd) == -1 || epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, newfd, &ev) == -1) {
+		perror("epoll_ctl");
+		close(newfd);
+		return;
+	}
+	if (connection_open(&server->connections, newfd) == NULL) {
+		LOG_ERROR("server: out of memory for connection on socket %d", newfd);
+		close(newfd);
+		return;
+	}
+	metrics_add(&server->metrics.tcp_connections, 1);
 
-	double speed = BALL_MIN_STARTING_VELO + ((double)rand() / RAND_MAX) * (BALL_MAX_STARTING_VELO - BALL_MIN_STARTING_VELO);
-	ballPosition.dx = (rand() % 2 == 0) ? speed : -speed;
-	speed = BALL_MIN_STARTING_VELO + ((double)rand() / RAND_MAX) * (BALL_MAX_STARTING_VELO - BALL_MIN_STARTING_VELO);
-	ballPosition.dy = (rand() % 2 == 0) ? speed : -speed;
+	LOG_INFO("server: new TCP connection from %s on socket %d",
+			inet_ntop(remoteaddr->ss_family,
+				get_in_addr((struct sockaddr*)remoteaddr),
+				remoteIP, INET6_ADDRSTRLEN),
+			newfd);
+}
 
+// accept every pending connection on the TCP listener
+void handle_new_connections(Server* server)
+{
+	struct sockaddr_storage remoteaddr;	//client address
+	socklen_t addrlen;
 
+	for (;;) {
+		addrlen = sizeof remoteaddr;
+		// accept connection to listener as new file descriptor
+		int newfd = accept(server->tcp_listener,
+				(struct sockaddr *)&remoteaddr,
+				&addrlen);
+
+		if (newfd == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("accept");
+			return;
+		}
+		add_connection(server, newfd, &remoteaddr);
+	}
+}
 
-	// TCP NETWORKING ============================
-	fd_set master;		// master file descriptor list
-	fd_set read_fds;	// temp file descriptor list for select()
-	int fdmax;		// largest file descriptor
+// a connection accepted by the ring; its address is looked up to log it
+void handle_accepted(Server* server, int newfd)
+{
+	struct sockaddr_storage remoteaddr;
+	socklen_t addrlen = sizeof remoteaddr;
+	if (getpeername(newfd, (struct sockaddr*)&remoteaddr, &addrlen) == -1) {
+		// already gone
+		close(newfd);
+		return;
+	}
+	add_connection(server, newfd, &remoteaddr);
+}
+
+// have the ring accept connections, each one completing with CONTROL_ACCEPT
+void arm_accept(Server* server)
+{
+	uring_prep_accept_multishot(uring_get_sqe(&server->uring), server->tcp_listener, CONTROL_ACCEPT);
+	server->accepting = true;
+}
 
-	Client clients[MAX_CLIENTS];
-	memset(clients, 0, sizeof(clients));
+// and complete with CONTROL_EPOLL whenever epoll has events
+void arm_epoll_poll(Server* server)
+{
+	uring_prep_poll_multishot(uring_get_sqe(&server->uring), server->epoll_fd, CONTROL_EPOLL);
+	server->polling_epoll = true;
+}
 
-	Position player_positions[MAX_CLIENTS];
-	memset(player_positions, 0, sizeof(player_positions));
+// handle everything the ring has completed
+void handle_control_completions(Server* server)
+{
+	struct io_uring_cqe* cqe;
+	while ((cqe = uring_peek_cqe(&server->uring)) != NULL) {
+		bool more = cqe->flags & IORING_CQE_F_MORE;
+		if (cqe->user_data == CONTROL_ACCEPT) {
+			if (cqe->res >= 0)
+				handle_accepted(server, cqe->res);
+			else if (cqe->res != -ECANCELED)
+				fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+			server->accepting = server->accepting && more;
+		} else if (cqe->user_data == CONTROL_EPOLL) {
+			server->epoll_pending = true;
+			server->polling_epoll = server->polling_epoll && more;
+		}
+		uring_cqe_seen(&server->uring);
+	}
+}
 
-	int tcp_listener, udp_listener;		// FD for the server listener
-	int newfd;		// newly accepted fd
-	struct sockaddr_storage remoteaddr;	//client address
-	socklen_t addrlen;
+/**
+ * Cancel the ring's accept and take in whatever it accepted first, so no
+ * connection is accepted after the connections have been handed off
+ */
+void stop_accepting(Server* server)
+{
+	if (!server->accepting)
+		return;
+	uring_prep_cancel(uring_get_sqe(&server->uring), CONTROL_ACCEPT);
+	while (server->accepting) {
+		if (uring_submit(&server->uring, 1) == -1)
+			exit(4);
+		handle_control_completions(server);
+	}
+}
 
-	char buf[260];		// buffer for client data, 260 = 4 bit opcode + 256 bit buffer
-	int nbytes;
+// tell the worker hosting the match a connection watches to stop sending it
+void stop_spectating(Server* server, Connection* connection)
+{
+	if (connection->spectator_id == 0)
+		return;
+	Worker* worker = &server->workers[connection->spectated_match % server->num_workers];
+	WorkerCommand command = { .type = WORKER_REMOVE_SPECTATOR, .match_id = connection->spectated_match, .spectator_id = connection->spectator_id };
+	// the viewer is dropped when the match ends anyway
+	if (worker_post(worker, &command) == -1)
+		LOG_ERROR("server: couldn't stop sending match %u to spectator %u", connection->spectated_match, connection->spectator_id);
+	connection->spectator_id = 0;
+}
 
-	char remoteIP[INET6_ADDRSTRLEN];
+// close a TCP client, taking it out of the matchmaking queue, its match or its match's audience
+void close_tcp_client(Server* server, Connection* connection)
+{
+	// a player leaving ends their match, and the worker tells us when it has
+	if (connection->player_id != 0) {
+		uint32_t match_id = match_id_for(connection->player_id);
+		WorkerCommand command = { .type = WORKER_REMOVE_CLIENT, .match_id = match_id, .slot = (connection->player_id - 1) % MAX_CLIENTS };
+		if (worker_post(&server->workers[match_id % server->num_workers], &command) == -1)
+			LOG_ERROR("server: couldn't end match %u, it ends when player %u's session times out", match_id, connection->player_id);
+	}
+	if (connection->waiting) {
+		matchmaker_cancel(&server->matchmaker, connection->ticket);
+		metrics_set(&server->metrics.matchmaking_waiting, server->matchmaker.waiting);
+		LOG_INFO("server: socket %d left the matchmaking queue", connection->fd);
+	}
+	stop_spectating(server, connection);
+	connection_close(&server->connections, connection);
+}
+
+// send what the socket will take of a connection's output, closing it if that fails
+int flush_tcp_client(Server* server, Connection* connection)
+{
+	ssize_t sent = connection_flush(connection);
+	if (sent == -1) {
+		perror("send");
+		close_tcp_client(server, connection);
+		return -1;
+	}
+	metrics_add(&server->metrics.tcp_sent_bytes, sent);
+	return 0;
+}
 
-	int yes=1;
-	int i, j, rv;
+// queue the response to a register or spectate request: the ids and the server config, written straight into the output buffer
+int queue_register_response(Connection* connection, uint32_t statuscode, uint32_t client_id, uint32_t match_id, uint32_t player_index)
+{
+	size_t header_size = WIRE_SIZE(TCP_FRAME_HEADER_SCHEMA);
+	uint8_t* frame = connection_reserve(connection, header_size + REGISTER_RESPONSE_SIZE);
+	if (frame == NULL)
+		return -1;
+
+	TcpFrameHeader header = { .length = 4 + REGISTER_RESPONSE_SIZE, .code = statuscode };
+	RegisterResponse response = {
+		.id = client_id,
+		.rows = ROWS,
+		.cols = COLS,
+		.player_move_speed = PLAYER_MOVE_SPEED,
+		.ball_radius = BALL_RADIUS,
+		.player_length = PLAYER_LENGTH,
+		.match_id = match_id,
+		.player_index = player_index,
+	};
+	size_t length = encode_tcp_frame_header(frame, &header);
+	length += encode_register_response_array(frame + length, &response, 1);
+	connection_commit(connection, length);
+	LOG_DEBUG("queued %zu byte response", length);
+	return 0;
+}
 
-	struct addrinfo hints, *ai, *p;
+/**
+ * Seat a pair of players in their match on its worker.  With -r, the
+ * recording is opened here and goes with the first seat, so creating and
+ * mapping its files doesn't hold up the worker's ticks.  If a seat can't
+ * be posted, the match is taken down again: by the worker if it has
+ * seated anyone, which releases the id once it has, else right here.
+ */
+int seat_pairing(Server* server, const MatchPairing* pairing)
+{
+	Worker* worker = &server->workers[pairing->match_id % server->num_workers];
+	const MatchTable* table = &worker->match_table;
+	ReplayWriter* replay = NULL;
+	if (table->replay_dir != NULL)
+		replay = replay_open(table->replay_dir, pairing->match_id, table->step_ticks * TICK_RATE);
+
+	int seated = 0;
+	while (seated < MAX_CLIENTS) {
+		WorkerCommand command = { .type = WORKER_ADD_CLIENT, .match_id = pairing->match_id, .slot = seated, .tcp_fd = pairing->fds[seated],
+			.replay = seated == 0 ? replay : NULL };
+		if (worker_post(worker, &command) == -1)
+			break;
+		seated++;
+	}
+	if (seated == 0)
+		replay_close(replay);
+	if (seated == MAX_CLIENTS)
+		return 0;
+
+	LOG_ERROR("server: couldn't seat the players of match %u on worker %d", pairing->match_id, worker->index);
+	WorkerCommand command = { .type = WORKER_REMOVE_CLIENT, .match_id = pairing->match_id, .slot = 0 };
+	if (seated == 0)
+		match_registry_release(server->matchmaker.registry, pairing->match_id);
+	else if (worker_post(worker, &command) == -1)
+		LOG_ERROR("server: match %u ends when its sessions time out", pairing->match_id);
+	return -1;
+}
+
+/**
+ * Start a match for every pair of waiting players, while there are matches
+ * free, and answer their registrations.  Returns -1 if current, the
+ * connection being read, couldn't take its response.
+ */
+int start_matches(Server* server, Connection* current)
+{
+	int rv = 0;
+	MatchPairing pairing;
+	while (matchmaker_pair(&server->matchmaker, &pairing)) {
+		Worker* worker = &server->workers[pairing.match_id % server->num_workers];
+		bool seated = seat_pairing(server, &pairing) == 0;
+		if (seated)
+			metrics_add(&server->metrics.matches_started, 1);
+
+		for (int slot = 0; slot < MAX_CLIENTS; slot++) {
+			// closing a connection cancels its ticket, so every fd paired is still open
+			Connection* connection = connection_get(&server->connections, pairing.fds[slot]);
+			connection->waiting = false;
+
+			uint32_t client_id = 0, status = TCP_STATUS_UNAVAILABLE;
+			if (seated) {
+				client_id = player_id_for(pairing.match_id, slot);
+				status = TCP_STATUS_OK;
+				connection->player_id = client_id;
+				metrics_add(&server->metrics.registrations, 1);
+				LOG_INFO("Registered client in match %u on worker %d (player_id %u)", pairing.match_id, worker->index, client_id);
+			}
+
+			if (queue_register_response(connection, status, client_id, pairing.match_id, seated ? slot + 1 : 0) == -1) {
+				LOG_WARN("server: socket %d isn't reading its responses", connection->fd);
+				if (connection == current) {
+					rv = -1;
+				} else {
+					metrics_add(&server->metrics.tcp_dropped_connections, 1);
+					close_tcp_client(server, connection);
+				}
+			} else if (connection != current) {
+				// the current connection is flushed once all of its requests are handled
+				flush_tcp_client(server, connection);
+			}
+		}
+	}
+	metrics_set(&server->metrics.matchmaking_waiting, server->matchmaker.waiting);
+	return rv;
+}
 
-	FD_ZERO(&master);	// clear the master and temp sets
-	FD_ZERO(&read_fds);
+/**
+ * A worker has ended a match: its id can be given out again, and its
+ * players can register for another.  Their fds are checked against the
+ * seat, since one that hung up may have been reused by a new connection.
+ */
+void finish_match(Server* server, const WorkerEvent* event)
+{
+	match_registry_release(server->matchmaker.registry, event->match_id);
+	metrics_add(&server->metrics.matches_ended, 1);
+	for (int slot = 0; slot < MAX_CLIENTS; slot++) {
+		Connection* connection = event->tcp_fds[slot] >= 0 ? connection_get(&server->connections, event->tcp_fds[slot]) : NULL;
+		if (connection != NULL && connection->player_id == player_id_for(event->match_id, slot))
+			connection->player_id = 0;
+	}
+	LOG_INFO("Match %u ended", event->match_id);
+}
+
+// a worker couldn't add a spectator, so the connection isn't watching anything after all
+void spectate_failed(Server* server, const WorkerEvent* event)
+{
+	Connection* connection = connection_get(&server->connections, event->spectator_fd);
+	if (connection == NULL || connection->spectator_id != event->spectator_id)
+		return;
+	LOG_INFO("server: match %u ended before spectator %u could watch it", event->match_id, event->spectator_id);
+	connection->spectator_id = 0;
+	connection->spectated_match = 0;
+}
+
+// collect what the workers have to tell us
+void handle_worker_events(Server* server)
+{
+	uint64_t pending;
+	if (read(server->events_fd, &pending, sizeof(pending)) == -1 && errno != EAGAIN)
+		perror("read");
+
+	bool ended = false;
+	for (int w = 0; w < server->num_workers; w++) {
+		size_t count;
+		WorkerEvent* events = worker_events(&server->workers[w], &count);
+		for (size_t i = 0; i < count; i++) {
+			if (events[i].type == WORKER_MATCH_ENDED) {
+				finish_match(server, &events[i]);
+				ended = true;
+			} else if (events[i].type == WORKER_SPECTATE_FAILED) {
+				spectate_failed(server, &events[i]);
+			}
+		}
+		free(events);
+	}
+	// freed ids may be what waiting players were short of
+	if (ended)
+		start_matches(server, NULL);
+}
+
+/**
+ * Register request: queue the player for a match.  The response is sent
+ * once they're paired with an opponent, unless the queue is full or they
+ * are already waiting or playing.  A spectator stops watching to play.
+ */
+int handle_register(Server* server, Connection* connection)
+{
+	if (connection->player_id != 0) {
+		LOG_DEBUG("server: socket %d is already playing as %u", connection->fd, connection->player_id);
+		return queue_register_response(connection, TCP_STATUS_ALREADY_PLAYING, 0, 0, 0);
+	}
+	if (connection->waiting) {
+		LOG_DEBUG("server: socket %d is already waiting for a match", connection->fd);
+		return queue_register_response(connection, TCP_STATUS_ALREADY_WAITING, 0, 0, 0);
+	}
+
+	if (matchmaker_enqueue(&server->matchmaker, connection->fd, &connection->ticket) == -1) {
+		metrics_add(&server->metrics.registrations_rejected, 1);
+		LOG_WARN("Matchmaking queue is full");
+		return queue_register_response(connection, TCP_STATUS_QUEUE_FULL, 0, 0, 0);
+	}
+	connection->waiting = true;
+	stop_spectating(server, connection);
+	LOG_DEBUG("server: socket %d waiting for an opponent", connection->fd);
+	return start_matches(server, connection);
+}
+
+/**
+ * Spectate request: add the connection to the audience of a match in
+ * play, on the worker that hosts it.  The response carries the spectator
+ * id, which the client sends over UDP so the worker learns its address,
+ * and player index 0.  Watching another match replaces the first.
+ */
+int handle_spectate(Server* server, Connection* connection, const struct TcpMessage* request)
+{
+	SpectateRequest body;
+	if (decode_spectate_request((const uint8_t*)request->msg, request->length, &body) == -1)
+		return queue_register_response(connection, TCP_STATUS_NO_SUCH_MATCH, 0, 0, 0);
+	uint32_t match_id = body.match_id;
+
+	if (!match_registry_in_use(server->matchmaker.registry, match_id)) {
+		LOG_DEBUG("server: socket %d asked to watch unknown match %u", connection->fd, match_id);
+		return queue_register_response(connection, TCP_STATUS_NO_SUCH_MATCH, 0, match_id, 0);
+	}
+
+	stop_spectating(server, connection);
+	if (++server->next_spectator_id == 0)
+		server->next_spectator_id = 1;
+	connection->spectator_id = server->next_spectator_id;
+	connection->spectated_match = match_id;
+
+	Worker* worker = &server->workers[match_id % server->num_workers];
+	WorkerCommand command = { .type = WORKER_ADD_SPECTATOR, .match_id = match_id, .tcp_fd = connection->fd, .spectator_id = connection->spectator_id };
+	if (worker_post(worker, &command) == -1) {
+		LOG_ERROR("server: couldn't add spectator %u to match %u on worker %d", connection->spectator_id, match_id, worker->index);
+		connection->spectator_id = 0;
+		connection->spectated_match = 0;
+		return queue_register_response(connection, TCP_STATUS_UNAVAILABLE, 0, match_id, 0);
+	}
+	metrics_add(&server->metrics.spectates, 1);
+	LOG_INFO("Spectator %u watching match %u on worker %d", connection->spectator_id, match_id, worker->index);
+	return queue_register_response(connection, TCP_STATUS_OK, connection->spectator_id, match_id, 0);
+}
+
+// run every complete request at the start of the read buffer, returning -1 if the stream is broken
+int handle_tcp_requests(Server* server, Connection* connection)
+{
+	size_t consumed = 0;
+	for (;;) {
+		int length = tcp_frame_length(connection->in + consumed, connection->in_length - consumed);
+		if (length == 0)
+			break;
+
+		struct TcpMessage tcpMessage;
+		if (length == -1 || deserialize_tcp_message(connection->in + consumed, length, &tcpMessage) == -1) {
+			LOG_WARN("server: malformed frame on socket %d", connection->fd);
+			return -1;
+		}
+		consumed += length;
+		metrics_add(&server->metrics.tcp_requests, 1);
+
+		int rv = 0;
+		if (tcpMessage.opcode == TCP_REGISTER)
+			rv = handle_register(server, connection);
+		else if (tcpMessage.opcode == TCP_SPECTATE)
+			rv = handle_spectate(server, connection, &tcpMessage);
+		if (rv == -1) {
+			LOG_WARN("server: socket %d isn't reading its responses", connection->fd);
+			return -1;
+		}
+	}
+
+	// keep the start of any partial frame for the next read
+	memmove(connection->in, connection->in + consumed, connection->in_length - consumed);
+	connection->in_length -= consumed;
+	return 0;
+}
+
+/**
+ * Read from a TCP client until its socket would block, answering each
+ * complete request, then write the responses out in as few sends as the
+ * socket allows.  Whatever doesn't fit is sent when the socket reports
+ * it's writable again.
+ */
+void handle_tcp_client(Server* server, int fd, uint32_t events)
+{
+	Connection* connection = connection_get(&server->connections, fd);
+	if (connection == NULL)
+		return;
+
+	if (events & EPOLLIN) {
+		for (;;) {
+			ssize_t nbytes = recv(fd, connection->in + connection->in_length,
+					sizeof(connection->in) - connection->in_length, 0);
+			if (nbytes < 0 && errno == EINTR)
+				continue;
+			if (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				break;
+
+			if (nbytes <= 0) {
+				// got error or connection closed by client
+				if (nbytes == 0) {
+					LOG_INFO("server: socket %d hung up", fd);
+				} else {
+					perror("recv");
+				}
+				// best effort at answering whatever arrived before the hangup
+				if (flush_tcp_client(server, connection) == 0)
+					close_tcp_client(server, connection);
+				return;
+			}
+
+			metrics_add(&server->metrics.tcp_received_bytes, nbytes);
+			connection->in_length += nbytes;
+			if (handle_tcp_requests(server, connection) == -1) {
+				metrics_add(&server->metrics.tcp_dropped_connections, 1);
+				close_tcp_client(server, connection);
+				return;
+			}
+		}
+	}
+
+	flush_tcp_client(server, connection);
+}
+
+
+// bind the TCP listener to PORT, returning -1 if no address works
+int bind_tcp_listener(void)
+{
+	struct addrinfo hints, *ai, *p;
+	int yes = 1;
+	int rv, fd = -1;
 
 	// get a socket and bind it
 	// the server will listen on this socket for connections and data
-	printf("Initializing TCP networking.\n");
 	memset(&hints, 0, sizeof hints);
 	hints.ai_family = AF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
@@ -88,27 +580,36 @@ int main(void)
 	// get socket address info for the listener, store in ai
 	if ((rv = getaddrinfo(NULL, PORT, &hints, &ai)) != 0) {
 		fprintf(stderr, "server: %s\n", gai_strerror(rv));
-		exit(1);
+		return -1;
 	}
 
 	// get socket for TCP listener
 	for (p = ai; p != NULL; p = p->ai_next) {
-		tcp_listener = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-		if (tcp_listener < 0) {
+		fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+		if (fd < 0) {
 			continue;
 		}
 
-		setsockopt(tcp_listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
 
-		if (bind(tcp_listener, p->ai_addr, p->ai_addrlen) < 0) {
-			close(tcp_listener);
+		if (bind(fd, p->ai_addr, p->ai_addrlen) < 0) {
+			close(fd);
+			fd = -1;
 			continue;
 		}
 		break;
 	}
+	freeaddrinfo(ai);
+	return fd;
+}
+
+// bind a UDP socket to PORT as a member of the SO_REUSEPORT group
+int bind_udp_socket(void)
+{
+	struct addrinfo hints, *ai, *p;
+	int yes = 1;
+	int rv, fd = -1;
 
-	// UDP NETWORKING ===============================
-	printf("Initializing UDP networking.\n");
 	memset(&hints, 0, sizeof hints);
 	hints.ai_family = AF_UNSPEC;
 	hints.ai_socktype = SOCK_DGRAM;
@@ -117,233 +618,888 @@ int main(void)
 	// get socket address info for udp listener
 	if ((rv = getaddrinfo(NULL, PORT, &hints, &ai)) != 0) {
 		fprintf(stderr, "server: %s\n", gai_strerror(rv));
-		exit(1);
+		return -1;
 	}
 
 	// get socket for UDP listener
 	for (p = ai; p != NULL; p = p->ai_next) {
-		udp_listener = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-		if (udp_listener < 0) {
+		fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+		if (fd < 0) {
 			continue;
 		}
 
-		setsockopt(udp_listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
-		setsockopt(udp_listener, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int));
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+		setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int));
 
-		if (bind(udp_listener, p->ai_addr, p->ai_addrlen) < 0) {
-			close(udp_listener);
+		if (bind(fd, p->ai_addr, p->ai_addrlen) < 0) {
+			close(fd);
+			fd = -1;
 			continue;
 		}
 		break;
 	}
+	freeaddrinfo(ai);
 
-	// if we got here then we didn't get bound
-	if (p == NULL) {
-		fprintf(stderr, "selectserver: failed to bind\n");
-		exit(2);
+	if (fd != -1 && set_nonblocking(fd) == -1) {
+		close(fd);
+		return -1;
 	}
+	return fd;
+}
 
-	freeaddrinfo(ai);
+/**
+ * Attach a classic BPF program to the SO_REUSEPORT group that picks the
+ * socket from the player id in the first four bytes of every datagram.
+ * Sockets are indexed in bind order, so socket w belongs to worker w, and
+ * match ids are striped so worker = match_id % num_workers.
+ */
+int attach_reuseport_steering(int udp_fd, int num_workers)
+{
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 0),			// A = player id
+		BPF_STMT(BPF_ALU | BPF_SUB | BPF_K, 1),
+		BPF_STMT(BPF_ALU | BPF_DIV | BPF_K, MAX_CLIENTS),	// A = match id
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, num_workers),	// A = owning worker
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	struct sock_fprog prog = { .len = sizeof(code) / sizeof(code[0]), .filter = code };
+
+	if (setsockopt(udp_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1) {
+		perror("setsockopt(SO_ATTACH_REUSEPORT_CBPF)");
+		return -1;
+	}
+	return 0;
+}
 
+// listen on a local Unix socket, for stats scrapes or handoffs, replacing any stale socket file
+int bind_unix_socket(const char* path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "server: socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
 
-	// listen on TCP listener socket
-	printf("Staring TCP listener.\n");
-	if (listen(tcp_listener, 10) == -1) {
-		perror("listen");
-		exit(3);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		perror("socket");
+		return -1;
+	}
+	unlink(path);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(fd, 16) == -1 || set_nonblocking(fd) == -1) {
+		perror(path);
+		close(fd);
+		return -1;
 	}
+	return fd;
+}
 
-	// add listener to master set
-	FD_SET(tcp_listener, &master);
-	FD_SET(udp_listener, &master);
+/**
+ * Answer a scrape with the Prometheus text format, wrapped in a minimal
+ * HTTP/1.0 response so it works with e.g. curl --unix-socket.  The
+ * rendered response becomes the connection's output buffer as it is,
+ * since it can be bigger than TCP_MAX_PENDING_OUTPUT.
+ */
+int queue_metrics_response(Server* server, Connection* scrape)
+{
+	metrics_add(&server->metrics.metrics_scrapes, 1);
+	MetricsBuffer body = {0};
+	metrics_render(&body, &server->metrics, server->workers, server->num_workers);
+
+	MetricsBuffer response = {0};
+	metrics_printf(&response, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", body.length);
+	metrics_printf(&response, "%.*s", (int)body.length, body.data ? body.data : "");
+	metrics_buffer_free(&body);
+	if (response.data == NULL)
+		return -1;
+
+	scrape->out = (uint8_t*)response.data;
+	scrape->out_start = 0;
+	scrape->out_end = response.length;
+	scrape->out_capacity = response.capacity;
+	return 0;
+}
 
-	fdmax = (tcp_listener > udp_listener ? tcp_listener : udp_listener) + 1;
+/**
+ * Read a scrape's request until its blank line, then answer it and write
+ * the response as the socket takes it, closing once it's all sent.  The
+ * request itself doesn't matter, every path gets the metrics.
+ */
+void handle_scrape(Server* server, int fd, uint32_t events)
+{
+	Connection* scrape = connection_get(&server->scrapes, fd);
+	if (scrape == NULL)
+		return;
+
+	// out is only allocated once the request is answered
+	while ((events & EPOLLIN) && scrape->out == NULL) {
+		ssize_t nbytes = recv(fd, scrape->in + scrape->in_length, sizeof(scrape->in) - 1 - scrape->in_length, 0);
+		if (nbytes < 0 && errno == EINTR)
+			continue;
+		if (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (nbytes <= 0) {
+			connection_close(&server->scrapes, scrape);
+			return;
+		}
+		scrape->in_length += nbytes;
+		scrape->in[scrape->in_length] = '\0';
+		// a request that fills the buffer is answered as it is
+		bool complete = strstr((const char*)scrape->in, "\r\n\r\n") != NULL || strstr((const char*)scrape->in, "\n\n") != NULL;
+		if ((complete || scrape->in_length == sizeof(scrape->in) - 1) && queue_metrics_response(server, scrape) == -1) {
+			connection_close(&server->scrapes, scrape);
+			return;
+		}
+	}
 
-	printf("listening for connections...\n");
+	if (scrape->out == NULL)
+		return;
+	if (connection_flush(scrape) == -1 || !connection_pending(scrape))
+		connection_close(&server->scrapes, scrape);
+}
 
+// accept every pending scrape on the metrics listener
+void handle_metrics_connections(Server* server)
+{
+	for (;;) {
+		int fd = accept4(server->metrics_listener, NULL, NULL, SOCK_NONBLOCK);
+		if (fd == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("accept");
+			return;
+		}
+		if (server->scrapes.count >= METRICS_MAX_SCRAPES) {
+			LOG_WARN("server: %d scrapes already in progress, turning one away", METRICS_MAX_SCRAPES);
+			close(fd);
+			continue;
+		}
 
-	// TICK CONFIGURATION =================================
-	// configure server tick
-	timer_t timer_id;
-	struct sigevent sev = {0};
-	struct itimerspec its;
+		struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.fd = fd };
+		if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			perror("epoll_ctl");
+			close(fd);
+			continue;
+		}
+		if (connection_open(&server->scrapes, fd) == NULL) {
+			LOG_ERROR("server: out of memory for scrape on socket %d", fd);
+			close(fd);
+		}
+	}
+}
 
-	TickState tick_state = { .ball_position = &ballPosition, .player_positions = player_positions, .udp_sock_fd = udp_listener, .tcp_sock_fd = tcp_listener, .clients = clients, .game_active = false, .left_score = 0, .right_score = 0};
-	clock_gettime(CLOCK_MONOTONIC, &tick_state.latest_tick);
+// append a connection's record and buffered bytes to the handoff state
+int export_connection(const Connection* connection, HandoffBuffer* state)
+{
+	ConnectionRecord record = {
+		.fd = connection->fd,
+		.waiting = connection->waiting,
+		.ticket = connection->ticket,
+		.player_id = connection->player_id,
+		.spectator_id = connection->spectator_id,
+		.spectated_match = connection->spectated_match,
+		.in_length = connection->in_length,
+		.out_length = connection->out_end - connection->out_start,
+	};
+	if (HANDOFF_PUT(state, connection_record, CONNECTION_RECORD_SCHEMA, &record) == -1)
+		return -1;
+	uint8_t* in = handoff_append(state, record.in_length);
+	uint8_t* out = handoff_append(state, record.out_length);
+	if ((record.in_length > 0 && in == NULL) || (record.out_length > 0 && out == NULL))
+		return -1;
+	// in was reserved first, so a realloc for out may have moved it
+	memcpy(state->data + state->length - record.out_length - record.in_length, connection->in, record.in_length);
+	if (record.out_length > 0)
+		memcpy(state->data + state->length - record.out_length, connection->out + connection->out_start, record.out_length);
+	return 0;
+}
 
-	sev.sigev_notify = SIGEV_THREAD;
-	sev.sigev_notify_function = tick;
-	sev.sigev_value.sival_ptr = &tick_state;
+// forget a successor that failed or took too long, and carry on serving
+void abandon_handoff(Server* server)
+{
+	struct itimerspec disarm = { 0 };
+	timerfd_settime(server->handoff_timer_fd, 0, &disarm, NULL);
+	epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, server->handoff_fd, NULL);
+	close(server->handoff_fd);
+	server->handoff_fd = -1;
+}
 
-	if (timer_create(CLOCK_MONOTONIC, &sev, &timer_id) == -1) {
-		perror("timer_create");
-		exit(1);
+/**
+ * First half of handing over to a new server process that connected to
+ * the handoff socket: send it the listeners, then carry on serving while
+ * it sets up its workers.  Its HANDOFF_READY comes through the event loop
+ * to complete_handoff(), or the timer gives up on it.
+ */
+void offer_handoff(Server* server, int sock)
+{
+	LOG_INFO("server: handing off to a new process");
+	HandoffListeners listeners = {
+		.num_workers = server->num_workers,
+		.matches_per_worker = server->workers[0].match_table.capacity,
+		.has_metrics_listener = server->metrics_listener != -1,
+		.num_connections = server->connections.count,
+	};
+	int* listener_fds = malloc(handoff_num_listeners(&listeners) * sizeof(int));
+	if (listener_fds == NULL)
+		return;
+	size_t num_listeners = 0;
+	listener_fds[num_listeners++] = server->tcp_listener;
+	if (server->metrics_listener != -1)
+		listener_fds[num_listeners++] = server->metrics_listener;
+	for (int w = 0; w < server->num_workers; w++)
+		listener_fds[num_listeners++] = server->workers[w].udp_fd;
+	int rv = handoff_send_listeners(sock, &listeners, listener_fds);
+	free(listener_fds);
+
+	struct epoll_event ev = { .events = EPOLLIN, .data.fd = sock };
+	struct itimerspec deadline = { .it_value = { .tv_sec = HANDOFF_TIMEOUT_MS / 1000, .tv_nsec = HANDOFF_TIMEOUT_MS % 1000 * 1000000l } };
+	if (rv == -1 || epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, sock, &ev) == -1) {
+		LOG_ERROR("server: couldn't send the new process the listeners, carrying on");
+		close(sock);
+		return;
+	}
+	server->handoff_fd = sock;
+	timerfd_settime(server->handoff_timer_fd, 0, &deadline, NULL);
+}
+
+/**
+ * The new process is ready: stop the workers and send it the connections
+ * and matches, so play pauses for as little as possible.  Exits once it
+ * confirms it's serving.  If anything fails before then, the workers
+ * start again and this process carries on as if nothing happened.
+ */
+void complete_handoff(Server* server)
+{
+	int sock = server->handoff_fd;
+	if (handoff_wait(sock, HANDOFF_READY) == -1) {
+		LOG_ERROR("server: the new process didn't get ready, carrying on");
+		abandon_handoff(server);
+		return;
+	}
+	struct itimerspec disarm = { 0 };
+	timerfd_settime(server->handoff_timer_fd, 0, &disarm, NULL);
+
+	// the ring accepts on its own, so stop it before taking stock of the connections
+	if (server->use_uring)
+		stop_accepting(server);
+	for (int w = 0; w < server->num_workers; w++) {
+		if (worker_stop(&server->workers[w]) == -1)
+			exit(3);
+	}
+	// matches that ended on the way free their players' connections first
+	handle_worker_events(server);
+	struct timespec stopped;
+	clock_gettime(CLOCK_MONOTONIC, &stopped);
+
+	HandoffHeader header = {
+		.num_connections = server->connections.count,
+		.next_spectator_id = server->next_spectator_id,
+		.stopped_ns = (uint64_t)stopped.tv_sec * 1000000000ull + stopped.tv_nsec,
+	};
+	HandoffBuffer state = {0};
+	size_t num_fds = 0;
+	int* fds = malloc((header.num_connections + 1) * sizeof(int));
+	int rv = fds == NULL ? -1 : 0;
+	for (size_t fd = 0; fd < server->connections.capacity && rv == 0; fd++) {
+		Connection* connection = server->connections.by_fd[fd];
+		if (connection == NULL)
+			continue;
+		fds[num_fds++] = connection->fd;
+		rv = export_connection(connection, &state);
+	}
+	for (int w = 0; w < server->num_workers && rv == 0; w++)
+		rv = worker_export(&server->workers[w], &state);
+
+	header.state_length = state.length;
+	if (rv == 0)
+		rv = handoff_send_state(sock, &header, fds, &state);
+	if (rv == 0)
+		rv = handoff_wait(sock, HANDOFF_ACK);
+	free(fds);
+	handoff_buffer_free(&state);
+
+	if (rv == -1) {
+		LOG_ERROR("server: handoff failed, resuming");
+		for (int w = 0; w < server->num_workers; w++) {
+			if (worker_start(&server->workers[w]) == -1)
+				exit(3);
+		}
+		abandon_handoff(server);
+		return;
 	}
 
-	its.it_value.tv_sec = 0;
-	its.it_value.tv_nsec = TICK_RATE * 1000000;
-	its.it_interval = its.it_value;
+	LOG_INFO("server: the new process has taken over, exiting");
+	// finish the recordings; the new process continues them in new files
+	for (int w = 0; w < server->num_workers; w++)
+		match_table_free(&server->workers[w].match_table);
+	exit(0);
+}
 
-	if (timer_settime(timer_id, 0, &its, NULL) == -1) {
-		perror("timer_settime");
-		exit(1);
+/**
+ * A new process asking to take over, one at a time.  Its socket stays
+ * blocking with a timeout: the exchanges on it are short except for the
+ * state transfer, during which everything is stopped for it anyway.
+ */
+void handle_handoff_connections(Server* server)
+{
+	for (;;) {
+		int fd = accept(server->handoff_listener, NULL, NULL);
+		if (fd == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("accept");
+			return;
+		}
+		if (server->handoff_fd != -1) {
+			LOG_WARN("server: already handing off, refusing another successor");
+			close(fd);
+			continue;
+		}
+		struct timeval timeout = { .tv_sec = HANDOFF_TIMEOUT_MS / 1000, .tv_usec = HANDOFF_TIMEOUT_MS % 1000 * 1000 };
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		offer_handoff(server, fd);
 	}
+}
 
-	printf("Timer has started.\n");
+// the successor took too long to get ready
+void handle_handoff_timeout(Server* server)
+{
+	uint64_t expirations;
+	if (read(server->handoff_timer_fd, &expirations, sizeof(expirations)) <= 0 || server->handoff_fd == -1)
+		return;
+	LOG_ERROR("server: the new process wasn't ready within %d ms, carrying on", HANDOFF_TIMEOUT_MS);
+	abandon_handoff(server);
+}
 
-	// MAIN LOOP ======================================
+/**
+ * Connect to the handoff socket of the server being replaced and receive
+ * its listeners.  Returns the connection, to receive the rest of the
+ * handoff on, or -1.
+ */
+int connect_handoff(const char* path, HandoffListeners* listeners, int** fds)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "server: socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock == -1) {
+		perror("socket");
+		return -1;
+	}
+	if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+		perror(path);
+		close(sock);
+		return -1;
+	}
+	if (handoff_receive_listeners(sock, listeners, fds) == -1) {
+		fprintf(stderr, "server: handoff from %s failed\n", path);
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+static int compare_tickets(const void* a, const void* b)
+{
+	uint64_t left = (*(Connection* const*)a)->ticket;
+	uint64_t right = (*(Connection* const*)b)->ticket;
+	return left < right ? -1 : left > right;
+}
+
+// take over one connection of the previous process as fd, returning NULL if its record is malformed
+Connection* import_connection(Server* server, HandoffBuffer* state, int fd, int** fd_map, size_t* fd_map_size)
+{
+	ConnectionRecord record;
+	if (HANDOFF_GET(state, connection_record, CONNECTION_RECORD_SCHEMA, &record) == -1)
+		return NULL;
+	const uint8_t* in = handoff_take(state, record.in_length);
+	const uint8_t* out = handoff_take(state, record.out_length);
+	if ((record.in_length > 0 && in == NULL) || (record.out_length > 0 && out == NULL) || record.in_length > TCP_READ_BUFFER_SIZE)
+		return NULL;
+
+	if (record.fd >= *fd_map_size) {
+		size_t size = (size_t)record.fd * 2 + 1;
+		int* map = realloc(*fd_map, size * sizeof(int));
+		if (map == NULL)
+			return NULL;
+		for (size_t i = *fd_map_size; i < size; i++)
+			map[i] = -1;
+		*fd_map = map;
+		*fd_map_size = size;
+	}
+	(*fd_map)[record.fd] = fd;
+
+	Connection* connection = connection_open(&server->connections, fd);
+	if (connection == NULL)
+		return NULL;
+	memcpy(connection->in, in, record.in_length);
+	connection->in_length = record.in_length;
+	if (record.out_length > 0) {
+		uint8_t* pending = connection_reserve(connection, record.out_length);
+		if (pending == NULL)
+			return NULL;
+		memcpy(pending, out, record.out_length);
+		connection_commit(connection, record.out_length);
+	}
+	connection->waiting = record.waiting;
+	connection->ticket = record.ticket;
+	connection->player_id = record.player_id;
+	connection->spectator_id = record.spectator_id;
+	connection->spectated_match = record.spectated_match;
+
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.fd = fd };
+	if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		perror("epoll_ctl");
+		return NULL;
+	}
+	return connection;
+}
+
+/**
+ * Take over the connections of the previous process, fds[i] for the i-th
+ * record.  fd_map is filled in with each connection's new fd, indexed by
+ * its old one, which the matches refer to them by.  Players who were
+ * waiting for an opponent are queued again in their original order.
+ */
+int import_connections(Server* server, HandoffBuffer* state, uint32_t count, const int* fds, int** fd_map, size_t* fd_map_size)
+{
+	Connection** waiting = calloc(count + 1, sizeof(Connection*));
+	if (waiting == NULL)
+		return -1;
+	size_t num_waiting = 0;
+
+	int rv = 0;
+	for (uint32_t i = 0; i < count && rv == 0; i++) {
+		Connection* connection = import_connection(server, state, fds[i], fd_map, fd_map_size);
+		if (connection == NULL)
+			rv = -1;
+		else if (connection->waiting)
+			waiting[num_waiting++] = connection;
+	}
+
+	qsort(waiting, num_waiting, sizeof(Connection*), compare_tickets);
+	for (size_t i = 0; i < num_waiting && rv == 0; i++)
+		rv = matchmaker_enqueue(&server->matchmaker, waiting[i]->fd, &waiting[i]->ticket);
+	free(waiting);
+	return rv;
+}
+
+// act on what epoll reported ready
+void handle_events(Server* server, const struct epoll_event* events, int nready)
+{
+	for (int n = 0; n < nready; n++) {
+		int fd = events[n].data.fd;
+		if (fd == server->tcp_listener) {
+			handle_new_connections(server);
+		} else if (fd == server->metrics_listener) {
+			handle_metrics_connections(server);
+		} else if (fd == server->handoff_listener) {
+			handle_handoff_connections(server);
+		} else if (fd == server->handoff_fd) {
+			complete_handoff(server);
+		} else if (fd == server->handoff_timer_fd) {
+			handle_handoff_timeout(server);
+		} else if (fd == server->events_fd) {
+			handle_worker_events(server);
+		} else if (connection_get(&server->scrapes, fd) != NULL) {
+			handle_scrape(server, fd, events[n].events);
+		} else {
+			handle_tcp_client(server, fd, events[n].events);
+		}
+	}
+}
+
+void run_epoll(Server* server)
+{
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	for (;;) {
+		// wait for ready file descriptors; only those are returned, so the cost
+		// of a wakeup scales with activity rather than the highest fd number
+		int nready = epoll_wait(server->epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+		if (nready == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			exit(4);
+		}
+		handle_events(server, events, nready);
+	}
+}
+
+/**
+ * The control loop on io_uring: new connections arrive as completions of
+ * a multishot accept, and the connections themselves stay on epoll, whose
+ * readiness the ring reports with a multishot poll.  Both are rearmed if
+ * the kernel ends them.
+ */
+void run_uring(Server* server)
+{
+	struct epoll_event events[MAX_EPOLL_EVENTS];
 	for (;;) {
-		read_fds = master;
-		// check file descriptors in teh read_fds set and determine if any are ready for reading, writing, or have raised an exception
-		// select modifies read_fds, only keeping fds that are ready for reading or writing in the set
-		if (select(fdmax + 1, &read_fds, NULL, NULL, NULL) == -1) {
-			perror("select");
+		if (!server->accepting)
+			arm_accept(server);
+		if (!server->polling_epoll)
+			arm_epoll_poll(server);
+		if (uring_submit(&server->uring, 1) == -1)
 			exit(4);
+		handle_control_completions(server);
+
+		while (server->epoll_pending) {
+			int nready = epoll_wait(server->epoll_fd, events, MAX_EPOLL_EVENTS, 0);
+			if (nready == -1) {
+				if (errno == EINTR)
+					continue;
+				perror("epoll_wait");
+				exit(4);
+			}
+			// a full batch may have left more behind
+			server->epoll_pending = nready == MAX_EPOLL_EVENTS;
+			handle_events(server, events, nready);
+		}
+	}
+}
+
+void usage(const char* prog)
+{
+	fprintf(stderr, "usage: %s [-b udp_batch_size] [-w workers] [-l debug|info|warn|error|off] [-m metrics_socket] [-r replay_dir] [-f]"
+			" [-s spectator_interval_ticks] [-d spectator_delay_ms] [-H listen_handoff_socket] [-t takeover_from_socket] [-i epoll|io_uring]"
+			" [-T step_ms]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int udp_batch_size = UDP_BATCH_SIZE;
+	int num_workers = NUM_WORKERS;
+	int level = LOG_LEVEL_INFO;
+	const char* metrics_path = METRICS_SOCKET_PATH;
+	const char* replay_dir = NULL;
+	bool full_rate_snapshots = false;
+	unsigned int spectator_interval = SPECTATOR_INTERVAL_TICKS;
+	unsigned int spectator_delay_ms = 0;
+	const char* handoff_path = HANDOFF_SOCKET_PATH;
+	const char* takeover_path = NULL;
+	bool use_uring = false;
+	unsigned int step_ms = TICK_RATE;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "b:w:l:m:r:fs:d:H:t:i:T:")) != -1) {
+		switch (opt) {
+		case 'w':
+			// 0 asks for the default, one per core
+			num_workers = atoi(optarg);
+			if (num_workers < 0) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'b':
+			udp_batch_size = strtoul(optarg, NULL, 10);
+			if (udp_batch_size == 0) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'r':
+			replay_dir = optarg;
+			break;
+		case 'f':
+			full_rate_snapshots = true;
+			break;
+		case 's':
+			spectator_interval = strtoul(optarg, NULL, 10);
+			if (spectator_interval == 0) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'd':
+			spectator_delay_ms = strtoul(optarg, NULL, 10);
+			break;
+		case 'm':
+			metrics_path = optarg;
+			break;
+		case 'H':
+			handoff_path = optarg;
+			break;
+		case 't':
+			takeover_path = optarg;
+			break;
+		case 'i':
+			if (strcmp(optarg, "io_uring") == 0) {
+				use_uring = true;
+			} else if (strcmp(optarg, "epoll") != 0) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'T':
+			// matches step on whole ticks, so the step must be a multiple of one
+			step_ms = strtoul(optarg, NULL, 10);
+			if (step_ms == 0 || step_ms % TICK_RATE != 0 || step_ms / TICK_RATE > MAX_STEP_TICKS) {
+				fprintf(stderr, "step must be a multiple of %d ms up to %d ms\n", TICK_RATE, TICK_RATE * MAX_STEP_TICKS);
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'l':
+			level = log_parse_level(optarg);
+			if (level == -1) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		default:
+			usage(argv[0]);
+			exit(1);
 		}
+	}
 
-		// run through connections looking for data to read
-		for (i = 0; i <= fdmax; i++) {
-			// check if i is in read_fds
-			if (FD_ISSET(i, &read_fds)) {
-				if (i == tcp_listener) {
-					// this means we have a new connection
-					addrlen = sizeof remoteaddr;
-					// accept connection to listener as new file descriptor
-					newfd = accept(tcp_listener,
-							(struct sockaddr *)&remoteaddr,
-							&addrlen);
-
-					if (newfd == -1) {
-						perror("accept");
-					} else {
-						FD_SET(newfd, &master);  // add to master set
-						if (newfd > fdmax) {
-							fdmax = newfd;
-						}
-
-						printf("server:  new TCP connection from %s on "
-								"socket %d\n",
-								inet_ntop(remoteaddr.ss_family,
-									get_in_addr((struct sockaddr*)&remoteaddr),
-									remoteIP, INET6_ADDRSTRLEN),
-								newfd);
-
-					}
-				} else if (i == udp_listener) {
-					// handle data from UDP socket
-					struct sockaddr_in from;
-					socklen_t fromlen = sizeof(from);
-
-					uint8_t buffer[1024];
-					if ((nbytes = recvfrom(udp_listener, &buffer, sizeof(buffer), 0,
-							(struct sockaddr *)&from, &fromlen)) <= 0) {
-						// got error
-						perror("recvfrom");
-					}
-
-					struct PositionMessage positionMessage;
-					deserialize_position_message(buffer, &positionMessage);
-
-					int client_index = positionMessage.id - 1;
-					if (client_index >= 0 && client_index < MAX_CLIENTS && clients[client_index].active) {
-						printf("Received UDP data from client %d (player_id %u)\n", client_index, positionMessage.id);
-						// learn/refresh the client's real UDP address
-						clients[client_index].addr = from;
-						player_positions[client_index] = positionMessage.position;
-						printf("setting position of client %d to (%f, %f)\n", client_index, positionMessage.position.x, positionMessage.position.y);
-					} else {
-						printf("Ignoring UDP packet with unknown player_id %u\n", positionMessage.id);
-					}
-
-					printf("udp_listener: got packet from %s\n",
-						inet_ntoa(from.sin_addr));
-					printf("udp_listener: packet is %d bytes long\n", nbytes);
+	// default to a worker per core
+	if (num_workers == 0)
+		num_workers = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
 
-				} else {
-					// handle data from a tcp client
-					if ((nbytes = recv(i, buf, sizeof buf, 0)) <= 0) {
-						// got error or connection closed by client
-						if (nbytes == 0) {
-							// connection closed
-							printf("server: socket %d hung up\n", i);
-						} else {
-							perror("recv");
-						}
-						close(i);
-						FD_CLR(i, &master);	// remove from master set
-					} else {
-						// check opcode
-						struct TcpMessage tcpMessage;
-						deserialize_tcp_message(buf, &tcpMessage);
-						if (tcpMessage.opcode == 0) {
-							// register request
-							printf("Registering player\n");
-
-							// find a free slot
-							int client_id = -1;
-							for (int k = 0; k < MAX_CLIENTS; k++) {
-								if (!clients[k].active) {
-									clients[k].active = true;
-									clients[k].player_id = k + 1;
-									clients[k].tcp_fd = i;
-									memset(&clients[k].addr, 0, sizeof(clients[k].addr));
-									client_id = k + 1;
-									printf("Registered client %d (player_id %d)\n", k, client_id);
-									break;
-								}
-							}
-
-							if (client_id == -1) {
-								printf("No free client slots available\n");
-							}
-							// respond
-							struct TcpResponse tcpResponse;
-							tcpResponse.statuscode = 0;
-
-							// send server config to client (big-endian / network byte order)
-							uint32_t net_id = htonl(client_id);
-							uint32_t rows = htonl(ROWS);
-							uint32_t cols = htonl(COLS);
-							
-							float player_move_speed_f = PLAYER_MOVE_SPEED;
-							uint32_t player_move_speed;
-							memcpy(&player_move_speed, &player_move_speed_f, sizeof(player_move_speed));
-							player_move_speed = htonl(player_move_speed);
-
-							float ball_radius_f = BALL_RADIUS;
-							uint32_t ball_radius;
-							memcpy(&ball_radius, &ball_radius_f, sizeof(ball_radius));
-							ball_radius = htonl(ball_radius);
-
-							float player_length_f = PLAYER_LENGTH;
-							uint32_t player_length;
-							memcpy(&player_length, &player_length_f, sizeof(player_length));
-							player_length = htonl(player_length);
-
-							int offset = 0;
-							memcpy(tcpResponse.msg + offset, &net_id, sizeof(net_id)); offset += sizeof(net_id);
-							memcpy(tcpResponse.msg + offset, &rows, sizeof(rows)); offset += sizeof(rows);
-							memcpy(tcpResponse.msg + offset, &cols, sizeof(cols)); offset += sizeof(cols);
-							memcpy(tcpResponse.msg + offset, &player_move_speed, sizeof(player_move_speed)); offset += sizeof(player_move_speed);
-							memcpy(tcpResponse.msg + offset, &ball_radius, sizeof(ball_radius)); offset += sizeof(ball_radius);
-							memcpy(tcpResponse.msg + offset, &player_length, sizeof(player_length)); offset += sizeof(player_length);
-
-							// clear rest of buffer
-							memset(tcpResponse.msg + offset, 0, sizeof(tcpResponse.msg) - offset);
-
-							uint8_t response_buffer[260];
-							serialize_tcp_response(&tcpResponse, response_buffer);
-
-							if (send(i, response_buffer, sizeof(response_buffer), 0) == -1) {
-								perror("send");
-							}
-
-							printf("sent %lu bytes\n", sizeof(response_buffer));
-
-						}
-					}
-				}
+	if (log_init(level) == -1)
+		exit(1);
+	// write out whatever is still queued on the way down
+	atexit(log_shutdown);
+	LOG_INFO("Starting the game server.");
+
+	if (use_uring && !uring_supported()) {
+		LOG_WARN("io_uring isn't available on this kernel, using epoll.");
+		use_uring = false;
+	}
+
+	// a hot restart takes over the sockets of the running server rather than binding its own
+	HandoffListeners inherited = {0};
+	int* handoff_fds = NULL;
+	int handoff_sock = -1;
+	uint64_t handoff_stopped_ns = 0;
+	if (takeover_path != NULL) {
+		LOG_INFO("Taking over from the server on %s.", takeover_path);
+		handoff_sock = connect_handoff(takeover_path, &inherited, &handoff_fds);
+		if (handoff_sock == -1)
+			exit(2);
+		num_workers = inherited.num_workers;
+	}
+
+	// TCP NETWORKING ============================
+	int tcp_listener;		// FD for the server listener
+	if (takeover_path != NULL) {
+		tcp_listener = handoff_fds[0];
+	} else {
+		LOG_INFO("Initializing TCP networking.");
+		tcp_listener = bind_tcp_listener();
+		if (tcp_listener == -1) {
+			fprintf(stderr, "server: failed to bind TCP listener\n");
+			exit(2);
+		}
+	}
+
+	// UDP NETWORKING ===============================
+	// one socket per worker, all bound to the same port with SO_REUSEPORT
+	int* udp_fds = calloc(num_workers, sizeof(int));
+	if (takeover_path != NULL) {
+		// the group already steers datagrams by worker
+		memcpy(udp_fds, handoff_fds + 1 + inherited.has_metrics_listener, num_workers * sizeof(int));
+	} else {
+		LOG_INFO("Initializing UDP networking.");
+		for (int w = 0; w < num_workers; w++) {
+			udp_fds[w] = bind_udp_socket();
+			if (udp_fds[w] == -1) {
+				fprintf(stderr, "server: failed to bind UDP socket\n");
+				exit(2);
 			}
 		}
+
+		if (num_workers > 1 && attach_reuseport_steering(udp_fds[0], num_workers) == -1) {
+			// without steering, datagrams would land on workers that don't own the match
+			LOG_WARN("server: can't steer datagrams to workers, running a single worker");
+			for (int w = 1; w < num_workers; w++)
+				close(udp_fds[w]);
+			num_workers = 1;
+		}
 	}
+
+	// listen on TCP listener socket
+	LOG_INFO("Starting TCP listener.");
+	if (listen(tcp_listener, SOMAXCONN) == -1) {
+		perror("listen");
+		exit(3);
+	}
+
+	// START WORKERS ================================
+	// match ids are striped over the workers, so a successor keeps the same layout
+	uint32_t matches_per_worker = takeover_path != NULL ? inherited.matches_per_worker : (MAX_MATCHES + num_workers - 1) / num_workers;
+	MatchRegistry registry;
+	if (match_registry_init(&registry, matches_per_worker * num_workers) == -1) {
+		fprintf(stderr, "server: failed to allocate %d matches\n", MAX_MATCHES);
+		exit(1);
+	}
+
+	// the delay is served by holding back whole spectator snapshots
+	unsigned int spectator_delay = spectator_delay_ms / (TICK_RATE * spectator_interval);
+
+	Worker* workers = calloc(num_workers, sizeof(Worker));
+	for (int w = 0; w < num_workers; w++) {
+		if (worker_init(&workers[w], w, num_workers, udp_fds[w], udp_batch_size, matches_per_worker, replay_dir, full_rate_snapshots,
+				spectator_interval, spectator_delay, step_ms / TICK_RATE, use_uring) == -1)
+			exit(3);
+	}
+	LOG_INFO("Batching up to %u datagrams per syscall.", udp_batch_size);
+	if (replay_dir != NULL)
+		LOG_INFO("Recording matches to %s.", replay_dir);
+	LOG_INFO("Sending snapshots %s.", full_rate_snapshots ? "every tick during play" : "when clients can't predict them");
+	LOG_INFO("Sending spectators a snapshot every %u ticks, %u ms behind.", spectator_interval, spectator_delay * spectator_interval * TICK_RATE);
+	LOG_INFO("Simulating new matches every %u ms.", step_ms);
+
+	// register listener with the event loop
+	int epoll_fd = epoll_create1(0);
+	if (epoll_fd == -1) {
+		perror("epoll_create1");
+		exit(3);
+	}
+
+	// with io_uring the listener is accepted on by the ring instead
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.fd = tcp_listener };
+	if (set_nonblocking(tcp_listener) == -1 || (!use_uring && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, tcp_listener, &ev) == -1)) {
+		perror("epoll_ctl");
+		exit(3);
+	}
+
+	// stats endpoint, disabled with an empty path
+	int metrics_listener = -1;
+	if (takeover_path != NULL && inherited.has_metrics_listener) {
+		metrics_listener = handoff_fds[1];
+		ev.data.fd = metrics_listener;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, metrics_listener, &ev) == -1) {
+			perror("epoll_ctl");
+			exit(3);
+		}
+	} else if (metrics_path[0] != '\0') {
+		metrics_listener = bind_unix_socket(metrics_path);
+		if (metrics_listener == -1)
+			exit(2);
+		ev.data.fd = metrics_listener;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, metrics_listener, &ev) == -1) {
+			perror("epoll_ctl");
+			exit(3);
+		}
+		LOG_INFO("Serving metrics on %s.", metrics_path);
+	}
+
+	// workers wake the control loop through this when they've ended a match
+	int events_fd = eventfd(0, EFD_NONBLOCK);
+	ev.data.fd = events_fd;
+	if (events_fd == -1 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, events_fd, &ev) == -1) {
+		perror("eventfd");
+		exit(3);
+	}
+	for (int w = 0; w < num_workers; w++)
+		workers[w].notify_fd = events_fd;
+
+	Server server = { .workers = workers, .num_workers = num_workers, .epoll_fd = epoll_fd,
+		.tcp_listener = tcp_listener, .metrics_listener = metrics_listener, .handoff_listener = -1, .handoff_fd = -1, .handoff_timer_fd = -1, .events_fd = events_fd,
+		.use_uring = use_uring };
+	if (use_uring && uring_init(&server.uring, 64) == -1) {
+		perror("io_uring_setup");
+		exit(3);
+	}
+	if (matchmaker_init(&server.matchmaker, &registry, MATCHMAKING_QUEUE_SIZE) == -1) {
+		fprintf(stderr, "server: failed to allocate the matchmaking queue\n");
+		exit(1);
+	}
+
+	// pick up the connections and matches where the previous process left them
+	if (takeover_path != NULL) {
+		// everything is ready, so this is where play pauses
+		HandoffHeader handoff;
+		HandoffBuffer handoff_state;
+		int* connection_fds = NULL;
+		handoff_reserve_fds(handoff_sock, inherited.num_connections * 2);
+		if (handoff_signal(handoff_sock, HANDOFF_READY) == -1
+				|| handoff_receive_state(handoff_sock, &handoff, &connection_fds, &handoff_state) == -1) {
+			fprintf(stderr, "server: handoff from %s failed\n", takeover_path);
+			exit(2);
+		}
+
+		int* fd_map = NULL;
+		size_t fd_map_size = 0;
+		if (import_connections(&server, &handoff_state, handoff.num_connections, connection_fds, &fd_map, &fd_map_size) == -1) {
+			fprintf(stderr, "server: malformed connections in handoff\n");
+			exit(2);
+		}
+
+		uint32_t* match_ids = calloc(registry.capacity + 1, sizeof(uint32_t));
+		uint32_t num_matches = 0;
+		for (int w = 0; w < num_workers; w++) {
+			if (match_ids == NULL || worker_import(&workers[w], &handoff_state, fd_map, fd_map_size, match_ids, &num_matches) == -1) {
+				fprintf(stderr, "server: malformed matches in handoff\n");
+				exit(2);
+			}
+		}
+		match_registry_claim(&registry, match_ids, num_matches);
+		server.next_spectator_id = handoff.next_spectator_id;
+		metrics_set(&server.metrics.matchmaking_waiting, server.matchmaker.waiting);
+		LOG_INFO("Took over %u connections and %u matches.", handoff.num_connections, num_matches);
+		free(match_ids);
+		free(fd_map);
+		free(connection_fds);
+		free(handoff_fds);
+		handoff_buffer_free(&handoff_state);
+		handoff_stopped_ns = handoff.stopped_ns;
+	}
+
+	for (int w = 0; w < num_workers; w++) {
+		if (worker_start(&workers[w]) == -1)
+			exit(3);
+	}
+	LOG_INFO("Started %d workers hosting up to %u matches.", num_workers, registry.capacity);
+
+	if (takeover_path != NULL) {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		uint64_t now_ns = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+		LOG_INFO("Resumed %.3f ms after the previous server stopped.", (now_ns - handoff_stopped_ns) / 1e6);
+
+		// the previous process exits once it hears this, so the control
+		// loop never runs in both at once
+		if (handoff_signal(handoff_sock, HANDOFF_ACK) == -1) {
+			fprintf(stderr, "server: the previous server gave up on the handoff\n");
+			exit(2);
+		}
+		close(handoff_sock);
+		start_matches(&server, NULL);
+	}
+
+	// where a successor connects to take over, disabled with an empty path
+	if (handoff_path[0] != '\0') {
+		server.handoff_listener = bind_unix_socket(handoff_path);
+		if (server.handoff_listener == -1)
+			exit(2);
+		ev.data.fd = server.handoff_listener;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server.handoff_listener, &ev) == -1) {
+			perror("epoll_ctl");
+			exit(3);
+		}
+		server.handoff_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+		ev.data.fd = server.handoff_timer_fd;
+		if (server.handoff_timer_fd == -1 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server.handoff_timer_fd, &ev) == -1) {
+			perror("timerfd_create");
+			exit(3);
+		}
+		LOG_INFO("Accepting hot restarts on %s.", handoff_path);
+	}
+
+	LOG_INFO("listening for connections...");
+
+	// MAIN LOOP ======================================
+	LOG_INFO("Using %s for network I/O.", use_uring ? "io_uring" : "epoll");
+	if (use_uring)
+		run_uring(&server);
+	else
+		run_epoll(&server);
 }
@@ -0,0 +1,105 @@
+/*
+ * timer_wheel.c -- hierarchical timer wheel for per-tick expiry of many timers
+ */
+
+#include <string.h>
+
+#include "timer_wheel.h"
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_SPAN (1ull << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+void timer_wheel_init(TimerWheel* wheel, uint64_t now) {
+	memset(wheel->slots, 0, sizeof(wheel->slots));
+	wheel->now = now;
+}
+
+static void link_entry(TimerEntry** slot, TimerEntry* entry) {
+	entry->next = *slot;
+	if (entry->next != NULL)
+		entry->next->link = &entry->next;
+	entry->link = slot;
+	*slot = entry;
+}
+
+void timer_wheel_cancel(TimerEntry* entry) {
+	if (entry->link == NULL)
+		return;
+	*entry->link = entry->next;
+	if (entry->next != NULL)
+		entry->next->link = entry->link;
+	entry->next = NULL;
+	entry->link = NULL;
+}
+
+/**
+ * Put an entry in the lowest level whose current turn reaches its expiry.
+ * Ones further off than the whole wheel wait in the top level and are
+ * placed again when they come down.
+ */
+static void place(TimerWheel* wheel, TimerEntry* entry) {
+	uint64_t expires = entry->expires;
+	if (expires - wheel->now >= TIMER_WHEEL_SPAN)
+		expires = wheel->now + TIMER_WHEEL_SPAN - 1;
+
+	int level = 0;
+	while (level < TIMER_WHEEL_LEVELS - 1
+			&& (expires >> (TIMER_WHEEL_BITS * (level + 1))) != (wheel->now >> (TIMER_WHEEL_BITS * (level + 1))))
+		level++;
+	link_entry(&wheel->slots[level][(expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK], entry);
+}
+
+/**
+ * Schedule an entry to fire on the tick expires, or the next tick if
+ * that's already gone, replacing whatever it was scheduled for
+ */
+void timer_wheel_schedule(TimerWheel* wheel, TimerEntry* entry, uint64_t expires) {
+	timer_wheel_cancel(entry);
+	entry->expires = expires > wheel->now ? expires : wheel->now + 1;
+	place(wheel, entry);
+}
+
+// take a slot's list, with its first entry pointing back at the new head
+static void take_slot(TimerEntry** slot, TimerEntry** head) {
+	*head = *slot;
+	*slot = NULL;
+	if (*head != NULL)
+		(*head)->link = head;
+}
+
+/**
+ * Turn the wheel to now, calling callback on each entry as its tick comes
+ * round.  An entry is no longer scheduled when its callback runs, and the
+ * callback may schedule or cancel any entry, including this one.
+ */
+void timer_wheel_advance(TimerWheel* wheel, uint64_t now, TimerCallback callback, void* arg) {
+	while (wheel->now < now) {
+		uint64_t tick = ++wheel->now;
+
+		// at the start of each turn of a level, bring the next slot of the
+		// level above down into it, highest first
+		int top = 0;
+		while (top < TIMER_WHEEL_LEVELS - 1 && ((tick >> (TIMER_WHEEL_BITS * top)) & TIMER_WHEEL_MASK) == 0)
+			top++;
+		for (int level = top; level > 0; level--) {
+			TimerEntry* pending;
+			take_slot(&wheel->slots[level][(tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK], &pending);
+			while (pending != NULL) {
+				TimerEntry* entry = pending;
+				timer_wheel_cancel(entry);
+				place(wheel, entry);
+			}
+		}
+
+		TimerEntry* pending;
+		take_slot(&wheel->slots[0][tick & TIMER_WHEEL_MASK], &pending);
+		while (pending != NULL) {
+			TimerEntry* entry = pending;
+			timer_wheel_cancel(entry);
+			if (entry->expires > tick)
+				place(wheel, entry);
+			else
+				callback(entry, arg);
+		}
+	}
+}
@@ -0,0 +1,45 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4	// 2^24 ticks, about three days at 16 ms
+
+/**
+ * a timer, embedded in whatever it's for.  id is the owner's to find it
+ * by when it fires.
+ */
+typedef struct TimerEntry {
+	struct TimerEntry* next;
+	struct TimerEntry** link;	// the pointer to this entry, NULL when not scheduled
+	uint64_t expires;
+	uint32_t id;
+} TimerEntry;
+
+/**
+ * hierarchical timer wheel counting in ticks.  Level 0 has a slot per
+ * tick for the next TIMER_WHEEL_SLOTS ticks, and each level above covers
+ * TIMER_WHEEL_SLOTS times the span of the one below; its slots are
+ * cascaded down as the wheel turns, so scheduling, cancelling and firing
+ * are all O(1) per timer however many there are.
+ */
+typedef struct {
+	TimerEntry* slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+	uint64_t now;	// last tick advanced to
+} TimerWheel;
+
+typedef void (*TimerCallback)(TimerEntry* entry, void* arg);
+
+void timer_wheel_init(TimerWheel* wheel, uint64_t now);
+void timer_wheel_schedule(TimerWheel* wheel, TimerEntry* entry, uint64_t expires);
+void timer_wheel_cancel(TimerEntry* entry);
+void timer_wheel_advance(TimerWheel* wheel, uint64_t now, TimerCallback callback, void* arg);
+
+static inline bool timer_scheduled(const TimerEntry* entry) {
+	return entry->link != NULL;
+}
+
+#endif
@@ -0,0 +1,211 @@
+/*
+ * udp_batch.c -- batched datagram receive and send with recvmmsg/sendmmsg or io_uring
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "config.h"
+#include "udp_batch.h"
+
+int udp_batch_init(UdpBatch* batch, int fd, unsigned int batch_size) {
+	memset(batch, 0, sizeof(*batch));
+	batch->fd = fd;
+	batch->batch_size = batch_size;
+
+	batch->recv_msgs = calloc(batch_size, sizeof(struct mmsghdr));
+	batch->recv_iovs = calloc(batch_size, sizeof(struct iovec));
+	batch->recv_addrs = calloc(batch_size, sizeof(struct sockaddr_in));
+	batch->recv_buffers = calloc(batch_size, UDP_MAX_DATAGRAM);
+
+	batch->send_msgs = calloc(batch_size, sizeof(struct mmsghdr));
+	batch->send_iovs = calloc(batch_size, sizeof(struct iovec));
+	batch->send_addrs = calloc(batch_size, sizeof(struct sockaddr_in));
+	batch->send_buffers = calloc(batch_size, UDP_MAX_DATAGRAM);
+	batch->send_shared = calloc(batch_size, sizeof(SharedPayload*));
+
+	if (!batch->recv_msgs || !batch->recv_iovs || !batch->recv_addrs || !batch->recv_buffers ||
+			!batch->send_msgs || !batch->send_iovs || !batch->send_addrs || !batch->send_buffers || !batch->send_shared) {
+		udp_batch_free(batch);
+		return -1;
+	}
+
+	// headers point at fixed buffers, so they only need wiring up once
+	for (unsigned int i = 0; i < batch_size; i++) {
+		batch->recv_iovs[i].iov_base = batch->recv_buffers + (size_t)i * UDP_MAX_DATAGRAM;
+		batch->recv_iovs[i].iov_len = UDP_MAX_DATAGRAM;
+		batch->recv_msgs[i].msg_hdr.msg_iov = &batch->recv_iovs[i];
+		batch->recv_msgs[i].msg_hdr.msg_iovlen = 1;
+		batch->recv_msgs[i].msg_hdr.msg_name = &batch->recv_addrs[i];
+
+		batch->send_iovs[i].iov_base = batch->send_buffers + (size_t)i * UDP_MAX_DATAGRAM;
+		batch->send_msgs[i].msg_hdr.msg_iov = &batch->send_iovs[i];
+		batch->send_msgs[i].msg_hdr.msg_iovlen = 1;
+		batch->send_msgs[i].msg_hdr.msg_name = &batch->send_addrs[i];
+		batch->send_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	}
+	return 0;
+}
+
+void udp_batch_free(UdpBatch* batch) {
+	free(batch->recv_msgs);
+	free(batch->recv_iovs);
+	free(batch->recv_addrs);
+	free(batch->recv_buffers);
+	free(batch->send_msgs);
+	free(batch->send_iovs);
+	free(batch->send_addrs);
+	free(batch->send_buffers);
+	free(batch->send_shared);
+	memset(batch, 0, sizeof(*batch));
+}
+
+/**
+ * Receive up to batch_size datagrams without blocking.  Returns the number
+ * received, 0 if the socket is drained, or -1 on error.  The previous
+ * batch's buffers are reused, so callers must finish with them first.
+ */
+int udp_batch_recv(UdpBatch* batch) {
+	for (unsigned int i = 0; i < batch->batch_size; i++)
+		batch->recv_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+
+	int n = recvmmsg(batch->fd, batch->recv_msgs, batch->batch_size, MSG_DONTWAIT, NULL);
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		perror("recvmmsg");
+		return -1;
+	}
+	return n;
+}
+
+const uint8_t* udp_batch_recv_data(const UdpBatch* batch, int i, unsigned int* len, const struct sockaddr_in** from) {
+	*len = batch->recv_msgs[i].msg_len;
+	*from = &batch->recv_addrs[i];
+	return batch->recv_iovs[i].iov_base;
+}
+
+/**
+ * Get the buffer for the next outgoing datagram, flushing first if the
+ * queue is full.  The datagram is only queued once udp_batch_commit() is
+ * called.
+ */
+uint8_t* udp_batch_reserve(UdpBatch* batch) {
+	if (batch->send_count == batch->batch_size)
+		udp_batch_flush(batch);
+	return batch->send_iovs[batch->send_count].iov_base;
+}
+
+void udp_batch_commit(UdpBatch* batch, const struct sockaddr_in* to, unsigned int len) {
+	unsigned int i = batch->send_count;
+	batch->send_addrs[i] = *to;
+	batch->send_iovs[i].iov_len = len;
+	batch->send_count++;
+}
+
+/**
+ * Queue a datagram that points at a shared payload instead of copying it
+ * into the batch
+ */
+void udp_batch_commit_shared(UdpBatch* batch, const struct sockaddr_in* to, SharedPayload* payload) {
+	if (batch->send_count == batch->batch_size)
+		udp_batch_flush(batch);
+	unsigned int i = batch->send_count;
+	batch->send_addrs[i] = *to;
+	batch->send_iovs[i].iov_base = payload->data;
+	batch->send_iovs[i].iov_len = payload->length;
+	batch->send_shared[i] = payload;
+	payload->refs++;
+	batch->send_count++;
+}
+
+// queue a send per datagram and submit them all in one syscall
+static int flush_uring(UdpBatch* batch) {
+	int submitted = 0;
+	for (unsigned int i = 0; i < batch->send_count; i++) {
+		struct io_uring_sqe* sqe = uring_get_sqe(batch->uring);
+		if (sqe == NULL) {
+			batch->send_dropped++;
+			continue;
+		}
+		uring_prep_sendmsg(sqe, batch->fd, &batch->send_msgs[i].msg_hdr, batch->uring_send_data);
+		submitted++;
+	}
+	uring_submit(batch->uring, 0);
+	return submitted;
+}
+
+/**
+ * Hand every queued datagram to the kernel.  Datagrams that can't be sent
+ * are dropped, as they would be anywhere else on the network.  Returns the
+ * number sent, or with io_uring the number submitted, whose results come
+ * back through udp_batch_sent().
+ */
+int udp_batch_flush(UdpBatch* batch) {
+	unsigned int sent = 0;
+	int delivered = 0;
+	if (batch->uring != NULL) {
+		delivered = flush_uring(batch);
+		sent = batch->send_count;
+	}
+	while (sent < batch->send_count) {
+		int n = sendmmsg(batch->fd, batch->send_msgs + sent, batch->send_count - sent, MSG_DONTWAIT);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				// socket buffer is full, nothing more will go out this flush
+				batch->send_dropped += batch->send_count - sent;
+				break;
+			}
+			// skip the datagram at the head of the queue and carry on with the rest
+			perror("sendmmsg");
+			batch->send_dropped++;
+			sent++;
+			continue;
+		}
+		delivered += n;
+		sent += n;
+	}
+
+	// point slots that sent a shared payload back at their own buffer
+	for (unsigned int i = 0; i < batch->send_count; i++) {
+		if (batch->send_shared[i] == NULL)
+			continue;
+		shared_payload_release(batch->send_shared[i]);
+		batch->send_shared[i] = NULL;
+		batch->send_iovs[i].iov_base = batch->send_buffers + (size_t)i * UDP_MAX_DATAGRAM;
+	}
+	batch->send_count = 0;
+	return delivered;
+}
+
+// count the result of a send submitted by udp_batch_flush()
+void udp_batch_sent(UdpBatch* batch, int result) {
+	if (result >= 0)
+		return;
+	if (result != -EAGAIN)
+		fprintf(stderr, "sendmsg: %s\n", strerror(-result));
+	batch->send_dropped++;
+}
+
+/**
+ * Allocate a payload of up to capacity bytes, holding one reference for
+ * the caller
+ */
+SharedPayload* shared_payload_new(size_t capacity) {
+	SharedPayload* payload = malloc(sizeof(SharedPayload) + capacity);
+	if (payload == NULL)
+		return NULL;
+	payload->refs = 1;
+	payload->length = 0;
+	return payload;
+}
+
+void shared_payload_release(SharedPayload* payload) {
+	if (payload != NULL && --payload->refs == 0)
+		free(payload);
+}
@@ -0,0 +1,66 @@
+#ifndef UDP_BATCH_H
+#define UDP_BATCH_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "uring.h"
+
+/**
+ * a datagram payload sent to many recipients without being copied.  Each
+ * queued send holds a reference, dropped once the batch is flushed, so it
+ * lives exactly as long as it's needed.  Only used on one thread.
+ */
+typedef struct {
+	uint32_t refs;
+	uint32_t length;
+	uint8_t data[];
+} SharedPayload;
+
+/**
+ * preallocated datagram buffers for moving many packets per syscall with
+ * recvmmsg/sendmmsg, or with io_uring submissions
+ */
+typedef struct {
+	int fd;
+	unsigned int batch_size;
+
+	// receive ring, refilled in place by each udp_batch_recv()
+	struct mmsghdr* recv_msgs;
+	struct iovec* recv_iovs;
+	struct sockaddr_in* recv_addrs;
+	uint8_t* recv_buffers;
+
+	// outgoing datagrams queued until the next flush
+	struct mmsghdr* send_msgs;
+	struct iovec* send_iovs;
+	struct sockaddr_in* send_addrs;
+	uint8_t* send_buffers;
+	SharedPayload** send_shared;	// payload each queued datagram points at, NULL if it's in send_buffers
+	unsigned int send_count;
+
+	uint64_t send_dropped;	// datagrams the kernel refused (e.g. full socket buffer)
+
+	// when set, flushes are submitted to this ring instead of sendmmsg, and
+	// each send completes with uring_send_data for udp_batch_sent()
+	Uring* uring;
+	uint64_t uring_send_data;
+} UdpBatch;
+
+int udp_batch_init(UdpBatch* batch, int fd, unsigned int batch_size);
+void udp_batch_free(UdpBatch* batch);
+
+int udp_batch_recv(UdpBatch* batch);
+const uint8_t* udp_batch_recv_data(const UdpBatch* batch, int i, unsigned int* len, const struct sockaddr_in** from);
+
+uint8_t* udp_batch_reserve(UdpBatch* batch);
+void udp_batch_commit(UdpBatch* batch, const struct sockaddr_in* to, unsigned int len);
+void udp_batch_commit_shared(UdpBatch* batch, const struct sockaddr_in* to, SharedPayload* payload);
+int udp_batch_flush(UdpBatch* batch);
+void udp_batch_sent(UdpBatch* batch, int result);
+
+SharedPayload* shared_payload_new(size_t capacity);
+void shared_payload_release(SharedPayload* payload);
+
+#endif
@@ -0,0 +1,281 @@
+/*
+ * uring.c -- a minimal io_uring driver on the raw syscalls, for the
+ * multishot receive, accept and batched send paths
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "uring.h"
+
+static int uring_setup(unsigned int entries, struct io_uring_params* params) {
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned int submit, unsigned int wait, unsigned int flags) {
+	return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned int opcode, void* arg, unsigned int count) {
+	return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+/**
+ * Set up a ring with room for entries submissions at once.  The completion
+ * queue is several times larger, since multishot requests post many
+ * completions per submission.  Returns -1 if io_uring isn't available.
+ */
+int uring_init(Uring* uring, unsigned int entries) {
+	memset(uring, 0, sizeof(*uring));
+	struct io_uring_params params = { .flags = IORING_SETUP_CQSIZE, .cq_entries = entries * 8 };
+	uring->fd = uring_setup(entries, &params);
+	if (uring->fd == -1)
+		return -1;
+	uring->features = params.features;
+
+	// older kernels map the rings separately and can drop completions on overflow
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+		close(uring->fd);
+		errno = ENOSYS;
+		return -1;
+	}
+
+	size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	uring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+	uring->ring = mmap(NULL, uring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+	uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+	if (uring->ring == MAP_FAILED || uring->sqes == MAP_FAILED) {
+		perror("mmap");
+		uring->ring = uring->ring == MAP_FAILED ? NULL : uring->ring;
+		uring->sqes = uring->sqes == MAP_FAILED ? NULL : uring->sqes;
+		uring_free(uring);
+		return -1;
+	}
+
+	uint8_t* ring = uring->ring;
+	uring->sq_head = (unsigned int*)(ring + params.sq_off.head);
+	uring->sq_tail = (unsigned int*)(ring + params.sq_off.tail);
+	uring->sq_array = (unsigned int*)(ring + params.sq_off.array);
+	uring->sq_mask = *(unsigned int*)(ring + params.sq_off.ring_mask);
+	uring->sq_entries = params.sq_entries;
+	uring->cq_head = (unsigned int*)(ring + params.cq_off.head);
+	uring->cq_tail = (unsigned int*)(ring + params.cq_off.tail);
+	uring->cqes = (struct io_uring_cqe*)(ring + params.cq_off.cqes);
+	uring->cq_mask = *(unsigned int*)(ring + params.cq_off.ring_mask);
+
+	// submission slots map to entries one to one, so only the tail moves
+	for (unsigned int i = 0; i < uring->sq_entries; i++)
+		uring->sq_array[i] = i;
+	return 0;
+}
+
+void uring_free(Uring* uring) {
+	if (uring->sqes != NULL)
+		munmap(uring->sqes, uring->sqes_size);
+	if (uring->ring != NULL)
+		munmap(uring->ring, uring->ring_size);
+	if (uring->fd > 0)
+		close(uring->fd);
+	memset(uring, 0, sizeof(*uring));
+	uring->fd = -1;
+}
+
+/**
+ * Get the next free submission entry, cleared, submitting what's queued
+ * first if the queue is full.  Returns NULL if there's still no room.
+ */
+struct io_uring_sqe* uring_get_sqe(Uring* uring) {
+	unsigned int tail = *uring->sq_tail + uring->sq_queued;
+	if (tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >= uring->sq_entries) {
+		uring_submit(uring, 0);
+		tail = *uring->sq_tail + uring->sq_queued;
+		if (tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >= uring->sq_entries)
+			return NULL;
+	}
+	struct io_uring_sqe* sqe = &uring->sqes[tail & uring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	uring->sq_queued++;
+	return sqe;
+}
+
+/**
+ * Submit everything queued and, if wait isn't 0, block until at least that
+ * many completions are ready, all in one syscall.  Returns the number
+ * submitted, or -1.
+ */
+int uring_submit(Uring* uring, unsigned int wait) {
+	unsigned int queued = uring->sq_queued;
+	__atomic_store_n(uring->sq_tail, *uring->sq_tail + queued, __ATOMIC_RELEASE);
+	uring->sq_queued = 0;
+	if (queued == 0 && wait == 0)
+		return 0;
+
+	for (;;) {
+		int n = uring_enter(uring->fd, queued, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+		if (n == -1 && errno == EINTR) {
+			// whatever was consumed before the signal doesn't need submitting again
+			queued = 0;
+			continue;
+		}
+		if (n == -1)
+			perror("io_uring_enter");
+		return n;
+	}
+}
+
+/**
+ * Register count buffers of buffer_size bytes as group, for requests with
+ * IOSQE_BUFFER_SELECT to receive into.  count must be a power of two.
+ */
+int uring_buffers_init(Uring* uring, UringBuffers* buffers, uint16_t group, unsigned int count, size_t buffer_size) {
+	memset(buffers, 0, sizeof(*buffers));
+	buffers->group = group;
+	buffers->count = count;
+	buffers->buffer_size = buffer_size;
+
+	buffers->ring_size = count * sizeof(struct io_uring_buf);
+	buffers->ring = mmap(NULL, buffers->ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	buffers->data = malloc(count * buffer_size);
+	if (buffers->ring == MAP_FAILED || buffers->data == NULL) {
+		if (buffers->ring != MAP_FAILED)
+			munmap(buffers->ring, buffers->ring_size);
+		free(buffers->data);
+		memset(buffers, 0, sizeof(*buffers));
+		return -1;
+	}
+
+	struct io_uring_buf_reg reg = { .ring_addr = (uint64_t)(uintptr_t)buffers->ring, .ring_entries = count, .bgid = group };
+	if (uring_register(uring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+		munmap(buffers->ring, buffers->ring_size);
+		free(buffers->data);
+		memset(buffers, 0, sizeof(*buffers));
+		return -1;
+	}
+
+	buffers->ring->tail = 0;
+	for (unsigned int i = 0; i < count; i++)
+		uring_buffers_return(buffers, i);
+	return 0;
+}
+
+void uring_buffers_free(Uring* uring, UringBuffers* buffers) {
+	if (buffers->ring == NULL)
+		return;
+	struct io_uring_buf_reg reg = { .bgid = buffers->group };
+	uring_register(uring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+	munmap(buffers->ring, buffers->ring_size);
+	free(buffers->data);
+	memset(buffers, 0, sizeof(*buffers));
+}
+
+// give a buffer back to the kernel once its completion has been handled
+void uring_buffers_return(UringBuffers* buffers, uint16_t id) {
+	uint16_t tail = buffers->ring->tail;
+	struct io_uring_buf* buf = &buffers->ring->bufs[tail & (buffers->count - 1)];
+	buf->addr = (uint64_t)(uintptr_t)(buffers->data + (size_t)id * buffers->buffer_size);
+	buf->len = buffers->buffer_size;
+	buf->bid = id;
+	__atomic_store_n(&buffers->ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Whether the kernel can do everything the io_uring backend needs.
+ * Multishot receive is the newest of it, so try arming one on a throwaway
+ * socket; kernels without it fail the request straight away.
+ */
+bool uring_supported(void) {
+	Uring uring;
+	if (uring_init(&uring, 8) == -1)
+		return false;
+
+	UringBuffers buffers;
+	int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	bool supported = fd != -1 && bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0
+		&& uring_buffers_init(&uring, &buffers, 0, 2, 64) == 0;
+
+	if (supported) {
+		struct msghdr msg = { .msg_namelen = sizeof(struct sockaddr_in) };
+		uring_prep_recvmsg_multishot(uring_get_sqe(&uring), fd, &msg, 0, 1);
+		uring_prep_accept_multishot(uring_get_sqe(&uring), fd, 2);
+		// the accept fails on a datagram socket either way, and both are
+		// looked at while they're submitted
+		if (uring_submit(&uring, 1) == -1)
+			supported = false;
+		for (struct io_uring_cqe* cqe; (cqe = uring_peek_cqe(&uring)) != NULL; uring_cqe_seen(&uring)) {
+			if (cqe->res == -EINVAL)
+				supported = false;
+		}
+		uring_buffers_free(&uring, &buffers);
+	}
+	if (fd != -1)
+		close(fd);
+	uring_free(&uring);
+	return supported;
+}
+
+void uring_prep_poll_multishot(struct io_uring_sqe* sqe, int fd, uint64_t user_data) {
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = user_data;
+}
+
+/**
+ * Receive datagrams into buffers from group until cancelled.  Each buffer
+ * starts with a struct io_uring_recvmsg_out, then msg->msg_namelen bytes of
+ * address, then the payload.
+ */
+void uring_prep_recvmsg_multishot(struct io_uring_sqe* sqe, int fd, struct msghdr* msg, uint16_t group, uint64_t user_data) {
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)msg;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = group;
+	sqe->user_data = user_data;
+}
+
+// accept connections until cancelled, each completion's result a new non-blocking socket
+void uring_prep_accept_multishot(struct io_uring_sqe* sqe, int fd, uint64_t user_data) {
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK;
+	sqe->user_data = user_data;
+}
+
+/**
+ * Send a datagram without waiting for room in the socket buffer: with
+ * MSG_DONTWAIT the kernel copies it, or fails it, while submitting, so msg
+ * and its buffers can be reused as soon as uring_submit() returns.
+ */
+void uring_prep_sendmsg(struct io_uring_sqe* sqe, int fd, const struct msghdr* msg, uint64_t user_data) {
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_DONTWAIT;
+	sqe->user_data = user_data;
+}
+
+// cancel every request submitted with user_data; the cancellation's own completion has user_data 0
+void uring_prep_cancel(struct io_uring_sqe* sqe, uint64_t user_data) {
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = user_data;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+}
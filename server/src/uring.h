@@ -0,0 +1,85 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+/**
+ * an io_uring instance driven with the raw syscalls: a submission queue
+ * filled in place and submitted with uring_submit(), and a completion
+ * queue read in place.  Only used on one thread at a time.
+ */
+typedef struct {
+	int fd;
+	unsigned int features;
+
+	void* ring;	// submission and completion rings share one mapping
+	size_t ring_size;
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+
+	unsigned int* sq_head;
+	unsigned int* sq_tail;
+	unsigned int* sq_array;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int sq_queued;	// prepared since the last submit
+
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	struct io_uring_cqe* cqes;
+	unsigned int cq_mask;
+} Uring;
+
+/**
+ * buffers registered with a ring for it to receive into, picked by the
+ * kernel as data arrives and handed back once the completion is handled
+ */
+typedef struct {
+	struct io_uring_buf_ring* ring;
+	size_t ring_size;
+	uint8_t* data;
+	unsigned int count;
+	size_t buffer_size;
+	uint16_t group;
+} UringBuffers;
+
+int uring_init(Uring* uring, unsigned int entries);
+void uring_free(Uring* uring);
+
+struct io_uring_sqe* uring_get_sqe(Uring* uring);
+int uring_submit(Uring* uring, unsigned int wait);
+
+int uring_buffers_init(Uring* uring, UringBuffers* buffers, uint16_t group, unsigned int count, size_t buffer_size);
+void uring_buffers_free(Uring* uring, UringBuffers* buffers);
+void uring_buffers_return(UringBuffers* buffers, uint16_t id);
+
+bool uring_supported(void);
+
+void uring_prep_poll_multishot(struct io_uring_sqe* sqe, int fd, uint64_t user_data);
+void uring_prep_recvmsg_multishot(struct io_uring_sqe* sqe, int fd, struct msghdr* msg, uint16_t group, uint64_t user_data);
+void uring_prep_accept_multishot(struct io_uring_sqe* sqe, int fd, uint64_t user_data);
+void uring_prep_sendmsg(struct io_uring_sqe* sqe, int fd, const struct msghdr* msg, uint64_t user_data);
+void uring_prep_cancel(struct io_uring_sqe* sqe, uint64_t user_data);
+
+// the next completion, or NULL if there are none; uring_cqe_seen() releases it
+static inline struct io_uring_cqe* uring_peek_cqe(Uring* uring) {
+	unsigned int head = *uring->cq_head;
+	if (head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &uring->cqes[head & uring->cq_mask];
+}
+
+static inline void uring_cqe_seen(Uring* uring) {
+	__atomic_store_n(uring->cq_head, *uring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// data received into a buffer from the group, for a completion with IORING_CQE_F_BUFFER set
+static inline uint8_t* uring_buffer(const UringBuffers* buffers, const struct io_uring_cqe* cqe) {
+	return buffers->data + (size_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) * buffers->buffer_size;
+}
+
+#endif
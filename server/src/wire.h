@@ -0,0 +1,204 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+/*
+ * wire.h -- message layouts declared once, with their structs and
+ * big-endian codecs generated from the declaration.
+ *
+ * A schema is a macro taking two macros: FIELD(kind, name) for each field
+ * in wire order, and TAG(value) for a constant byte (a message type or
+ * version) that's written on encode, checked on decode and not stored.
+ * Kinds are u8, i8, u16, i16, u32, u64 and f32.  tools/schemagen prints the
+ * same layouts as Rust for the client.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <endian.h>
+#include <arpa/inet.h>
+
+typedef uint8_t wire_u8;
+typedef int8_t wire_i8;
+typedef uint16_t wire_u16;
+typedef int16_t wire_i16;
+typedef uint32_t wire_u32;
+typedef uint64_t wire_u64;
+typedef float wire_f32;
+
+#define WIRE_SIZE_u8 1
+#define WIRE_SIZE_i8 1
+#define WIRE_SIZE_u16 2
+#define WIRE_SIZE_i16 2
+#define WIRE_SIZE_u32 4
+#define WIRE_SIZE_u64 8
+#define WIRE_SIZE_f32 4
+
+static inline void wire_put_u8(uint8_t* p, uint8_t value) { *p = value; }
+static inline void wire_put_i8(uint8_t* p, int8_t value) { *p = (uint8_t)value; }
+
+static inline void wire_put_u16(uint8_t* p, uint16_t value) {
+	value = htons(value);
+	memcpy(p, &value, 2);
+}
+
+static inline void wire_put_i16(uint8_t* p, int16_t value) { wire_put_u16(p, (uint16_t)value); }
+
+static inline void wire_put_u32(uint8_t* p, uint32_t value) {
+	value = htonl(value);
+	memcpy(p, &value, 4);
+}
+
+static inline void wire_put_u64(uint8_t* p, uint64_t value) {
+	value = htobe64(value);
+	memcpy(p, &value, 8);
+}
+
+static inline void wire_put_f32(uint8_t* p, float value) {
+	uint32_t bits;
+	memcpy(&bits, &value, 4);
+	wire_put_u32(p, bits);
+}
+
+static inline uint8_t wire_get_u8(const uint8_t* p) { return *p; }
+static inline int8_t wire_get_i8(const uint8_t* p) { return (int8_t)*p; }
+
+static inline uint16_t wire_get_u16(const uint8_t* p) {
+	uint16_t value;
+	memcpy(&value, p, 2);
+	return ntohs(value);
+}
+
+static inline int16_t wire_get_i16(const uint8_t* p) { return (int16_t)wire_get_u16(p); }
+
+static inline uint32_t wire_get_u32(const uint8_t* p) {
+	uint32_t value;
+	memcpy(&value, p, 4);
+	return ntohl(value);
+}
+
+static inline uint64_t wire_get_u64(const uint8_t* p) {
+	uint64_t value;
+	memcpy(&value, p, 8);
+	return be64toh(value);
+}
+
+static inline float wire_get_f32(const uint8_t* p) {
+	uint32_t bits = wire_get_u32(p);
+	float value;
+	memcpy(&value, &bits, 4);
+	return value;
+}
+
+/**
+ * Byte swap every 16 or 32 bit word of a buffer in place, eight bytes at a
+ * time.  A no-op on big-endian hosts.
+ */
+static inline void wire_swap16(uint8_t* p, size_t bytes) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	size_t i = 0;
+	for (; i + 8 <= bytes; i += 8) {
+		uint64_t words;
+		memcpy(&words, p + i, 8);
+		words = ((words & 0x00ff00ff00ff00ffull) << 8) | ((words >> 8) & 0x00ff00ff00ff00ffull);
+		memcpy(p + i, &words, 8);
+	}
+	for (; i < bytes; i += 2) {
+		uint16_t word;
+		memcpy(&word, p + i, 2);
+		wire_put_u16(p + i, word);
+	}
+#else
+	(void)p;
+	(void)bytes;
+#endif
+}
+
+static inline void wire_swap32(uint8_t* p, size_t bytes) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	size_t i = 0;
+	for (; i + 8 <= bytes; i += 8) {
+		uint64_t words;
+		memcpy(&words, p + i, 8);
+		words = __builtin_bswap64(words);
+		words = (words >> 32) | (words << 32);
+		memcpy(p + i, &words, 8);
+	}
+	for (; i < bytes; i += 4) {
+		uint32_t word;
+		memcpy(&word, p + i, 4);
+		wire_put_u32(p + i, word);
+	}
+#else
+	(void)p;
+	(void)bytes;
+#endif
+}
+
+// struct members, in wire order
+#define WIRE_STRUCT_FIELD(kind, name) wire_##kind name;
+#define WIRE_STRUCT_TAG(value)
+#define WIRE_FIELDS(schema) schema(WIRE_STRUCT_FIELD, WIRE_STRUCT_TAG)
+
+// encoded size, a constant expression
+#define WIRE_SIZE_FIELD(kind, name) + WIRE_SIZE_##kind
+#define WIRE_SIZE_TAG(value) + 1
+#define WIRE_SIZE(schema) (0 schema(WIRE_SIZE_FIELD, WIRE_SIZE_TAG))
+
+#define WIRE_PUT_FIELD(kind, name) wire_put_##kind(p, msg->name); p += WIRE_SIZE_##kind;
+#define WIRE_PUT_TAG(value) *p++ = (value);
+#define WIRE_GET_FIELD(kind, name) msg->name = wire_get_##kind(p); p += WIRE_SIZE_##kind;
+#define WIRE_CHECK_TAG(value) if (*p++ != (value)) return -1;
+
+/**
+ * Define encode_<name>(buffer, msg), which writes the schema's fields of
+ * msg and returns WIRE_SIZE(schema), and decode_<name>(buffer, length,
+ * msg), which returns -1 if buffer is too short or a tag doesn't match.
+ * Anything in buffer past the schema is left to the caller.
+ */
+#define WIRE_CODEC(name, type, schema) \
+	static inline size_t encode_##name(uint8_t* buffer, const type* msg) { \
+		uint8_t* p = buffer; \
+		schema(WIRE_PUT_FIELD, WIRE_PUT_TAG) \
+		return p - buffer; \
+	} \
+	static inline int decode_##name(const uint8_t* buffer, size_t length, type* msg) { \
+		if (length < WIRE_SIZE(schema)) \
+			return -1; \
+		const uint8_t* p = buffer; \
+		schema(WIRE_GET_FIELD, WIRE_CHECK_TAG) \
+		(void)p; \
+		return 0; \
+	}
+
+#define WIRE_ASSERT_WIDTH_16(kind, name) _Static_assert(WIRE_SIZE_##kind == 2, #name " is not 16 bits wide");
+#define WIRE_ASSERT_WIDTH_32(kind, name) _Static_assert(WIRE_SIZE_##kind == 4, #name " is not 32 bits wide");
+#define WIRE_ASSERT_NO_TAG(value) _Static_assert(0, "block layouts can't have tags");
+
+/**
+ * Codecs for a schema whose fields all have the same width, and whose
+ * struct (generated by WIRE_FIELDS) therefore has exactly the wire layout.
+ * They're copied as they are and byte swapped a word at a time:
+ * encode_<name>_array(buffer, msgs, count) returns the bytes written and
+ * decode_<name>_array(buffer, msgs, count) reads count of them.
+ */
+#define WIRE_BLOCK_CODEC(name, type, schema, width) \
+	_Static_assert(sizeof(type) == WIRE_SIZE(schema), #type " isn't laid out as its schema"); \
+	static inline void name##_check_layout(void) { \
+		schema(WIRE_ASSERT_WIDTH_##width, WIRE_ASSERT_NO_TAG) \
+	} \
+	static inline size_t encode_##name##_array(uint8_t* buffer, const type* msgs, size_t count) { \
+		for (size_t i = 0; i < count; i++) { \
+			memcpy(buffer + i * sizeof(type), &msgs[i], sizeof(type)); \
+			wire_swap##width(buffer + i * sizeof(type), sizeof(type)); \
+		} \
+		return count * sizeof(type); \
+	} \
+	static inline void decode_##name##_array(const uint8_t* buffer, type* msgs, size_t count) { \
+		for (size_t i = 0; i < count; i++) { \
+			memcpy(&msgs[i], buffer + i * sizeof(type), sizeof(type)); \
+			wire_swap##width((uint8_t*)&msgs[i], sizeof(type)); \
+		} \
+	}
+
+#endif
@@ -0,0 +1,734 @@
+/*
+ * worker.c -- per-core simulation threads, each with its own sockets and matches
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "config.h"
+#include "protocol.h"
+#include "worker.h"
+#include "handoff.h"
+#include "log.h"
+
+// what each io_uring completion is for
+enum {
+	URING_TIMER = 1,
+	URING_MAILBOX,
+	URING_UDP_RECV,
+	URING_UDP_SEND,
+};
+
+/**
+ * Set up the worker's ring, sized for a full batch of sends on top of its
+ * multishot requests, and the buffers datagrams are received into
+ */
+static int init_uring(Worker* worker, unsigned int udp_batch_size) {
+	unsigned int entries = 64;
+	while (entries < 2 * udp_batch_size)
+		entries *= 2;
+	if (uring_init(&worker->uring, entries) == -1) {
+		perror("io_uring_setup");
+		return -1;
+	}
+
+	size_t buffer_size = sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) + UDP_MAX_DATAGRAM;
+	if (uring_buffers_init(&worker->uring, &worker->recv_buffers, 0, URING_RECV_BUFFERS, buffer_size) == -1) {
+		fprintf(stderr, "worker %d: failed to register %u receive buffers\n", worker->index, URING_RECV_BUFFERS);
+		return -1;
+	}
+	worker->recv_msg.msg_namelen = sizeof(struct sockaddr_in);
+
+	worker->udp_batch.uring = &worker->uring;
+	worker->udp_batch.uring_send_data = URING_UDP_SEND;
+	worker->use_uring = true;
+	return 0;
+}
+
+// have epoll watch the socket, timer and mailbox
+static int watch_fds(Worker* worker) {
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.fd = worker->udp_fd;
+	if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->udp_fd, &ev) == -1) {
+		perror("epoll_ctl");
+		return -1;
+	}
+	ev.events = EPOLLIN;
+	ev.data.fd = worker->timer_fd;
+	if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->timer_fd, &ev) == -1) {
+		perror("epoll_ctl");
+		return -1;
+	}
+	ev.data.fd = worker->mailbox_fd;
+	if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->mailbox_fd, &ev) == -1) {
+		perror("epoll_ctl");
+		return -1;
+	}
+	return 0;
+}
+
+int worker_init(Worker* worker, int index, int num_workers, int udp_fd, unsigned int udp_batch_size, uint32_t capacity, const char* replay_dir, bool full_rate_snapshots,
+		unsigned int spectator_interval, unsigned int spectator_delay, unsigned int step_ticks, bool use_uring) {
+	memset(worker, 0, sizeof(*worker));
+	worker->index = index;
+	worker->num_workers = num_workers;
+	worker->udp_fd = udp_fd;
+
+	if (match_table_init(&worker->match_table, capacity, index, num_workers) == -1) {
+		fprintf(stderr, "worker %d: failed to allocate %u matches\n", index, capacity);
+		return -1;
+	}
+	worker->match_table.replay_dir = replay_dir;
+	worker->match_table.step_ticks = step_ticks;
+
+	if (udp_batch_init(&worker->udp_batch, udp_fd, udp_batch_size) == -1) {
+		fprintf(stderr, "worker %d: failed to allocate UDP batch of %u\n", index, udp_batch_size);
+		return -1;
+	}
+
+	worker->epoll_fd = epoll_create1(0);
+	if (worker->epoll_fd == -1) {
+		perror("epoll_create1");
+		return -1;
+	}
+
+	// the tick timer is just another fd in the event loop, so the simulation
+	// runs on this thread and never races with the socket handlers
+	worker->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (worker->timer_fd == -1) {
+		perror("timerfd_create");
+		return -1;
+	}
+
+	worker->mailbox_fd = eventfd(0, EFD_NONBLOCK);
+	if (worker->mailbox_fd == -1) {
+		perror("eventfd");
+		return -1;
+	}
+	pthread_mutex_init(&worker->mailbox_lock, NULL);
+	worker->notify_fd = -1;
+	pthread_mutex_init(&worker->outbox_lock, NULL);
+
+	if (use_uring) {
+		if (init_uring(worker, udp_batch_size) == -1)
+			return -1;
+	} else if (watch_fds(worker) == -1) {
+		return -1;
+	}
+
+	worker->tick_state.match_table = &worker->match_table;
+	worker->tick_state.udp_batch = &worker->udp_batch;
+	worker->tick_state.metrics = &worker->metrics;
+	worker->tick_state.udp_sock_fd = udp_fd;
+	worker->tick_state.timer_fd = worker->timer_fd;
+	worker->tick_state.full_rate_snapshots = full_rate_snapshots;
+	worker->tick_state.spectator_interval = spectator_interval;
+	worker->tick_state.spectator_delay = spectator_delay;
+	return 0;
+}
+
+/**
+ * Queue a command for the worker and wake its event loop.  Safe to call
+ * from any thread.  Returns -1 if there was no room to queue it.
+ */
+int worker_post(Worker* worker, const WorkerCommand* command) {
+	pthread_mutex_lock(&worker->mailbox_lock);
+	if (worker->mailbox_count == worker->mailbox_capacity) {
+		size_t capacity = worker->mailbox_capacity ? worker->mailbox_capacity * 2 : 64;
+		WorkerCommand* mailbox = realloc(worker->mailbox, capacity * sizeof(WorkerCommand));
+		if (mailbox == NULL) {
+			pthread_mutex_unlock(&worker->mailbox_lock);
+			return -1;
+		}
+		worker->mailbox = mailbox;
+		worker->mailbox_capacity = capacity;
+	}
+	worker->mailbox[worker->mailbox_count++] = *command;
+	pthread_mutex_unlock(&worker->mailbox_lock);
+
+	// once queued it runs, so a failed wakeup is only reported
+	uint64_t one = 1;
+	if (write(worker->mailbox_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+		perror("write");
+	return 0;
+}
+
+// queue an event for the control plane and wake it
+static void worker_notify(Worker* worker, const WorkerEvent* event) {
+	pthread_mutex_lock(&worker->outbox_lock);
+	if (worker->outbox_count == worker->outbox_capacity) {
+		size_t capacity = worker->outbox_capacity ? worker->outbox_capacity * 2 : 64;
+		WorkerEvent* outbox = realloc(worker->outbox, capacity * sizeof(WorkerEvent));
+		if (outbox == NULL) {
+			pthread_mutex_unlock(&worker->outbox_lock);
+			LOG_ERROR("worker %d: out of memory for events", worker->index);
+			return;
+		}
+		worker->outbox = outbox;
+		worker->outbox_capacity = capacity;
+	}
+	worker->outbox[worker->outbox_count++] = *event;
+	pthread_mutex_unlock(&worker->outbox_lock);
+
+	uint64_t one = 1;
+	if (worker->notify_fd != -1 && write(worker->notify_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+		perror("write");
+}
+
+/**
+ * Take the events the worker has queued, in order, for the caller to free.
+ * Safe to call from any thread.
+ */
+WorkerEvent* worker_events(Worker* worker, size_t* count) {
+	pthread_mutex_lock(&worker->outbox_lock);
+	WorkerEvent* events = worker->outbox;
+	*count = worker->outbox_count;
+	worker->outbox = NULL;
+	worker->outbox_count = 0;
+	worker->outbox_capacity = 0;
+	pthread_mutex_unlock(&worker->outbox_lock);
+	return events;
+}
+
+/**
+ * End a match whose player left, freeing its seats, and tell the control
+ * plane so it can give the id out again and let the players register anew
+ */
+static void end_match(Worker* worker, Match* match) {
+	WorkerEvent event = { .type = WORKER_MATCH_ENDED, .match_id = match->match_id };
+	for (int slot = 0; slot < MAX_CLIENTS; slot++)
+		event.tcp_fds[slot] = match->clients[slot].active ? match->clients[slot].tcp_fd : -1;
+
+	WorkerMetrics* metrics = &worker->metrics;
+	metrics_set(&metrics->active_matches, metrics_get(&metrics->active_matches) - 1);
+	metrics_set(&metrics->spectators, metrics_get(&metrics->spectators) - match->num_spectators);
+	metrics_set(&metrics->players_away, metrics_get(&metrics->players_away) - match->num_away);
+	match_table_end(&worker->match_table, match);
+	worker_notify(worker, &event);
+}
+
+static void handle_command(Worker* worker, const WorkerCommand* command) {
+	switch (command->type) {
+	case WORKER_ADD_CLIENT: {
+		Match* match = match_table_add_client(&worker->match_table, command->match_id, command->slot, command->tcp_fd, command->replay);
+		if (match != NULL && match->num_clients == 1)
+			metrics_add(&worker->metrics.active_matches, 1);
+		if (match == NULL)
+			LOG_WARN("worker %d: could not seat client in match %u slot %d", worker->index, command->match_id, command->slot);
+		else
+			LOG_DEBUG("worker %d: seated client in match %u slot %d", worker->index, command->match_id, command->slot);
+		break;
+	}
+	case WORKER_REMOVE_CLIENT: {
+		int slot;
+		Match* match = match_table_lookup(&worker->match_table, player_id_for(command->match_id, command->slot), &slot);
+		if (match == NULL)
+			break;
+		LOG_INFO("worker %d: player %u hung up, ending match %u", worker->index, match->clients[slot].player_id, match->match_id);
+		end_match(worker, match);
+		break;
+	}
+	case WORKER_ADD_SPECTATOR: {
+		// the match may have ended since the control plane saw it in use
+		Match* match = match_table_find(&worker->match_table, command->match_id);
+		if (match == NULL || match->num_clients == 0 || match_add_spectator(match, command->spectator_id) == -1) {
+			LOG_WARN("worker %d: could not add spectator %u to match %u", worker->index, command->spectator_id, command->match_id);
+			WorkerEvent event = { .type = WORKER_SPECTATE_FAILED, .match_id = command->match_id,
+				.spectator_id = command->spectator_id, .spectator_fd = command->tcp_fd };
+			worker_notify(worker, &event);
+			break;
+		}
+		metrics_add(&worker->metrics.spectators, 1);
+		LOG_DEBUG("worker %d: spectator %u watching match %u", worker->index, command->spectator_id, command->match_id);
+		break;
+	}
+	case WORKER_REMOVE_SPECTATOR: {
+		Match* match = match_table_find(&worker->match_table, command->match_id);
+		if (match == NULL || match_find_spectator(match, command->spectator_id) == NULL)
+			break;
+		match_remove_spectator(match, command->spectator_id);
+		metrics_set(&worker->metrics.spectators, metrics_get(&worker->metrics.spectators) - 1);
+		break;
+	}
+	case WORKER_STOP:
+		worker->stopping = true;
+		break;
+	}
+}
+
+// swap the mailbox out under the lock, then run its commands without it
+static void handle_mailbox(Worker* worker) {
+	uint64_t pending;
+	if (read(worker->mailbox_fd, &pending, sizeof(pending)) == -1)
+		return;
+
+	pthread_mutex_lock(&worker->mailbox_lock);
+	WorkerCommand* commands = worker->mailbox;
+	size_t count = worker->mailbox_count;
+	worker->mailbox = NULL;
+	worker->mailbox_count = 0;
+	worker->mailbox_capacity = 0;
+	pthread_mutex_unlock(&worker->mailbox_lock);
+
+	for (size_t i = 0; i < count; i++)
+		handle_command(worker, &commands[i]);
+	free(commands);
+}
+
+// a spectator telling us where to send the match they're watching
+static void handle_spectate(Worker* worker, const uint8_t* buffer, unsigned int nbytes, const struct sockaddr_in* from)
+{
+	SpectateMessage message;
+	if (nbytes != SPECTATE_MESSAGE_SIZE || decode_spectate_message(buffer, nbytes, &message) == -1) {
+		metrics_add(&worker->metrics.udp_malformed_packets, 1);
+		return;
+	}
+
+	Match* match = match_table_find(&worker->match_table, match_id_for(message.id));
+	Spectator* spectator = match != NULL ? match_find_spectator(match, message.spectator_id) : NULL;
+	if (spectator == NULL) {
+		metrics_add(&worker->metrics.udp_unknown_player, 1);
+		LOG_DEBUG("Ignoring spectate datagram for unknown spectator %u", message.spectator_id);
+		return;
+	}
+	metrics_add(&match->metrics.udp_received_packets, 1);
+	metrics_add(&match->metrics.udp_received_bytes, nbytes);
+	spectator->addr = *from;
+}
+
+/**
+ * A player's clock probe.  It's answered at once with the time it arrived,
+ * and if it echoes an earlier pong, the time since that pong went out less
+ * what the client held it for is a round trip, smoothed into the player's
+ * estimate the way TCP smooths its own.
+ */
+static void handle_ping(Worker* worker, const uint8_t* buffer, unsigned int nbytes, const struct sockaddr_in* from, uint64_t received_ns)
+{
+	PingMessage message;
+	if (nbytes != PING_MESSAGE_SIZE || decode_ping_message(buffer, nbytes, &message) == -1) {
+		metrics_add(&worker->metrics.udp_malformed_packets, 1);
+		return;
+	}
+
+	int client_index;
+	Match* match = match_table_lookup(&worker->match_table, message.id, &client_index);
+	if (match == NULL) {
+		metrics_add(&worker->metrics.udp_unknown_player, 1);
+		LOG_DEBUG("Ignoring ping from unknown player_id %u", message.id);
+		return;
+	}
+	if (match->away[client_index]) {
+		metrics_set(&worker->metrics.players_away, metrics_get(&worker->metrics.players_away) - 1);
+		LOG_INFO("worker %d: player %u is back in match %u", worker->index, message.id, match->match_id);
+	}
+	match_table_touch(&worker->match_table, match, client_index);
+	metrics_add(&match->metrics.udp_received_packets, 1);
+	metrics_add(&match->metrics.udp_received_bytes, nbytes);
+
+	Client* client = &match->clients[client_index];
+	uint64_t received_us = received_ns / 1000;
+	if (message.echo_time != 0 && message.echo_time + message.echo_delay <= received_us) {
+		uint64_t sample = received_us - message.echo_time - message.echo_delay;
+		if (sample <= UINT32_MAX) {
+			histogram_record(&worker->metrics.player_rtt, sample * 1000);
+			if (client->rtt_us == 0)
+				client->rtt_us = (uint32_t)sample;
+			else
+				client->rtt_us = (uint32_t)((int64_t)client->rtt_us + ((int64_t)sample - client->rtt_us) / 8);
+		}
+	}
+
+	PongMessage pong = {
+		.client_time = message.client_time,
+		.server_time = received_us,
+		.rtt = client->rtt_us
+	};
+	uint8_t* out = udp_batch_reserve(&worker->udp_batch);
+	encode_pong_message(out, &pong);
+	udp_batch_commit(&worker->udp_batch, from, PONG_MESSAGE_SIZE);
+	metrics_add(&match->metrics.udp_sent_packets, 1);
+	metrics_add(&match->metrics.udp_sent_bytes, PONG_MESSAGE_SIZE);
+	metrics_add(&worker->metrics.udp_sent_packets, 1);
+	metrics_add(&worker->metrics.udp_sent_bytes, PONG_MESSAGE_SIZE);
+}
+
+// one datagram from a player or spectator
+static void handle_datagram(Worker* worker, const uint8_t* buffer, unsigned int nbytes, const struct sockaddr_in* from, uint64_t received_ns)
+{
+	metrics_add(&worker->metrics.udp_received_packets, 1);
+	metrics_add(&worker->metrics.udp_received_bytes, nbytes);
+
+	switch (client_datagram_type(buffer, nbytes)) {
+	case CLIENT_SPECTATE:
+		handle_spectate(worker, buffer, nbytes, from);
+		return;
+	case CLIENT_PING:
+		handle_ping(worker, buffer, nbytes, from, received_ns);
+		return;
+	}
+
+	InputMessage inputMessage;
+	if (deserialize_input_message(buffer, nbytes, &inputMessage) == -1) {
+		metrics_add(&worker->metrics.udp_malformed_packets, 1);
+		LOG_DEBUG("Ignoring malformed UDP packet of %u bytes", nbytes);
+		return;
+	}
+
+	int client_index;
+	Match* match = match_table_lookup(&worker->match_table, inputMessage.id, &client_index);
+	if (match != NULL) {
+		if (match->away[client_index]) {
+			metrics_set(&worker->metrics.players_away, metrics_get(&worker->metrics.players_away) - 1);
+			LOG_INFO("worker %d: player %u is back in match %u", worker->index, inputMessage.id, match->match_id);
+		}
+		match_table_touch(&worker->match_table, match, client_index);
+		metrics_add(&match->metrics.udp_received_packets, 1);
+		metrics_add(&match->metrics.udp_received_bytes, nbytes);
+		char address[INET_ADDRSTRLEN];
+		LOG_DEBUG("Received %u bytes of UDP data from %s:%u for match %u client %d (player_id %u)",
+			nbytes, inet_ntop(AF_INET, &from->sin_addr, address, sizeof(address)), ntohs(from->sin_port),
+			match->match_id, client_index, inputMessage.id);
+		// hand the input to the simulation, which applies it on its next step
+		InputEvent event = {
+			.addr = *from,
+			.received_ns = received_ns,
+			.ack = inputMessage.ack,
+			.first_seq = inputMessage.first_seq,
+			.count = inputMessage.count,
+			.slot = client_index
+		};
+		memcpy(event.commands, inputMessage.commands, inputMessage.count * sizeof(InputCommand));
+		if (!input_queue_push(&match->inputs, &event)) {
+			metrics_add(&worker->metrics.inputs_dropped, 1);
+			LOG_WARN("Dropping input for match %u client %d, queue full", match->match_id, client_index);
+		}
+	} else {
+		metrics_add(&worker->metrics.udp_unknown_player, 1);
+		LOG_DEBUG("Ignoring UDP packet with unknown player_id %u", inputMessage.id);
+	}
+}
+
+/**
+ * A player's liveness check came round.  If they've been heard from since
+ * it was set, it's set again from then; otherwise a player quiet for
+ * SESSION_AWAY_TICKS is marked away, holding the match, and one quiet for
+ * SESSION_TIMEOUT_TICKS ends it.
+ */
+static void check_session(TimerEntry* timer, void* arg) {
+	Worker* worker = arg;
+	MatchTable* table = &worker->match_table;
+	int slot;
+	Match* match = match_table_lookup(table, timer->id, &slot);
+	if (match == NULL)
+		return;
+
+	uint64_t quiet = table->sessions.now - match->last_seen[slot];
+	if (quiet >= SESSION_TIMEOUT_TICKS) {
+		LOG_INFO("worker %d: player %u timed out, ending match %u", worker->index, timer->id, match->match_id);
+		metrics_add(&worker->metrics.sessions_expired, 1);
+		end_match(worker, match);
+		return;
+	}
+	if (quiet >= SESSION_AWAY_TICKS && !match->away[slot]) {
+		LOG_INFO("worker %d: player %u went quiet, holding match %u", worker->index, timer->id, match->match_id);
+		match->away[slot] = true;
+		match->num_away++;
+		metrics_add(&worker->metrics.players_away, 1);
+	}
+	uint64_t timeout = match->away[slot] ? SESSION_TIMEOUT_TICKS : SESSION_AWAY_TICKS;
+	timer_wheel_schedule(&table->sessions, timer, match->last_seen[slot] + timeout);
+}
+
+// step the matches, then check on the players whose time is up
+static void handle_tick(Worker* worker) {
+	tick(&worker->tick_state);
+	timer_wheel_advance(&worker->match_table.sessions, worker->tick_state.tick_count, check_session, worker);
+}
+
+static uint64_t now_ns(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// drain every queued datagram from the UDP socket, a batch per syscall
+static void handle_udp(Worker* worker)
+{
+	UdpBatch* batch = &worker->udp_batch;
+	for (;;) {
+		int count = udp_batch_recv(batch);
+		if (count <= 0)
+			return;
+
+		uint64_t received_ns = now_ns();
+		for (int n = 0; n < count; n++) {
+			unsigned int nbytes;
+			const struct sockaddr_in* from;
+			const uint8_t* buffer = udp_batch_recv_data(batch, n, &nbytes, &from);
+			handle_datagram(worker, buffer, nbytes, from, received_ns);
+		}
+
+		// a short batch means the socket is empty
+		if ((unsigned int)count < batch->batch_size)
+			break;
+	}
+
+	// pongs go straight back rather than waiting for the tick, or they'd
+	// measure its phase as well as the network
+	if (batch->send_count > 0)
+		udp_batch_flush(batch);
+}
+
+static void run_epoll(Worker* worker) {
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	for (;;) {
+		int nready = epoll_wait(worker->epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+		if (nready == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			exit(4);
+		}
+
+		for (int n = 0; n < nready; n++) {
+			int fd = events[n].data.fd;
+			if (fd == worker->timer_fd) {
+				handle_tick(worker);
+			} else if (fd == worker->udp_fd) {
+				handle_udp(worker);
+			} else if (fd == worker->mailbox_fd) {
+				handle_mailbox(worker);
+			}
+		}
+
+		if (worker->stopping)
+			return;
+	}
+}
+
+// (re)submit one of the worker's multishot requests
+static void arm_uring(Worker* worker, uint64_t request) {
+	struct io_uring_sqe* sqe = uring_get_sqe(&worker->uring);
+	if (sqe == NULL) {
+		fprintf(stderr, "worker %d: io_uring submission queue full\n", worker->index);
+		exit(4);
+	}
+	if (request == URING_TIMER)
+		uring_prep_poll_multishot(sqe, worker->timer_fd, URING_TIMER);
+	else if (request == URING_MAILBOX)
+		uring_prep_poll_multishot(sqe, worker->mailbox_fd, URING_MAILBOX);
+	else
+		uring_prep_recvmsg_multishot(sqe, worker->udp_fd, &worker->recv_msg, worker->recv_buffers.group, URING_UDP_RECV);
+	worker->uring_armed++;
+}
+
+// a datagram the kernel put in one of the receive buffers
+static void handle_uring_datagram(Worker* worker, const struct io_uring_cqe* cqe, uint64_t received_ns) {
+	uint8_t* buffer = uring_buffer(&worker->recv_buffers, cqe);
+	const struct io_uring_recvmsg_out* out = (const struct io_uring_recvmsg_out*)buffer;
+	if ((out->flags & MSG_TRUNC) || out->namelen < sizeof(struct sockaddr_in)) {
+		metrics_add(&worker->metrics.udp_received_packets, 1);
+		metrics_add(&worker->metrics.udp_malformed_packets, 1);
+	} else {
+		struct sockaddr_in from;
+		memcpy(&from, buffer + sizeof(*out), sizeof(from));
+		const uint8_t* payload = buffer + sizeof(*out) + worker->recv_msg.msg_namelen + worker->recv_msg.msg_controllen;
+		handle_datagram(worker, payload, out->payloadlen, &from, received_ns);
+	}
+	uring_buffers_return(&worker->recv_buffers, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+}
+
+static void handle_completion(Worker* worker, const struct io_uring_cqe* cqe, uint64_t received_ns) {
+	switch (cqe->user_data) {
+	case URING_TIMER:
+		if (cqe->res >= 0)
+			handle_tick(worker);
+		break;
+	case URING_MAILBOX:
+		if (cqe->res >= 0)
+			handle_mailbox(worker);
+		break;
+	case URING_UDP_RECV:
+		if (cqe->flags & IORING_CQE_F_BUFFER)
+			handle_uring_datagram(worker, cqe, received_ns);
+		else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED)
+			fprintf(stderr, "worker %d: recvmsg: %s\n", worker->index, strerror(-cqe->res));
+		break;
+	case URING_UDP_SEND:
+		udp_batch_sent(&worker->udp_batch, cqe->res);
+		return;
+	default:
+		// cancellations
+		return;
+	}
+
+	// a multishot request that ran out of buffers or failed has ended, and
+	// is resubmitted unless it was cancelled to stop
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		worker->uring_armed--;
+		if (!worker->stopping)
+			arm_uring(worker, cqe->user_data);
+	}
+}
+
+/**
+ * The same loop on io_uring: multishot requests deliver the timer, mailbox
+ * and every datagram as completions, sends go out as submissions, and
+ * waiting for the next completion submits whatever was queued in the same
+ * syscall.  Stopping cancels the requests and waits for them to end.
+ */
+static void run_uring(Worker* worker) {
+	arm_uring(worker, URING_TIMER);
+	arm_uring(worker, URING_MAILBOX);
+	arm_uring(worker, URING_UDP_RECV);
+
+	bool cancelled = false;
+	for (;;) {
+		if (uring_submit(&worker->uring, 1) == -1)
+			exit(4);
+
+		uint64_t received_ns = now_ns();
+		struct io_uring_cqe* cqe;
+		while ((cqe = uring_peek_cqe(&worker->uring)) != NULL) {
+			handle_completion(worker, cqe, received_ns);
+			uring_cqe_seen(&worker->uring);
+		}
+		if (worker->udp_batch.send_count > 0)
+			udp_batch_flush(&worker->udp_batch);
+
+		if (!worker->stopping)
+			continue;
+		if (worker->uring_armed == 0)
+			return;
+		if (!cancelled) {
+			uring_prep_cancel(uring_get_sqe(&worker->uring), URING_TIMER);
+			uring_prep_cancel(uring_get_sqe(&worker->uring), URING_MAILBOX);
+			uring_prep_cancel(uring_get_sqe(&worker->uring), URING_UDP_RECV);
+			cancelled = true;
+		}
+	}
+}
+
+static void* worker_main(void* arg) {
+	Worker* worker = arg;
+
+	clock_gettime(CLOCK_MONOTONIC, &worker->tick_state.latest_tick);
+
+	struct itimerspec its;
+	its.it_value.tv_sec = 0;
+	its.it_value.tv_nsec = TICK_RATE * 1000000;
+	its.it_interval = its.it_value;
+
+	if (timerfd_settime(worker->timer_fd, 0, &its, NULL) == -1) {
+		perror("timerfd_settime");
+		exit(1);
+	}
+	struct timespec* start = &worker->tick_state.latest_tick;
+	uint64_t start_ns = (uint64_t)start->tv_sec * 1000000000ull + start->tv_nsec;
+	worker->tick_state.next_deadline_ns = start_ns + TICK_RATE * 1000000ull;
+	// ticks restored by a handoff happened before now
+	worker->tick_state.epoch_ns = start_ns - worker->tick_state.tick_count * TICK_RATE * 1000000ull;
+
+	LOG_INFO("worker %d: hosting up to %u matches, %s physics, %s.", worker->index, worker->match_table.capacity, worker->match_table.physics.kernel_name,
+		worker->use_uring ? "io_uring" : "epoll");
+
+	if (worker->use_uring)
+		run_uring(worker);
+	else
+		run_epoll(worker);
+
+	struct itimerspec disarm = { 0 };
+	timerfd_settime(worker->timer_fd, 0, &disarm, NULL);
+	udp_batch_flush(&worker->udp_batch);
+	worker->stopping = false;
+	return NULL;
+}
+
+/**
+ * Start the worker's thread, pinned to the core matching its index
+ */
+int worker_start(Worker* worker) {
+	int rv = pthread_create(&worker->thread, NULL, worker_main, worker);
+	if (rv != 0) {
+		fprintf(stderr, "worker %d: pthread_create: %s\n", worker->index, strerror(rv));
+		return -1;
+	}
+
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus > 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(worker->index % ncpus, &cpus);
+		rv = pthread_setaffinity_np(worker->thread, sizeof(cpus), &cpus);
+		if (rv != 0)
+			fprintf(stderr, "worker %d: pthread_setaffinity_np: %s\n", worker->index, strerror(rv));
+	}
+	return 0;
+}
+
+/**
+ * Have the worker finish what it's doing and wait for its thread to exit.
+ * Its sockets and matches are left as they are, and worker_start() picks
+ * up where it stopped.
+ */
+int worker_stop(Worker* worker) {
+	WorkerCommand command = { .type = WORKER_STOP };
+	if (worker_post(worker, &command) == -1)
+		return -1;
+	int rv = pthread_join(worker->thread, NULL);
+	if (rv != 0) {
+		fprintf(stderr, "worker %d: pthread_join: %s\n", worker->index, strerror(rv));
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Append a stopped worker's clock and matches for a handoff
+ */
+int worker_export(const Worker* worker, HandoffBuffer* buffer) {
+	WorkerRecord record = {
+		.tick_count = worker->tick_state.tick_count,
+		.num_matches = match_table_count(&worker->match_table),
+	};
+	if (HANDOFF_PUT(buffer, worker_record, WORKER_RECORD_SCHEMA, &record) == -1)
+		return -1;
+	return match_table_export(&worker->match_table, buffer);
+}
+
+/**
+ * Restore what worker_export() appended into a worker that hasn't been
+ * started, adding the ids of the matches that are being played to
+ * match_ids so the control plane doesn't hand them out again
+ */
+int worker_import(Worker* worker, HandoffBuffer* buffer, const int* fd_map, size_t fd_map_size, uint32_t* match_ids, uint32_t* num_match_ids) {
+	WorkerRecord record;
+	if (HANDOFF_GET(buffer, worker_record, WORKER_RECORD_SCHEMA, &record) == -1)
+		return -1;
+	worker->tick_state.tick_count = record.tick_count;
+
+	MatchTable* table = &worker->match_table;
+	timer_wheel_init(&table->sessions, record.tick_count);
+	if (match_table_import(table, buffer, record.num_matches, fd_map, fd_map_size) == -1)
+		return -1;
+
+	for (uint32_t i = 0; i < table->high_water; i++) {
+		Match* match = &table->matches[i];
+		if (match->num_clients > 0) {
+			match_ids[(*num_match_ids)++] = match->match_id;
+			metrics_add(&worker->metrics.active_matches, 1);
+		}
+		metrics_add(&worker->metrics.spectators, match->num_spectators);
+	}
+	return 0;
+}
@@ -0,0 +1,101 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "match.h"
+#include "game.h"
+#include "udp_batch.h"
+#include "uring.h"
+
+typedef enum {
+	WORKER_ADD_CLIENT,
+	WORKER_REMOVE_CLIENT,	// their connection closed, which ends the match
+	WORKER_ADD_SPECTATOR,
+	WORKER_REMOVE_SPECTATOR,
+	WORKER_STOP,
+} WorkerCommandType;
+
+/**
+ * request from the control plane to a worker, delivered through its mailbox
+ */
+typedef struct {
+	WorkerCommandType type;
+	uint32_t match_id;
+	int slot;
+	int tcp_fd;
+	uint32_t spectator_id;
+	ReplayWriter* replay;	// WORKER_ADD_CLIENT: the match's recording, opened by the control plane
+} WorkerCommand;
+
+typedef enum {
+	WORKER_MATCH_ENDED,
+	WORKER_SPECTATE_FAILED,	// the match ended before the spectator could be added
+} WorkerEventType;
+
+/**
+ * news from a worker for the control plane, collected with worker_events()
+ */
+typedef struct {
+	WorkerEventType type;
+	uint32_t match_id;
+	int tcp_fds[MAX_CLIENTS];	// the players' connections, -1 for empty seats
+	uint32_t spectator_id;	// with WORKER_SPECTATE_FAILED, the viewer turned away
+	int spectator_fd;	// and their connection
+} WorkerEvent;
+
+/**
+ * one simulation thread: its own UDP socket, event loop, tick timer and
+ * share of the matches.  Nothing in here is touched by other threads
+ * except the mailbox and the metrics, which are atomics.
+ */
+typedef struct Worker {
+	int index;
+	int num_workers;
+	pthread_t thread;
+
+	int epoll_fd;
+	int udp_fd;
+	int timer_fd;
+	bool stopping;	// leave the event loop once this batch of events is handled
+
+	// with io_uring, the socket, timer and mailbox are watched by multishot
+	// requests on the ring instead of epoll, and datagrams land in recv_buffers
+	bool use_uring;
+	Uring uring;
+	UringBuffers recv_buffers;
+	struct msghdr recv_msg;
+	unsigned int uring_armed;	// multishot requests still live
+
+	// commands posted by the control plane, signalled through an eventfd
+	int mailbox_fd;
+	pthread_mutex_t mailbox_lock;
+	WorkerCommand* mailbox;
+	size_t mailbox_count;
+	size_t mailbox_capacity;
+
+	// events for the control plane, which is woken through notify_fd
+	int notify_fd;
+	pthread_mutex_t outbox_lock;
+	WorkerEvent* outbox;
+	size_t outbox_count;
+	size_t outbox_capacity;
+
+	MatchTable match_table;
+	UdpBatch udp_batch;
+	TickState tick_state;
+	WorkerMetrics metrics;
+} Worker;
+
+int worker_init(Worker* worker, int index, int num_workers, int udp_fd, unsigned int udp_batch_size, uint32_t capacity, const char* replay_dir, bool full_rate_snapshots,
+		unsigned int spectator_interval, unsigned int spectator_delay, unsigned int step_ticks, bool use_uring);
+int worker_start(Worker* worker);
+int worker_post(Worker* worker, const WorkerCommand* command);
+WorkerEvent* worker_events(Worker* worker, size_t* count);
+int worker_stop(Worker* worker);
+
+int worker_export(const Worker* worker, HandoffBuffer* buffer);
+int worker_import(Worker* worker, HandoffBuffer* buffer, const int* fd_map, size_t fd_map_size, uint32_t* match_ids, uint32_t* num_match_ids);
+
+#endif
@@ -0,0 +1,326 @@
+/*
+ * bench.c -- microbenchmarks for the tick physics and protocol code
+ *
+ * Each benchmark runs over a working set of 1 to 100k matches so cache
+ * effects show up as the set outgrows each level.  Results are printed as
+ * one JSON object per line on stdout; a readable table goes to stderr.
+ * Cycles and cache misses come from perf_event_open and are null when the
+ * kernel doesn't allow it (e.g. in containers).
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "config.h"
+#include "protocol.h"
+#include "match.h"
+#include "game.h"
+
+#define BENCH_MIN_OPS 2000000ull
+
+static const uint32_t match_counts[] = { 1, 10, 100, 1000, 10000, 100000 };
+
+typedef struct {
+	int cycles_fd;
+	int misses_fd;
+} Counters;
+
+typedef struct {
+	uint64_t ns;
+	int64_t cycles;		// -1 when unavailable
+	int64_t cache_misses;	// -1 when unavailable
+} Sample;
+
+static int open_counter(uint64_t config, int group_fd) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+static void counters_open(Counters* counters) {
+	counters->cycles_fd = open_counter(PERF_COUNT_HW_CPU_CYCLES, -1);
+	counters->misses_fd = open_counter(PERF_COUNT_HW_CACHE_MISSES, counters->cycles_fd);
+}
+
+static void counters_start(Counters* counters) {
+	if (counters->cycles_fd != -1) {
+		ioctl(counters->cycles_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(counters->cycles_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	}
+}
+
+static int64_t read_counter(int fd) {
+	uint64_t value;
+	if (fd == -1 || read(fd, &value, sizeof(value)) != sizeof(value))
+		return -1;
+	return (int64_t)value;
+}
+
+static void counters_stop(Counters* counters, Sample* sample) {
+	if (counters->cycles_fd != -1)
+		ioctl(counters->cycles_fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+	sample->cycles = read_counter(counters->cycles_fd);
+	sample->cache_misses = read_counter(counters->misses_fd);
+}
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void report(const char* name, uint32_t matches, uint64_t ops, const Sample* sample) {
+	double ns_per_op = (double)sample->ns / ops;
+
+	printf("{\"bench\":\"%s\",\"matches\":%u,\"ops\":%lu,\"ns_per_op\":%.3f,", name, matches, ops, ns_per_op);
+	if (sample->cycles >= 0)
+		printf("\"cycles_per_op\":%.3f,", (double)sample->cycles / ops);
+	else
+		printf("\"cycles_per_op\":null,");
+	if (sample->cache_misses >= 0)
+		printf("\"cache_misses_per_op\":%.5f}\n", (double)sample->cache_misses / ops);
+	else
+		printf("\"cache_misses_per_op\":null}\n");
+	fflush(stdout);
+
+	fprintf(stderr, "%-32s %8u matches %10.2f ns/op", name, matches, ns_per_op);
+	if (sample->cycles >= 0)
+		fprintf(stderr, " %10.2f cycles/op %8.4f misses/op", (double)sample->cycles / ops, (double)sample->cache_misses / ops);
+	fprintf(stderr, "\n");
+}
+
+// enough passes over the working set to get a stable measurement
+static uint64_t passes_for(uint32_t matches) {
+	uint64_t passes = BENCH_MIN_OPS / matches;
+	return passes > 0 ? passes : 1;
+}
+
+// a table of matches mid-game, with paddles placed where the ball will hit them
+static void setup_matches(MatchTable* table, uint32_t matches) {
+	if (match_table_init(table, matches, 0, 1) == -1) {
+		fprintf(stderr, "bench: failed to allocate %u matches\n", matches);
+		exit(1);
+	}
+	for (uint32_t i = 0; i < matches; i++) {
+		for (int slot = 0; slot < MAX_CLIENTS; slot++)
+			match_table_add_client(table, i, slot, -1, NULL);
+
+		Match* match = &table->matches[i];
+		match->game_active = true;
+		match->start_tick = 1;
+		float ball_y = table->physics.ball_y[i];
+		match->player_positions[0] = (Position){ .x = 10.0f, .y = ball_y - 1.0f };
+		match->player_positions[1] = (Position){ .x = COLS - 10.0f, .y = ball_y - 1.0f };
+	}
+}
+
+static void bench_step_matches(Counters* counters, uint32_t matches) {
+	MatchTable table;
+	setup_matches(&table, matches);
+
+	uint64_t passes = passes_for(matches);
+	uint64_t tick_count = 1;
+	Sample sample;
+
+	counters_start(counters);
+	uint64_t start = now_ns();
+	for (uint64_t p = 0; p < passes; p++)
+		step_matches(&table, ++tick_count, TICK_SECONDS);
+	sample.ns = now_ns() - start;
+	counters_stop(counters, &sample);
+
+	report("step_matches", matches, passes * matches, &sample);
+	match_table_free(&table);
+}
+
+// the ball physics alone, with every match in play
+static void bench_physics(Counters* counters, uint32_t matches, const char* name, PhysicsKernel kernel) {
+	MatchTable table;
+	setup_matches(&table, matches);
+	PhysicsBatch* physics = &table.physics;
+	for (uint32_t i = 0; i < matches; i++) {
+		physics->step_dt[i] = TICK_SECONDS;
+		for (int p = 0; p < MAX_CLIENTS; p++) {
+			physics->paddle_x[p][i] = table.matches[i].player_positions[p].x;
+			physics->paddle_y[p][i] = table.matches[i].player_positions[p].y;
+		}
+	}
+
+	uint32_t lanes = (matches + PHYSICS_LANES - 1) / PHYSICS_LANES * PHYSICS_LANES;
+	uint64_t passes = passes_for(matches);
+	Sample sample;
+
+	counters_start(counters);
+	uint64_t start = now_ns();
+	for (uint64_t p = 0; p < passes; p++)
+		kernel(physics, lanes);
+	sample.ns = now_ns() - start;
+	counters_stop(counters, &sample);
+
+	report(name, matches, passes * matches, &sample);
+	match_table_free(&table);
+}
+
+static void fill_snapshots(GameStateMessage* messages, uint32_t matches) {
+	for (uint32_t i = 0; i < matches; i++) {
+		GameStateMessage* message = &messages[i];
+		message->sequence = i + 2;
+		message->left_score = i % 7;
+		message->right_score = i % 5;
+		message->game_active = true;
+		message->start_tick = 0;
+		message->num_positions = MAX_CLIENTS + 1;
+		for (int p = 0; p < MAX_CLIENTS + 1; p++) {
+			Position position = { .x = (i + p) % COLS, .y = (i * 3 + p) % ROWS, .dx = 12.5f, .dy = -11.0f };
+			quantize_position(&position, &message->positions[p]);
+		}
+	}
+}
+
+static void bench_serialize_game_state(Counters* counters, uint32_t matches, bool delta) {
+	GameStateMessage* messages = calloc(matches, sizeof(GameStateMessage));
+	GameStateMessage* bases = calloc(matches, sizeof(GameStateMessage));
+	fill_snapshots(messages, matches);
+	fill_snapshots(bases, matches);
+	// typical delta: only the ball moved
+	for (uint32_t i = 0; i < matches; i++) {
+		bases[i].sequence = messages[i].sequence - 1;
+		bases[i].positions[0].x ^= 1;
+	}
+
+	uint8_t buffer[MAX_SNAPSHOT_SIZE];
+	uint64_t passes = passes_for(matches);
+	size_t bytes = 0;
+	Sample sample;
+
+	counters_start(counters);
+	uint64_t start = now_ns();
+	for (uint64_t p = 0; p < passes; p++) {
+		for (uint32_t i = 0; i < matches; i++)
+			bytes += serialize_game_state_message(buffer, &messages[i], delta ? &bases[i] : NULL);
+	}
+	sample.ns = now_ns() - start;
+	counters_stop(counters, &sample);
+
+	// keep the compiler from discarding the work
+	if (bytes == 0)
+		fprintf(stderr, "bench: nothing serialized\n");
+
+	report(delta ? "serialize_game_state_delta" : "serialize_game_state_full", matches, passes * matches, &sample);
+	free(messages);
+	free(bases);
+}
+
+static void bench_deserialize_input(Counters* counters, uint32_t matches) {
+	size_t size = MAX_INPUT_MESSAGE_SIZE;
+	uint8_t* buffers = malloc((size_t)matches * MAX_CLIENTS * size);
+	uint32_t count = matches * MAX_CLIENTS;
+	for (uint32_t i = 0; i < count; i++) {
+		InputMessage msg = { .id = i + 1, .ack = i, .first_seq = i, .count = INPUT_REDUNDANCY };
+		for (int c = 0; c < INPUT_REDUNDANCY; c++)
+			msg.commands[c] = (InputCommand){ .tick = i + c, .move = c % 3 - 1 };
+		serialize_input_message(buffers + i * size, &msg);
+	}
+
+	uint64_t passes = passes_for(count);
+	uint32_t checksum = 0;
+	Sample sample;
+
+	counters_start(counters);
+	uint64_t start = now_ns();
+	for (uint64_t p = 0; p < passes; p++) {
+		for (uint32_t i = 0; i < count; i++) {
+			InputMessage msg;
+			if (deserialize_input_message(buffers + i * size, size, &msg) == 0)
+				checksum += msg.id;
+		}
+	}
+	sample.ns = now_ns() - start;
+	counters_stop(counters, &sample);
+
+	if (checksum == 0)
+		fprintf(stderr, "bench: nothing deserialized\n");
+
+	report("deserialize_input_message", matches, passes * count, &sample);
+	free(buffers);
+}
+
+static void bench_serialize_tcp_response(Counters* counters, uint32_t matches) {
+	uint32_t count = matches * MAX_CLIENTS;
+	struct TcpResponse* responses = calloc(count, sizeof(struct TcpResponse));
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t id = htonl(i + 1);
+		memcpy(responses[i].msg, &id, sizeof(id));
+		responses[i].length = 32;	// the size of a register response
+	}
+
+	uint8_t buffer[TCP_MAX_FRAME];
+	uint64_t passes = passes_for(count);
+	uint32_t checksum = 0;
+	Sample sample;
+
+	counters_start(counters);
+	uint64_t start = now_ns();
+	for (uint64_t p = 0; p < passes; p++) {
+		for (uint32_t i = 0; i < count; i++) {
+			serialize_tcp_response(&responses[i], buffer);
+			checksum += buffer[TCP_LENGTH_SIZE + 7];
+		}
+	}
+	sample.ns = now_ns() - start;
+	counters_stop(counters, &sample);
+
+	if (checksum == 0)
+		fprintf(stderr, "bench: nothing serialized\n");
+
+	report("serialize_tcp_response", matches, passes * count, &sample);
+	free(responses);
+}
+
+int main(int argc, char *argv[]) {
+	// optional filter: only run benchmarks whose name contains argv[1]
+	const char* filter = argc > 1 ? argv[1] : "";
+
+	Counters counters;
+	counters_open(&counters);
+	if (counters.cycles_fd == -1)
+		fprintf(stderr, "bench: hardware counters unavailable, reporting time only\n");
+
+	size_t num_counts = sizeof(match_counts) / sizeof(match_counts[0]);
+	for (size_t c = 0; c < num_counts; c++) {
+		uint32_t matches = match_counts[c];
+		if (strstr("step_matches", filter))
+			bench_step_matches(&counters, matches);
+		if (strstr("physics_scalar", filter))
+			bench_physics(&counters, matches, "physics_scalar", physics_step_scalar);
+#if defined(__x86_64__) || defined(__i386__)
+		if (strstr("physics_sse2", filter) && __builtin_cpu_supports("sse2"))
+			bench_physics(&counters, matches, "physics_sse2", physics_step_sse2);
+		if (strstr("physics_avx2", filter) && __builtin_cpu_supports("avx2"))
+			bench_physics(&counters, matches, "physics_avx2", physics_step_avx2);
+#endif
+		if (strstr("serialize_game_state_full", filter))
+			bench_serialize_game_state(&counters, matches, false);
+		if (strstr("serialize_game_state_delta", filter))
+			bench_serialize_game_state(&counters, matches, true);
+		if (strstr("deserialize_input_message", filter))
+			bench_deserialize_input(&counters, matches);
+		if (strstr("serialize_tcp_response", filter))
+			bench_serialize_tcp_response(&counters, matches);
+	}
+	return 0;
+}
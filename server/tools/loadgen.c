@@ -0,0 +1,535 @@
+/*
+ * loadgen.c -- simulates many headless clients against a game server
+ *
+ * Registers N clients over TCP, then drives each one's UDP traffic at a
+ * fixed rate while validating the snapshots that come back.  Reports
+ * achieved packet rates, snapshot inter-arrival jitter and loss, the
+ * round trips players measure by pinging the server, how old snapshots
+ * are when they arrive and how long input takes to show up in one.  Run
+ * through tools/netproxy to see them over a bad link.
+ * Optionally adds spectators spread across the matches, reported apart.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+
+#include "config.h"
+#include "protocol.h"
+
+#define LOADGEN_HISTORY 64
+#define LOADGEN_EPOLL_EVENTS 256
+#define LOADGEN_PING_INTERVAL_NS 500000000ull
+
+typedef struct {
+	int tcp_fd;
+	int udp_fd;
+	uint32_t player_id;	// or spectator id
+	uint32_t match_id;
+	bool spectator;
+	uint64_t last_send_ns;
+
+	// snapshots received, kept to decode deltas against
+	GameStateMessage history[LOADGEN_HISTORY];
+	uint32_t last_sequence;
+	uint64_t last_arrival_ns;
+
+	uint32_t last_tick;	// server tick of the newest snapshot
+
+	// newest pong, echoed in the next ping
+	uint64_t last_ping_ns;
+	uint64_t pong_server_time;
+	uint64_t pong_arrival_ns;
+
+	// the last few commands, resent in every datagram
+	float paddle_y;
+	uint32_t input_seq;
+	InputCommand commands[INPUT_REDUNDANCY];
+	uint64_t input_sent_ns[LOADGEN_HISTORY];	// by input sequence
+	uint32_t applied_seq;	// newest command a snapshot has included
+} SimClient;
+
+typedef struct {
+	uint64_t sent;
+	uint64_t received;
+	uint64_t invalid;
+	uint64_t lost;		// sequence numbers skipped over
+	uint64_t reordered;	// snapshots older than one already seen
+
+	// running inter-arrival statistics (Welford), in nanoseconds
+	uint64_t arrivals;
+	double mean_gap;
+	double m2_gap;
+	double max_gap;
+
+	uint64_t pongs;
+	double rtt_sum;		// nanoseconds
+	double rtt_max;
+
+	// snapshot arrival against its tick's server time, comparable because
+	// loadgen and the server read the same monotonic clock
+	uint64_t ages;
+	double age_sum;
+	double age_max;
+
+	// sending a command to receiving the first snapshot that includes it
+	uint64_t inputs_applied;
+	double input_latency_sum;
+	double input_latency_max;
+} Stats;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void usage(const char* prog) {
+	fprintf(stderr, "usage: %s [-s host] [-p port] [-n clients] [-v spectators] [-r rate_hz] [-d seconds]\n", prog);
+}
+
+// raise the fd limit, each client needs a TCP and a UDP socket
+static void raise_fd_limit(int clients) {
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == -1)
+		return;
+	rlim_t wanted = (rlim_t)clients * 2 + 64;
+	if (limit.rlim_cur >= wanted)
+		return;
+	limit.rlim_cur = wanted < limit.rlim_max ? wanted : limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+}
+
+static int read_full(int fd, uint8_t* buffer, size_t length) {
+	size_t total = 0;
+	while (total < length) {
+		ssize_t n = recv(fd, buffer + total, length - total, 0);
+		if (n <= 0)
+			return -1;
+		total += n;
+	}
+	return 0;
+}
+
+// open a TCP connection and ask to be matched with an opponent
+static int request_registration(const struct addrinfo* server, SimClient* client) {
+	client->tcp_fd = socket(server->ai_family, SOCK_STREAM, 0);
+	if (client->tcp_fd == -1) {
+		perror("socket");
+		return -1;
+	}
+	if (connect(client->tcp_fd, server->ai_addr, server->ai_addrlen) == -1) {
+		perror("connect");
+		return -1;
+	}
+
+	struct TcpMessage request = { .opcode = TCP_REGISTER };
+	uint8_t request_buffer[TCP_MAX_FRAME];
+	size_t request_length = serialize_tcp_message(&request, request_buffer);
+	if (send(client->tcp_fd, request_buffer, request_length, 0) == -1) {
+		perror("send");
+		return -1;
+	}
+	return 0;
+}
+
+// open a TCP connection and ask to watch a match
+static int request_spectate(const struct addrinfo* server, SimClient* client, uint32_t match_id) {
+	client->tcp_fd = socket(server->ai_family, SOCK_STREAM, 0);
+	if (client->tcp_fd == -1) {
+		perror("socket");
+		return -1;
+	}
+	if (connect(client->tcp_fd, server->ai_addr, server->ai_addrlen) == -1) {
+		perror("connect");
+		return -1;
+	}
+
+	struct TcpMessage request = { .opcode = TCP_SPECTATE };
+	SpectateRequest body = { .match_id = match_id };
+	request.length = encode_spectate_request((uint8_t*)request.msg, &body);
+	uint8_t request_buffer[TCP_MAX_FRAME];
+	size_t request_length = serialize_tcp_message(&request, request_buffer);
+	if (send(client->tcp_fd, request_buffer, request_length, 0) == -1) {
+		perror("send");
+		return -1;
+	}
+	client->spectator = true;
+	return 0;
+}
+
+// wait for the server to pair the client, or accept the spectator, reading its ids
+static int await_registration(SimClient* client) {
+	// read the length prefix, then the rest of the frame
+	uint8_t response_buffer[TCP_MAX_FRAME];
+	int length = -1;
+	if (read_full(client->tcp_fd, response_buffer, TCP_LENGTH_SIZE) == 0)
+		length = tcp_frame_length(response_buffer, sizeof(response_buffer));	// just checks the prefix is in range
+	struct TcpResponse response;
+	if (length <= 0 || read_full(client->tcp_fd, response_buffer + TCP_LENGTH_SIZE, length - TCP_LENGTH_SIZE) == -1
+			|| deserialize_tcp_response(response_buffer, length, &response) == -1) {
+		fprintf(stderr, "loadgen: server closed connection during registration\n");
+		return -1;
+	}
+
+	if (response.statuscode != TCP_STATUS_OK) {
+		fprintf(stderr, "loadgen: registration refused with status %u\n", response.statuscode);
+		return -1;
+	}
+
+	if (response.length < REGISTER_RESPONSE_SIZE) {
+		fprintf(stderr, "loadgen: registration response too short\n");
+		return -1;
+	}
+	RegisterResponse body;
+	decode_register_response_array((const uint8_t*)response.msg, &body, 1);
+	client->player_id = body.id;
+	client->match_id = body.match_id;
+	client->paddle_y = ROWS / 2.0f;
+	return 0;
+}
+
+static int open_udp(const struct addrinfo* server, SimClient* client) {
+	client->udp_fd = socket(server->ai_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	if (client->udp_fd == -1) {
+		perror("socket");
+		return -1;
+	}
+	// connected so the kernel filters out anything not from the server
+	if (connect(client->udp_fd, server->ai_addr, server->ai_addrlen) == -1) {
+		perror("connect");
+		return -1;
+	}
+	return 0;
+}
+
+// tell the server where to send the match, again every second in case it was lost
+static void send_spectate(SimClient* client, uint64_t now, Stats* stats) {
+	if (client->last_send_ns != 0 && now - client->last_send_ns < 1000000000ull)
+		return;
+	client->last_send_ns = now;
+
+	// any player id of the match routes the datagram to its worker
+	SpectateMessage msg = { .id = client->match_id * MAX_CLIENTS + 1, .spectator_id = client->player_id };
+	uint8_t buffer[SPECTATE_MESSAGE_SIZE];
+	size_t length = encode_spectate_message(buffer, &msg);
+	if (send(client->udp_fd, buffer, length, 0) == (ssize_t)length)
+		stats->sent++;
+}
+
+static void send_input(SimClient* client, uint64_t now, Stats* stats) {
+	// chase a target sweeping up and down so the paddle keeps moving
+	float target = (ROWS / 2.0f) + (ROWS / 3.0f) * sinf((float)(now / 1000000) / 500.0f + client->player_id);
+	int8_t move = target > client->paddle_y + 0.5f ? 1 : (target < client->paddle_y - 0.5f ? -1 : 0);
+	client->paddle_y += move * PLAYER_MOVE_SPEED * (float)TICK_SECONDS;
+
+	memmove(client->commands, client->commands + 1, (INPUT_REDUNDANCY - 1) * sizeof(InputCommand));
+	client->commands[INPUT_REDUNDANCY - 1] = (InputCommand){ .tick = client->last_tick, .move = move };
+	client->input_seq++;
+	client->input_sent_ns[client->input_seq % LOADGEN_HISTORY] = now;
+
+	uint8_t count = client->input_seq < INPUT_REDUNDANCY ? client->input_seq : INPUT_REDUNDANCY;
+	InputMessage msg = {
+		.id = client->player_id,
+		.ack = client->last_sequence,
+		.first_seq = client->input_seq - count + 1,
+		.count = count
+	};
+	memcpy(msg.commands, client->commands + INPUT_REDUNDANCY - count, count * sizeof(InputCommand));
+
+	uint8_t buffer[MAX_INPUT_MESSAGE_SIZE];
+	size_t length = serialize_input_message(buffer, &msg);
+	if (send(client->udp_fd, buffer, length, 0) == (ssize_t)length)
+		stats->sent++;
+}
+
+static void send_ping(SimClient* client, uint64_t now, Stats* stats) {
+	if (client->last_ping_ns != 0 && now - client->last_ping_ns < LOADGEN_PING_INTERVAL_NS)
+		return;
+	client->last_ping_ns = now;
+
+	PingMessage msg = {
+		.id = client->player_id,
+		.client_time = now / 1000,
+		.echo_time = client->pong_server_time,
+		.echo_delay = client->pong_server_time != 0 ? (now - client->pong_arrival_ns) / 1000 : 0
+	};
+	uint8_t buffer[PING_MESSAGE_SIZE];
+	size_t length = encode_ping_message(buffer, &msg);
+	if (send(client->udp_fd, buffer, length, 0) == (ssize_t)length)
+		stats->sent++;
+}
+
+static void record_pong(SimClient* client, const uint8_t* buffer, size_t length, uint64_t now, Stats* stats) {
+	PongMessage pong;
+	if (decode_pong_message(buffer, length, &pong) == -1 || pong.client_time * 1000 > now) {
+		stats->invalid++;
+		return;
+	}
+	double rtt = (double)(now - pong.client_time * 1000);
+	stats->pongs++;
+	stats->rtt_sum += rtt;
+	if (rtt > stats->rtt_max)
+		stats->rtt_max = rtt;
+	client->pong_server_time = pong.server_time;
+	client->pong_arrival_ns = now;
+}
+
+static void record_latency(SimClient* client, const GameStateMessage* snapshot, uint64_t now, Stats* stats) {
+	if (snapshot->server_time != 0 && snapshot->server_time * 1000 <= now) {
+		double age = (double)(now - snapshot->server_time * 1000);
+		stats->ages++;
+		stats->age_sum += age;
+		if (age > stats->age_max)
+			stats->age_max = age;
+	}
+
+	if (client->spectator || (int32_t)(snapshot->input_seq - client->applied_seq) <= 0
+			|| client->input_seq - snapshot->input_seq >= LOADGEN_HISTORY)
+		return;
+	client->applied_seq = snapshot->input_seq;
+	double latency = (double)(now - client->input_sent_ns[snapshot->input_seq % LOADGEN_HISTORY]);
+	stats->inputs_applied++;
+	stats->input_latency_sum += latency;
+	if (latency > stats->input_latency_max)
+		stats->input_latency_max = latency;
+}
+
+static void record_arrival(SimClient* client, uint64_t now, Stats* stats) {
+	if (client->last_arrival_ns != 0) {
+		double gap = (double)(now - client->last_arrival_ns);
+		stats->arrivals++;
+		double delta = gap - stats->mean_gap;
+		stats->mean_gap += delta / stats->arrivals;
+		stats->m2_gap += delta * (gap - stats->mean_gap);
+		if (gap > stats->max_gap)
+			stats->max_gap = gap;
+	}
+	client->last_arrival_ns = now;
+}
+
+static void receive_snapshots(SimClient* client, Stats* stats) {
+	uint8_t buffer[UDP_MAX_DATAGRAM];
+	for (;;) {
+		ssize_t n = recv(client->udp_fd, buffer, sizeof(buffer), 0);
+		if (n < 0)
+			return;
+		uint64_t now = now_ns();
+		stats->received++;
+		if (buffer[0] == SERVER_PONG) {
+			record_pong(client, buffer, n, now, stats);
+			continue;
+		}
+
+		uint32_t base_sequence = game_state_base_sequence(buffer, n);
+		const GameStateMessage* base = NULL;
+		if (base_sequence != 0)
+			base = &client->history[base_sequence % LOADGEN_HISTORY];
+
+		GameStateMessage snapshot;
+		if (deserialize_game_state_message(buffer, n, base, &snapshot) == -1) {
+			stats->invalid++;
+			continue;
+		}
+
+		if (client->last_sequence != 0) {
+			int32_t advance = (int32_t)(snapshot.sequence - client->last_sequence);
+			if (advance <= 0) {
+				stats->reordered++;
+				continue;
+			}
+			stats->lost += advance - 1;
+		}
+		client->last_sequence = snapshot.sequence;
+		client->last_tick = snapshot.tick;
+		client->history[snapshot.sequence % LOADGEN_HISTORY] = snapshot;
+		record_arrival(client, now, stats);
+		record_latency(client, &snapshot, now, stats);
+	}
+}
+
+static void report(const char* label, const Stats* stats, const Stats* previous, double seconds) {
+	double jitter = stats->arrivals > 1 ? sqrt(stats->m2_gap / (stats->arrivals - 1)) : 0.0;
+	uint64_t expected = stats->received - stats->pongs - stats->reordered + stats->lost;
+	double loss = expected > 0 ? 100.0 * stats->lost / expected : 0.0;
+	printf("%s sent=%.0f/s recv=%.0f/s gap_mean=%.2fms jitter=%.2fms gap_max=%.2fms loss=%.2f%% invalid=%lu reordered=%lu",
+		label,
+		(stats->sent - previous->sent) / seconds,
+		(stats->received - previous->received) / seconds,
+		stats->mean_gap / 1e6, jitter / 1e6, stats->max_gap / 1e6,
+		loss, stats->invalid, stats->reordered);
+	if (stats->pongs > 0)
+		printf(" rtt_mean=%.3fms rtt_max=%.3fms", stats->rtt_sum / stats->pongs / 1e6, stats->rtt_max / 1e6);
+	if (stats->ages > 0)
+		printf(" age_mean=%.2fms age_max=%.2fms", stats->age_sum / stats->ages / 1e6, stats->age_max / 1e6);
+	if (stats->inputs_applied > 0)
+		printf(" input_mean=%.2fms input_max=%.2fms", stats->input_latency_sum / stats->inputs_applied / 1e6, stats->input_latency_max / 1e6);
+	printf("\n");
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+	const char* host = "127.0.0.1";
+	const char* port = PORT;
+	int num_clients = 2;
+	int num_spectators = 0;
+	double rate_hz = 1000.0 / TICK_RATE;
+	double duration = 10.0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "s:p:n:v:r:d:")) != -1) {
+		switch (opt) {
+		case 's': host = optarg; break;
+		case 'p': port = optarg; break;
+		case 'n': num_clients = atoi(optarg); break;
+		case 'v': num_spectators = atoi(optarg); break;
+		case 'r': rate_hz = atof(optarg); break;
+		case 'd': duration = atof(optarg); break;
+		default:
+			usage(argv[0]);
+			exit(1);
+		}
+	}
+	if (num_clients <= 0 || num_spectators < 0 || rate_hz <= 0.0 || duration <= 0.0) {
+		usage(argv[0]);
+		exit(1);
+	}
+	if (num_clients % MAX_CLIENTS != 0) {
+		// the odd one out would wait for an opponent forever
+		fprintf(stderr, "loadgen: clients must be a multiple of %d\n", MAX_CLIENTS);
+		exit(1);
+	}
+
+	struct addrinfo hints = { .ai_family = AF_INET }, *server;
+	int rv = getaddrinfo(host, port, &hints, &server);
+	if (rv != 0) {
+		fprintf(stderr, "loadgen: %s\n", gai_strerror(rv));
+		exit(1);
+	}
+
+	raise_fd_limit(num_clients + num_spectators);
+
+	// spectators follow the players in the same array
+	int total = num_clients + num_spectators;
+	SimClient* clients = calloc(total, sizeof(SimClient));
+	if (clients == NULL) {
+		fprintf(stderr, "loadgen: failed to allocate %d clients\n", num_clients);
+		exit(1);
+	}
+
+	// REGISTER ===================================
+	// every request goes out before any answer is read, since the server
+	// only answers a player once it has found their opponent
+	uint64_t start = now_ns();
+	for (int i = 0; i < num_clients; i++) {
+		if (request_registration(server, &clients[i]) == -1 || open_udp(server, &clients[i]) == -1) {
+			fprintf(stderr, "loadgen: stopped after requesting %d registrations\n", i);
+			exit(2);
+		}
+	}
+	for (int i = 0; i < num_clients; i++) {
+		if (await_registration(&clients[i]) == -1) {
+			fprintf(stderr, "loadgen: stopped after registering %d clients\n", i);
+			exit(2);
+		}
+	}
+	double register_seconds = (now_ns() - start) / 1e9;
+	printf("registered %d clients in %.3fs (%.0f/s)\n", num_clients, register_seconds, num_clients / register_seconds);
+
+	// spread spectators round-robin over the matches
+	for (int i = num_clients; i < total; i++) {
+		uint32_t match_id = clients[((i - num_clients) * MAX_CLIENTS) % num_clients].match_id;
+		if (request_spectate(server, &clients[i], match_id) == -1 || open_udp(server, &clients[i]) == -1
+				|| await_registration(&clients[i]) == -1) {
+			fprintf(stderr, "loadgen: stopped after adding %d spectators\n", i - num_clients);
+			exit(2);
+		}
+	}
+	if (num_spectators > 0)
+		printf("added %d spectators\n", num_spectators);
+
+	int epoll_fd = epoll_create1(0);
+	for (int i = 0; i < total; i++) {
+		struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.u32 = i };
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, clients[i].udp_fd, &ev) == -1) {
+			perror("epoll_ctl");
+			exit(3);
+		}
+	}
+
+	// every client sends once per timer period
+	int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	uint64_t period_ns = (uint64_t)(1e9 / rate_hz);
+	struct itimerspec its = {
+		.it_value = { .tv_sec = period_ns / 1000000000ull, .tv_nsec = period_ns % 1000000000ull },
+		.it_interval = { .tv_sec = period_ns / 1000000000ull, .tv_nsec = period_ns % 1000000000ull },
+	};
+	timerfd_settime(timer_fd, 0, &its, NULL);
+	struct epoll_event timer_ev = { .events = EPOLLIN, .data.u32 = UINT32_MAX };
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &timer_ev);
+
+	// DRIVE TRAFFIC ==============================
+	Stats stats = {0}, last_report = {0};
+	Stats spectator_stats = {0}, last_spectator_report = {0};
+	start = now_ns();
+	uint64_t end = start + (uint64_t)(duration * 1e9);
+	uint64_t next_report = start + 1000000000ull;
+	struct epoll_event events[LOADGEN_EPOLL_EVENTS];
+
+	for (;;) {
+		uint64_t now = now_ns();
+		if (now >= end)
+			break;
+		if (now >= next_report) {
+			report("[1s]", &stats, &last_report, (now - next_report + 1000000000ull) / 1e9);
+			last_report = stats;
+			if (num_spectators > 0) {
+				report("[1s spectators]", &spectator_stats, &last_spectator_report, (now - next_report + 1000000000ull) / 1e9);
+				last_spectator_report = spectator_stats;
+			}
+			next_report += 1000000000ull;
+		}
+
+		int nready = epoll_wait(epoll_fd, events, LOADGEN_EPOLL_EVENTS, 100);
+		for (int n = 0; n < nready; n++) {
+			uint32_t index = events[n].data.u32;
+			if (index == UINT32_MAX) {
+				uint64_t expirations;
+				if (read(timer_fd, &expirations, sizeof(expirations)) <= 0)
+					continue;
+				now = now_ns();
+				for (int i = 0; i < num_clients; i++) {
+					send_input(&clients[i], now, &stats);
+					send_ping(&clients[i], now, &stats);
+				}
+				for (int i = num_clients; i < total; i++)
+					send_spectate(&clients[i], now, &spectator_stats);
+			} else {
+				receive_snapshots(&clients[index], clients[index].spectator ? &spectator_stats : &stats);
+			}
+		}
+	}
+
+	Stats zero = {0};
+	report("[total]", &stats, &zero, (now_ns() - start) / 1e9);
+	if (num_spectators > 0)
+		report("[total spectators]", &spectator_stats, &zero, (now_ns() - start) / 1e9);
+
+	for (int i = 0; i < total; i++) {
+		close(clients[i].udp_fd);
+		close(clients[i].tcp_fd);
+	}
+	freeaddrinfo(server);
+	free(clients);
+	return 0;
+}
@@ -0,0 +1,737 @@
+/*
+ * netproxy.c -- puts a bad network between clients and a game server
+ *
+ * Listens on a TCP and a UDP port and forwards everything to the server,
+ * holding each packet back according to a profile per direction: delay,
+ * jitter, loss, duplication, reordering and a bandwidth cap.  Datagrams
+ * get every impairment; TCP is a stream, so its chunks are only delayed
+ * and rate limited, in order.  Prints what it did to each direction every
+ * second and in total when it stops.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "config.h"
+
+#define PROXY_PORT "9035"
+#define PROXY_EPOLL_EVENTS 256
+#define PROXY_MAX_QUEUED 65536			// packets held back at once
+#define PROXY_MAX_BACKLOG_NS 1000000000ull	// queueing a bandwidth cap allows before dropping
+#define PROXY_MAX_DATAGRAM 65536
+#define PROXY_TCP_CHUNK 4096
+#define PROXY_FLOW_IDLE_NS 30000000000ull	// a client's datagram flow is forgotten after this long quiet
+#define PROXY_FLOW_BUCKETS 4096
+
+enum { UP, DOWN };	// client to server, server to client
+static const char* direction_names[] = { "up", "down" };
+
+// what an epoll event is for, in the top half of its data
+enum { EV_TIMER, EV_UDP_LISTEN, EV_TCP_LISTEN, EV_UDP_FLOW, EV_TCP_CLIENT, EV_TCP_SERVER };
+#define EVENT(type, index) (((uint64_t)(type) << 32) | (uint32_t)(index))
+
+/**
+ * how one direction of the link misbehaves
+ */
+typedef struct {
+	double delay_ms;
+	double jitter_ms;	// delay varies uniformly by up to this much either way
+	double loss;		// percent of datagrams dropped
+	double duplicate;	// percent of datagrams sent twice
+	double reorder;		// percent of datagrams sent without the delay, ahead of those held back
+	double rate_kbps;	// 0 for unlimited
+} Profile;
+
+typedef struct {
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t lost;
+	uint64_t overflowed;	// dropped because too much was queued
+	uint64_t duplicated;
+	uint64_t reordered;
+	uint64_t delivered;
+} DirectionStats;
+
+typedef struct {
+	Profile profile;
+	DirectionStats stats;
+	uint64_t link_free_ns;		// when the bandwidth cap lets the next packet start
+	uint64_t last_release_ns;	// in order packets never overtake each other
+} Direction;
+
+/**
+ * a datagram or stream chunk waiting for its release time
+ */
+typedef struct {
+	uint64_t release_ns;
+	uint64_t order;		// first come, first served among equal release times
+	bool tcp;
+	int direction;
+	uint32_t flow;
+	uint32_t generation;	// of the flow when queued, so a reused slot gets nothing stale
+	uint32_t length;	// 0 for a TCP connection closing
+	uint8_t data[];
+} Packet;
+
+/**
+ * a client's datagrams, relayed from a socket of its own so the server
+ * tells clients apart by port as it would without the proxy
+ */
+typedef struct {
+	struct sockaddr_in client;
+	int upstream_fd;	// -1 if the slot is free
+	uint32_t generation;
+	uint64_t last_seen_ns;
+	int32_t next;		// in its hash bucket, or the free list
+} UdpFlow;
+
+typedef struct {
+	int client_fd;		// -1 if the slot is free
+	int server_fd;
+	uint32_t generation;
+	int32_t next_free;
+} TcpPair;
+
+typedef struct {
+	int epoll_fd;
+	int timer_fd;
+	int udp_fd;
+	int tcp_fd;
+	struct sockaddr_in server;
+
+	Direction directions[2];
+	uint32_t rng_state;
+
+	Packet** queue;		// min-heap on release time
+	size_t queued;
+	uint64_t next_order;
+	uint64_t armed_ns;
+
+	UdpFlow* flows;
+	uint32_t num_flows;
+	int32_t free_flows;
+	int32_t buckets[PROXY_FLOW_BUCKETS];
+
+	TcpPair* pairs;
+	uint32_t num_pairs;
+	int32_t free_pairs;
+} Proxy;
+
+static volatile sig_atomic_t stopping;
+
+static void handle_signal(int sig) {
+	(void)sig;
+	stopping = 1;
+}
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void usage(const char* prog) {
+	fprintf(stderr, "usage: %s [-l listen_port] [-s server_host] [-p server_port] [-U profile] [-D profile] [-B profile] [-t seconds] [-S seed] [-q]\n", prog);
+	fprintf(stderr, "profiles are comma separated, e.g. delay=40,jitter=10,loss=2,dup=1,reorder=5,rate=512\n");
+	fprintf(stderr, "  delay, jitter  milliseconds\n");
+	fprintf(stderr, "  loss, dup, reorder  percent of datagrams\n");
+	fprintf(stderr, "  rate  kilobits per second, 0 for unlimited\n");
+}
+
+/**
+ * Apply the keys in spec to a profile, leaving the others as they were,
+ * so -B can set both directions and -U or -D adjust one of them
+ */
+static int parse_profile(const char* spec, Profile* profile) {
+	char* copy = strdup(spec);
+	char* saveptr;
+	int rv = 0;
+	for (char* item = strtok_r(copy, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr)) {
+		char* equals = strchr(item, '=');
+		char* end;
+		double value = equals != NULL ? strtod(equals + 1, &end) : 0.0;
+		if (equals == NULL || end == equals + 1 || *end != '\0' || value < 0) {
+			fprintf(stderr, "netproxy: bad profile setting '%s'\n", item);
+			rv = -1;
+			break;
+		}
+		*equals = '\0';
+		if (strcmp(item, "delay") == 0)
+			profile->delay_ms = value;
+		else if (strcmp(item, "jitter") == 0)
+			profile->jitter_ms = value;
+		else if (strcmp(item, "loss") == 0)
+			profile->loss = value;
+		else if (strcmp(item, "dup") == 0)
+			profile->duplicate = value;
+		else if (strcmp(item, "reorder") == 0)
+			profile->reorder = value;
+		else if (strcmp(item, "rate") == 0)
+			profile->rate_kbps = value;
+		else {
+			fprintf(stderr, "netproxy: unknown profile setting '%s'\n", item);
+			rv = -1;
+			break;
+		}
+	}
+	free(copy);
+	return rv;
+}
+
+static void print_profile(const char* name, const Profile* profile) {
+	printf("%s: delay %.1fms jitter %.1fms loss %.1f%% dup %.1f%% reorder %.1f%%", name,
+		profile->delay_ms, profile->jitter_ms, profile->loss, profile->duplicate, profile->reorder);
+	if (profile->rate_kbps > 0)
+		printf(" rate %.0fkbit/s", profile->rate_kbps);
+	printf("\n");
+}
+
+// xorshift, seeded from the command line so a run can be repeated
+static double random_unit(Proxy* proxy) {
+	uint32_t x = proxy->rng_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	proxy->rng_state = x;
+	return x / 4294967296.0;
+}
+
+static bool chance(Proxy* proxy, double percent) {
+	return percent > 0 && random_unit(proxy) * 100.0 < percent;
+}
+
+// QUEUE ==============================
+
+static bool earlier(const Packet* a, const Packet* b) {
+	return a->release_ns < b->release_ns || (a->release_ns == b->release_ns && a->order < b->order);
+}
+
+static void queue_push(Proxy* proxy, Packet* packet) {
+	size_t i = proxy->queued++;
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+		if (!earlier(packet, proxy->queue[parent]))
+			break;
+		proxy->queue[i] = proxy->queue[parent];
+		i = parent;
+	}
+	proxy->queue[i] = packet;
+}
+
+static Packet* queue_pop(Proxy* proxy) {
+	Packet* top = proxy->queue[0];
+	Packet* last = proxy->queue[--proxy->queued];
+	size_t i = 0;
+	for (;;) {
+		size_t child = 2 * i + 1;
+		if (child >= proxy->queued)
+			break;
+		if (child + 1 < proxy->queued && earlier(proxy->queue[child + 1], proxy->queue[child]))
+			child++;
+		if (!earlier(proxy->queue[child], last))
+			break;
+		proxy->queue[i] = proxy->queue[child];
+		i = child;
+	}
+	if (proxy->queued > 0)
+		proxy->queue[i] = last;
+	return top;
+}
+
+/**
+ * Put a packet through a direction's profile and queue whatever survives.
+ * The bandwidth cap sends packets one after another, then the delay is
+ * added; jitter never lets a packet overtake an earlier one, only
+ * reordering does, by skipping the delay.  TCP chunks are never lost,
+ * duplicated or reordered.
+ */
+static void impair(Proxy* proxy, int direction, bool tcp, uint32_t flow, uint32_t generation, const uint8_t* data, uint32_t length, uint64_t now) {
+	Direction* dir = &proxy->directions[direction];
+	const Profile* profile = &dir->profile;
+	dir->stats.packets++;
+	dir->stats.bytes += length;
+
+	if (!tcp && chance(proxy, profile->loss)) {
+		dir->stats.lost++;
+		return;
+	}
+	int copies = 1;
+	if (!tcp && chance(proxy, profile->duplicate)) {
+		dir->stats.duplicated++;
+		copies = 2;
+	}
+
+	for (int copy = 0; copy < copies; copy++) {
+		if (proxy->queued == PROXY_MAX_QUEUED) {
+			dir->stats.overflowed++;
+			continue;
+		}
+
+		uint64_t depart = now;
+		if (profile->rate_kbps > 0) {
+			uint64_t start = dir->link_free_ns > now ? dir->link_free_ns : now;
+			if (start - now > PROXY_MAX_BACKLOG_NS) {
+				dir->stats.overflowed++;
+				continue;
+			}
+			depart = start + (uint64_t)(length * 8e6 / profile->rate_kbps);
+			dir->link_free_ns = depart;
+		}
+
+		uint64_t release = depart;
+		if (!tcp && chance(proxy, profile->reorder)) {
+			dir->stats.reordered++;
+		} else {
+			double delay_ms = profile->delay_ms + profile->jitter_ms * (2.0 * random_unit(proxy) - 1.0);
+			if (delay_ms > 0)
+				release += (uint64_t)(delay_ms * 1e6);
+			if (release < dir->last_release_ns)
+				release = dir->last_release_ns;
+			dir->last_release_ns = release;
+		}
+
+		Packet* packet = malloc(sizeof(Packet) + length);
+		if (packet == NULL) {
+			dir->stats.overflowed++;
+			continue;
+		}
+		packet->release_ns = release;
+		packet->order = proxy->next_order++;
+		packet->tcp = tcp;
+		packet->direction = direction;
+		packet->flow = flow;
+		packet->generation = generation;
+		packet->length = length;
+		memcpy(packet->data, data, length);
+		queue_push(proxy, packet);
+	}
+}
+
+// wake up when the next packet is due, if that's changed
+static void arm_timer(Proxy* proxy) {
+	uint64_t due = proxy->queued > 0 ? proxy->queue[0]->release_ns : 0;
+	if (due == proxy->armed_ns)
+		return;
+	struct itimerspec its = { 0 };
+	its.it_value.tv_sec = due / 1000000000ull;
+	its.it_value.tv_nsec = due % 1000000000ull;
+	if (timerfd_settime(proxy->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+		perror("timerfd_settime");
+		exit(3);
+	}
+	proxy->armed_ns = due;
+}
+
+// UDP ==============================
+
+static uint32_t flow_bucket(const struct sockaddr_in* addr) {
+	uint32_t hash = addr->sin_addr.s_addr * 2654435761u ^ addr->sin_port * 40503u;
+	return (hash ^ (hash >> 16)) & (PROXY_FLOW_BUCKETS - 1);
+}
+
+static int32_t find_flow(const Proxy* proxy, const struct sockaddr_in* addr) {
+	for (int32_t i = proxy->buckets[flow_bucket(addr)]; i != -1; i = proxy->flows[i].next) {
+		const UdpFlow* flow = &proxy->flows[i];
+		if (flow->client.sin_addr.s_addr == addr->sin_addr.s_addr && flow->client.sin_port == addr->sin_port)
+			return i;
+	}
+	return -1;
+}
+
+// a new client: connect a socket of its own to the server
+static int32_t open_flow(Proxy* proxy, const struct sockaddr_in* addr) {
+	int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	if (fd == -1) {
+		perror("socket");
+		return -1;
+	}
+	if (connect(fd, (const struct sockaddr*)&proxy->server, sizeof(proxy->server)) == -1) {
+		perror("connect");
+		close(fd);
+		return -1;
+	}
+
+	int32_t index = proxy->free_flows;
+	if (index != -1) {
+		proxy->free_flows = proxy->flows[index].next;
+	} else {
+		UdpFlow* flows = realloc(proxy->flows, (proxy->num_flows + 1) * sizeof(UdpFlow));
+		if (flows == NULL) {
+			close(fd);
+			return -1;
+		}
+		proxy->flows = flows;
+		index = proxy->num_flows++;
+		proxy->flows[index].generation = 0;
+	}
+
+	struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EVENT(EV_UDP_FLOW, index) };
+	epoll_ctl(proxy->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+
+	UdpFlow* flow = &proxy->flows[index];
+	flow->client = *addr;
+	flow->upstream_fd = fd;
+	uint32_t bucket = flow_bucket(addr);
+	flow->next = proxy->buckets[bucket];
+	proxy->buckets[bucket] = index;
+	return index;
+}
+
+static void close_flow(Proxy* proxy, int32_t index) {
+	UdpFlow* flow = &proxy->flows[index];
+	int32_t* link = &proxy->buckets[flow_bucket(&flow->client)];
+	while (*link != index)
+		link = &proxy->flows[*link].next;
+	*link = flow->next;
+
+	close(flow->upstream_fd);
+	flow->upstream_fd = -1;
+	flow->generation++;
+	flow->next = proxy->free_flows;
+	proxy->free_flows = index;
+}
+
+static void expire_flows(Proxy* proxy, uint64_t now) {
+	for (uint32_t i = 0; i < proxy->num_flows; i++) {
+		if (proxy->flows[i].upstream_fd != -1 && now - proxy->flows[i].last_seen_ns > PROXY_FLOW_IDLE_NS)
+			close_flow(proxy, i);
+	}
+}
+
+static void receive_from_clients(Proxy* proxy, uint64_t now) {
+	static uint8_t buffer[PROXY_MAX_DATAGRAM];
+	for (;;) {
+		struct sockaddr_in from;
+		socklen_t from_length = sizeof(from);
+		ssize_t n = recvfrom(proxy->udp_fd, buffer, sizeof(buffer), MSG_DONTWAIT, (struct sockaddr*)&from, &from_length);
+		if (n < 0)
+			return;
+
+		int32_t index = find_flow(proxy, &from);
+		if (index == -1 && (index = open_flow(proxy, &from)) == -1)
+			continue;
+		proxy->flows[index].last_seen_ns = now;
+		impair(proxy, UP, false, index, proxy->flows[index].generation, buffer, n, now);
+	}
+}
+
+static void receive_from_server(Proxy* proxy, int32_t index, uint64_t now) {
+	static uint8_t buffer[PROXY_MAX_DATAGRAM];
+	UdpFlow* flow = &proxy->flows[index];
+	for (;;) {
+		ssize_t n = recv(flow->upstream_fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+		if (n < 0)
+			return;
+		impair(proxy, DOWN, false, index, flow->generation, buffer, n, now);
+	}
+}
+
+// TCP ==============================
+
+static void accept_connection(Proxy* proxy) {
+	int client_fd = accept(proxy->tcp_fd, NULL, NULL);
+	if (client_fd == -1) {
+		perror("accept");
+		return;
+	}
+	// the server is on the same machine, so a blocking connect is quick
+	int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (server_fd == -1 || connect(server_fd, (const struct sockaddr*)&proxy->server, sizeof(proxy->server)) == -1) {
+		perror("netproxy: connect to server");
+		if (server_fd != -1)
+			close(server_fd);
+		close(client_fd);
+		return;
+	}
+
+	int32_t index = proxy->free_pairs;
+	if (index != -1) {
+		proxy->free_pairs = proxy->pairs[index].next_free;
+	} else {
+		TcpPair* pairs = realloc(proxy->pairs, (proxy->num_pairs + 1) * sizeof(TcpPair));
+		if (pairs == NULL) {
+			close(server_fd);
+			close(client_fd);
+			return;
+		}
+		proxy->pairs = pairs;
+		index = proxy->num_pairs++;
+		proxy->pairs[index].generation = 0;
+	}
+	TcpPair* pair = &proxy->pairs[index];
+	pair->client_fd = client_fd;
+	pair->server_fd = server_fd;
+
+	struct epoll_event client_ev = { .events = EPOLLIN, .data.u64 = EVENT(EV_TCP_CLIENT, index) };
+	struct epoll_event server_ev = { .events = EPOLLIN, .data.u64 = EVENT(EV_TCP_SERVER, index) };
+	epoll_ctl(proxy->epoll_fd, EPOLL_CTL_ADD, client_fd, &client_ev);
+	epoll_ctl(proxy->epoll_fd, EPOLL_CTL_ADD, server_fd, &server_ev);
+}
+
+static void close_pair(Proxy* proxy, int32_t index) {
+	TcpPair* pair = &proxy->pairs[index];
+	close(pair->client_fd);
+	close(pair->server_fd);
+	pair->client_fd = -1;
+	pair->server_fd = -1;
+	pair->generation++;
+	pair->next_free = proxy->free_pairs;
+	proxy->free_pairs = index;
+}
+
+/**
+ * Queue what one side of a connection sent.  When it closes, stop reading
+ * it and queue the close behind its data, so the other side sees the
+ * close only once everything before it has arrived.
+ */
+static void relay_stream(Proxy* proxy, int32_t index, int direction, uint64_t now) {
+	uint8_t buffer[PROXY_TCP_CHUNK];
+	TcpPair* pair = &proxy->pairs[index];
+	int fd = direction == UP ? pair->client_fd : pair->server_fd;
+	ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+	if (n <= 0) {
+		epoll_ctl(proxy->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+		n = 0;
+	}
+	impair(proxy, direction, true, index, pair->generation, buffer, n, now);
+}
+
+// blocking, which stalls the proxy only if a peer stops reading its control connection
+static void write_stream(int fd, const uint8_t* data, size_t length) {
+	size_t sent = 0;
+	while (sent < length) {
+		ssize_t n = send(fd, data + sent, length - sent, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		sent += n;
+	}
+}
+
+// RELEASE ==============================
+
+static void deliver(Proxy* proxy, const Packet* packet) {
+	if (packet->tcp) {
+		TcpPair* pair = &proxy->pairs[packet->flow];
+		if (pair->client_fd == -1 || pair->generation != packet->generation)
+			return;
+		if (packet->length == 0) {
+			close_pair(proxy, packet->flow);
+			return;
+		}
+		write_stream(packet->direction == UP ? pair->server_fd : pair->client_fd, packet->data, packet->length);
+	} else {
+		UdpFlow* flow = &proxy->flows[packet->flow];
+		if (flow->upstream_fd == -1 || flow->generation != packet->generation)
+			return;
+		if (packet->direction == UP)
+			send(flow->upstream_fd, packet->data, packet->length, MSG_DONTWAIT);
+		else
+			sendto(proxy->udp_fd, packet->data, packet->length, MSG_DONTWAIT, (const struct sockaddr*)&flow->client, sizeof(flow->client));
+	}
+	proxy->directions[packet->direction].stats.delivered++;
+}
+
+static void release_due(Proxy* proxy, uint64_t now) {
+	while (proxy->queued > 0 && proxy->queue[0]->release_ns <= now) {
+		Packet* packet = queue_pop(proxy);
+		deliver(proxy, packet);
+		free(packet);
+	}
+}
+
+static void report(const char* label, const Proxy* proxy, const DirectionStats* previous, double seconds) {
+	printf("%s", label);
+	for (int d = UP; d <= DOWN; d++) {
+		const DirectionStats* stats = &proxy->directions[d].stats;
+		printf(" %s: in=%.0f/s out=%.0f/s %.1fkbit/s lost=%lu dup=%lu reordered=%lu overflowed=%lu", direction_names[d],
+			(stats->packets - previous[d].packets) / seconds,
+			(stats->delivered - previous[d].delivered) / seconds,
+			(stats->bytes - previous[d].bytes) * 8 / seconds / 1000.0,
+			stats->lost, stats->duplicated, stats->reordered, stats->overflowed);
+	}
+	printf(" queued=%zu\n", proxy->queued);
+	fflush(stdout);
+}
+
+// SETUP ==============================
+
+static int listen_socket(int type, const char* port) {
+	struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = type, .ai_flags = AI_PASSIVE };
+	struct addrinfo* ai;
+	int rv = getaddrinfo(NULL, port, &hints, &ai);
+	if (rv != 0) {
+		fprintf(stderr, "netproxy: %s\n", gai_strerror(rv));
+		return -1;
+	}
+	int fd = socket(ai->ai_family, ai->ai_socktype, 0);
+	int yes = 1;
+	if (fd != -1)
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	if (fd == -1 || bind(fd, ai->ai_addr, ai->ai_addrlen) == -1 || (type == SOCK_STREAM && listen(fd, 128) == -1)) {
+		perror("netproxy: listen");
+		freeaddrinfo(ai);
+		return -1;
+	}
+	freeaddrinfo(ai);
+	return fd;
+}
+
+int main(int argc, char *argv[]) {
+	const char* listen_port = PROXY_PORT;
+	const char* host = "127.0.0.1";
+	const char* port = PORT;
+	double duration = 0.0;
+	bool quiet = false;
+	Proxy proxy = { .rng_state = (uint32_t)time(NULL) | 1, .free_flows = -1, .free_pairs = -1 };
+
+	int opt;
+	while ((opt = getopt(argc, argv, "l:s:p:U:D:B:t:S:q")) != -1) {
+		switch (opt) {
+		case 'l': listen_port = optarg; break;
+		case 's': host = optarg; break;
+		case 'p': port = optarg; break;
+		case 'U':
+			if (parse_profile(optarg, &proxy.directions[UP].profile) == -1)
+				exit(1);
+			break;
+		case 'D':
+			if (parse_profile(optarg, &proxy.directions[DOWN].profile) == -1)
+				exit(1);
+			break;
+		case 'B':
+			if (parse_profile(optarg, &proxy.directions[UP].profile) == -1 || parse_profile(optarg, &proxy.directions[DOWN].profile) == -1)
+				exit(1);
+			break;
+		case 't': duration = atof(optarg); break;
+		case 'S': proxy.rng_state = (uint32_t)strtoul(optarg, NULL, 10) | 1; break;
+		case 'q': quiet = true; break;
+		default:
+			usage(argv[0]);
+			exit(1);
+		}
+	}
+
+	struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_DGRAM };
+	struct addrinfo* server;
+	int rv = getaddrinfo(host, port, &hints, &server);
+	if (rv != 0) {
+		fprintf(stderr, "netproxy: %s\n", gai_strerror(rv));
+		exit(1);
+	}
+	memcpy(&proxy.server, server->ai_addr, sizeof(proxy.server));
+	freeaddrinfo(server);
+
+	proxy.queue = malloc(PROXY_MAX_QUEUED * sizeof(Packet*));
+	if (proxy.queue == NULL) {
+		fprintf(stderr, "netproxy: failed to allocate the packet queue\n");
+		exit(1);
+	}
+	memset(proxy.buckets, -1, sizeof(proxy.buckets));
+
+	proxy.udp_fd = listen_socket(SOCK_DGRAM, listen_port);
+	proxy.tcp_fd = listen_socket(SOCK_STREAM, listen_port);
+	proxy.epoll_fd = epoll_create1(0);
+	proxy.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (proxy.udp_fd == -1 || proxy.tcp_fd == -1 || proxy.epoll_fd == -1 || proxy.timer_fd == -1)
+		exit(2);
+
+	struct epoll_event timer_ev = { .events = EPOLLIN, .data.u64 = EVENT(EV_TIMER, 0) };
+	struct epoll_event udp_ev = { .events = EPOLLIN, .data.u64 = EVENT(EV_UDP_LISTEN, 0) };
+	struct epoll_event tcp_ev = { .events = EPOLLIN, .data.u64 = EVENT(EV_TCP_LISTEN, 0) };
+	epoll_ctl(proxy.epoll_fd, EPOLL_CTL_ADD, proxy.timer_fd, &timer_ev);
+	epoll_ctl(proxy.epoll_fd, EPOLL_CTL_ADD, proxy.udp_fd, &udp_ev);
+	epoll_ctl(proxy.epoll_fd, EPOLL_CTL_ADD, proxy.tcp_fd, &tcp_ev);
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+
+	char address[INET_ADDRSTRLEN];
+	printf("forwarding port %s to %s:%u\n", listen_port,
+		inet_ntop(AF_INET, &proxy.server.sin_addr, address, sizeof(address)), ntohs(proxy.server.sin_port));
+	print_profile("up", &proxy.directions[UP].profile);
+	print_profile("down", &proxy.directions[DOWN].profile);
+	fflush(stdout);
+
+	uint64_t start = now_ns();
+	uint64_t end = duration > 0 ? start + (uint64_t)(duration * 1e9) : 0;
+	uint64_t next_report = start + 1000000000ull;
+	DirectionStats last_report[2] = { 0 };
+	struct epoll_event events[PROXY_EPOLL_EVENTS];
+
+	while (!stopping) {
+		uint64_t now = now_ns();
+		if (end != 0 && now >= end)
+			break;
+		if (now >= next_report) {
+			if (!quiet)
+				report("[1s]", &proxy, last_report, (now - next_report + 1000000000ull) / 1e9);
+			for (int d = UP; d <= DOWN; d++)
+				last_report[d] = proxy.directions[d].stats;
+			expire_flows(&proxy, now);
+			next_report += 1000000000ull;
+		}
+
+		arm_timer(&proxy);
+		int nready = epoll_wait(proxy.epoll_fd, events, PROXY_EPOLL_EVENTS, 100);
+		if (nready == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			exit(3);
+		}
+
+		now = now_ns();
+		for (int n = 0; n < nready; n++) {
+			uint32_t type = events[n].data.u64 >> 32;
+			int32_t index = (int32_t)(uint32_t)events[n].data.u64;
+			switch (type) {
+			case EV_TIMER: {
+				uint64_t expirations;
+				if (read(proxy.timer_fd, &expirations, sizeof(expirations)) > 0)
+					proxy.armed_ns = 0;
+				break;
+			}
+			case EV_UDP_LISTEN:
+				receive_from_clients(&proxy, now);
+				break;
+			case EV_TCP_LISTEN:
+				accept_connection(&proxy);
+				break;
+			case EV_UDP_FLOW:
+				if (proxy.flows[index].upstream_fd != -1)
+					receive_from_server(&proxy, index, now);
+				break;
+			case EV_TCP_CLIENT:
+				if (proxy.pairs[index].client_fd != -1)
+					relay_stream(&proxy, index, UP, now);
+				break;
+			case EV_TCP_SERVER:
+				if (proxy.pairs[index].server_fd != -1)
+					relay_stream(&proxy, index, DOWN, now);
+				break;
+			}
+		}
+		release_due(&proxy, now_ns());
+	}
+
+	DirectionStats zero[2] = { 0 };
+	report("[total]", &proxy, zero, (now_ns() - start) / 1e9);
+	return 0;
+}
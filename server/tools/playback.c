@@ -0,0 +1,473 @@
+/*
+ * playback.c -- inspect and re-simulate recorded matches
+ *
+ * Reads the .replay/.index pair written by a server started with -r.  The
+ * simulation is re-run with the server's own step code from the keyframe
+ * before the requested tick, as fast as the CPU allows unless paced with
+ * -x, and every re-simulated state can be checked against the recording.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "protocol.h"
+#include "match.h"
+#include "game.h"
+#include "replay.h"
+
+typedef struct {
+	const uint8_t* data;
+	size_t size;
+	const ReplayFileHeader* header;
+	size_t data_end;
+
+	ReplayIndexEntry* index;	// one per keyframe, in tick order
+	size_t num_keyframes;
+} Replay;
+
+typedef struct {
+	MatchTable table;
+	Match* match;
+} Simulation;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void usage(const char* prog) {
+	fprintf(stderr,
+		"usage: %s [-f from_tick] [-t to_tick] [-x speed] <command> <file.replay> [tick]\n"
+		"commands:\n"
+		"  info    header, tick range and keyframes\n"
+		"  dump    recorded inputs and states\n"
+		"  seek    re-simulate up to tick and print the state there\n"
+		"  play    re-simulate from -f to -t, printing every state; -x paces it\n"
+		"          at that multiple of real time (default: as fast as possible)\n"
+		"  verify  re-simulate everything and compare with the recorded states\n",
+		prog);
+}
+
+static void* map_file(const char* path, size_t* size) {
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return NULL;
+	struct stat st;
+	void* data = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size > 0)
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return NULL;
+	*size = st.st_size;
+	return data;
+}
+
+static const ReplayRecordHeader* record_at(const Replay* replay, size_t offset) {
+	if (offset + sizeof(ReplayRecordHeader) > replay->data_end)
+		return NULL;
+	const ReplayRecordHeader* record = (const ReplayRecordHeader*)(replay->data + offset);
+	if (record->length < sizeof(ReplayRecordHeader) || offset + record->length > replay->data_end)
+		return NULL;
+	return record;
+}
+
+// use the .index file next to the replay, or rebuild it by scanning
+static void load_index(Replay* replay, const char* path) {
+	char index_path[512];
+	snprintf(index_path, sizeof(index_path), "%s", path);
+	char* extension = strrchr(index_path, '.');
+	if (extension != NULL && strcmp(extension, ".replay") == 0) {
+		strcpy(extension, ".index");
+		size_t size;
+		ReplayIndexEntry* index = map_file(index_path, &size);
+		if (index != NULL) {
+			replay->index = index;
+			replay->num_keyframes = size / sizeof(ReplayIndexEntry);
+			if (replay->num_keyframes > replay->header->num_keyframes)
+				replay->num_keyframes = replay->header->num_keyframes;
+			return;
+		}
+	}
+
+	fprintf(stderr, "playback: no index for %s, scanning\n", path);
+	size_t capacity = 64;
+	replay->index = malloc(capacity * sizeof(ReplayIndexEntry));
+	const ReplayRecordHeader* record;
+	for (size_t offset = sizeof(ReplayFileHeader); (record = record_at(replay, offset)) != NULL; offset += record->length) {
+		if (record->type != REPLAY_KEYFRAME)
+			continue;
+		if (replay->num_keyframes == capacity) {
+			capacity *= 2;
+			replay->index = realloc(replay->index, capacity * sizeof(ReplayIndexEntry));
+		}
+		const ReplayKeyframe* keyframe = (const ReplayKeyframe*)(record + 1);
+		replay->index[replay->num_keyframes++] = (ReplayIndexEntry){ .tick = keyframe->tick, .offset = offset };
+	}
+}
+
+// ticks per step of the recorded match, 0 if this build can't step it that way
+static uint8_t step_ticks_of(const ReplayFileHeader* header) {
+	uint32_t tick_rate = header->tick_rate;
+	if (tick_rate == 0 || tick_rate % TICK_RATE != 0 || tick_rate / TICK_RATE > MAX_STEP_TICKS)
+		return 0;
+	return tick_rate / TICK_RATE;
+}
+
+static int load_replay(Replay* replay, const char* path) {
+	memset(replay, 0, sizeof(*replay));
+	replay->data = map_file(path, &replay->size);
+	if (replay->data == NULL || replay->size < sizeof(ReplayFileHeader)) {
+		fprintf(stderr, "playback: can't read %s\n", path);
+		return -1;
+	}
+
+	replay->header = (const ReplayFileHeader*)replay->data;
+	if (memcmp(replay->header->magic, REPLAY_MAGIC, sizeof(REPLAY_MAGIC)) != 0 || replay->header->version != REPLAY_VERSION) {
+		fprintf(stderr, "playback: %s is not a version %d replay\n", path, REPLAY_VERSION);
+		return -1;
+	}
+	if (replay->header->max_clients != MAX_CLIENTS || step_ticks_of(replay->header) == 0)
+		fprintf(stderr, "playback: recorded with different settings, re-simulation won't match\n");
+
+	// a file that's still being written is only valid up to data_end
+	replay->data_end = replay->header->data_end;
+	if (replay->data_end > replay->size)
+		replay->data_end = replay->size;
+
+	load_index(replay, path);
+	return 0;
+}
+
+// the last keyframe at or before tick, or -1 if tick is before the recording
+static long find_keyframe(const Replay* replay, uint64_t tick) {
+	long lo = 0, hi = (long)replay->num_keyframes - 1, found = -1;
+	while (lo <= hi) {
+		long mid = (lo + hi) / 2;
+		if (replay->index[mid].tick <= tick) {
+			found = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return found;
+}
+
+static void restore_keyframe(Simulation* sim, const ReplayKeyframe* keyframe) {
+	Match* match = sim->match;
+	match->rng_state = keyframe->rng_state;
+	match->start_tick = keyframe->start_tick;
+	match->num_clients = keyframe->num_clients;
+	match->game_active = keyframe->game_active;
+	match->left_score = keyframe->left_score;
+	match->right_score = keyframe->right_score;
+	memcpy(match->player_positions, keyframe->players, sizeof(match->player_positions));
+	physics_set_ball(&sim->table.physics, 0, &keyframe->ball);
+	sim->table.high_water = 1;
+}
+
+// run one recorded step through the server's simulation
+static void simulate_step(Simulation* sim, const ReplayStep* step) {
+	const ReplayInput* inputs = (const ReplayInput*)(step + 1);
+	sim->match->num_clients = step->num_clients;
+	// step on the recorded tick whatever phase the match had on the server
+	sim->match->step_phase = (sim->match->step_ticks - step->tick % sim->match->step_ticks) % sim->match->step_ticks;
+	for (uint32_t i = 0; i < step->num_inputs; i++) {
+		ReplayInput input;
+		memcpy(&input, &inputs[i], sizeof(input));
+		if (input.slot < MAX_CLIENTS)
+			sim->match->player_positions[input.slot] = input.position;
+	}
+	step_matches(&sim->table, step->tick, TICK_SECONDS);
+}
+
+static int recorded_state(const ReplayStep* step, GameStateMessage* state) {
+	const uint8_t* buffer = (const uint8_t*)(step + 1) + step->num_inputs * sizeof(ReplayInput);
+	return deserialize_game_state_message(buffer, step->state_length, NULL, state);
+}
+
+static bool same_state(const GameStateMessage* a, const GameStateMessage* b) {
+	return a->left_score == b->left_score && a->right_score == b->right_score &&
+		a->game_active == b->game_active && a->start_tick == b->start_tick &&
+		a->num_positions == b->num_positions &&
+		memcmp(a->positions, b->positions, a->num_positions * sizeof(QuantizedPosition)) == 0;
+}
+
+static void print_state(uint64_t tick, const GameStateMessage* state) {
+	printf("tick %lu  score %u-%u  %s", tick, state->left_score, state->right_score, state->game_active ? "playing" : "countdown");
+	if (!state->game_active && state->start_tick > tick)
+		printf(" %.2fs", (state->start_tick - tick) * TICK_RATE / 1000.0);
+	printf("  ball (%.2f, %.2f) v (%.2f, %.2f)", state->positions[0].x / POSITION_SCALE, state->positions[0].y / POSITION_SCALE,
+		state->positions[0].dx / VELOCITY_SCALE, state->positions[0].dy / VELOCITY_SCALE);
+	for (int p = 1; p < state->num_positions; p++)
+		printf("  p%d (%.2f, %.2f)", p, state->positions[p].x / POSITION_SCALE, state->positions[p].y / POSITION_SCALE);
+	printf("\n");
+}
+
+static int command_info(const Replay* replay) {
+	const ReplayFileHeader* header = replay->header;
+	time_t created = header->created;
+	printf("match %u, recorded %s", header->match_id, ctime(&created));
+	printf("%u ms per step, %u players, %zu bytes of records\n", header->tick_rate, header->max_clients, replay->data_end);
+
+	uint64_t steps = 0, inputs = 0, resyncs = 0, first = 0, last = 0;
+	const ReplayRecordHeader* record;
+	for (size_t offset = sizeof(ReplayFileHeader); (record = record_at(replay, offset)) != NULL; offset += record->length) {
+		resyncs += record->type == REPLAY_RESYNC;
+		if (record->type != REPLAY_STEP)
+			continue;
+		const ReplayStep* step = (const ReplayStep*)(record + 1);
+		if (steps++ == 0)
+			first = step->tick;
+		last = step->tick;
+		inputs += step->num_inputs;
+	}
+	printf("%lu steps, ticks %lu to %lu (%.1fs), %lu inputs, %lu rewinds\n", steps, first, last, steps * header->tick_rate / 1000.0, inputs, resyncs);
+	printf("%zu keyframes:", replay->num_keyframes);
+	for (size_t k = 0; k < replay->num_keyframes; k++)
+		printf(" %lu", replay->index[k].tick);
+	printf("\n");
+	return 0;
+}
+
+static int command_dump(const Replay* replay, uint64_t from, uint64_t to) {
+	// start at the keyframe before from rather than the top of the file
+	long k = find_keyframe(replay, from);
+	size_t offset = k >= 0 ? replay->index[k].offset : sizeof(ReplayFileHeader);
+
+	const ReplayRecordHeader* record;
+	for (; (record = record_at(replay, offset)) != NULL; offset += record->length) {
+		if (record->type == REPLAY_KEYFRAME || record->type == REPLAY_RESYNC) {
+			const ReplayKeyframe* keyframe = (const ReplayKeyframe*)(record + 1);
+			if (keyframe->tick >= from && keyframe->tick <= to)
+				printf("%s at tick %lu  rng %08x  ball (%.3f, %.3f)\n", record->type == REPLAY_RESYNC ? "resync" : "keyframe",
+					keyframe->tick, keyframe->rng_state, keyframe->ball.x, keyframe->ball.y);
+			continue;
+		}
+		if (record->type != REPLAY_STEP)
+			continue;
+
+		const ReplayStep* step = (const ReplayStep*)(record + 1);
+		if (step->tick < from)
+			continue;
+		if (step->tick > to)
+			break;
+
+		const ReplayInput* inputs = (const ReplayInput*)(step + 1);
+		for (uint32_t i = 0; i < step->num_inputs; i++) {
+			ReplayInput input;
+			memcpy(&input, &inputs[i], sizeof(input));
+			printf("  input  slot %u  (%.2f, %.2f)\n", input.slot, input.position.x, input.position.y);
+		}
+		GameStateMessage state;
+		if (recorded_state(step, &state) == 0)
+			print_state(step->tick, &state);
+	}
+	return 0;
+}
+
+/**
+ * Re-simulate from the keyframe before from up to to, calling back with
+ * the re-simulated and recorded state of every step in [from, to]
+ */
+typedef bool (*StepCallback)(uint64_t tick, const GameStateMessage* simulated, const GameStateMessage* recorded, void* context);
+
+static long simulate(const Replay* replay, uint64_t from, uint64_t to, StepCallback callback, void* context) {
+	long k = find_keyframe(replay, from);
+	if (k < 0) {
+		if (replay->num_keyframes == 0) {
+			fprintf(stderr, "playback: recording has no keyframes\n");
+			return -1;
+		}
+		k = 0;
+	}
+
+	Simulation sim;
+	if (match_table_init(&sim.table, 1, 0, 1) == -1) {
+		fprintf(stderr, "playback: out of memory\n");
+		return -1;
+	}
+	sim.match = &sim.table.matches[0];
+	// the match steps on the same ticks as it did on the server
+	if (step_ticks_of(replay->header) != 0)
+		sim.match->step_ticks = step_ticks_of(replay->header);
+
+	long steps = 0;
+	const ReplayRecordHeader* record;
+	for (size_t offset = replay->index[k].offset; (record = record_at(replay, offset)) != NULL; offset += record->length) {
+		// later keyframes are only needed when seeking; simulating straight
+		// through them is a check that the simulation is deterministic.
+		// Resyncs mark where the server rewrote the past, so always restore.
+		if ((record->type == REPLAY_KEYFRAME && steps == 0) || record->type == REPLAY_RESYNC) {
+			restore_keyframe(&sim, (const ReplayKeyframe*)(record + 1));
+			continue;
+		}
+		if (record->type != REPLAY_STEP)
+			continue;
+
+		const ReplayStep* step = (const ReplayStep*)(record + 1);
+		if (step->tick > to)
+			break;
+		simulate_step(&sim, step);
+		steps++;
+		if (step->tick < from)
+			continue;
+
+		GameStateMessage simulated = { .sequence = 0 }, recorded;
+		fill_game_state(&sim.table, 0, sim.match, &simulated);
+		if (recorded_state(step, &recorded) == -1)
+			recorded = simulated;
+		if (!callback(step->tick, &simulated, &recorded, context))
+			break;
+	}
+
+	match_table_free(&sim.table);
+	return steps;
+}
+
+typedef struct {
+	uint64_t last_tick;
+	bool found;
+	GameStateMessage state;
+} SeekContext;
+
+static bool seek_step(uint64_t tick, const GameStateMessage* simulated, const GameStateMessage* recorded, void* context) {
+	SeekContext* seek = context;
+	seek->last_tick = tick;
+	seek->state = *simulated;
+	seek->found = true;
+	return true;
+}
+
+static int command_seek(const Replay* replay, uint64_t tick) {
+	SeekContext seek = { .found = false };
+	uint64_t start = now_ns();
+	long steps = simulate(replay, tick, tick, seek_step, &seek);
+	uint64_t elapsed = now_ns() - start;
+	if (steps < 0)
+		return 1;
+	if (!seek.found) {
+		fprintf(stderr, "playback: tick %lu was not recorded\n", tick);
+		return 1;
+	}
+	print_state(seek.last_tick, &seek.state);
+	fprintf(stderr, "re-simulated %ld steps in %.3fms\n", steps, elapsed / 1e6);
+	return 0;
+}
+
+typedef struct {
+	double speed;
+	uint64_t start_ns;
+	uint64_t first_tick;
+	bool started;
+} PlayContext;
+
+static bool play_step(uint64_t tick, const GameStateMessage* simulated, const GameStateMessage* recorded, void* context) {
+	PlayContext* play = context;
+	if (!play->started) {
+		play->started = true;
+		play->first_tick = tick;
+		play->start_ns = now_ns();
+	}
+	if (play->speed > 0) {
+		uint64_t due = play->start_ns + (uint64_t)((tick - play->first_tick) * TICK_RATE * 1000000.0 / play->speed);
+		uint64_t now = now_ns();
+		if (due > now) {
+			struct timespec wait = { .tv_sec = (due - now) / 1000000000ull, .tv_nsec = (due - now) % 1000000000ull };
+			nanosleep(&wait, NULL);
+		}
+	}
+	print_state(tick, simulated);
+	fflush(stdout);
+	return true;
+}
+
+static int command_play(const Replay* replay, uint64_t from, uint64_t to, double speed) {
+	PlayContext play = { .speed = speed };
+	return simulate(replay, from, to, play_step, &play) < 0;
+}
+
+typedef struct {
+	uint64_t compared;
+	uint64_t mismatched;
+} VerifyContext;
+
+static bool verify_step(uint64_t tick, const GameStateMessage* simulated, const GameStateMessage* recorded, void* context) {
+	VerifyContext* verify = context;
+	verify->compared++;
+	if (same_state(simulated, recorded))
+		return true;
+
+	if (verify->mismatched++ == 0) {
+		printf("first divergence at tick %lu\n  recorded:  ", tick);
+		print_state(tick, recorded);
+		printf("  simulated: ");
+		print_state(tick, simulated);
+	}
+	return true;
+}
+
+static int command_verify(const Replay* replay) {
+	VerifyContext verify = {0};
+	uint64_t start = now_ns();
+	long steps = simulate(replay, 0, UINT64_MAX, verify_step, &verify);
+	uint64_t elapsed = now_ns() - start;
+	if (steps < 0)
+		return 1;
+
+	double seconds = elapsed / 1e9;
+	printf("%lu steps compared, %lu differ\n", verify.compared, verify.mismatched);
+	printf("re-simulated %ld steps in %.3fms, %.0f steps/s (%.0fx real time)\n",
+		steps, elapsed / 1e6, steps / seconds, steps * replay->header->tick_rate / 1000.0 / seconds);
+	return verify.mismatched > 0 ? 2 : 0;
+}
+
+int main(int argc, char *argv[]) {
+	uint64_t from = 0, to = UINT64_MAX;
+	double speed = 0.0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "f:t:x:")) != -1) {
+		switch (opt) {
+		case 'f': from = strtoull(optarg, NULL, 10); break;
+		case 't': to = strtoull(optarg, NULL, 10); break;
+		case 'x': speed = atof(optarg); break;
+		default:
+			usage(argv[0]);
+			exit(1);
+		}
+	}
+	if (argc - optind < 2) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	const char* command = argv[optind];
+	Replay replay;
+	if (load_replay(&replay, argv[optind + 1]) == -1)
+		exit(1);
+
+	if (strcmp(command, "info") == 0)
+		return command_info(&replay);
+	if (strcmp(command, "dump") == 0)
+		return command_dump(&replay, from, to);
+	if (strcmp(command, "play") == 0)
+		return command_play(&replay, from, to, speed);
+	if (strcmp(command, "verify") == 0)
+		return command_verify(&replay);
+	if (strcmp(command, "seek") == 0 && argc - optind >= 3)
+		return command_seek(&replay, strtoull(argv[optind + 2], NULL, 10));
+
+	usage(argv[0]);
+	return 1;
+}
@@ -0,0 +1,129 @@
+/*
+ * schemagen.c -- prints the wire schemas in protocol.h as Rust
+ *
+ * Each schema becomes a struct with the same fields, its encoded SIZE, an
+ * encode() appending it to a buffer and a decode() checking its length
+ * and tags, alongside the constants the layouts refer to.  `make schema`
+ * writes the output over the client's network/wire.rs.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "config.h"
+#include "protocol.h"
+
+// field names that are keywords in Rust
+static const char* rust_name(const char* name) {
+	static const char* keywords[] = { "move", "type", "match", "ref", "loop", "in" };
+	static char raw[64];
+	for (size_t i = 0; i < sizeof(keywords) / sizeof(keywords[0]); i++) {
+		if (strcmp(name, keywords[i]) == 0) {
+			snprintf(raw, sizeof(raw), "r#%s", name);
+			return raw;
+		}
+	}
+	return name;
+}
+
+static size_t offset;
+
+#define RUST_STRUCT_FIELD(kind, name) printf("    pub %s: %s,\n", rust_name(#name), #kind);
+#define RUST_NO_TAG(value)
+#define RUST_PUT_FIELD(kind, name) printf("        buf.extend_from_slice(&self.%s.to_be_bytes());\n", rust_name(#name));
+#define RUST_PUT_TAG(value) printf("        buf.push(%s);\n", #value);
+#define RUST_SKIP_FIELD(kind, name) offset += WIRE_SIZE_##kind;
+#define RUST_SKIP_TAG(value) offset += 1;
+#define RUST_CHECK_TAG(value) \
+	printf("        if buf[%zu] != %s {\n", offset, #value); \
+	printf("            bail!(\"expected %s at byte %zu, got {}\", buf[%zu]);\n", #value, offset, offset); \
+	printf("        }\n"); \
+	offset += 1;
+#define RUST_GET_FIELD(kind, name) \
+	printf("            %s: %s::from_be_bytes(buf[%zu..%zu].try_into().unwrap()),\n", \
+			rust_name(#name), #kind, offset, offset + WIRE_SIZE_##kind); \
+	offset += WIRE_SIZE_##kind;
+
+#define RUST_MESSAGE(type, schema) \
+	static void print_##type(void) { \
+		printf("#[derive(Debug, Clone, Copy, Default, PartialEq)]\n"); \
+		printf("pub struct %s {\n", #type); \
+		schema(RUST_STRUCT_FIELD, RUST_NO_TAG) \
+		printf("}\n\n"); \
+		printf("impl %s {\n", #type); \
+		printf("    pub const SIZE: usize = %d;\n\n", WIRE_SIZE(schema)); \
+		printf("    pub fn encode(&self, buf: &mut Vec<u8>) {\n"); \
+		schema(RUST_PUT_FIELD, RUST_PUT_TAG) \
+		printf("    }\n\n"); \
+		printf("    pub fn decode(buf: &[u8]) -> Result<%s> {\n", #type); \
+		printf("        if buf.len() < Self::SIZE {\n"); \
+		printf("            bail!(\"%s truncated: {} of {} bytes\", buf.len(), Self::SIZE);\n", #type); \
+		printf("        }\n"); \
+		offset = 0; \
+		schema(RUST_SKIP_FIELD, RUST_CHECK_TAG) \
+		printf("        Ok(%s {\n", #type); \
+		offset = 0; \
+		schema(RUST_GET_FIELD, RUST_SKIP_TAG) \
+		printf("        })\n"); \
+		printf("    }\n"); \
+		printf("}\n"); \
+	}
+
+RUST_MESSAGE(InputCommand, INPUT_COMMAND_SCHEMA)
+RUST_MESSAGE(InputMessageHeader, INPUT_MESSAGE_SCHEMA)
+RUST_MESSAGE(SpectateMessage, SPECTATE_MESSAGE_SCHEMA)
+RUST_MESSAGE(PingMessage, PING_MESSAGE_SCHEMA)
+RUST_MESSAGE(PongMessage, PONG_MESSAGE_SCHEMA)
+RUST_MESSAGE(QuantizedPosition, QUANTIZED_POSITION_SCHEMA)
+RUST_MESSAGE(SnapshotHeader, SNAPSHOT_HEADER_SCHEMA)
+RUST_MESSAGE(TcpFrameHeader, TCP_FRAME_HEADER_SCHEMA)
+RUST_MESSAGE(SpectateRequest, SPECTATE_REQUEST_SCHEMA)
+RUST_MESSAGE(RegisterResponse, REGISTER_RESPONSE_SCHEMA)
+
+#define RUST_CONST(name, type) printf("pub const %s: %s = %lld;\n", #name, #type, (long long)(name));
+#define RUST_CONST_F32(name) printf("pub const %s: f32 = %.1f;\n", #name, (double)(name));
+
+int main(void) {
+	printf("// Generated by server/tools/schemagen from the schemas in server/src/protocol.h.\n");
+	printf("// Don't edit; change the schema and run `make schema` in server/ instead.\n\n");
+	printf("#![allow(dead_code)]\n\n");
+	printf("use anyhow::{bail, Result};\n\n");
+
+	RUST_CONST(CLIENT_INPUT, u8)
+	RUST_CONST(CLIENT_SPECTATE, u8)
+	RUST_CONST(CLIENT_PING, u8)
+	RUST_CONST(SERVER_PONG, u8)
+	RUST_CONST(SNAPSHOT_VERSION, u8)
+	RUST_CONST(MAX_CLIENTS, u32)
+	RUST_CONST(INPUT_REDUNDANCY, usize)
+	RUST_CONST_F32(POSITION_SCALE)
+	RUST_CONST_F32(VELOCITY_SCALE)
+	RUST_CONST(TCP_MAX_BODY, usize)
+	RUST_CONST(TCP_MAX_PAYLOAD, usize)
+	RUST_CONST(TCP_REGISTER, u32)
+	RUST_CONST(TCP_SPECTATE, u32)
+	RUST_CONST(TCP_STATUS_OK, u32)
+	RUST_CONST(TCP_STATUS_QUEUE_FULL, u32)
+	RUST_CONST(TCP_STATUS_ALREADY_WAITING, u32)
+	RUST_CONST(TCP_STATUS_NO_SUCH_MATCH, u32)
+	RUST_CONST(TCP_STATUS_ALREADY_PLAYING, u32)
+	RUST_CONST(TCP_STATUS_UNAVAILABLE, u32)
+
+	void (*messages[])(void) = {
+		print_InputCommand,
+		print_InputMessageHeader,
+		print_SpectateMessage,
+		print_PingMessage,
+		print_PongMessage,
+		print_QuantizedPosition,
+		print_SnapshotHeader,
+		print_TcpFrameHeader,
+		print_SpectateRequest,
+		print_RegisterResponse,
+	};
+	for (size_t i = 0; i < sizeof(messages) / sizeof(messages[0]); i++) {
+		printf("\n");
+		messages[i]();
+	}
+	return 0;
+}